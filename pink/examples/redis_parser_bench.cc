@@ -0,0 +1,125 @@
+// Copyright (c) 2015-present, Qihoo, Inc.  All rights reserved.
+// This source code is licensed under the BSD-style license found in the
+// LICENSE file in the root directory of this source tree. An additional grant
+// of patent rights can be found in the PATENTS file in the same directory.
+
+/*
+ * Measures RedisParser over pipelined request traffic, the way RedisConn
+ * parses it. Without a file it builds a pipeline of small SET and GET
+ * commands; a file holds the raw bytes clients sent, e.g. captured with
+ * tcpdump or "redis-benchmark -P 16". Compare the scanners with
+ *   PINK_RESP_SCAN=scalar ./redis_parser_bench
+ *   ./redis_parser_bench
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/time.h>
+
+#include <algorithm>
+#include <string>
+#include <vector>
+
+#include "pink/include/redis_parser.h"
+
+using namespace pink;
+
+static uint64_t NowMicros() {
+  struct timeval tv;
+  gettimeofday(&tv, NULL);
+  return static_cast<uint64_t>(tv.tv_sec) * 1000000 + tv.tv_usec;
+}
+
+static uint64_t num_commands = 0;
+
+static int CountCommand(RedisParser* parser, const RedisCmdArgsSlice& argv) {
+  num_commands++;
+  return 0;
+}
+
+static std::string MakePipeline(int num) {
+  std::string out;
+  char buf[128];
+  for (int i = 0; i < num; i++) {
+    if (i % 2 == 0) {
+      snprintf(buf, sizeof(buf), "key:%08d", i);
+      out += "*3\r\n$3\r\nSET\r\n$12\r\n";
+      out += buf;
+      out += "\r\n$3\r\nxxx\r\n";
+    } else {
+      snprintf(buf, sizeof(buf), "key:%08d", i - 1);
+      out += "*2\r\n$3\r\nGET\r\n$12\r\n";
+      out += buf;
+      out += "\r\n";
+    }
+  }
+  return out;
+}
+
+static bool ReadFile(const char* path, std::string* out) {
+  FILE* f = fopen(path, "rb");
+  if (f == NULL) {
+    return false;
+  }
+  char buf[65536];
+  size_t n;
+  while ((n = fread(buf, 1, sizeof(buf), f)) > 0) {
+    out->append(buf, n);
+  }
+  fclose(f);
+  return true;
+}
+
+int main(int argc, char* argv[]) {
+  std::string input;
+  if (argc > 1) {
+    if (!ReadFile(argv[1], &input)) {
+      printf("Usage: ./redis_parser_bench [capture_file] [rounds]\n");
+      exit(-1);
+    }
+  } else {
+    input = MakePipeline(100000);
+  }
+  int rounds = argc > 2 ? atoi(argv[2]) : 50;
+  const char* scan = getenv("PINK_RESP_SCAN");
+
+  RedisParserSettings settings;
+  settings.DealSliceMessage = CountCommand;
+  RedisParser parser;
+  parser.RedisParserInit(REDIS_PARSER_REQUEST, settings);
+
+  // Parsed in reads of 16KB, the default RedisConn read buffer size
+  const int kReadSize = 16 * 1024;
+  std::vector<char> rbuf(input.size() + kReadSize);
+  uint64_t start = NowMicros();
+  for (int r = 0; r < rounds; r++) {
+    size_t offset = 0;
+    int left = 0;
+    while (offset < input.size()) {
+      int n = static_cast<int>(std::min(input.size() - offset,
+                                        static_cast<size_t>(kReadSize)));
+      memcpy(&rbuf[left], input.data() + offset, n);
+      offset += n;
+      int processed = 0;
+      RedisParserStatus ret = parser.ProcessInputBufferInPlace(
+          &rbuf[0], left + n, &processed);
+      if (ret == kRedisParserError) {
+        printf("Parse error at offset %zu\n", offset);
+        exit(-1);
+      }
+      left = left + n - processed;
+      memmove(&rbuf[0], &rbuf[processed], left);
+    }
+  }
+  uint64_t elapsed = NowMicros() - start;
+  if (elapsed == 0) {
+    elapsed = 1;
+  }
+
+  double bytes = static_cast<double>(input.size()) * rounds;
+  printf("scanner %s: %lu commands, %.1f MB in %.3f s, %.1f MB/s, %.2f M commands/s\n",
+         scan != NULL ? scan : "default", num_commands, bytes / 1e6,
+         elapsed / 1e6, bytes / elapsed, num_commands / static_cast<double>(elapsed));
+  return 0;
+}
@@ -10,29 +10,18 @@
 #include <queue>
 
 #include "pink/include/pink_thread.h"
+#include "pink/include/timer_service.h"
 
 #include "slash/include/slash_mutex.h"
 
 namespace pink {
 
-struct TimerItem {
-  uint64_t exec_time;
-  void (*function)(void *);
-  void* arg;
-  TimerItem(uint64_t _exec_time, void (*_function)(void*), void* _arg) :
-    exec_time(_exec_time),
-    function(_function),
-    arg(_arg) {}
-  bool operator < (const TimerItem& item) const {
-    return exec_time > item.exec_time;
-  }
-};
-
-class BGThread : public Thread {
+class BGThread : public Thread, public TimerTarget {
  public:
   explicit BGThread(int full = 100000) :
     Thread::Thread(),
     full_(full),
+    has_timers_(false),
     mu_(),
     rsignal_(&mu_),
     wsignal_(&mu_) {
@@ -40,6 +29,9 @@ class BGThread : public Thread {
 
   virtual ~BGThread() {
     StopThread();
+    if (has_timers_.load()) {
+      TimerService::Default()->CancelAll(this);
+    }
   }
 
   virtual int StopThread() override {
@@ -52,14 +44,18 @@ class BGThread : public Thread {
   void Schedule(void (*function)(void*), void* arg);
 
   /*
-   * timeout is in millionsecond
+   * timeout is in millionsecond, the timer is kept by TimerService::Default
+   * and its handle returned, for Cancel and Reschedule there
    */
-  void DelaySchedule(uint64_t timeout, void (*function)(void *), void* arg);
+  uint64_t DelaySchedule(uint64_t timeout, void (*function)(void *), void* arg);
 
   void QueueSize(int* pri_size, int* qu_size);
   void QueueClear();
   void SwallowReadyTasks();
 
+  // Queues the tasks of timers that came due, at once
+  virtual void ScheduleTimerTasks(const std::vector<TimerTask>& tasks) override;
+
  private:
 
   struct BGItem {
@@ -70,9 +66,9 @@ class BGThread : public Thread {
   };
 
   std::queue<BGItem> queue_;
-  std::priority_queue<TimerItem> timer_queue_;
 
   size_t full_;
+  std::atomic<bool> has_timers_;
   slash::Mutex mu_;
   slash::CondVar rsignal_;
   slash::CondVar wsignal_;
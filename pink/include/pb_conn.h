@@ -32,6 +32,7 @@ class PbConn: public PinkConn {
   ReadStatus GetRequest() override;
   WriteStatus SendReply() override;
   void TryResizeBuffer() override;
+  bool HasLargeBuffer() override;
   int WriteResp(const std::string& resp) override ;
   void NotifyWrite();
   void NotifyClose();
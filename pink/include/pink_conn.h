@@ -7,6 +7,11 @@
 #define PINK_INCLUDE_PINK_CONN_H_
 
 #include <sys/time.h>
+#include <stdint.h>
+
+#include <atomic>
+#include <functional>
+#include <memory>
 #include <string>
 
 #ifdef __ENABLE_SSL
@@ -21,6 +26,7 @@
 namespace pink {
 
 class Thread;
+class OutputChain;
 
 class PinkConn : public std::enable_shared_from_this<PinkConn> {
  public:
@@ -41,8 +47,62 @@ class PinkConn : public std::enable_shared_from_this<PinkConn> {
   virtual int WriteResp(const std::string& resp) {
     return 0;
   }
+  /*
+   * Like WriteResp for a reply shared with other conns, e.g. a published
+   * message. The default copies it
+   */
+  virtual int WriteSharedResp(std::shared_ptr<const std::string> resp) {
+    return WriteResp(*resp);
+  }
 
   virtual void TryResizeBuffer() {}
+  /*
+   * Whether TryResizeBuffer may have something to shrink. The server
+   * threads ask after reading and run TryResizeBuffer every cron_interval
+   * only while it is true.
+   */
+  virtual bool HasLargeBuffer() {
+    return false;
+  }
+
+  /*
+   * Completion based I/O, used instead of GetRequest/SendReply when the
+   * server runs the io_uring backend (ServerThread::set_io_backend) and
+   * SupportsCompletionIO() is true. The worker receives and sends, the
+   * conn only handles the bytes:
+   *  - ProcessInput gets data already received from the socket and returns
+   *    what GetRequest would have returned for it
+   *  - TakeOutput moves all pending reply bytes into the empty *output,
+   *    without copying, and clears is_reply; the worker sends them from
+   *    there, so the conn may keep appending replies meanwhile. Returns
+   *    false if there are none
+   *  - OutputSent is called once the taken output is completely written,
+   *    like SendReply returning kWriteAll
+   * Asynchronous replies are announced through the notify queue as before.
+   */
+  virtual bool SupportsCompletionIO() {
+    return false;
+  }
+  virtual ReadStatus ProcessInput(const char* data, size_t len) {
+    return kReadError;
+  }
+  virtual bool TakeOutput(OutputChain* output) {
+    return false;
+  }
+  virtual void OutputSent() {}
+
+  /*
+   * Whether the conn may be moved to another worker thread right now, see
+   * ServerThread::set_rebalance_interval. Asked on the conn's thread
+   * between two events. Conns must say no while a request or reply is in
+   * flight, or if they keep state of their worker; their timers are
+   * dropped by the move. Migrated is then called on the new thread with
+   * its worker specific data, see ServerHandle::CreateWorkerSpecificData
+   */
+  virtual bool CanMigrate() {
+    return false;
+  }
+  virtual void Migrated(void* worker_private_data) {}
 
   int flags() const {
     return flags_;
@@ -92,6 +152,48 @@ class PinkConn : public std::enable_shared_from_this<PinkConn> {
     return last_interaction_;
   }
 
+  // Set by the conn's server thread while its resize timer is armed
+  bool resize_timer_armed() const {
+    return resize_timer_armed_;
+  }
+  void set_resize_timer_armed(bool armed) {
+    resize_timer_armed_ = armed;
+  }
+
+  /*
+   * The cpu whose softirq handled the last packets of the conn
+   * (SO_INCOMING_CPU), -1 where the kernel does not tell
+   */
+  int incoming_cpu() const;
+
+  /*
+   * Bytes received but not handled yet and replies not written yet, for
+   * the buffer gauges, limits and watermarks, see
+   * ServerThread::set_output_buffer_limit. Asked on the conn's thread.
+   */
+  virtual size_t input_bytes() {
+    return 0;
+  }
+  virtual size_t output_bytes() {
+    return 0;
+  }
+
+  ConnClass conn_class() const {
+    return conn_class_;
+  }
+  void set_conn_class(ConnClass conn_class) {
+    conn_class_ = conn_class;
+  }
+
+  /*
+   * Whether output_bytes of output pending at now_ms, a monotonic clock,
+   * break limit. Remembers since when the soft limit is exceeded, so
+   * call it whenever the pending output changed much, with 0 once all
+   * of it is written.
+   */
+  bool OutputLimitReached(size_t output_bytes, const OutputBufferLimit& limit,
+                          uint64_t now_ms);
+
   Thread *thread() const {
     return thread_;
   }
@@ -104,6 +206,18 @@ class PinkConn : public std::enable_shared_from_this<PinkConn> {
     return pink_epoll_;
   }
 
+  /*
+   * Deadlines of this conn, e.g. for request or blocking command timeouts.
+   * cb runs on the conn's thread timeout_ms from now, unless the conn has
+   * been closed or moved out of its thread by then. Call these from the
+   * conn's thread only, e.g. in GetRequest or a previous timer callback.
+   * AddTimer returns 0 if the conn has no PinkEpoll, else the id for
+   * CancelTimer. CancelTimers drops all of them.
+   */
+  uint64_t AddTimer(int timeout_ms, const std::function<void()>& cb);
+  bool CancelTimer(uint64_t id);
+  void CancelTimers();
+
 #ifdef __ENABLE_SSL
   SSL* ssl() {
     return ssl_;
@@ -121,7 +235,11 @@ class PinkConn : public std::enable_shared_from_this<PinkConn> {
   bool is_writable_;
   bool close_;
   struct timeval last_interaction_;
+  bool resize_timer_armed_;
   int flags_;
+  ConnClass conn_class_;
+  // Since when the output exceeds the soft limit, 0 if it does not
+  uint64_t output_soft_since_ms_;
 
 #ifdef __ENABLE_SSL
   SSL* ssl_;
@@ -131,6 +249,8 @@ class PinkConn : public std::enable_shared_from_this<PinkConn> {
   Thread *thread_;
   // the pink epoll this conn belong to
   PinkEpoll *pink_epoll_;
+  // Bumped by CancelTimers, timers of an older epoch do nothing
+  std::atomic<uint64_t> timer_epoch_;
 
   /*
    * No allowed copy and copy assign operator
@@ -42,6 +42,66 @@ enum NotifyType {
   kNotiEpolloutAndEpollin = 4,
   kNotiWrite = 5,
   kNotiWait = 6,
+  // Internal, wakes a worker to run the tasks queued for it
+  kNotiTask = 7,
+};
+
+enum IoBackend {
+  kEpollBackend = 0,
+  kIoUringBackend = 1,
+};
+
+enum ConnPlacement {
+  kRoundRobinPlacement = 0,
+  kLeastLoadedPlacement = 1,
+};
+
+/*
+ * Conns of a class share their output buffer limit, see
+ * ServerThread::set_output_buffer_limit and PinkConn::set_conn_class
+ */
+enum ConnClass {
+  kNormalConnClass = 0,
+  kReplicaConnClass = 1,
+  kPubSubConnClass = 2,
+};
+const int kConnClassNum = 3;
+
+/*
+ * A conn is closed once the replies it has not read yet reach hard_bytes,
+ * or stay at soft_bytes or more for soft_seconds. 0 turns a limit off.
+ */
+struct OutputBufferLimit {
+  size_t hard_bytes;
+  size_t soft_bytes;
+  int soft_seconds;
+};
+
+/*
+ * Socket options of a listener and the connections accepted on it, see
+ * ServerThread::set_socket_profile. Buffer sizes of 0 keep the kernel
+ * defaults, defer_accept waits up to that many seconds for the first
+ * data before a connection is reported. accept_batch caps the
+ * connections accepted per readiness of the listener.
+ */
+struct SocketProfile {
+  SocketProfile()
+      : tcp_nodelay(true),
+        send_buffer(0),
+        recv_buffer(0),
+        quick_ack(false),
+        defer_accept(0),
+        keep_alive(false),
+        backlog(1024),
+        accept_batch(64) {}
+  bool tcp_nodelay;
+  int send_buffer;
+  int recv_buffer;
+  bool quick_ack;
+  int defer_accept;
+  bool keep_alive;
+  int backlog;
+  int accept_batch;
 };
 
 enum EventStatus {
@@ -10,10 +10,12 @@
 #include <functional>
 #include <queue>
 #include <map>
+#include <memory>
 #include <utility>
 #include <atomic>
 #include <vector>
 #include <set>
+#include <unordered_set>
 #include <fcntl.h>
 
 #include "slash/include/xdebug.h"
@@ -29,6 +31,7 @@ namespace pink {
 class PinkEpoll;
 struct PinkFiredEvent;
 class PinkConn;
+class PatternIndex;
 
 class PubSubThread : public Thread {
  public:
@@ -38,8 +41,25 @@ class PubSubThread : public Thread {
 
   // PubSub
 
+  /*
+   * Hands msg to the subscribers of channel and of the patterns matching
+   * it and returns their number. Waits for the pubsub thread, so not from
+   * there.
+   */
   int Publish(const std::string& channel, const std::string& msg);
 
+  /*
+   * Like Publish, without waiting. Any number of threads may publish at
+   * once, the messages queue lock-free and are fanned out in batches, in
+   * order per publishing thread. A message is built once per channel or
+   * pattern and shared by all of its subscribers, and each subscriber is
+   * written to once per batch. cb, if set, gets the number of receivers on
+   * the pubsub thread, 0 if the thread stops first.
+   */
+  typedef std::function<void(int receivers)> PublishCallback;
+  void PublishAsync(std::string channel, std::string msg,
+                    PublishCallback cb = PublishCallback());
+
   void Subscribe(std::shared_ptr<PinkConn> conn,
                  const std::vector<std::string>& channels,
                  const bool pattern,
@@ -81,31 +101,69 @@ class PubSubThread : public Thread {
 
   bool IsReady(int fd);
 
+  /*
+   * A subscriber is closed once the messages it has not read yet break
+   * limit, see OutputBufferLimit and PinkConn::output_bytes.
+   * Default: 32MB hard, 8MB for 60s soft, like Redis.
+   * Set before StartThread
+   */
+  void set_output_buffer_limit(const OutputBufferLimit& limit) {
+    output_buffer_limit_ = limit;
+  }
+  // Subscribers closed so far for breaking the limit
+  uint64_t output_limit_closed() const {
+    return output_limit_closed_.load(std::memory_order_relaxed);
+  }
+
+  /*
+   * Pattern matching so far. Patterns are indexed by their literal prefix,
+   * only the ones a channel starts with and that are not just a prefix
+   * followed by '*' are evaluated.
+   */
+  struct PatternMatchStats {
+    uint64_t publishes;
+    uint64_t patterns_evaluated;
+    uint64_t patterns_matched;
+  };
+  PatternMatchStats pattern_match_stats() const;
+
  private:
   void RemoveConn(std::shared_ptr<PinkConn> conn);
 
   int ClientChannelSize(std::shared_ptr<PinkConn> conn);
 
+  /*
+   * Publishes not fanned out yet, newest first. The publish finding the
+   * list empty wakes the thread through msg_pfd_, which takes the whole
+   * list at once.
+   */
+  struct PublishItem;
+  std::atomic<PublishItem*> publish_head_;
   int msg_pfd_[2];
   bool should_exit_;
+  void HandlePublishes();
+  // Calls back the publishes never fanned out
+  void DropPublishes();
+  /*
+   * Queues a message for the ready conns, returns their number. The conns
+   * are remembered in publish_conns_, to be written once the batch is done
+   */
+  int Deliver(const std::vector<std::shared_ptr<PinkConn> >& conns,
+              const std::string& subscribe_channel,
+              const std::string& channel, const std::string& msg,
+              bool pattern);
+  std::vector<std::shared_ptr<PinkConn> > publish_conns_;
+  std::unordered_set<PinkConn*> publish_conns_set_;
 
   mutable slash::RWMutex rwlock_; /* For external statistics */
   std::map<int, std::shared_ptr<ConnHandle> > conns_;
 
-  slash::Mutex pub_mutex_;
-  slash::CondVar receiver_rsignal_;
-  slash::Mutex receiver_mutex_;
-
   /*
    * receive fd from worker thread
    */
   slash::Mutex mutex_;
   std::queue<PinkItem> queue_;
 
-  std::string channel_;
-  std::string message_;
-  int receivers_;
-
   /*
    * The epoll handler
    */
@@ -122,6 +180,16 @@ class PubSubThread : public Thread {
 
   std::map<std::string, std::vector<std::shared_ptr<PinkConn> >> pubsub_channel_;    // channel <---> conns
   std::map<std::string, std::vector<std::shared_ptr<PinkConn> >> pubsub_pattern_;    // channel <---> conns
+  // The patterns of pubsub_pattern_ with subscribers, to their map entry
+  PatternIndex* pattern_index_;
+  std::atomic<uint64_t> pattern_publishes_;
+  std::atomic<uint64_t> patterns_evaluated_;
+  std::atomic<uint64_t> patterns_matched_;
+
+  // Also counts and logs a conn that breaks output_buffer_limit_
+  bool OutputLimitReached(PinkConn* conn);
+  OutputBufferLimit output_buffer_limit_;
+  std::atomic<uint64_t> output_limit_closed_;
 
   // No copying allowed
   PubSubThread(const PubSubThread&);
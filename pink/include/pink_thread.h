@@ -9,11 +9,33 @@
 #include <pthread.h>
 #include <string>
 #include <atomic>
+#include <vector>
 
 #include "slash/include/slash_mutex.h"
 
 namespace pink {
 
+/*
+ * Where a group of pink threads runs. kCpuListPlacement pins the threads
+ * round robin to one of cpus each, kPhysicalCorePlacement to one hardware
+ * thread per physical core, so no two of them share a core while there
+ * are enough, and kNumaNodePlacement spreads them round robin over the
+ * NUMA nodes (all of them if nodes is empty), each free to run on any cpu
+ * of its node. Memory a pinned thread touches first stays on its node.
+ */
+struct ThreadPlacement {
+  enum Policy {
+    kNoPlacement,
+    kCpuListPlacement,
+    kPhysicalCorePlacement,
+    kNumaNodePlacement,
+  };
+  Policy policy;
+  std::vector<int> cpus;
+  std::vector<int> nodes;
+  ThreadPlacement() : policy(kNoPlacement) {}
+};
+
 class Thread {
  public:
   Thread();
@@ -47,6 +69,18 @@ class Thread {
     thread_name_ = name;
   }
 
+  /*
+   * The cpus the thread is pinned to when it starts, empty to leave it
+   * to the scheduler. Call before StartThread
+   */
+  void set_cpu_affinity(const std::vector<int>& cpus) {
+    cpu_affinity_ = cpus;
+  }
+
+  const std::vector<int>& cpu_affinity() const {
+    return cpu_affinity_;
+  }
+
  protected:
   std::atomic<bool> should_stop_;
 
@@ -58,6 +92,7 @@ class Thread {
   bool running_;
   pthread_t thread_id_;
   std::string thread_name_;
+  std::vector<int> cpu_affinity_;
 
   /*
    * No allowed copy and copy assign
@@ -6,14 +6,21 @@
 #ifndef PINK_INCLUDE_REDIS_CONN_H_
 #define PINK_INCLUDE_REDIS_CONN_H_
 
+#include <atomic>
+#include <deque>
 #include <map>
+#include <memory>
 #include <vector>
 #include <string>
 
+#include "slash/include/slash_mutex.h"
 #include "slash/include/slash_status.h"
 #include "pink/include/pink_define.h"
 #include "pink/include/pink_conn.h"
 #include "pink/include/redis_parser.h"
+#include "pink/include/thread_pool.h"
+#include "pink/include/work_stealing_pool.h"
+#include "pink/src/output_chain.h"
 
 namespace pink {
 
@@ -24,6 +31,26 @@ enum HandleType {
   kAsynchronous
 };
 
+/*
+ * Runs the commands a RedisConn offloads, see
+ * RedisConn::SetOffloadExecutor. Schedule is called from the worker
+ * threads and must not run func right away, nor block for long.
+ */
+class RedisOffloadExecutor {
+ public:
+  virtual ~RedisOffloadExecutor() {}
+  virtual void Schedule(TaskFunc func, void* arg) = 0;
+};
+
+/*
+ * Runs the offloaded commands on pool, which is not owned. Schedule blocks
+ * while the pool's queue is full.
+ */
+extern RedisOffloadExecutor* NewThreadPoolOffloadExecutor(ThreadPool* pool);
+// Runs the offloaded commands on pool, which is not owned
+extern RedisOffloadExecutor* NewWorkStealingPoolOffloadExecutor(
+    WorkStealingPool* pool);
+
 class RedisConn: public PinkConn {
  public:
   RedisConn(const int fd,
@@ -37,36 +64,144 @@ class RedisConn: public PinkConn {
   virtual ReadStatus GetRequest() override;
   virtual WriteStatus SendReply() override;
   virtual int WriteResp(const std::string& resp) override;
+  // Queued like AppendReply, not copied
+  virtual int WriteSharedResp(std::shared_ptr<const std::string> resp) override;
+
+  virtual bool SupportsCompletionIO() override;
+  virtual ReadStatus ProcessInput(const char* data, size_t len) override;
+  virtual bool TakeOutput(OutputChain* output) override;
+
+  // kSynchronous conns with no reply pending, see PinkConn::CanMigrate
+  virtual bool CanMigrate() override;
+  // Also true while offloaded replies are ready to be written
+  virtual bool is_reply() override;
+  // Unparsed input, and replies not written yet but not offloaded ones
+  virtual size_t input_bytes() override;
+  virtual size_t output_bytes() override;
 
   void TryResizeBuffer() override;
+  bool HasLargeBuffer() override;
   void SetHandleType(const HandleType& handle_type);
   HandleType GetHandleType();
 
+  /*
+   * Called with the commands of each complete read. A kAsynchronous conn
+   * handles them here. A kSynchronous conn gets them after DealMessage
+   * handled each one, with async false; the arguments are only copied for
+   * this while the method is overridden, the default stops it.
+   */
   virtual void ProcessRedisCmds(const std::vector<RedisCmdArgsType>& argvs, bool async, std::string* response);
   void NotifyEpoll(bool success);
 
   virtual int DealMessage(const RedisCmdArgsType& argv, std::string* response) = 0;
+  /*
+   * Called for every command of a kSynchronous conn. argv points into the
+   * read buffer and is only valid until it returns, each argument is
+   * followed by a '\0'. The default copies argv and calls the overload
+   * above; override it to avoid copying the arguments.
+   */
+  virtual int DealMessage(const RedisCmdArgsSlice& argv, std::string* response);
+
+  /*
+   * Queue a reply behind everything in response so far, e.g. from
+   * DealMessage instead of appending a large value to response. reply is
+   * taken over or referenced until it has been written, not copied.
+   * Like response, only for the conn's thread.
+   */
+  void AppendReply(std::string&& reply);
+  void AppendReply(std::shared_ptr<const std::string> reply);
+
+  /*
+   * Commands of a kSynchronous conn for which ShouldOffload returns true
+   * are copied and run by executor, on its threads, through the
+   * DealMessage(const RedisCmdArgsType&) overload; it may run for several
+   * commands of the conn at the same time. The other commands are still
+   * handled right away. Replies are written in the order of the commands
+   * however the offloaded ones complete, a command whose DealMessage
+   * fails closes the conn after the replies before it. executor is not
+   * owned and must outlive the conn, nullptr turns offloading off.
+   * Call from the conn's thread, e.g. from the ConnFactory.
+   */
+  void SetOffloadExecutor(RedisOffloadExecutor* executor);
+  virtual bool ShouldOffload(const RedisCmdArgsSlice& argv) { return true; }
 
  private:
-  static int ParserDealMessageCb(RedisParser* parser, const RedisCmdArgsType& argv);
-  static int ParserCompleteCb(RedisParser* parser, const std::vector<RedisCmdArgsType>& argvs);
+  static int ParserDealMessageCb(RedisParser* parser, const RedisCmdArgsSlice& argv);
   ReadStatus ParseRedisParserStatus(RedisParserStatus status);
+  // Grows rbuf_ for the next read, returns the free space or -1 if full
+  int ReserveReadSpace();
+  // Moves the unparsed input into a big buffer of at least size bytes
+  bool UseBigBuffer(int size);
+  // Moves the unparsed input back into the small buffer
+  void ReleaseBigBuffer();
+  /*
+   * Parses after nread bytes have been placed at last_read_pos_ + 1. The
+   * parser works in place, an incomplete command is kept at the start of
+   * rbuf_ and parsed again with the next input.
+   */
+  ReadStatus ConsumeRead(int nread);
 
   HandleType handle_type_;
 
+  /*
+   * rbuf_ is the small buffer, grown in steps of REDIS_IOBUF_LEN, or a
+   * pooled big buffer while a command of REDIS_MBULK_BIG_ARG or more is
+   * read. A bulk argument is read straight into a buffer of its size once
+   * its length is known, and the big buffer is given back as soon as the
+   * command has been handled. The small buffer waits in small_rbuf_.
+   */
   char* rbuf_;
   int rbuf_len_;
   int rbuf_max_len_;
-  int msg_peak_;
+  bool big_rbuf_;
+  char* small_rbuf_;
+  int small_rbuf_len_;
   int command_len_;
 
-  uint32_t wbuf_pos_;
+  // Replies are built in response_, then queued in output_ to be written
   std::string response_;
+  OutputChain output_;
 
   // For Redis Protocol parser
   int last_read_pos_;
   RedisParser redis_parser_;
-  long bulk_len_;
+  // Bytes missing from the bulk argument being read, see RedisParser
+  long bulk_missing_;
+  // Commands for the next ProcessRedisCmds
+  std::vector<RedisCmdArgsType> cmd_argvs_;
+  // Cleared by the default ProcessRedisCmds of a kSynchronous conn
+  bool process_sync_cmds_;
+
+  /*
+   * Offloading, see SetOffloadExecutor. Once a command is offloaded the
+   * reply of every later command gets a slot in offload_queue_ too, by
+   * sequence number, until the queue has drained. The executor threads
+   * fill in their slots and ask the worker to write through a kNotiWrite
+   * when they complete the head of the queue; the worker moves the
+   * completed slots at the head to output_ when it writes.
+   */
+  struct OffloadSlot {
+    uint64_t seq;
+    std::string reply;
+    bool done;
+    bool failed;
+  };
+  struct OffloadTask;
+  static void RunOffloadTask(void* arg);
+  int OffloadOrDeal(const RedisCmdArgsSlice& argv);
+  void OffloadDone(uint64_t seq, std::string* reply, bool failed);
+  // Moves the completed replies at the head of offload_queue_ to output_
+  void CollectOffloaded();
+  // True if replies are waiting in offload_queue_, any thread
+  bool OffloadPending();
+
+  RedisOffloadExecutor* offload_executor_;
+  slash::Mutex offload_mu_;
+  std::deque<OffloadSlot> offload_queue_;
+  uint64_t offload_next_seq_;
+  std::atomic<bool> offload_ready_;
+  // Where AppendReply goes while a command is handled behind the queue
+  std::string* offload_reply_;
 };
 
 }  // namespace pink
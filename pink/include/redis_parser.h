@@ -7,7 +7,9 @@
 #define PINK_INCLUDE_REDIS_PARSER_H_
 
 #include "pink/include/pink_define.h"
+#include "slash/include/slash_slice.h"
 
+#include <string>
 #include <vector>
 
 #define REDIS_PARSER_REQUEST 1
@@ -18,7 +20,10 @@ namespace pink {
 class RedisParser;
 
 typedef std::vector<std::string> RedisCmdArgsType;
+// Arguments pointing into the parsed input, see ProcessInputBufferInPlace
+typedef std::vector<slash::Slice> RedisCmdArgsSlice;
 typedef int (*RedisParserDataCb) (RedisParser*, const RedisCmdArgsType&);
+typedef int (*RedisParserSliceDataCb) (RedisParser*, const RedisCmdArgsSlice&);
 typedef int (*RedisParserMultiDataCb) (RedisParser*, const std::vector<RedisCmdArgsType>&);
 typedef int (*RedisParserCb) (RedisParser*);
 typedef int RedisParserType;
@@ -43,9 +48,12 @@ enum RedisParserError {
 struct RedisParserSettings {
   RedisParserDataCb DealMessage;
   RedisParserMultiDataCb Complete;
+  // Only used by ProcessInputBufferInPlace, instead of the two above
+  RedisParserSliceDataCb DealSliceMessage;
   RedisParserSettings() {
     DealMessage = NULL;
     Complete = NULL;
+    DealSliceMessage = NULL;
   }
 };
 
@@ -54,9 +62,26 @@ class RedisParser {
   RedisParser();
   RedisParserStatus RedisParserInit(RedisParserType type, const RedisParserSettings& settings);
   RedisParserStatus ProcessInputBuffer(const char* input_buf, int length, int* parsed_len);
+  /*
+   * Parses without copying: the argv passed to DealSliceMessage points
+   * into input_buf, which must stay in place until the callback returns.
+   * Every argument is followed by a '\0' written over its '\r', so its
+   * data() is also a C string. An incomplete command is not cached,
+   * parsed_len only counts the complete ones and the caller passes the
+   * rest again, followed by the new input, in the next call.
+   */
+  RedisParserStatus ProcessInputBufferInPlace(char* input_buf, int length, int* parsed_len);
   long get_bulk_len() {
     return bulk_len_;
   }
+  /*
+   * After kRedisParserHalf: the bytes still missing from the input to
+   * complete the bulk argument being parsed, its "\r\n" included. 0 if
+   * the input ends elsewhere.
+   */
+  long get_bulk_missing() {
+    return bulk_missing_;
+  }
   RedisParserError get_error_code() {
     return error_code_;
   }
@@ -68,6 +93,12 @@ class RedisParser {
   void CacheHalfArgv();
   int FindNextSeparators();
   int GetNextNum(int pos, long* value);
+  /*
+   * Parses the "*<num>\r\n" or "$<num>\r\n" header at cur_pos_. Returns
+   * the position of its '\n', -1 if it is incomplete or -2 if num is not
+   * a number
+   */
+  int ParseHeader(long* value);
   RedisParserStatus ProcessInlineBuffer();
   RedisParserStatus ProcessMultibulkBuffer();
   RedisParserStatus ProcessRequestBuffer();
@@ -84,6 +115,7 @@ class RedisParser {
 
   long multibulk_len_;
   long bulk_len_;
+  long bulk_missing_;
   std::string half_argv_;
 
   int redis_parser_type_; // REDIS_PARSER_REQUEST or REDIS_PARSER_RESPONSE
@@ -91,6 +123,13 @@ class RedisParser {
   RedisCmdArgsType argv_;
   std::vector<RedisCmdArgsType> argvs_;
 
+  // In place mode, see ProcessInputBufferInPlace
+  bool in_place_;
+  char* in_place_buf_;
+  RedisCmdArgsSlice argv_slices_;
+  // Where the command being parsed starts
+  int command_start_;
+
   int cur_pos_;
   const char* input_buf_;
   std::string input_str_;
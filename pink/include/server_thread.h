@@ -6,6 +6,12 @@
 #ifndef PINK_INCLUDE_SERVER_THREAD_H_
 #define PINK_INCLUDE_SERVER_THREAD_H_
 
+#include <netinet/in.h>
+
+#include <algorithm>
+#include <atomic>
+#include <functional>
+#include <map>
 #include <set>
 #include <vector>
 #include <memory>
@@ -139,9 +145,26 @@ class ServerThread : public Thread {
     int fd;
     std::string ip_port;
     struct timeval last_interaction;
+    // The cpu that handled the conn's last packets, -1 if unknown
+    int incoming_cpu;
+    // See PinkConn::input_bytes and output_bytes, 0 for a HolyThread
+    size_t input_bytes;
+    size_t output_bytes;
   };
   virtual std::vector<ConnInfo> conns_info() const = 0;
 
+  /*
+   * The bytes buffered for all conns, from conns_info, and the number of
+   * conns closed so far for breaking their output buffer limit
+   */
+  struct BufferedBytes {
+    size_t input_bytes;
+    size_t output_bytes;
+    size_t max_output_bytes;
+    uint64_t limit_closed_conns;
+  };
+  BufferedBytes buffered_bytes() const;
+
   // Move out from server thread
   virtual std::shared_ptr<PinkConn> MoveConnOut(int fd) = 0;
   // Move into server thread
@@ -154,6 +177,168 @@ class ServerThread : public Thread {
 
   virtual void SetQueueLimit(int queue_limit) { }
 
+  /*
+   * Load of a worker thread over the last second or so. busy_permille is
+   * the share of time spent handling events, spin_permille the share
+   * spent polling without a result, see set_busy_poll, and
+   * sleep_permille the rest, blocked in epoll_wait or io_uring_enter.
+   * events_per_sec counts fired events and io_uring completions
+   */
+  struct WorkerLoad {
+    int conns;
+    int events_per_sec;
+    int busy_permille;
+    int spin_permille;
+    int sleep_permille;
+  };
+  // One entry per worker, empty for a HolyThread
+  virtual std::vector<WorkerLoad> workers_load() const {
+    return std::vector<WorkerLoad>();
+  }
+
+  /*
+   * Write the reply right after a request has been processed instead of
+   * waiting for EPOLLOUT, EPOLLOUT is only registered if the socket buffer
+   * is full. Saves two epoll_ctl calls and an epoll_wait round per request.
+   * Set before StartThread, default: false
+   */
+  void set_immediate_write(bool immediate_write) {
+    immediate_write_ = immediate_write;
+  }
+  bool immediate_write() const { return immediate_write_; }
+
+  /*
+   * Every worker of a DispatchThread listens on its own SO_REUSEPORT
+   * socket and accepts its connections itself, the kernel spreads new
+   * connections over the workers. The dispatch thread only runs the cron
+   * tasks then, and queue_limit no longer applies to new connections.
+   * Set before StartThread, default: false, ignored by HolyThread
+   */
+  void set_reuse_port(bool reuse_port) {
+    reuse_port_ = reuse_port;
+  }
+  bool reuse_port() const { return reuse_port_; }
+
+  /*
+   * kIoUringBackend lets the workers of a DispatchThread receive and send
+   * through io_uring (Linux 5.19+): multishot accept on their own
+   * listeners, receives into provided buffers and sends batched into
+   * one io_uring_enter per loop. Only conns with SupportsCompletionIO()
+   * use it, the others and the notify queue stay on epoll. kNotiWait is
+   * ignored and MoveConnOut is not supported for io_uring conns. Workers
+   * fall back to epoll where io_uring is not available.
+   * Set before StartThread, default: kEpollBackend, ignored by HolyThread
+   */
+  void set_io_backend(IoBackend io_backend) {
+    io_backend_ = io_backend;
+  }
+  IoBackend io_backend() const { return io_backend_; }
+
+  /*
+   * kLeastLoadedPlacement hands a new conn of a DispatchThread to the
+   * worker with the lowest busy_permille, the one with the fewest conns
+   * if several are within 10% of it, instead of the next one round robin.
+   * Set before StartThread, default: kRoundRobinPlacement, ignored by
+   * HolyThread and with reuse_port
+   */
+  void set_conn_placement(ConnPlacement conn_placement) {
+    conn_placement_ = conn_placement;
+  }
+  ConnPlacement conn_placement() const { return conn_placement_; }
+
+  /*
+   * Every interval_ms the dispatch thread compares the load of its
+   * workers. If the busiest one is much busier than the idlest, one of
+   * its conns is moved over between two requests: the one causing the
+   * most events whose move narrows the gap without reversing it, among
+   * the conns that agree to it, see PinkConn::CanMigrate. Only epoll conns
+   * are moved: with kIoUringBackend on a kernel that has io_uring every
+   * conn supporting completion I/O stays on the worker that accepted it,
+   * and rebalancing only applies to the others.
+   * Set before StartThread, default: 0, off, ignored by HolyThread
+   */
+  void set_rebalance_interval(int interval_ms) {
+    rebalance_interval_ = interval_ms;
+  }
+  int rebalance_interval() const { return rebalance_interval_; }
+
+  /*
+   * After handling events the workers of a DispatchThread keep polling
+   * without blocking for spin_us, so the next request does not pay for a
+   * wakeup, and only block once nothing arrived for that long. Accepted
+   * sockets also get SO_BUSY_POLL (and SO_PREFER_BUSY_POLL where
+   * available) of spin_us; the kernel only allows raising it above
+   * net.core.busy_read with CAP_NET_ADMIN. A spinning worker keeps its
+   * core busy, see WorkerLoad::spin_permille, so this is meant for
+   * workers with cores of their own, see set_thread_placement.
+   * Set before StartThread, default: 0, off
+   */
+  void set_busy_poll(int spin_us) {
+    busy_poll_us_ = spin_us;
+  }
+  int busy_poll() const { return busy_poll_us_; }
+
+  /*
+   * Pins the workers of a DispatchThread, or a HolyThread itself, see
+   * ThreadPlacement. Pinned threads also allocate their event buffers
+   * themselves, so they are local to their node.
+   * Set before StartThread, default: kNoPlacement
+   */
+  void set_thread_placement(const ThreadPlacement& placement) {
+    thread_placement_ = placement;
+  }
+  const ThreadPlacement& thread_placement() const {
+    return thread_placement_;
+  }
+
+  /*
+   * The workers of a DispatchThread close a conn of conn_class that
+   * breaks limit, see OutputBufferLimit and PinkConn::output_bytes. They
+   * check when a reply could not be written completely.
+   * Default: those of Redis, none for kNormalConnClass, 256MB hard and
+   * 64MB for 60s soft for kReplicaConnClass, 32MB and 8MB for 60s for
+   * kPubSubConnClass. Ignored by HolyThread
+   */
+  void set_output_buffer_limit(ConnClass conn_class,
+                               const OutputBufferLimit& limit) {
+    output_buffer_limits_[conn_class] = limit;
+  }
+  const OutputBufferLimit& output_buffer_limit(ConnClass conn_class) const {
+    return output_buffer_limits_[conn_class];
+  }
+
+  /*
+   * By default a worker stops reading a conn while a reply could not be
+   * written completely, until all of it is. With high_bytes set it keeps
+   * reading and handling requests until the conn's output_bytes reach
+   * high_bytes, and starts again once they dropped to low_bytes. Only
+   * for conns that report their output_bytes and take requests while
+   * replies are pending, like RedisConn. io_uring conns keep receiving
+   * all the time unless high_bytes is set.
+   * Set before StartThread, default: 0, off, ignored by HolyThread
+   */
+  void set_output_watermarks(size_t high_bytes, size_t low_bytes) {
+    output_high_watermark_ = high_bytes;
+    output_low_watermark_ = std::min(low_bytes, high_bytes);
+  }
+  size_t output_high_watermark() const { return output_high_watermark_; }
+  size_t output_low_watermark() const { return output_low_watermark_; }
+
+  /*
+   * Options of the listening sockets and the connections accepted on
+   * them, see SocketProfile. The profile given for a bind ip applies to
+   * the listeners on that address, the other one to all the rest.
+   * Set before StartThread, default: SocketProfile()
+   */
+  void set_socket_profile(const SocketProfile& profile) {
+    socket_profile_ = profile;
+  }
+  void set_socket_profile(const std::string& bind_ip,
+                          const SocketProfile& profile) {
+    ip_socket_profiles_[bind_ip] = profile;
+  }
+  const SocketProfile& socket_profile(const std::string& bind_ip) const;
+
   virtual ~ServerThread();
 
  protected:
@@ -187,7 +372,40 @@ class ServerThread : public Thread {
   int port_;
   std::set<std::string> ips_;
   std::vector<ServerSocket*> server_sockets_;
-  std::set<int32_t> server_fds_;
+
+  bool immediate_write_;
+  bool reuse_port_;
+  IoBackend io_backend_;
+  ConnPlacement conn_placement_;
+  int rebalance_interval_;
+  int busy_poll_us_;
+  ThreadPlacement thread_placement_;
+  OutputBufferLimit output_buffer_limits_[kConnClassNum];
+  size_t output_high_watermark_;
+  size_t output_low_watermark_;
+  std::atomic<uint64_t> output_limit_closed_;
+  void SetDefaultOutputBufferLimits();
+  SocketProfile socket_profile_;
+  std::map<std::string, SocketProfile> ip_socket_profiles_;
+
+  /*
+   * Accepts the pending connections on listener, up to its accept_batch,
+   * and hands each one that AccessHandle lets in to handle_conn with its
+   * ip_port
+   */
+  void AcceptConns(
+      ServerSocket* listener,
+      const std::function<void(int, const std::string&)>& handle_conn);
+  /*
+   * The part of AcceptConns after accept(), returns -1 and closes connfd
+   * if the connection is refused, else fills ip_port
+   */
+  int SetupAcceptedConn(int connfd, const struct sockaddr_in& cliaddr,
+                        std::string* ip_port);
+  // nullptr if fd is none of our listeners
+  ServerSocket* FindServerSocket(int fd) const;
+  // Best effort, see set_busy_poll
+  void SetBusyPoll(int connfd);
 
   virtual int InitHandle();
   virtual void *ThreadMain() override;
@@ -9,10 +9,13 @@
 #include <string>
 #include <queue>
 #include <atomic>
+#include <vector>
 #include <pthread.h>
 
 #include "slash/include/slash_mutex.h"
 #include "pink/include/pink_define.h"
+#include "pink/include/pink_thread.h"
+#include "pink/include/timer_service.h"
 
 namespace pink {
 
@@ -25,20 +28,7 @@ struct Task {
      : func(_func), arg(_arg) {}
 };
 
-struct TimeTask {
-  uint64_t exec_time;
-  TaskFunc func;
-  void* arg;
-  TimeTask(uint64_t _exec_time, TaskFunc _func, void* _arg) :
-    exec_time(_exec_time),
-    func(_func),
-    arg(_arg) {}
-  bool operator < (const TimeTask& task) const {
-    return exec_time > task.exec_time;
-  }
-};
-
-class ThreadPool {
+class ThreadPool : public TimerTarget {
 
  public:
   class Worker {
@@ -48,8 +38,13 @@ class ThreadPool {
 
       int start();
       int stop();
+      // The cpus to pin the worker to once started, see ThreadPlacement
+      void set_cpu_affinity(const std::vector<int>& cpus) {
+        cpu_affinity_ = cpus;
+      }
     private:
       pthread_t thread_id_;
+      std::vector<int> cpu_affinity_;
       std::atomic<bool> start_;
       ThreadPool* const thread_pool_;
       std::string worker_name_;
@@ -71,13 +66,28 @@ class ThreadPool {
   void set_should_stop();
 
   void Schedule(TaskFunc func, void* arg);
-  void DelaySchedule(uint64_t timeout, TaskFunc func, void* arg);
+  /*
+   * Runs func(arg) after timeout ms, through TimerService::Default. The
+   * returned handle may be passed to its Cancel and Reschedule.
+   */
+  uint64_t DelaySchedule(uint64_t timeout, TaskFunc func, void* arg);
   size_t max_queue_size();
   size_t worker_size();
   void cur_queue_size(size_t* qsize);
   void cur_time_queue_size(size_t* qsize);
   std::string thread_pool_name();
 
+  // Queues the tasks of timers that came due, at once
+  virtual void ScheduleTimerTasks(const std::vector<TimerTask>& tasks) override;
+
+  /*
+   * Pins the workers, see ThreadPlacement.
+   * Set before start_thread_pool, default: kNoPlacement
+   */
+  void set_thread_placement(const ThreadPlacement& placement) {
+    thread_placement_ = placement;
+  }
+
  private:
   void runInThread();
 
@@ -85,10 +95,12 @@ class ThreadPool {
   size_t max_queue_size_;
   std::string thread_pool_name_;
   std::queue<Task> queue_;
-  std::priority_queue<TimeTask> time_queue_;
+  // Set once DelaySchedule is used, our timers are canceled on destruction
+  std::atomic<bool> has_timers_;
   std::vector<Worker*> workers_;
   std::atomic<bool> running_;
   std::atomic<bool> should_stop_;
+  ThreadPlacement thread_placement_;
 
   slash::Mutex mu_;
   slash::CondVar rsignal_;
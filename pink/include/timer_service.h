@@ -0,0 +1,124 @@
+// Copyright (c) 2015-present, Qihoo, Inc.  All rights reserved.
+// This source code is licensed under the BSD-style license found in the
+// LICENSE file in the root directory of this source tree. An additional grant
+// of patent rights can be found in the PATENTS file in the same directory.
+
+#ifndef PINK_INCLUDE_TIMER_SERVICE_H_
+#define PINK_INCLUDE_TIMER_SERVICE_H_
+
+#include <stdint.h>
+
+#include <unordered_map>
+#include <utility>
+#include <vector>
+
+#include "slash/include/slash_mutex.h"
+#include "pink/include/pink_thread.h"
+
+namespace pink {
+
+class TimerWheel;
+
+struct TimerTask {
+  void (*function)(void*);
+  void* arg;
+  TimerTask(void (*_function)(void*), void* _arg)
+    : function(_function), arg(_arg) {}
+};
+
+/*
+ * Where the tasks of a TimerService's timers run, e.g. ThreadPool and
+ * BGThread. ScheduleTimerTasks is called on the timer thread with all of
+ * the target's timers that came due at once, it must not block for long
+ * nor call back into the TimerService.
+ */
+class TimerTarget {
+ public:
+  virtual ~TimerTarget() {}
+  virtual void ScheduleTimerTasks(const std::vector<TimerTask>& tasks) = 0;
+};
+
+/*
+ * One thread keeping the timers of many targets in a TimerWheel, on the
+ * monotonic clock with a resolution of one millisecond. Add, Cancel and
+ * Reschedule may be called from any thread.
+ */
+class TimerService : public Thread {
+ public:
+  TimerService();
+  virtual ~TimerService();
+
+  /*
+   * The service behind ThreadPool::DelaySchedule and
+   * BGThread::DelaySchedule, started on first use and never destroyed
+   */
+  static TimerService* Default();
+
+  /*
+   * Hands function(arg) to target after timeout_ms. Returns the handle of
+   * the timer, never 0.
+   */
+  uint64_t Add(uint64_t timeout_ms, TimerTarget* target,
+               void (*function)(void*), void* arg);
+
+  // False if the timer has already come due or been canceled
+  bool Cancel(uint64_t id);
+  // Moves the timer to timeout_ms from now, false like Cancel
+  bool Reschedule(uint64_t id, uint64_t timeout_ms);
+
+  /*
+   * Cancels all timers of target and waits for the tasks already being
+   * handed to it, so it may be destroyed afterwards. Not from target's
+   * ScheduleTimerTasks.
+   */
+  void CancelAll(TimerTarget* target);
+
+  // Timers of target not come due yet
+  size_t pending(TimerTarget* target);
+  size_t size();
+
+  virtual int StopThread() override;
+
+ private:
+  struct Timer {
+    uint64_t wheel_id;
+    // Part of the handle, changes when the timer is freed
+    uint32_t gen;
+    TimerTarget* target;
+    void (*function)(void*);
+    void* arg;
+  };
+
+  virtual void* ThreadMain() override;
+  // Called by the wheel, collects the task in due_
+  void Expire(uint32_t slot);
+  // The slot of a live timer, -1 if id is not one
+  int64_t FindSlot(uint64_t id);
+  void FreeSlot(uint32_t slot);
+  // Arms timer slot, wakes the thread if it comes due before its wakeup
+  void Arm(uint32_t slot, uint64_t timeout_ms);
+
+  slash::Mutex mu_;
+  slash::CondVar cv_;
+  TimerWheel* wheel_;
+  std::vector<Timer> timers_;
+  std::vector<uint32_t> free_slots_;
+  std::unordered_map<TimerTarget*, size_t> pending_;
+  // When the thread wakes up next, UINT64_MAX if there is no timer
+  uint64_t wakeup_ms_;
+
+  /*
+   * Due tasks by target, handed over outside of mu_. dispatching_ is set
+   * meanwhile and CancelAll waits on dispatched_ until it is cleared.
+   */
+  std::vector<std::pair<TimerTarget*, std::vector<TimerTask> > > due_;
+  bool dispatching_;
+  slash::CondVar dispatched_;
+
+  // No copying allowed
+  TimerService(const TimerService&);
+  void operator=(const TimerService&);
+};
+
+}  // namespace pink
+#endif  // PINK_INCLUDE_TIMER_SERVICE_H_
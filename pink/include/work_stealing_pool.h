@@ -0,0 +1,188 @@
+// Copyright (c) 2015-present, Qihoo, Inc.  All rights reserved.
+// This source code is licensed under the BSD-style license found in the
+// LICENSE file in the root directory of this source tree. An additional grant
+// of patent rights can be found in the PATENTS file in the same directory.
+
+#ifndef PINK_INCLUDE_WORK_STEALING_POOL_H_
+#define PINK_INCLUDE_WORK_STEALING_POOL_H_
+
+#include <atomic>
+#include <future>
+#include <string>
+#include <type_traits>
+#include <utility>
+#include <vector>
+
+#include "slash/include/slash_mutex.h"
+#include "pink/include/pink_define.h"
+#include "pink/include/pink_thread.h"
+#include "pink/include/thread_pool.h"
+
+namespace pink {
+
+/*
+ * A thread pool for many short tasks on many workers. Every worker has a
+ * lock-free deque of its own, tasks scheduled from a worker go there and
+ * idle workers steal from the others. Tasks from other threads go through
+ * an injection queue with a shard per worker. Idle workers sleep on a
+ * futex and are woken one at a time, only while some are asleep.
+ *
+ * The queues are unbounded and tasks run in no particular order. Tasks
+ * scheduled before start_thread_pool run once it is started, and
+ * stop_thread_pool returns once every task scheduled so far, or by those
+ * tasks, has run. Tasks still queued when the pool is destroyed without
+ * having been started are deleted without running.
+ */
+class WorkStealingPool {
+ public:
+  // A unit of work, deleted once it has run
+  class Task {
+   public:
+    virtual ~Task() {}
+    virtual void Run() = 0;
+  };
+
+  explicit WorkStealingPool(size_t worker_num,
+                            const std::string& thread_pool_name = "WSPool");
+  virtual ~WorkStealingPool();
+
+  int start_thread_pool();
+  int stop_thread_pool();
+
+  // Takes ownership of task, from any thread
+  void Schedule(Task* task);
+  void Schedule(TaskFunc func, void* arg);
+
+  /*
+   * Runs f(), which may be move-only, on a worker. Post drops the result,
+   * Submit returns it, or the exception f threw, through a future. The
+   * two argument Submit runs then(f()), or f() and then() if f returns
+   * void, on the worker instead.
+   */
+  template <typename F>
+  void Post(F&& f) {
+    Schedule(new FuncTask<typename std::decay<F>::type>(std::forward<F>(f)));
+  }
+
+  template <typename F>
+  std::future<typename std::result_of<typename std::decay<F>::type()>::type>
+  Submit(F&& f) {
+    typedef typename std::result_of<typename std::decay<F>::type()>::type R;
+    std::packaged_task<R()> task(std::forward<F>(f));
+    std::future<R> future = task.get_future();
+    Post(std::move(task));
+    return future;
+  }
+
+  template <typename F, typename C>
+  void Submit(F&& f, C&& then) {
+    Schedule(new ThenTask<typename std::decay<F>::type,
+                          typename std::decay<C>::type>(
+        std::forward<F>(f), std::forward<C>(then)));
+  }
+
+  size_t worker_size() const {
+    return worker_num_;
+  }
+  std::string thread_pool_name() const {
+    return thread_pool_name_;
+  }
+  // Tasks waiting in all queues, a snapshot
+  void cur_queue_size(size_t* qsize);
+  // Tasks a worker took from another worker's deque so far
+  uint64_t steal_count() const {
+    return steal_count_.load(std::memory_order_relaxed);
+  }
+
+  /*
+   * Pins the workers, see ThreadPlacement.
+   * Set before start_thread_pool, default: kNoPlacement
+   */
+  void set_thread_placement(const ThreadPlacement& placement) {
+    thread_placement_ = placement;
+  }
+
+ private:
+  template <typename F>
+  class FuncTask : public Task {
+   public:
+    template <typename U>
+    explicit FuncTask(U&& f) : f_(std::forward<U>(f)) {}
+    virtual void Run() override {
+      f_();
+    }
+   private:
+    F f_;
+  };
+
+  template <typename F, typename C>
+  class ThenTask : public Task {
+   public:
+    template <typename U, typename V>
+    ThenTask(U&& f, V&& then)
+        : f_(std::forward<U>(f)), then_(std::forward<V>(then)) {}
+    virtual void Run() override {
+      Run(std::is_void<typename std::result_of<F()>::type>());
+    }
+   private:
+    void Run(std::true_type) {
+      f_();
+      then_();
+    }
+    void Run(std::false_type) {
+      then_(f_());
+    }
+    F f_;
+    C then_;
+  };
+
+  struct Worker;
+  struct Shard;
+  friend struct Worker;
+
+  void RunWorker(Worker* worker);
+  // The next task for worker, nullptr if there is none anywhere
+  Task* FindTask(Worker* worker);
+  Task* PopShard(Shard* shard, Worker* worker);
+  bool HasTask();
+  // Sleeps until woken, unless there is work or the pool stops
+  void Park();
+  void WakeOne();
+  void WakeAll();
+
+  size_t worker_num_;
+  std::string thread_pool_name_;
+  ThreadPlacement thread_placement_;
+  std::vector<Worker*> workers_;
+  std::vector<Shard*> shards_;
+  std::atomic<bool> running_;
+  std::atomic<bool> should_stop_;
+  std::atomic<uint64_t> steal_count_;
+
+  /*
+   * Parking. A worker reads epoch_, counts itself in sleepers_ and looks
+   * for work once more before it waits for epoch_ to change. A scheduler
+   * bumps epoch_ after queueing if anyone sleeps, so either the worker
+   * finds the task or the wait returns. While waking_ is set a wakeup is
+   * under way and further ones are left to the worker it woke, which
+   * clears it before it looks for work and wakes the next one if it finds
+   * more than one task, so a burst costs one futex call, not one each.
+   */
+  std::atomic<uint32_t> epoch_;
+  std::atomic<int> sleepers_;
+  std::atomic<bool> waking_;
+#ifndef __linux__
+  slash::Mutex park_mu_;
+  slash::CondVar park_cv_;
+#endif
+
+  /*
+   * No allowed copy and copy assign
+   */
+  WorkStealingPool(const WorkStealingPool&);
+  void operator=(const WorkStealingPool&);
+};
+
+}  // namespace pink
+
+#endif  // PINK_INCLUDE_WORK_STEALING_POOL_H_
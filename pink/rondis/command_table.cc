@@ -0,0 +1,201 @@
+#include <string.h>
+#include <strings.h>
+#include "pink/include/redis_conn.h"
+#include <ndbapi/NdbApi.hpp>
+#include <ndbapi/Ndb.hpp>
+
+#include "common.h"
+#include "config.h"
+#include "stats.h"
+#include "slowlog.h"
+#include "command_table.h"
+#include "string/commands.h"
+
+static int ping_handler(Ndb *ndb,
+                        const pink::RedisCmdArgsSlice &argv,
+                        std::string *response)
+{
+    response->append("+PONG\r\n");
+    return 0;
+}
+
+static int echo_handler(Ndb *ndb,
+                        const pink::RedisCmdArgsSlice &argv,
+                        std::string *response)
+{
+    response->append("$" + std::to_string(argv[1].size()) + "\r\n");
+    response->append(argv[1].data(), argv[1].size());
+    response->append("\r\n");
+    return 0;
+}
+
+static int config_handler(Ndb *ndb,
+                          const pink::RedisCmdArgsSlice &argv,
+                          std::string *response)
+{
+    return rondb_config_command(argv, response);
+}
+
+static int info_handler(Ndb *ndb,
+                        const pink::RedisCmdArgsSlice &argv,
+                        std::string *response)
+{
+    if (argv.size() > 2)
+    {
+        assign_arity_err_to_response(response, argv[0].data());
+        return -1;
+    }
+    rondb_info_command(argv, response);
+    return 0;
+}
+
+static int latency_handler(Ndb *ndb,
+                           const pink::RedisCmdArgsSlice &argv,
+                           std::string *response)
+{
+    rondb_latency_command(argv, response);
+    return 0;
+}
+
+static int slowlog_handler(Ndb *ndb,
+                           const pink::RedisCmdArgsSlice &argv,
+                           std::string *response)
+{
+    return rondb_slowlog_command(argv, response);
+}
+
+static int get_handler(Ndb *ndb,
+                       const pink::RedisCmdArgsSlice &argv,
+                       std::string *response)
+{
+    rondb_get_command(ndb, argv, response);
+    return 0;
+}
+
+static int set_handler(Ndb *ndb,
+                       const pink::RedisCmdArgsSlice &argv,
+                       std::string *response)
+{
+    rondb_set_command(ndb, argv, response);
+    return 0;
+}
+
+static int incr_handler(Ndb *ndb,
+                        const pink::RedisCmdArgsSlice &argv,
+                        std::string *response)
+{
+    rondb_incr_command(ndb, argv, response);
+    return 0;
+}
+
+#define CMD_NAME(name) name, sizeof(name) - 1
+
+/*
+    GET and SET read or write the whole key, so repeating them after a
+    temporary error is safe. INCR is not retried: a transaction aborted with
+    a temporary error could have been preceded by one that did commit.
+*/
+constexpr RondisCommand rondis_commands[CMD_UNKNOWN] = {
+    {CMD_PING, CMD_NAME("ping"), 1, CMD_FLAG_NO_NDB, 0, 0, 0, 0, ping_handler},
+    {CMD_ECHO, CMD_NAME("echo"), 2, CMD_FLAG_NO_NDB, 0, 0, 0, 0, echo_handler},
+    {CMD_CONFIG, CMD_NAME("config"), -3, CMD_FLAG_NO_NDB | CMD_FLAG_ADMIN, 0, 0, 0, 0, config_handler},
+    {CMD_INFO, CMD_NAME("info"), -1, CMD_FLAG_NO_NDB | CMD_FLAG_ADMIN, 0, 0, 0, 0, info_handler},
+    {CMD_LATENCY, CMD_NAME("latency"), -2, CMD_FLAG_NO_NDB | CMD_FLAG_ADMIN, 0, 0, 0, 0, latency_handler},
+    {CMD_SLOWLOG, CMD_NAME("slowlog"), -2, CMD_FLAG_NO_NDB | CMD_FLAG_ADMIN, 0, 0, 0, 0, slowlog_handler},
+    {CMD_GET, CMD_NAME("get"), 2, CMD_FLAG_READ, 1, 1, 1, 3, get_handler},
+    {CMD_SET, CMD_NAME("set"), 3, CMD_FLAG_WRITE, 1, 1, 1, 3, set_handler},
+    {CMD_INCR, CMD_NAME("incr"), 2, CMD_FLAG_WRITE, 1, 1, 1, 0, incr_handler},
+};
+
+constexpr bool command_ids_match_positions()
+{
+    for (int i = 0; i < CMD_UNKNOWN; i++)
+    {
+        if (rondis_commands[i].id != i)
+        {
+            return false;
+        }
+    }
+    return true;
+}
+static_assert(command_ids_match_positions(),
+              "rondis_commands must be in RondisCommandId order");
+
+/*
+    Hash table mapping case-folded command names to indexes in
+    rondis_commands, -1 marks an empty slot. It has at least twice as many
+    slots as there are commands, which keeps the probe sequences short.
+*/
+#define COMMAND_HASH_SIZE 64
+static_assert(COMMAND_HASH_SIZE >= 2 * CMD_UNKNOWN,
+              "COMMAND_HASH_SIZE is too small for the number of commands");
+
+struct CommandHashTable
+{
+    int slots[COMMAND_HASH_SIZE];
+};
+
+// FNV-1a over the ASCII lower case name
+constexpr Uint32 command_name_hash(const char *name, size_t len)
+{
+    Uint32 hash = 2166136261U;
+    for (size_t i = 0; i < len; i++)
+    {
+        char c = name[i];
+        if (c >= 'A' && c <= 'Z')
+        {
+            c += 'a' - 'A';
+        }
+        hash ^= Uint32((unsigned char)c);
+        hash *= 16777619U;
+    }
+    return hash;
+}
+
+constexpr CommandHashTable build_command_hash_table()
+{
+    CommandHashTable table = {};
+    for (int i = 0; i < COMMAND_HASH_SIZE; i++)
+    {
+        table.slots[i] = -1;
+    }
+    for (int i = 0; i < CMD_UNKNOWN; i++)
+    {
+        Uint32 slot = command_name_hash(rondis_commands[i].name,
+                                        rondis_commands[i].name_len) %
+                      COMMAND_HASH_SIZE;
+        while (table.slots[slot] != -1)
+        {
+            slot = (slot + 1) % COMMAND_HASH_SIZE;
+        }
+        table.slots[slot] = i;
+    }
+    return table;
+}
+
+static constexpr CommandHashTable command_hash_table = build_command_hash_table();
+
+const RondisCommand *lookup_command(const slash::Slice &name)
+{
+    Uint32 slot = command_name_hash(name.data(), name.size()) % COMMAND_HASH_SIZE;
+    while (command_hash_table.slots[slot] != -1)
+    {
+        const RondisCommand *cmd = &rondis_commands[command_hash_table.slots[slot]];
+        if (cmd->name_len == name.size() &&
+            strncasecmp(cmd->name, name.data(), name.size()) == 0)
+        {
+            return cmd;
+        }
+        slot = (slot + 1) % COMMAND_HASH_SIZE;
+    }
+    return nullptr;
+}
+
+const char *command_name(int id)
+{
+    if (id >= 0 && id < CMD_UNKNOWN)
+    {
+        return rondis_commands[id].name;
+    }
+    return "unknown";
+}
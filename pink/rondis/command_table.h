@@ -0,0 +1,98 @@
+#include <string>
+#include "pink/include/redis_conn.h"
+#include <ndbapi/NdbApi.hpp>
+#include <ndbapi/Ndb.hpp>
+
+#ifndef RONDIS_COMMAND_TABLE_H
+#define RONDIS_COMMAND_TABLE_H
+/*
+    Static registry of all commands supported by Rondis.
+
+    Each command has a fixed id which is both its index in rondis_commands
+    and its slot in the per-worker statistics. Lookups go through an
+    open-addressed hash table on the case-folded command name which is
+    built at compile time, so dispatching costs one hash, usually one probe
+    and one final strncasecmp.
+
+    Adding a command: add its id below (before CMD_UNKNOWN) and its entry at
+    the same position in rondis_commands (command_table.cc). A mismatch is
+    caught by a static_assert.
+*/
+
+enum RondisCommandId
+{
+    CMD_PING = 0,
+    CMD_ECHO,
+    CMD_CONFIG,
+    CMD_INFO,
+    CMD_LATENCY,
+    CMD_SLOWLOG,
+    CMD_GET,
+    CMD_SET,
+    CMD_INCR,
+    // Statistics slot for commands that are not in the table
+    CMD_UNKNOWN,
+    NUM_COMMAND_IDS
+};
+
+// The command reads from RonDB
+#define CMD_FLAG_READ (1 << 0)
+// The command writes to RonDB
+#define CMD_FLAG_WRITE (1 << 1)
+// The command does not touch RonDB and needs no Ndb object
+#define CMD_FLAG_NO_NDB (1 << 2)
+// The command can have more than one key
+#define CMD_FLAG_MULTI_KEY (1 << 3)
+// Administrative command (statistics, configuration)
+#define CMD_FLAG_ADMIN (1 << 4)
+
+/*
+    Returns -1 if the command was rejected without being executed, e.g.
+    because of an unknown subcommand. The Ndb object is nullptr for
+    commands flagged CMD_FLAG_NO_NDB.
+*/
+typedef int (*RondisCommandHandler)(Ndb *ndb,
+                                    const pink::RedisCmdArgsSlice &argv,
+                                    std::string *response);
+
+struct RondisCommand
+{
+    RondisCommandId id;
+    // Lower case, as reported by INFO and LATENCY
+    const char *name;
+    Uint32 name_len;
+    /*
+        Same as in Redis: a positive arity requires exactly that many
+        arguments (including the command name), a negative arity -N
+        requires at least N.
+    */
+    int arity;
+    Uint32 flags;
+    // Key positions in argv; first_key == 0 means no keys
+    int first_key;
+    // A negative last_key counts from the end of argv
+    int last_key;
+    int key_step;
+    /*
+        How often the command is retried after NdbError::TemporaryError
+        before the error is returned to the client. Must be 0 for commands
+        that are not idempotent.
+    */
+    Uint32 retry_budget;
+    RondisCommandHandler handler;
+};
+
+extern const RondisCommand rondis_commands[CMD_UNKNOWN];
+
+// nullptr if there is no such command
+const RondisCommand *lookup_command(const slash::Slice &name);
+
+inline bool command_arity_ok(const RondisCommand *cmd, size_t argc)
+{
+    return cmd->arity >= 0 ? argc == size_t(cmd->arity)
+                           : argc >= size_t(-cmd->arity);
+}
+
+// Also valid for CMD_UNKNOWN
+const char *command_name(int id);
+#endif
@@ -4,6 +4,50 @@
 #include <ndbapi/Ndb.hpp>
 
 #include "common.h"
+#include "stats.h"
+
+/*
+    Offset in the connection's response buffer where the reply of the command
+    currently executed by this thread starts. The response buffer can already
+    hold replies of earlier pipelined commands, and a command might have
+    written a partial reply before it fails. An error reply therefore replaces
+    everything from this offset onwards, but never earlier replies.
+*/
+static thread_local size_t command_reply_start = 0;
+
+void set_command_reply_start(std::string *response)
+{
+    command_reply_start = response->size();
+}
+
+static thread_local pink::RedisConn *large_reply_conn = nullptr;
+static thread_local std::string *large_reply_response = nullptr;
+static thread_local size_t large_reply_moved = 0;
+
+void set_large_reply_conn(pink::RedisConn *conn, std::string *response)
+{
+    large_reply_conn = conn;
+    large_reply_response = response;
+    large_reply_moved = 0;
+}
+
+size_t large_reply_bytes()
+{
+    return large_reply_moved;
+}
+
+void append_large_reply(std::string *response, std::string &&reply)
+{
+    if (large_reply_conn == nullptr || response != large_reply_response)
+    {
+        response->append(reply);
+        return;
+    }
+    // The replies in the response so far are queued before it
+    size_t queued = response->size() + reply.size();
+    large_reply_conn->AppendReply(std::move(reply));
+    large_reply_moved += queued - response->size();
+}
 
 void assign_ndb_err_to_response(
     std::string *response,
@@ -12,8 +56,13 @@ void assign_ndb_err_to_response(
 {
     char buf[512];
     snprintf(buf, sizeof(buf), "-ERR %s; NDB(%u) %s\r\n", app_str, error.code, error.message);
+    trace_ndb_error(error);
     std::cout << buf;
-    response->assign(buf);
+    if (response->size() > command_reply_start)
+    {
+        response->resize(command_reply_start);
+    }
+    response->append(buf);
 }
 
 void assign_generic_err_to_response(
@@ -23,5 +72,18 @@ void assign_generic_err_to_response(
     char buf[512];
     snprintf(buf, sizeof(buf), "-ERR %s\r\n", app_str);
     std::cout << buf;
-    response->assign(buf);
+    if (response->size() > command_reply_start)
+    {
+        response->resize(command_reply_start);
+    }
+    response->append(buf);
+}
+
+void assign_arity_err_to_response(
+    std::string *response,
+    const char *command)
+{
+    char error_message[256];
+    snprintf(error_message, sizeof(error_message), REDIS_WRONG_NUMBER_OF_ARGS, command);
+    assign_generic_err_to_response(response, error_message);
 }
@@ -13,9 +13,35 @@
 #define RONDB_INTERNAL_ERROR 2
 #define READ_ERROR 626
 
+void set_command_reply_start(std::string *response);
+
+namespace pink
+{
+    class RedisConn;
+}
+/*
+    Replies of at least LARGE_REPLY_MIN_SIZE bytes, e.g. GET of a large
+    value, are built in a string of their own and handed to the connection
+    with append_large_reply() instead of being copied into the response.
+    pink copies smaller ones into its output blocks anyway.
+*/
+#define LARGE_REPLY_MIN_SIZE (16 * 1024)
+/*
+    The connection that large replies of the command currently executed by
+    this thread are handed to, and its response buffer. Without one they
+    are appended to the response.
+*/
+void set_large_reply_conn(pink::RedisConn *conn, std::string *response);
+/*
+    Bytes moved out of the response buffer since set_large_reply_conn(),
+    the large replies and whatever the response held before them
+*/
+size_t large_reply_bytes();
+void append_large_reply(std::string *response, std::string &&reply);
 int write_formatted(char *buffer, int bufferSize, const char *format, ...);
 void assign_ndb_err_to_response(std::string *response, const char *app_str, NdbError error);
 void assign_generic_err_to_response(std::string *response, const char *app_str);
+void assign_arity_err_to_response(std::string *response, const char *command);
 
 // NDB API error messages
 #define FAILED_GET_DICT "Failed to get NdbDict"
@@ -27,9 +53,14 @@ void assign_generic_err_to_response(std::string *response, const char *app_str);
 #define FAILED_INCR_KEY_MULTI_ROW "Failed to increment key, multi-row value"
 #define FAILED_GET_OP "Failed to get NdbOperation object"
 #define FAILED_DEFINE_OP "Failed to define RonDB operation"
+#define FAILED_DECOMPRESS_VALUE "Failed to decompress value"
 
 // Redis errors
 #define REDIS_UNKNOWN_COMMAND "unknown command '%s'"
+#define REDIS_UNKNOWN_SUBCOMMAND "unknown subcommand '%s' for '%s' command"
+#define REDIS_UNKNOWN_CONFIG_PARAM "Unknown option or number of arguments for CONFIG SET - '%s'"
+#define REDIS_INVALID_CONFIG_VALUE "Invalid argument '%s' for CONFIG SET '%s'"
+#define REDIS_SLOWLOG_INVALID_COUNT "count should be greater than or equal to -1"
 #define REDIS_WRONG_NUMBER_OF_ARGS "wrong number of arguments for '%s' command"
 #define REDIS_NO_SUCH_KEY "$-1\r\n"
 #define REDIS_KEY_TOO_LARGE "key is too large (3000 bytes max)"
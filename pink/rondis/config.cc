@@ -0,0 +1,107 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <errno.h>
+#include <string.h>
+#include <strings.h>
+#include "pink/include/redis_conn.h"
+#include <ndbapi/NdbApi.hpp>
+#include <ndbapi/Ndb.hpp>
+
+#include "common.h"
+#include "config.h"
+#include "string/table_definitions.h"
+#include "string/value_compression.h"
+
+std::atomic<Int64> slowlog_log_slower_than(10000);
+std::atomic<Int64> slowlog_max_len(128);
+std::atomic<Int64> value_compression(0);
+// Smaller values fit into the key row and are never split
+std::atomic<Int64> value_compression_min_size(INLINE_VALUE_LEN + 1);
+
+bool value_compression_wanted(uint32_t value_len)
+{
+    return value_compression.load(std::memory_order_relaxed) != 0 &&
+           Int64(value_len) >= value_compression_min_size.load(std::memory_order_relaxed);
+}
+
+static const struct
+{
+    const char *name;
+    std::atomic<Int64> *value;
+    Int64 min_value;
+    Int64 max_value;
+} config_params[] = {
+    {"slowlog-log-slower-than", &slowlog_log_slower_than, -1, INT64_MAX},
+    {"slowlog-max-len", &slowlog_max_len, 0, 1000000},
+    {"value-compression", &value_compression, 0, 1},
+    {"value-compression-min-size", &value_compression_min_size, 64, INT64_MAX},
+};
+
+int rondb_config_command(const pink::RedisCmdArgsSlice &argv,
+                         std::string *response)
+{
+    bool is_get = strcasecmp(argv[1].data(), "GET") == 0;
+    bool is_set = strcasecmp(argv[1].data(), "SET") == 0;
+    if ((is_get && argv.size() != 3) || (is_set && argv.size() != 4))
+    {
+        assign_arity_err_to_response(response, argv[0].data());
+        return -1;
+    }
+    if (!is_get && !is_set)
+    {
+        char error_message[256];
+        snprintf(error_message, sizeof(error_message),
+                 REDIS_UNKNOWN_SUBCOMMAND, argv[1].data(), argv[0].data());
+        assign_generic_err_to_response(response, error_message);
+        return -1;
+    }
+
+    for (const auto &param : config_params)
+    {
+        if (strcasecmp(argv[2].data(), param.name) != 0)
+        {
+            continue;
+        }
+        if (is_get)
+        {
+            std::string value = std::to_string(param.value->load(std::memory_order_relaxed));
+            *response += "*2\r\n";
+            *response += "$" + std::to_string(strlen(param.name)) + "\r\n";
+            *response += std::string(param.name) + "\r\n";
+            *response += "$" + std::to_string(value.length()) + "\r\n";
+            *response += value + "\r\n";
+            return 0;
+        }
+        char *end = nullptr;
+        errno = 0;
+        long long value = strtoll(argv[3].data(), &end, 10);
+        if (errno != 0 || end == argv[3].data() || *end != '\0' ||
+            value < param.min_value || value > param.max_value)
+        {
+            char error_message[256];
+            snprintf(error_message, sizeof(error_message),
+                     REDIS_INVALID_CONFIG_VALUE, argv[3].data(), param.name);
+            assign_generic_err_to_response(response, error_message);
+            return 0;
+        }
+        param.value->store(value, std::memory_order_relaxed);
+        response->append("+OK\r\n");
+        return 0;
+    }
+
+    if (is_get)
+    {
+        // Unknown parameters; keeps clients probing for Redis settings happy
+        *response += "*2\r\n";
+        *response += "$" + std::to_string(argv[2].size()) + "\r\n";
+        response->append(argv[2].data(), argv[2].size());
+        *response += "\r\n";
+        *response += "*0\r\n";
+        return 0;
+    }
+    char error_message[256];
+    snprintf(error_message, sizeof(error_message),
+             REDIS_UNKNOWN_CONFIG_PARAM, argv[2].data());
+    assign_generic_err_to_response(response, error_message);
+    return -1;
+}
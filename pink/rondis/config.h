@@ -0,0 +1,31 @@
+#include <atomic>
+#include <string>
+#include "pink/include/redis_conn.h"
+#include <ndbapi/NdbApi.hpp>
+#include <ndbapi/Ndb.hpp>
+
+#ifndef RONDIS_CONFIG_H
+#define RONDIS_CONFIG_H
+/*
+    Parameters that can be changed at runtime using CONFIG SET. They are read
+    by the worker threads on the request path, hence they are atomics and
+    read with relaxed loads.
+*/
+
+// Log commands taking at least this many microseconds; negative disables
+extern std::atomic<Int64> slowlog_log_slower_than;
+// Number of SLOWLOG entries kept per worker thread
+extern std::atomic<Int64> slowlog_max_len;
+// 1 to compress large STRING values in SET, values are always readable
+extern std::atomic<Int64> value_compression;
+// Only values of at least this many bytes are compressed
+extern std::atomic<Int64> value_compression_min_size;
+
+/*
+    CONFIG GET <parameter>
+    CONFIG SET <parameter> <value>
+    Returns -1 if the command was rejected without being executed.
+*/
+int rondb_config_command(const pink::RedisCmdArgsSlice &argv,
+                         std::string *response);
+#endif
@@ -6,7 +6,8 @@
 #include "common.h"
 #include "string/table_definitions.h"
 #include "string/commands.h"
-#include <strings.h>
+#include "stats.h"
+#include "command_table.h"
 
 /*
     Ndb objects are not thread-safe. Hence, each worker thread / RonDB connection should
@@ -87,133 +88,74 @@ void rondb_end()
     ndb_end(0);
 }
 
-void print_args(const pink::RedisCmdArgsType &argv)
+void print_args(const pink::RedisCmdArgsSlice &argv)
 {
     for (const auto &arg : argv)
     {
-        printf("%s ", arg.c_str());
+        printf("%.*s ", int(arg.size()), arg.data());
     }
     printf("\n");
 }
 
-void unsupported_command(const pink::RedisCmdArgsType &argv, std::string *response)
+void unsupported_command(const pink::RedisCmdArgsSlice &argv, std::string *response)
 {
     printf("Unsupported command: ");
     print_args(argv);
     char error_message[256];
-    snprintf(error_message, sizeof(error_message), REDIS_UNKNOWN_COMMAND, argv[0].c_str());
+    snprintf(error_message, sizeof(error_message), REDIS_UNKNOWN_COMMAND, argv[0].data());
     assign_generic_err_to_response(response, error_message);
 }
 
-int rondb_redis_handler(const pink::RedisCmdArgsType &argv,
+int rondb_redis_handler(const pink::RedisCmdArgsSlice &argv,
                         std::string *response,
-                        int worker_id)
+                        int worker_id,
+                        CommandTrace *trace)
 {
-    // First check non-ndb commands
-    const char *command = argv[0].c_str();
-    if (strcasecmp(command, "ping") == 0)
+    set_command_reply_start(response);
+    const RondisCommand *cmd = lookup_command(argv[0]);
+    if (cmd == nullptr)
     {
-        if (argv.size() != 1)
-        {
-            char error_message[256];
-            snprintf(error_message, sizeof(error_message), REDIS_WRONG_NUMBER_OF_ARGS, argv[0].c_str());
-            assign_generic_err_to_response(response, error_message);
-            return 0;
-        }
-        response->append("+PONG\r\n");
+        trace->cmd = CMD_UNKNOWN;
+        trace->rejected = true;
+        unsupported_command(argv, response);
+        return 0;
     }
-    else if (argv[0] == "ECHO")
+    trace->cmd = cmd->id;
+    if (!command_arity_ok(cmd, argv.size()))
     {
-        if (argv.size() != 2)
-        {
-            char error_message[256];
-            snprintf(error_message, sizeof(error_message), REDIS_WRONG_NUMBER_OF_ARGS, argv[0].c_str());
-            assign_generic_err_to_response(response, error_message);
-            return 0;
-        }
-
-        response->assign("$" + std::to_string(argv[1].length()) + "\r\n" + argv[1] + "\r\n");
+        trace->rejected = true;
+        assign_arity_err_to_response(response, argv[0].data());
+        return 0;
     }
-    else if (argv[0] == "CONFIG")
+
+    if (cmd->flags & CMD_FLAG_NO_NDB)
     {
-        if (argv.size() != 3)
+        if (cmd->handler(nullptr, argv, response) != 0)
         {
-            char error_message[256];
-            snprintf(error_message, sizeof(error_message), REDIS_WRONG_NUMBER_OF_ARGS, argv[0].c_str());
-            assign_generic_err_to_response(response, error_message);
-            return 0;
-        }
-        if (argv[1] == "GET")
-        {
-            *response += "*2\r\n";
-            *response += "$" + std::to_string(argv[2].length()) + "\r\n";
-            *response += argv[2] + "\r\n";
-            *response += "*0\r\n";
-        }
-        else
-        {
-            unsupported_command(argv, response);
+            trace->rejected = true;
         }
+        return 0;
     }
-    else
+
+    Ndb *ndb = ndb_objects[worker_id];
+    ndb_stats_begin(ndb, trace);
+    if (cmd->handler(ndb, argv, response) != 0)
     {
-        Ndb *ndb = ndb_objects[worker_id];
-        if (strcasecmp(command, "GET") == 0)
-        {
-            if (argv.size() == 2)
-            {
-                rondb_get_command(ndb, argv, response);
-            }
-            else
-            {
-                char error_message[256];
-                snprintf(error_message, sizeof(error_message), REDIS_WRONG_NUMBER_OF_ARGS, argv[0].c_str());
-                assign_generic_err_to_response(response, error_message);
-            }
-        }
-        else if (strcasecmp(command, "SET") == 0)
-        {
-            if (argv.size() == 3)
-            {
-                rondb_set_command(ndb, argv, response);
-            }
-            else
-            {
-                char error_message[256];
-                snprintf(error_message, sizeof(error_message), REDIS_WRONG_NUMBER_OF_ARGS, argv[0].c_str());
-                assign_generic_err_to_response(response, error_message);
-            }
-        }
-        else if (strcasecmp(command, "INCR") == 0)
-        {
-            if (argv.size() == 2)
-            {
-                rondb_incr_command(ndb, argv, response);
-            }
-            else
-            {
-                char error_message[256];
-                snprintf(error_message, sizeof(error_message), REDIS_WRONG_NUMBER_OF_ARGS, argv[0].c_str());
-                assign_generic_err_to_response(response, error_message);
-            }
-        }
-        else
-        {
-            unsupported_command(argv, response);
-        }
-        if (ndb->getClientStat(ndb->TransStartCount) != ndb->getClientStat(ndb->TransCloseCount))
-        {
-            /*
-                If we are here, we have a transaction that was not closed.
-                Only a certain amount of transactions can be open at the same time.
-                If this limit is reached, the Ndb object will not create any new ones.
-                Hence, better to catch these cases early.
-            */
-            print_args(argv);
-            printf("Number of transactions started: %lld\n", ndb->getClientStat(ndb->TransStartCount));
-            printf("Number of transactions closed: %lld\n", ndb->getClientStat(ndb->TransCloseCount));
-            exit(1);
-        }
+        trace->rejected = true;
+    }
+    ndb_stats_end(ndb, worker_id, trace);
+    if (ndb->getClientStat(ndb->TransStartCount) != ndb->getClientStat(ndb->TransCloseCount))
+    {
+        /*
+            If we are here, we have a transaction that was not closed.
+            Only a certain amount of transactions can be open at the same time.
+            If this limit is reached, the Ndb object will not create any new ones.
+            Hence, better to catch these cases early.
+        */
+        print_args(argv);
+        printf("Number of transactions started: %lld\n", ndb->getClientStat(ndb->TransStartCount));
+        printf("Number of transactions closed: %lld\n", ndb->getClientStat(ndb->TransCloseCount));
+        exit(1);
     }
     return 0;
 }
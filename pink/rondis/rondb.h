@@ -2,6 +2,7 @@
 #include "pink/include/redis_conn.h"
 #include <ndbapi/NdbApi.hpp>
 #include <ndbapi/Ndb.hpp>
+#include "stats.h"
 
 #ifndef RONDIS_RONDB_H
 #define RONDIS_RONDB_H
@@ -14,7 +15,8 @@ int setup_rondb(const char *connect_string, int num_ndb_objects);
 
 void rondb_end();
 
-int rondb_redis_handler(const pink::RedisCmdArgsType &argv,
+int rondb_redis_handler(const pink::RedisCmdArgsSlice &argv,
                         std::string *response,
-                        int fd);
+                        int worker_id,
+                        CommandTrace *trace);
 #endif
@@ -1,6 +1,8 @@
 #include <signal.h>
 #include <atomic>
+#include <deque>
 #include <mutex>
+#include <random>
 
 #include <ndbapi/NdbApi.hpp>
 #include <ndbapi/Ndb.hpp>
@@ -8,15 +10,73 @@
 #include "pink/include/pink_conn.h"
 #include "pink/include/redis_conn.h"
 #include "pink/include/pink_thread.h"
+#include "pink/include/bg_thread.h"
 #include "pink/src/dispatch_thread.h"
+#include "pink/src/pink_epoll.h"
 #include "rondb.h"
 #include "common.h"
+#include "stats.h"
+#include "slowlog.h"
+#include "command_table.h"
 
 using namespace pink;
 
 std::vector<Ndb *> ndb_objects;
 std::map<std::string, std::string> db;
 
+/*
+    Fires the backoff timers of commands retried after a temporary NDB
+    error. The retry itself runs on the connection's worker thread.
+*/
+static BGThread *retry_timer = nullptr;
+
+#define RETRY_BASE_DELAY_MS 2
+#define RETRY_MAX_DELAY_MS 64
+/*
+    Commands a connection may queue behind a pending retry, in argument
+    bytes. A client pipelining past it is disconnected, otherwise it could
+    grow the queue without bound for the whole backoff.
+*/
+#define RETRY_MAX_QUEUED_BYTES (16 * 1024 * 1024)
+
+// The commands are handled on slices; each argument is NUL terminated
+static RedisCmdArgsSlice args_to_slices(const RedisCmdArgsType &argv)
+{
+    RedisCmdArgsSlice slices;
+    slices.reserve(argv.size());
+    for (const auto &arg : argv)
+    {
+        slices.emplace_back(arg);
+    }
+    return slices;
+}
+
+static RedisCmdArgsType copy_args(const RedisCmdArgsSlice &argv)
+{
+    RedisCmdArgsType args;
+    args.reserve(argv.size());
+    for (const auto &arg : argv)
+    {
+        args.push_back(arg.ToString());
+    }
+    return args;
+}
+
+/*
+    Exponential backoff with jitter, so that commands hitting the same
+    error storm (e.g. a data node restart) do not all retry at once.
+*/
+static Uint64 retry_delay_ms(Uint32 attempt)
+{
+    static thread_local std::minstd_rand rng{Uint32(rondis_now_ns())};
+    Uint64 delay = RETRY_BASE_DELAY_MS << std::min(attempt, Uint32(10));
+    if (delay > RETRY_MAX_DELAY_MS)
+    {
+        delay = RETRY_MAX_DELAY_MS;
+    }
+    return delay / 2 + rng() % (delay / 2 + 1);
+}
+
 class RondisHandle : public ServerHandle
 {
 public:
@@ -46,28 +106,207 @@ public:
         int fd,
         const std::string &ip_port,
         Thread *thread,
-        void *worker_specific_data);
-    virtual ~RondisConn() = default;
+        void *worker_specific_data,
+        PinkEpoll *pink_epoll);
+    virtual ~RondisConn();
+
+    ReadStatus GetRequest() override;
+    WriteStatus SendReply() override;
+    bool is_reply() override;
+
+    // io_uring backend, see PinkConn::SupportsCompletionIO()
+    ReadStatus ProcessInput(const char *data, size_t len) override;
+    bool TakeOutput(OutputChain *output) override;
+    void OutputSent() override;
 
 protected:
     int DealMessage(const RedisCmdArgsType &argv, std::string *response) override;
+    int DealMessage(const RedisCmdArgsSlice &argv, std::string *response) override;
 
 private:
+    /*
+        With hand_over, large replies are queued with AppendReply() instead
+        of being copied into response, which must be the connection's own
+        buffer then, see append_large_reply()
+    */
+    bool ExecuteCommand(const RedisCmdArgsSlice &argv,
+                        std::string *response,
+                        CommandTrace *trace,
+                        bool hand_over);
+    void StartParse();
+    void RecordTraces(std::vector<CommandTrace> *traces);
+    void ScheduleRetry();
+    void RunRetry();
+    static void RetryTimerFired(void *arg);
+
     int _worker_id;
+    // Start of the PARSE phase of the next command
+    Uint64 _parse_start_ns;
+    // Queue time of the next command
+    Uint64 _queue_ns;
+    // Commands executed whose replies are not completely written yet
+    std::vector<CommandTrace> _pending_traces;
+    // Of those, the ones whose replies were taken by TakeOutput()
+    std::vector<CommandTrace> _taken_traces;
+
+    /*
+        A command waiting for its retry after a temporary NDB error. Until
+        it has been executed, all commands following it on this connection
+        are queued to keep the replies in order.
+    */
+    bool _retry_pending;
+    /*
+        Set by the retry timer thread, the retry is executed in SendReply()
+        or TakeOutput()
+    */
+    std::atomic<bool> _retry_due;
+    // Copies, the read buffer argv pointed into has been reused since
+    RedisCmdArgsType _retry_argv;
+    CommandTrace _retry_trace;
+    std::deque<RedisCmdArgsType> _queued_commands;
+    size_t _queued_bytes;
 };
 
 RondisConn::RondisConn(
     int fd,
     const std::string &ip_port,
     Thread *thread,
-    void *worker_specific_data)
-    : RedisConn(fd, ip_port, thread)
+    void *worker_specific_data,
+    PinkEpoll *pink_epoll)
+    : RedisConn(fd, ip_port, thread, pink_epoll),
+      _parse_start_ns(0),
+      _queue_ns(0),
+      _retry_pending(false),
+      _retry_due(false),
+      _retry_trace(),
+      _queued_bytes(0)
 {
     int worker_id = *static_cast<int *>(worker_specific_data);
     _worker_id = worker_id;
 }
 
+RondisConn::~RondisConn()
+{
+    for (auto &trace : _pending_traces)
+    {
+        delete trace.slowlog_entry;
+    }
+    for (auto &trace : _taken_traces)
+    {
+        delete trace.slowlog_entry;
+    }
+    delete _retry_trace.slowlog_entry;
+}
+
+void RondisConn::StartParse()
+{
+    _parse_start_ns = rondis_now_ns();
+    /*
+        Only the first command read after epoll returned has waited for the
+        events before it; later pipelined commands wait in the PARSE phase.
+    */
+    _queue_ns = 0;
+    if (pink_epoll() != nullptr &&
+        pink_epoll()->last_poll_ns() != 0 &&
+        pink_epoll()->last_poll_ns() < _parse_start_ns)
+    {
+        _queue_ns = _parse_start_ns - pink_epoll()->last_poll_ns();
+    }
+}
+
+ReadStatus RondisConn::GetRequest()
+{
+    StartParse();
+    ReadStatus status = RedisConn::GetRequest();
+    if (status == kReadAll && _retry_pending && !RedisConn::is_reply())
+    {
+        /*
+            Nothing to write before the retry; waiting for EPOLLOUT would
+            spin. The retry timer will ask for EPOLLOUT when it is time.
+        */
+        return kReadHalf;
+    }
+    return status;
+}
+
+ReadStatus RondisConn::ProcessInput(const char *data, size_t len)
+{
+    StartParse();
+    return RedisConn::ProcessInput(data, len);
+}
+
+bool RondisConn::is_reply()
+{
+    return _retry_due.load(std::memory_order_acquire) || RedisConn::is_reply();
+}
+
+WriteStatus RondisConn::SendReply()
+{
+    if (_retry_due.exchange(false, std::memory_order_acq_rel))
+    {
+        RunRetry();
+    }
+    WriteStatus status = RedisConn::SendReply();
+    if (status == kWriteAll)
+    {
+        RecordTraces(&_pending_traces);
+    }
+    return status;
+}
+
+bool RondisConn::TakeOutput(OutputChain *output)
+{
+    if (_retry_due.exchange(false, std::memory_order_acq_rel))
+    {
+        RunRetry();
+    }
+    if (!RedisConn::TakeOutput(output))
+    {
+        return false;
+    }
+    _taken_traces.insert(_taken_traces.end(),
+                         _pending_traces.begin(),
+                         _pending_traces.end());
+    _pending_traces.clear();
+    return true;
+}
+
+void RondisConn::OutputSent()
+{
+    RecordTraces(&_taken_traces);
+}
+
+// The replies of the traces have been written completely
+void RondisConn::RecordTraces(std::vector<CommandTrace> *traces)
+{
+    if (traces->empty())
+    {
+        return;
+    }
+    Uint64 now = rondis_now_ns();
+    for (const auto &trace : *traces)
+    {
+        Uint64 reply_ns = now - trace.executed_at_ns;
+        record_command(_worker_id, trace, reply_ns);
+        if (trace.slowlog_entry != nullptr)
+        {
+            slowlog_push(_worker_id, trace.slowlog_entry, reply_ns);
+        }
+    }
+    traces->clear();
+}
+
 int RondisConn::DealMessage(const RedisCmdArgsType &argv, std::string *response)
+{
+    return DealMessage(args_to_slices(argv), response);
+}
+
+/*
+    argv points into the read buffer of the connection. The arguments are
+    not copied before the commands use them, SET values are only copied
+    into the NDB row buffers.
+*/
+int RondisConn::DealMessage(const RedisCmdArgsSlice &argv, std::string *response)
 {
     /*    
         printf("Received Redis message: ");
@@ -77,7 +316,143 @@ int RondisConn::DealMessage(const RedisCmdArgsType &argv, std::string *response)
         }
         printf("\n");
     */
-    return rondb_redis_handler(argv, response, _worker_id);
+    if (_retry_pending)
+    {
+        size_t bytes = 0;
+        for (const auto &arg : argv)
+        {
+            bytes += arg.size();
+        }
+        if (_queued_bytes + bytes > RETRY_MAX_QUEUED_BYTES)
+        {
+            // Closes the connection
+            return -1;
+        }
+        _queued_bytes += bytes;
+        _queued_commands.push_back(copy_args(argv));
+        return 0;
+    }
+    CommandTrace trace = {};
+    trace.queue_ns = _queue_ns;
+    trace.parse_ns = rondis_now_ns() - _parse_start_ns;
+    if (!ExecuteCommand(argv, response, &trace, true))
+    {
+        _retry_pending = true;
+        _retry_argv = copy_args(argv);
+        _retry_trace = trace;
+        ScheduleRetry();
+    }
+    _queue_ns = 0;
+    return 0;
+}
+
+/*
+    Returns false if the command failed with a temporary NDB error and has
+    retry budget left. Its partial reply has then been removed again.
+*/
+bool RondisConn::ExecuteCommand(const RedisCmdArgsSlice &argv,
+                                std::string *response,
+                                CommandTrace *trace,
+                                bool hand_over)
+{
+    Uint64 start = rondis_now_ns();
+    size_t reply_start = response->size();
+    trace->temporary_error = false;
+
+    set_current_trace(trace);
+    set_large_reply_conn(hand_over ? this : nullptr, response);
+    rondb_redis_handler(argv, response, _worker_id, trace);
+    // Only successful replies are handed over, after everything else
+    size_t handed_over = large_reply_bytes();
+    set_large_reply_conn(nullptr, nullptr);
+    set_current_trace(nullptr);
+
+    Uint64 end = rondis_now_ns();
+    // Accumulates over retries; the time spent in backoff is not included
+    trace->execute_ns += end - start;
+    // The next pipelined command starts parsing where this one ended
+    _parse_start_ns = end;
+    if (trace->temporary_error &&
+        handed_over == 0 &&
+        trace->cmd < CMD_UNKNOWN &&
+        trace->retries < rondis_commands[trace->cmd].retry_budget)
+    {
+        response->resize(reply_start);
+        trace->retries++;
+        return false;
+    }
+
+    trace->executed_at_ns = end;
+    trace->reply_bytes = response->size() + handed_over - reply_start;
+    trace->failed = !trace->rejected &&
+                    handed_over == 0 &&
+                    trace->reply_bytes > 0 &&
+                    (*response)[reply_start] == '-';
+    trace->slowlog_entry = slowlog_create_entry(argv, ip_port(), *trace);
+    _pending_traces.push_back(*trace);
+    return true;
+}
+
+void RondisConn::ScheduleRetry()
+{
+    std::weak_ptr<PinkConn> *conn = new std::weak_ptr<PinkConn>(shared_from_this());
+    retry_timer->DelaySchedule(retry_delay_ms(_retry_trace.retries - 1),
+                               RetryTimerFired,
+                               conn);
+}
+
+// Runs on the retry timer thread
+void RondisConn::RetryTimerFired(void *arg)
+{
+    std::weak_ptr<PinkConn> *weak_conn = static_cast<std::weak_ptr<PinkConn> *>(arg);
+    std::shared_ptr<PinkConn> conn = weak_conn->lock();
+    delete weak_conn;
+    if (conn == nullptr)
+    {
+        // The connection was closed in the meantime
+        return;
+    }
+    RondisConn *rondis_conn = static_cast<RondisConn *>(conn.get());
+    rondis_conn->_retry_due.store(true, std::memory_order_release);
+    rondis_conn->NotifyEpoll(true);
+}
+
+// Runs on the worker thread, from SendReply() or TakeOutput()
+void RondisConn::RunRetry()
+{
+    std::string replies;
+    CommandTrace trace = _retry_trace;
+    _retry_trace.slowlog_entry = nullptr;
+    if (!ExecuteCommand(args_to_slices(_retry_argv), &replies, &trace, false))
+    {
+        _retry_trace = trace;
+        ScheduleRetry();
+        return;
+    }
+    _retry_pending = false;
+    _retry_argv.clear();
+
+    while (!_queued_commands.empty() && !_retry_pending)
+    {
+        RedisCmdArgsType argv = std::move(_queued_commands.front());
+        _queued_commands.pop_front();
+        for (const auto &arg : argv)
+        {
+            _queued_bytes -= arg.size();
+        }
+        CommandTrace queued_trace = {};
+        if (!ExecuteCommand(args_to_slices(argv), &replies, &queued_trace, false))
+        {
+            _retry_pending = true;
+            _retry_argv = std::move(argv);
+            _retry_trace = queued_trace;
+            ScheduleRetry();
+        }
+    }
+    if (!replies.empty())
+    {
+        AppendReply(std::move(replies));
+    }
 }
 
 class RondisConnFactory : public ConnFactory
@@ -90,7 +465,7 @@ public:
         void *worker_specific_data,
         pink::PinkEpoll *pink_epoll = nullptr) const
     {
-        return std::make_shared<RondisConn>(connfd, ip_port, thread, worker_specific_data);
+        return std::make_shared<RondisConn>(connfd, ip_port, thread, worker_specific_data, pink_epoll);
     }
 };
 
@@ -135,6 +510,15 @@ int main(int argc, char *argv[])
     }
 
     ndb_objects.resize(worker_threads);
+    init_worker_stats(worker_threads);
+    init_slowlog(worker_threads);
+    retry_timer = new BGThread();
+    retry_timer->set_thread_name("RondisRetryTimer");
+    if (retry_timer->StartThread() != 0)
+    {
+        printf("Failed to start the retry timer thread\n");
+        return -1;
+    }
 
     if (setup_rondb(connect_string, worker_threads) != 0)
     {
@@ -148,6 +532,12 @@ int main(int argc, char *argv[])
     RondisHandle *handle = new RondisHandle();
 
     ServerThread *my_thread = NewDispatchThread(port, worker_threads, conn_factory, 1000, 1000, handle);
+    // Replies are written right away, EPOLLOUT only when the socket is full
+    my_thread->set_immediate_write(true);
+    // Each worker accepts on its own SO_REUSEPORT socket
+    my_thread->set_reuse_port(true);
+    // Workers use io_uring if the kernel has it, epoll otherwise
+    my_thread->set_io_backend(pink::kIoUringBackend);
     if (my_thread->StartThread() != 0)
     {
         printf("StartThread error happened!\n");
@@ -164,6 +554,8 @@ int main(int argc, char *argv[])
 
     delete my_thread;
     delete conn_factory;
+    retry_timer->StopThread();
+    delete retry_timer;
 
     rondb_end();
 
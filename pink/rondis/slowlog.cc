@@ -0,0 +1,241 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <strings.h>
+#include <time.h>
+#include <algorithm>
+#include <atomic>
+#include <deque>
+#include <mutex>
+#include "pink/include/redis_conn.h"
+#include <ndbapi/NdbApi.hpp>
+#include <ndbapi/Ndb.hpp>
+
+#include "common.h"
+#include "config.h"
+#include "slowlog.h"
+
+struct SlowlogRing
+{
+    std::mutex mutex;
+    // Newest entry first
+    std::deque<SlowlogEntry *> entries;
+};
+
+static SlowlogRing *slowlog_rings = nullptr;
+static int num_slowlog_rings = 0;
+static std::atomic<Uint64> slowlog_next_id(0);
+
+int init_slowlog(int num_workers)
+{
+    slowlog_rings = new SlowlogRing[num_workers];
+    num_slowlog_rings = num_workers;
+    return 0;
+}
+
+SlowlogEntry *slowlog_create_entry(const pink::RedisCmdArgsSlice &argv,
+                                   const std::string &ip_port,
+                                   const CommandTrace &trace)
+{
+    Int64 log_slower_than = slowlog_log_slower_than.load(std::memory_order_relaxed);
+    if (log_slower_than < 0 ||
+        Int64((trace.queue_ns + trace.parse_ns + trace.execute_ns) / 1000) < log_slower_than)
+    {
+        return nullptr;
+    }
+
+    SlowlogEntry *entry = new SlowlogEntry();
+    entry->id = slowlog_next_id.fetch_add(1, std::memory_order_relaxed);
+    entry->time = time(nullptr);
+    entry->ip_port = ip_port;
+    entry->queue_ns = trace.queue_ns;
+    entry->parse_ns = trace.parse_ns;
+    entry->execute_ns = trace.execute_ns;
+    entry->num_ndb_executes = trace.num_ndb_executes;
+    entry->ndb_execute_ns.assign(
+        trace.ndb_execute_ns,
+        trace.ndb_execute_ns + std::min(trace.num_ndb_executes, Uint32(MAX_TRACED_EXECUTES)));
+    entry->value_rows = trace.value_rows;
+    entry->reply_bytes = trace.reply_bytes;
+
+    // Same truncation as Redis, the key and value sizes remain visible
+    size_t argc = std::min(argv.size(), size_t(SLOWLOG_ENTRY_MAX_ARGC));
+    entry->argv.reserve(argc);
+    for (size_t i = 0; i < argc; i++)
+    {
+        char buf[64];
+        if (argc != argv.size() && i == argc - 1)
+        {
+            snprintf(buf, sizeof(buf), "... (%zu more arguments)", argv.size() - argc + 1);
+            entry->argv.push_back(buf);
+        }
+        else if (argv[i].size() > SLOWLOG_ENTRY_MAX_STRING)
+        {
+            snprintf(buf, sizeof(buf), "... (%zu more bytes)", argv[i].size() - SLOWLOG_ENTRY_MAX_STRING);
+            entry->argv.push_back(std::string(argv[i].data(), SLOWLOG_ENTRY_MAX_STRING) + buf);
+        }
+        else
+        {
+            entry->argv.push_back(argv[i].ToString());
+        }
+    }
+    return entry;
+}
+
+void slowlog_push(int worker_id, SlowlogEntry *entry, Uint64 reply_ns)
+{
+    entry->reply_ns = reply_ns;
+    entry->duration_us =
+        (entry->queue_ns + entry->parse_ns + entry->execute_ns + reply_ns) / 1000;
+
+    size_t max_len = size_t(slowlog_max_len.load(std::memory_order_relaxed));
+    SlowlogRing &ring = slowlog_rings[worker_id];
+    std::lock_guard<std::mutex> lock(ring.mutex);
+    ring.entries.push_front(entry);
+    while (ring.entries.size() > max_len)
+    {
+        delete ring.entries.back();
+        ring.entries.pop_back();
+    }
+}
+
+static void append_bulk(std::string *response, const std::string &str)
+{
+    response->append("$" + std::to_string(str.size()) + "\r\n");
+    response->append(str);
+    response->append("\r\n");
+}
+
+static void append_integer(std::string *response, Uint64 value)
+{
+    response->append(":" + std::to_string(value) + "\r\n");
+}
+
+/*
+    An entry is the Redis 6 element SLOWLOG reply extended with a seventh
+    element: a flat list of field/value pairs with the phase breakdown.
+*/
+static void append_slowlog_entry(std::string *response, const SlowlogEntry &entry)
+{
+    response->append("*7\r\n");
+    append_integer(response, entry.id);
+    append_integer(response, Uint64(entry.time));
+    append_integer(response, entry.duration_us);
+    response->append("*" + std::to_string(entry.argv.size()) + "\r\n");
+    for (const auto &arg : entry.argv)
+    {
+        append_bulk(response, arg);
+    }
+    append_bulk(response, entry.ip_port);
+    // No client names in Rondis
+    append_bulk(response, "");
+
+    response->append("*16\r\n");
+    append_bulk(response, "queue_us");
+    append_integer(response, entry.queue_ns / 1000);
+    append_bulk(response, "parse_us");
+    append_integer(response, entry.parse_ns / 1000);
+    append_bulk(response, "execute_us");
+    append_integer(response, entry.execute_ns / 1000);
+    append_bulk(response, "ndb_executes");
+    append_integer(response, entry.num_ndb_executes);
+    append_bulk(response, "ndb_execute_us");
+    response->append("*" + std::to_string(entry.ndb_execute_ns.size()) + "\r\n");
+    for (Uint64 ns : entry.ndb_execute_ns)
+    {
+        append_integer(response, ns / 1000);
+    }
+    append_bulk(response, "reply_us");
+    append_integer(response, entry.reply_ns / 1000);
+    append_bulk(response, "value_rows");
+    append_integer(response, entry.value_rows);
+    append_bulk(response, "reply_bytes");
+    append_integer(response, entry.reply_bytes);
+}
+
+static void slowlog_get(Int64 count, std::string *response)
+{
+    // Each ring is sorted newest first, so only its first count entries matter
+    std::vector<std::pair<Uint64, std::string>> formatted;
+    for (int w = 0; w < num_slowlog_rings; w++)
+    {
+        SlowlogRing &ring = slowlog_rings[w];
+        std::lock_guard<std::mutex> lock(ring.mutex);
+        Int64 num = 0;
+        for (const SlowlogEntry *entry : ring.entries)
+        {
+            if (count >= 0 && num++ >= count)
+            {
+                break;
+            }
+            std::string str;
+            append_slowlog_entry(&str, *entry);
+            formatted.emplace_back(entry->id, std::move(str));
+        }
+    }
+    std::sort(formatted.begin(), formatted.end(),
+              [](const std::pair<Uint64, std::string> &a,
+                 const std::pair<Uint64, std::string> &b)
+              { return a.first > b.first; });
+    if (count >= 0 && formatted.size() > size_t(count))
+    {
+        formatted.resize(count);
+    }
+    response->append("*" + std::to_string(formatted.size()) + "\r\n");
+    for (const auto &entry : formatted)
+    {
+        response->append(entry.second);
+    }
+}
+
+int rondb_slowlog_command(const pink::RedisCmdArgsSlice &argv,
+                          std::string *response)
+{
+    const char *subcommand = argv[1].data();
+    if (strcasecmp(subcommand, "GET") == 0 && argv.size() <= 3)
+    {
+        Int64 count = 10;
+        if (argv.size() == 3)
+        {
+            char *end = nullptr;
+            count = strtoll(argv[2].data(), &end, 10);
+            if (end == argv[2].data() || *end != '\0' || count < -1)
+            {
+                assign_generic_err_to_response(response, REDIS_SLOWLOG_INVALID_COUNT);
+                return 0;
+            }
+        }
+        slowlog_get(count, response);
+    }
+    else if (strcasecmp(subcommand, "LEN") == 0 && argv.size() == 2)
+    {
+        Uint64 len = 0;
+        for (int w = 0; w < num_slowlog_rings; w++)
+        {
+            std::lock_guard<std::mutex> lock(slowlog_rings[w].mutex);
+            len += slowlog_rings[w].entries.size();
+        }
+        append_integer(response, len);
+    }
+    else if (strcasecmp(subcommand, "RESET") == 0 && argv.size() == 2)
+    {
+        for (int w = 0; w < num_slowlog_rings; w++)
+        {
+            std::lock_guard<std::mutex> lock(slowlog_rings[w].mutex);
+            for (SlowlogEntry *entry : slowlog_rings[w].entries)
+            {
+                delete entry;
+            }
+            slowlog_rings[w].entries.clear();
+        }
+        response->append("+OK\r\n");
+    }
+    else
+    {
+        char error_message[256];
+        snprintf(error_message, sizeof(error_message),
+                 REDIS_UNKNOWN_SUBCOMMAND, argv[1].data(), argv[0].data());
+        assign_generic_err_to_response(response, error_message);
+        return -1;
+    }
+    return 0;
+}
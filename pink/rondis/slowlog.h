@@ -0,0 +1,61 @@
+#include <string>
+#include <vector>
+#include "pink/include/redis_conn.h"
+#include <ndbapi/NdbApi.hpp>
+#include <ndbapi/Ndb.hpp>
+#include "stats.h"
+
+#ifndef RONDIS_SLOWLOG_H
+#define RONDIS_SLOWLOG_H
+/*
+    SLOWLOG GET [count] / LEN / RESET
+
+    Every worker thread owns a ring of the most recent slow commands. A worker
+    only takes the mutex of its own ring, which is contended only while a
+    SLOWLOG command is reading it.
+
+    Whether a command is slow is decided once it has been executed, based on
+    queue + parse + execute time (slowlog-log-slower-than). Only then its
+    (truncated) arguments are copied. The entry is added to the ring when
+    the reply has been written, so that the reply phase is part of it.
+*/
+
+#define SLOWLOG_ENTRY_MAX_ARGC 32
+#define SLOWLOG_ENTRY_MAX_STRING 128
+
+struct SlowlogEntry
+{
+    Uint64 id;
+    // Unix time in seconds when the command was executed
+    Int64 time;
+    Uint64 duration_us;
+    std::vector<std::string> argv;
+    std::string ip_port;
+    Uint64 queue_ns;
+    Uint64 parse_ns;
+    Uint64 execute_ns;
+    Uint64 reply_ns;
+    // Time of each NdbTransaction::execute(), see MAX_TRACED_EXECUTES
+    std::vector<Uint64> ndb_execute_ns;
+    Uint32 num_ndb_executes;
+    Uint32 value_rows;
+    Uint64 reply_bytes;
+};
+
+int init_slowlog(int num_workers);
+
+/*
+    Returns a new entry if the command is slow according to the current
+    slowlog-log-slower-than, otherwise nullptr.
+*/
+SlowlogEntry *slowlog_create_entry(const pink::RedisCmdArgsSlice &argv,
+                                   const std::string &ip_port,
+                                   const CommandTrace &trace);
+
+// Completes the entry and adds it to the worker's ring, taking ownership
+void slowlog_push(int worker_id, SlowlogEntry *entry, Uint64 reply_ns);
+
+// Returns -1 if the command was rejected without being executed
+int rondb_slowlog_command(const pink::RedisCmdArgsSlice &argv,
+                          std::string *response);
+#endif
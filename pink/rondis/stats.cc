@@ -0,0 +1,484 @@
+#include <stdio.h>
+#include <string.h>
+#include <strings.h>
+#include <time.h>
+#include "pink/include/redis_conn.h"
+#include <ndbapi/NdbApi.hpp>
+#include <ndbapi/Ndb.hpp>
+
+#include "common.h"
+#include "stats.h"
+
+/*
+    The subset of Ndb::getClientStat() that is published in INFO ndb.
+    WaitExecCompleteCount is the number of round trips to the data nodes
+    and WaitNanosCount the time spent waiting for them.
+*/
+static const struct
+{
+    Ndb::ClientStatistics id;
+    const char *name;
+} ndb_client_stat_names[] = {
+    {Ndb::TransStartCount, "ndb_trans_start_count"},
+    {Ndb::TransCommitCount, "ndb_trans_commit_count"},
+    {Ndb::TransAbortCount, "ndb_trans_abort_count"},
+    {Ndb::TransCloseCount, "ndb_trans_close_count"},
+    {Ndb::PkOpCount, "ndb_pk_op_count"},
+    {Ndb::UkOpCount, "ndb_uk_op_count"},
+    {Ndb::ReadRowCount, "ndb_read_row_count"},
+    {Ndb::WaitExecCompleteCount, "ndb_round_trips"},
+    {Ndb::WaitMetaRequestCount, "ndb_wait_meta_request_count"},
+    {Ndb::WaitNanosCount, "ndb_wait_nanos"},
+    {Ndb::BytesSentCount, "ndb_bytes_sent"},
+    {Ndb::BytesRecvdCount, "ndb_bytes_received"},
+    {Ndb::ForcedSendsCount, "ndb_forced_sends"},
+    {Ndb::UnforcedSendsCount, "ndb_unforced_sends"},
+    {Ndb::DeferredSendsCount, "ndb_deferred_sends"},
+};
+
+static WorkerStats *worker_stats = nullptr;
+static int num_worker_stats = 0;
+
+static thread_local CommandTrace *current_trace = nullptr;
+
+Uint64 rondis_now_ns()
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return Uint64(ts.tv_sec) * 1000000000ULL + Uint64(ts.tv_nsec);
+}
+
+int init_worker_stats(int num_workers)
+{
+    // Value-initialization zeroes all atomics
+    worker_stats = new WorkerStats[num_workers]();
+    num_worker_stats = num_workers;
+    return 0;
+}
+
+// Only the owning worker writes, so no atomic read-modify-write is needed
+static inline void stat_add(std::atomic<Uint64> &counter, Uint64 value)
+{
+    counter.store(counter.load(std::memory_order_relaxed) + value,
+                  std::memory_order_relaxed);
+}
+
+static inline Uint32 latency_bucket(Uint64 ns)
+{
+    if (ns < LATENCY_SUB_BUCKETS)
+    {
+        return Uint32(ns);
+    }
+    Uint32 msb = 63 - __builtin_clzll(ns);
+    if (msb > LATENCY_MAX_MSB)
+    {
+        return LATENCY_NUM_BUCKETS - 1;
+    }
+    Uint32 shift = msb - LATENCY_SUB_BUCKET_BITS;
+    return (shift + 1) * LATENCY_SUB_BUCKETS +
+           Uint32((ns >> shift) & (LATENCY_SUB_BUCKETS - 1));
+}
+
+// Largest value in nanoseconds that is mapped into the bucket
+static inline Uint64 latency_bucket_upper_ns(Uint32 bucket)
+{
+    if (bucket < LATENCY_SUB_BUCKETS)
+    {
+        return bucket;
+    }
+    Uint32 shift = bucket / LATENCY_SUB_BUCKETS - 1;
+    Uint64 sub = bucket % LATENCY_SUB_BUCKETS;
+    Uint64 lower = (LATENCY_SUB_BUCKETS + sub) << shift;
+    return lower + (Uint64(1) << shift) - 1;
+}
+
+static inline void record_latency(CommandStats &stats,
+                                  CommandPhase phase,
+                                  Uint64 ns)
+{
+    stat_add(stats.phase_ns[phase], ns);
+    stat_add(stats.histograms[phase].buckets[latency_bucket(ns)], 1);
+}
+
+void record_command(int worker_id, const CommandTrace &trace, Uint64 reply_ns)
+{
+    CommandStats &stats = worker_stats[worker_id].commands[trace.cmd];
+    if (trace.rejected)
+    {
+        stat_add(stats.rejected_calls, 1);
+        return;
+    }
+    stat_add(stats.calls, 1);
+    if (trace.failed)
+    {
+        stat_add(stats.failed_calls, 1);
+    }
+    stat_add(stats.ndb_wait_ns, trace.ndb_wait_ns);
+    stat_add(stats.ndb_round_trips, trace.ndb_round_trips);
+    if (trace.retries > 0)
+    {
+        stat_add(stats.retries, trace.retries);
+        stat_add(trace.temporary_error ? stats.retry_exhaustions : stats.retry_successes, 1);
+    }
+    record_latency(stats, PHASE_PARSE, trace.parse_ns);
+    record_latency(stats, PHASE_EXECUTE, trace.execute_ns);
+    record_latency(stats, PHASE_REPLY, reply_ns);
+    record_latency(stats,
+                   PHASE_TOTAL,
+                   trace.parse_ns + trace.execute_ns + reply_ns);
+}
+
+void ndb_stats_begin(Ndb *ndb, CommandTrace *trace)
+{
+    trace->ndb_wait_ns = ndb->getClientStat(Ndb::WaitNanosCount);
+    trace->ndb_round_trips = ndb->getClientStat(Ndb::WaitExecCompleteCount);
+}
+
+void ndb_stats_end(Ndb *ndb, int worker_id, CommandTrace *trace)
+{
+    std::atomic<Uint64> *snapshot = worker_stats[worker_id].ndb_client_stats;
+    for (const auto &stat : ndb_client_stat_names)
+    {
+        snapshot[stat.id].store(ndb->getClientStat(stat.id),
+                                std::memory_order_relaxed);
+    }
+    trace->ndb_wait_ns =
+        snapshot[Ndb::WaitNanosCount].load(std::memory_order_relaxed) -
+        trace->ndb_wait_ns;
+    trace->ndb_round_trips =
+        snapshot[Ndb::WaitExecCompleteCount].load(std::memory_order_relaxed) -
+        trace->ndb_round_trips;
+}
+
+void set_current_trace(CommandTrace *trace)
+{
+    current_trace = trace;
+}
+
+int execute_traced(NdbTransaction *trans,
+                   NdbTransaction::ExecType exec_type,
+                   NdbOperation::AbortOption abort_option)
+{
+    Uint64 start = rondis_now_ns();
+    int ret = trans->execute(exec_type, abort_option);
+    if (current_trace != nullptr)
+    {
+        Uint32 num = current_trace->num_ndb_executes++;
+        if (num < MAX_TRACED_EXECUTES)
+        {
+            current_trace->ndb_execute_ns[num] = rondis_now_ns() - start;
+        }
+    }
+    return ret;
+}
+
+void trace_value_rows(Uint32 num_rows)
+{
+    if (current_trace != nullptr)
+    {
+        current_trace->value_rows += num_rows;
+    }
+}
+
+void trace_ndb_error(const NdbError &error)
+{
+    if (current_trace != nullptr)
+    {
+        current_trace->temporary_error = (error.status == NdbError::TemporaryError);
+    }
+}
+
+/*
+    Aggregation over all workers. These run on the worker executing INFO or
+    LATENCY and only read the other workers' statistics.
+*/
+struct AggregatedStats
+{
+    Uint64 calls;
+    Uint64 rejected_calls;
+    Uint64 failed_calls;
+    Uint64 ndb_wait_ns;
+    Uint64 ndb_round_trips;
+    Uint64 retries;
+    Uint64 retry_successes;
+    Uint64 retry_exhaustions;
+    Uint64 phase_ns[NUM_COMMAND_PHASES];
+    Uint64 buckets[NUM_COMMAND_PHASES][LATENCY_NUM_BUCKETS];
+};
+
+static void aggregate_command_stats(int cmd, AggregatedStats *agg)
+{
+    memset(agg, 0, sizeof(*agg));
+    for (int w = 0; w < num_worker_stats; w++)
+    {
+        const CommandStats &stats = worker_stats[w].commands[cmd];
+        agg->calls += stats.calls.load(std::memory_order_relaxed);
+        agg->rejected_calls += stats.rejected_calls.load(std::memory_order_relaxed);
+        agg->failed_calls += stats.failed_calls.load(std::memory_order_relaxed);
+        agg->ndb_wait_ns += stats.ndb_wait_ns.load(std::memory_order_relaxed);
+        agg->ndb_round_trips += stats.ndb_round_trips.load(std::memory_order_relaxed);
+        agg->retries += stats.retries.load(std::memory_order_relaxed);
+        agg->retry_successes += stats.retry_successes.load(std::memory_order_relaxed);
+        agg->retry_exhaustions += stats.retry_exhaustions.load(std::memory_order_relaxed);
+        for (int phase = 0; phase < NUM_COMMAND_PHASES; phase++)
+        {
+            agg->phase_ns[phase] += stats.phase_ns[phase].load(std::memory_order_relaxed);
+            for (int b = 0; b < LATENCY_NUM_BUCKETS; b++)
+            {
+                agg->buckets[phase][b] +=
+                    stats.histograms[phase].buckets[b].load(std::memory_order_relaxed);
+            }
+        }
+    }
+}
+
+// Returns the percentile in microseconds
+static double percentile_usec(const Uint64 *buckets, Uint64 count, double percentile)
+{
+    if (count == 0)
+    {
+        return 0.0;
+    }
+    Uint64 rank = Uint64(percentile / 100.0 * double(count) + 0.5);
+    if (rank == 0)
+    {
+        rank = 1;
+    }
+    Uint64 seen = 0;
+    for (Uint32 b = 0; b < LATENCY_NUM_BUCKETS; b++)
+    {
+        seen += buckets[b];
+        if (seen >= rank)
+        {
+            return double(latency_bucket_upper_ns(b)) / 1000.0;
+        }
+    }
+    return double(latency_bucket_upper_ns(LATENCY_NUM_BUCKETS - 1)) / 1000.0;
+}
+
+static void append_bulk_string(std::string *response, const std::string &str)
+{
+    response->append("$" + std::to_string(str.size()) + "\r\n");
+    response->append(str);
+    response->append("\r\n");
+}
+
+static void append_commandstats(std::string *info)
+{
+    AggregatedStats *agg = new AggregatedStats;
+    char line[512];
+    info->append("# Commandstats\r\n");
+    for (int cmd = 0; cmd < NUM_COMMAND_IDS; cmd++)
+    {
+        aggregate_command_stats(cmd, agg);
+        if (agg->calls == 0 && agg->rejected_calls == 0)
+        {
+            continue;
+        }
+        Uint64 usec = agg->phase_ns[PHASE_EXECUTE] / 1000;
+        snprintf(line,
+                 sizeof(line),
+                 "cmdstat_%s:calls=%llu,usec=%llu,usec_per_call=%.2f,"
+                 "rejected_calls=%llu,failed_calls=%llu,"
+                 "parse_usec=%llu,reply_usec=%llu,"
+                 "ndb_usec=%llu,ndb_round_trips=%llu,"
+                 "retries=%llu,retry_successes=%llu,retry_exhaustions=%llu\r\n",
+                 command_name(cmd),
+                 agg->calls,
+                 usec,
+                 agg->calls ? double(usec) / double(agg->calls) : 0.0,
+                 agg->rejected_calls,
+                 agg->failed_calls,
+                 agg->phase_ns[PHASE_PARSE] / 1000,
+                 agg->phase_ns[PHASE_REPLY] / 1000,
+                 agg->ndb_wait_ns / 1000,
+                 agg->ndb_round_trips,
+                 agg->retries,
+                 agg->retry_successes,
+                 agg->retry_exhaustions);
+        info->append(line);
+    }
+    delete agg;
+}
+
+/*
+    latency_percentiles_usec_<cmd> is the end-to-end latency inside Rondis
+    (PHASE_TOTAL); latency_phases_usec_<cmd> shows where it was spent.
+*/
+static void append_latencystats(std::string *info)
+{
+    AggregatedStats *agg = new AggregatedStats;
+    char line[512];
+    info->append("# Latencystats\r\n");
+    for (int cmd = 0; cmd < NUM_COMMAND_IDS; cmd++)
+    {
+        aggregate_command_stats(cmd, agg);
+        if (agg->calls == 0)
+        {
+            continue;
+        }
+        const Uint64 *total = agg->buckets[PHASE_TOTAL];
+        snprintf(line,
+                 sizeof(line),
+                 "latency_percentiles_usec_%s:p50=%.3f,p99=%.3f,p99.9=%.3f\r\n",
+                 command_name(cmd),
+                 percentile_usec(total, agg->calls, 50.0),
+                 percentile_usec(total, agg->calls, 99.0),
+                 percentile_usec(total, agg->calls, 99.9));
+        info->append(line);
+
+        const Uint64 *parse = agg->buckets[PHASE_PARSE];
+        const Uint64 *execute = agg->buckets[PHASE_EXECUTE];
+        const Uint64 *reply = agg->buckets[PHASE_REPLY];
+        snprintf(line,
+                 sizeof(line),
+                 "latency_phases_usec_%s:parse_p50=%.3f,parse_p99=%.3f,"
+                 "execute_p50=%.3f,execute_p99=%.3f,"
+                 "reply_p50=%.3f,reply_p99=%.3f,"
+                 "ndb_round_trips_per_call=%.2f\r\n",
+                 command_name(cmd),
+                 percentile_usec(parse, agg->calls, 50.0),
+                 percentile_usec(parse, agg->calls, 99.0),
+                 percentile_usec(execute, agg->calls, 50.0),
+                 percentile_usec(execute, agg->calls, 99.0),
+                 percentile_usec(reply, agg->calls, 50.0),
+                 percentile_usec(reply, agg->calls, 99.0),
+                 double(agg->ndb_round_trips) / double(agg->calls));
+        info->append(line);
+    }
+    delete agg;
+}
+
+static void append_ndbstats(std::string *info)
+{
+    char line[128];
+    info->append("# Ndb\r\n");
+    for (const auto &stat : ndb_client_stat_names)
+    {
+        Uint64 sum = 0;
+        for (int w = 0; w < num_worker_stats; w++)
+        {
+            sum += worker_stats[w].ndb_client_stats[stat.id].load(std::memory_order_relaxed);
+        }
+        snprintf(line, sizeof(line), "%s:%llu\r\n", stat.name, sum);
+        info->append(line);
+    }
+}
+
+/*
+    INFO [section]
+    Supported sections are commandstats, latencystats and ndb. Without a
+    section (or with "all"/"everything") all of them are returned.
+*/
+void rondb_info_command(const pink::RedisCmdArgsSlice &argv,
+                        std::string *response)
+{
+    bool all = argv.size() == 1 ||
+               strcasecmp(argv[1].data(), "all") == 0 ||
+               strcasecmp(argv[1].data(), "everything") == 0 ||
+               strcasecmp(argv[1].data(), "default") == 0;
+    std::string info;
+    if (all || strcasecmp(argv[1].data(), "commandstats") == 0)
+    {
+        append_commandstats(&info);
+    }
+    if (all || strcasecmp(argv[1].data(), "latencystats") == 0)
+    {
+        if (!info.empty())
+            info.append("\r\n");
+        append_latencystats(&info);
+    }
+    if (all || strcasecmp(argv[1].data(), "ndb") == 0)
+    {
+        if (!info.empty())
+            info.append("\r\n");
+        append_ndbstats(&info);
+    }
+    append_bulk_string(response, info);
+}
+
+/*
+    LATENCY HISTOGRAM [command ...]
+    Same reply layout as Redis: per command the number of calls and a
+    cumulative histogram of the end-to-end latency with power-of-two
+    microsecond buckets.
+*/
+void rondb_latency_command(const pink::RedisCmdArgsSlice &argv,
+                           std::string *response)
+{
+    if (strcasecmp(argv[1].data(), "histogram") != 0)
+    {
+        char error_message[256];
+        snprintf(error_message, sizeof(error_message),
+                 REDIS_UNKNOWN_SUBCOMMAND, argv[1].data(), argv[0].data());
+        assign_generic_err_to_response(response, error_message);
+        return;
+    }
+    bool wanted[NUM_COMMAND_IDS];
+    for (int cmd = 0; cmd < NUM_COMMAND_IDS; cmd++)
+    {
+        wanted[cmd] = (argv.size() == 2);
+    }
+    for (size_t i = 2; i < argv.size(); i++)
+    {
+        for (int cmd = 0; cmd < NUM_COMMAND_IDS; cmd++)
+        {
+            if (strcasecmp(argv[i].data(), command_name(cmd)) == 0)
+            {
+                wanted[cmd] = true;
+            }
+        }
+    }
+
+    AggregatedStats *agg = new AggregatedStats;
+    std::string body;
+    int num_commands = 0;
+    for (int cmd = 0; cmd < NUM_COMMAND_IDS; cmd++)
+    {
+        if (!wanted[cmd])
+        {
+            continue;
+        }
+        aggregate_command_stats(cmd, agg);
+        if (agg->calls == 0)
+        {
+            continue;
+        }
+        Uint64 pow2_counts[64] = {0};
+        for (Uint32 b = 0; b < LATENCY_NUM_BUCKETS; b++)
+        {
+            Uint64 count = agg->buckets[PHASE_TOTAL][b];
+            if (count == 0)
+            {
+                continue;
+            }
+            Uint64 usec = (latency_bucket_upper_ns(b) + 999) / 1000;
+            Uint32 k = usec <= 1 ? 0 : 64 - __builtin_clzll(usec - 1);
+            pow2_counts[k] += count;
+        }
+        int first = 0;
+        int last = 63;
+        while (first < 63 && pow2_counts[first] == 0)
+            first++;
+        while (last > first && pow2_counts[last] == 0)
+            last--;
+
+        append_bulk_string(&body, command_name(cmd));
+        body.append("*4\r\n");
+        append_bulk_string(&body, "calls");
+        body.append(":" + std::to_string(agg->calls) + "\r\n");
+        append_bulk_string(&body, "histogram_usec");
+        body.append("*" + std::to_string(2 * (last - first + 1)) + "\r\n");
+        Uint64 cumulative = 0;
+        for (int k = first; k <= last; k++)
+        {
+            cumulative += pow2_counts[k];
+            body.append(":" + std::to_string(Uint64(1) << k) + "\r\n");
+            body.append(":" + std::to_string(cumulative) + "\r\n");
+        }
+        num_commands++;
+    }
+    delete agg;
+    response->append("*" + std::to_string(2 * num_commands) + "\r\n");
+    response->append(body);
+}
@@ -0,0 +1,155 @@
+#include <atomic>
+#include <string>
+#include "pink/include/redis_conn.h"
+#include <ndbapi/NdbApi.hpp>
+#include <ndbapi/Ndb.hpp>
+#include "command_table.h"
+
+#ifndef RONDIS_STATS_H
+#define RONDIS_STATS_H
+/*
+    Per-worker command statistics.
+
+    Every worker thread owns exactly one WorkerStats object and is the only
+    thread ever writing to it. Counters are therefore updated with a relaxed
+    load followed by a relaxed store; there are no locked instructions on the
+    request path. INFO and LATENCY can run on any worker and simply sum up all
+    WorkerStats objects using relaxed loads. A reader may observe a command
+    whose counters are only partially updated, which is fine for monitoring.
+*/
+
+/*
+    Log-linear histogram over nanoseconds. Every power of two is split into
+    LATENCY_SUB_BUCKETS linear sub-buckets, which bounds the relative error
+    of a reported percentile to 1 / LATENCY_SUB_BUCKETS (12.5%). Values above
+    2^(LATENCY_MAX_MSB + 1) ns (~18 minutes) end up in the last bucket.
+*/
+#define LATENCY_SUB_BUCKET_BITS 3
+#define LATENCY_SUB_BUCKETS (1 << LATENCY_SUB_BUCKET_BITS)
+#define LATENCY_MAX_MSB 39
+#define LATENCY_NUM_BUCKETS ((LATENCY_MAX_MSB - LATENCY_SUB_BUCKET_BITS + 2) * LATENCY_SUB_BUCKETS)
+
+struct LatencyHistogram
+{
+    std::atomic<Uint64> buckets[LATENCY_NUM_BUCKETS];
+};
+
+/*
+    A command's latency is split into three consecutive phases:
+    - PARSE:   from the start of GetRequest() (socket read and RESP parsing)
+               up to the moment the command is dispatched
+    - EXECUTE: the command handler itself, dominated by NDB round trips
+    - REPLY:   from the end of the handler until the reply has been written
+               to the socket completely
+    PHASE_TOTAL is the sum of all three.
+*/
+enum CommandPhase
+{
+    PHASE_TOTAL = 0,
+    PHASE_PARSE,
+    PHASE_EXECUTE,
+    PHASE_REPLY,
+    NUM_COMMAND_PHASES
+};
+
+struct CommandStats
+{
+    std::atomic<Uint64> calls;
+    // Refused before execution (unknown command, wrong number of arguments)
+    std::atomic<Uint64> rejected_calls;
+    // Executed, but replied with an error
+    std::atomic<Uint64> failed_calls;
+    // Time the Ndb object spent waiting for the data nodes
+    std::atomic<Uint64> ndb_wait_ns;
+    // Number of times the Ndb object waited for the data nodes
+    std::atomic<Uint64> ndb_round_trips;
+    // Retries after NdbError::TemporaryError
+    std::atomic<Uint64> retries;
+    // Calls that succeeded after being retried
+    std::atomic<Uint64> retry_successes;
+    // Calls that still failed when their retry budget was used up
+    std::atomic<Uint64> retry_exhaustions;
+    std::atomic<Uint64> phase_ns[NUM_COMMAND_PHASES];
+    LatencyHistogram histograms[NUM_COMMAND_PHASES];
+};
+
+struct WorkerStats
+{
+    CommandStats commands[NUM_COMMAND_IDS];
+    // Last snapshot of Ndb::getClientStat() of this worker's Ndb object
+    std::atomic<Uint64> ndb_client_stats[Ndb::NumClientStatistics];
+};
+
+struct SlowlogEntry;
+
+// Number of NdbTransaction::execute() calls per command timed individually
+#define MAX_TRACED_EXECUTES 8
+
+/*
+    Filled in while a single command travels through RondisConn and
+    rondb_redis_handler(). It is only recorded into WorkerStats once the
+    reply has been written, since only then the REPLY phase is known.
+*/
+struct CommandTrace
+{
+    int cmd;
+    bool rejected;
+    bool failed;
+    // Time between epoll returning the connection and reading from it
+    Uint64 queue_ns;
+    Uint64 parse_ns;
+    Uint64 execute_ns;
+    Uint64 ndb_wait_ns;
+    Uint64 ndb_round_trips;
+    Uint32 num_ndb_executes;
+    Uint64 ndb_execute_ns[MAX_TRACED_EXECUTES];
+    // Rows in the value table read or written
+    Uint32 value_rows;
+    Uint64 reply_bytes;
+    // The last NDB error of this attempt was NdbError::TemporaryError
+    bool temporary_error;
+    // Number of times the command was retried
+    Uint32 retries;
+    // Timestamp when the handler returned, used to compute the REPLY phase
+    Uint64 executed_at_ns;
+    // Only set for commands slow enough to be logged, owned by the trace
+    SlowlogEntry *slowlog_entry;
+};
+
+// Monotonic clock in nanoseconds
+Uint64 rondis_now_ns();
+
+int init_worker_stats(int num_workers);
+
+void record_command(int worker_id, const CommandTrace &trace, Uint64 reply_ns);
+
+/*
+    Must be called on the worker owning ndb. Both brackets the NDB part of a
+    command (to get its round trips and wait time) and publishes the Ndb
+    object's client statistics to other workers.
+*/
+void ndb_stats_begin(Ndb *ndb, CommandTrace *trace);
+void ndb_stats_end(Ndb *ndb, int worker_id, CommandTrace *trace);
+
+/*
+    The trace of the command currently executed by this thread. Code deep
+    down in the command handlers reports into it without having to pass it
+    through every call.
+*/
+void set_current_trace(CommandTrace *trace);
+
+// NdbTransaction::execute() that is timed in the current trace
+int execute_traced(NdbTransaction *trans,
+                   NdbTransaction::ExecType exec_type,
+                   NdbOperation::AbortOption abort_option);
+
+void trace_value_rows(Uint32 num_rows);
+
+void trace_ndb_error(const NdbError &error);
+
+void rondb_info_command(const pink::RedisCmdArgsSlice &argv,
+                        std::string *response);
+
+void rondb_latency_command(const pink::RedisCmdArgsSlice &argv,
+                           std::string *response);
+#endif
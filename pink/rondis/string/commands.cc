@@ -9,10 +9,11 @@
 #include "commands.h"
 #include "../common.h"
 #include "table_definitions.h"
+#include "value_compression.h"
 
 bool setup_transaction(
     Ndb *ndb,
-    const pink::RedisCmdArgsType &argv,
+    const pink::RedisCmdArgsSlice &argv,
     std::string *response,
     struct key_table *key_row,
     const char *key_str,
@@ -71,14 +72,14 @@ bool setup_transaction(
     The key exists but has no value (empty string).
 */
 void rondb_get_command(Ndb *ndb,
-                       const pink::RedisCmdArgsType &argv,
+                       const pink::RedisCmdArgsSlice &argv,
                        std::string *response)
 {
     const NdbDictionary::Dictionary *dict;
     const NdbDictionary::Table *tab = nullptr;
     NdbTransaction *trans = nullptr;
     struct key_table key_row;
-    const char *key_str = argv[1].c_str();
+    const char *key_str = argv[1].data();
     Uint32 key_len = argv[1].size();
     if (!setup_transaction(ndb,
                            argv,
@@ -134,14 +135,14 @@ void rondb_get_command(Ndb *ndb,
 
 void rondb_set_command(
     Ndb *ndb,
-    const pink::RedisCmdArgsType &argv,
+    const pink::RedisCmdArgsSlice &argv,
     std::string *response)
 {
     const NdbDictionary::Dictionary *dict;
     const NdbDictionary::Table *tab = nullptr;
     NdbTransaction *trans = nullptr;
     struct key_table key_row;
-    const char *key_str = argv[1].c_str();
+    const char *key_str = argv[1].data();
     Uint32 key_len = argv[1].size();
     if (!setup_transaction(ndb,
                            argv,
@@ -154,8 +155,17 @@ void rondb_set_command(
                            &trans))
       return;
 
-    const char *value_str = argv[2].c_str();
+    const char *value_str = argv[2].data();
     Uint32 value_len = argv[2].size();
+    Uint32 row_state = 0;
+    std::string compressed_value;
+    if (compress_value(value_str, value_len, &compressed_value))
+    {
+        // From here on the compressed bytes are handled like any value
+        value_str = compressed_value.data();
+        value_len = compressed_value.size();
+        row_state |= VALUE_CODEC_LZ4;
+    }
     char varsize_param[EXTENSION_VALUE_LEN + 500];
     Uint32 num_value_rows = 0;
     Uint64 rondb_key = 0;
@@ -195,7 +205,7 @@ void rondb_set_command(
                               value_str,
                               value_len,
                               num_value_rows,
-                              Uint32(0),
+                              row_state,
                               &varsize_param[0]);
     if (ret_code != 0)
     {
@@ -233,7 +243,7 @@ void rondb_set_command(
                                           value_str,
                                           value_len,
                                           num_value_rows,
-                                          Uint32(0),
+                                          row_state,
                                           &varsize_param[0]) != 0)
             {
                 ndb->closeTransaction(trans);
@@ -264,14 +274,14 @@ void rondb_set_command(
 
 void rondb_incr_command(
     Ndb *ndb,
-    const pink::RedisCmdArgsType &argv,
+    const pink::RedisCmdArgsSlice &argv,
     std::string *response)
 {
     const NdbDictionary::Dictionary *dict;
     const NdbDictionary::Table *tab = nullptr;
     NdbTransaction *trans = nullptr;
     struct key_table key_row;
-    const char *key_str = argv[1].c_str();
+    const char *key_str = argv[1].data();
     Uint32 key_len = argv[1].size();
     if (!setup_transaction(ndb,
                            argv,
@@ -26,14 +26,14 @@ void set_length(char* buf, Uint32 key_len);
 Uint32 get_length(char* buf);
 
 void rondb_get_command(Ndb *ndb,
-                       const pink::RedisCmdArgsType &argv,
+                       const pink::RedisCmdArgsSlice &argv,
                        std::string *response);
 
 void rondb_set_command(Ndb *ndb,
-                       const pink::RedisCmdArgsType &argv,
+                       const pink::RedisCmdArgsSlice &argv,
                        std::string *response);
 
 void rondb_incr_command(Ndb *ndb,
-                        const pink::RedisCmdArgsType &argv,
+                        const pink::RedisCmdArgsSlice &argv,
                         std::string *response);
 #endif
@@ -6,9 +6,11 @@
 #include <ndbapi/Ndb.hpp>
 
 #include "../common.h"
+#include "../stats.h"
 #include "db_operations.h"
 #include "table_definitions.h"
 #include "interpreted_code.h"
+#include "value_compression.h"
 
 NdbRecord *pk_key_record = nullptr;
 NdbRecord *entire_key_record = nullptr;
@@ -75,7 +77,8 @@ int create_key_row(std::string *response,
         int ret_code = 0;
         if (num_value_rows == 0)
         {
-            if (trans->execute(NdbTransaction::Commit,
+            if (execute_traced(trans,
+                               NdbTransaction::Commit,
                                NdbOperation::AbortOnError) == 0 &&
                 trans->getNdbError().code == 0)
             {
@@ -84,7 +87,8 @@ int create_key_row(std::string *response,
         }
         else
         {
-            if (trans->execute(NdbTransaction::NoCommit,
+            if (execute_traced(trans,
+                               NdbTransaction::NoCommit,
                                NdbOperation::AbortOnError) == 0 &&
                 trans->getNdbError().code == 0)
             {
@@ -169,7 +173,8 @@ int delete_key_row(std::string *response,
         return -1;
     }
 
-    if (trans->execute(NdbTransaction::NoCommit,
+    if (execute_traced(trans,
+                       NdbTransaction::NoCommit,
                        NdbOperation::AbortOnError) != 0 ||
         trans->getNdbError().code != 0)
     {
@@ -224,7 +229,8 @@ int insert_key_row(std::string *response,
     {
         if (num_value_rows == 0)
         {
-            if (trans->execute(NdbTransaction::Commit,
+            if (execute_traced(trans,
+                               NdbTransaction::Commit,
                                NdbOperation::AbortOnError) == 0 &&
                 trans->getNdbError().code == 0)
             {
@@ -233,7 +239,8 @@ int insert_key_row(std::string *response,
         }
         else
         {
-            if (trans->execute(NdbTransaction::NoCommit,
+            if (execute_traced(trans,
+                               NdbTransaction::NoCommit,
                                NdbOperation::AbortOnError) == 0 &&
                 trans->getNdbError().code == 0)
             {
@@ -323,6 +330,7 @@ int create_value_row(std::string *response,
             return -1;
         }
     }
+    trace_value_rows(1);
     return 0;
 }
 
@@ -361,7 +369,8 @@ int create_all_value_rows(std::string *response,
         start_value_ptr += this_value_len;
     }
 
-    if (trans->execute(NdbTransaction::Commit,
+    if (execute_traced(trans,
+                       NdbTransaction::Commit,
                        NdbOperation::AbortOnError) != 0 ||
         trans->getNdbError().code != 0)
     {
@@ -373,6 +382,25 @@ int create_all_value_rows(std::string *response,
     return 0;
 }
 
+/*
+    Where the reply for a value of value_len bytes is built: a large one in
+    large_reply, which finish_value_reply() hands over to the connection
+*/
+static std::string *value_reply(std::string *response,
+                                std::string *large_reply,
+                                Uint32 value_len)
+{
+    return value_len >= LARGE_REPLY_MIN_SIZE ? large_reply : response;
+}
+
+static void finish_value_reply(std::string *response, std::string *reply)
+{
+    if (reply != response)
+    {
+        append_large_reply(response, std::move(*reply));
+    }
+}
+
 int get_simple_key_row(std::string *response,
                        const NdbDictionary::Table *tab,
                        Ndb *ndb,
@@ -401,13 +429,14 @@ int get_simple_key_row(std::string *response,
                                    trans->getNdbError());
         return RONDB_INTERNAL_ERROR;
     }
-    if (trans->execute(NdbTransaction::Commit,
+    if (execute_traced(trans,
+                       NdbTransaction::Commit,
                        NdbOperation::AbortOnError) != 0 ||
         read_op->getNdbError().code != 0)
     {
         if (read_op->getNdbError().classification == NdbError::NoDataFound)
         {
-            response->assign(REDIS_NO_SUCH_KEY);
+            response->append(REDIS_NO_SUCH_KEY);
             return READ_ERROR;
         }
         assign_ndb_err_to_response(response,
@@ -420,6 +449,24 @@ int get_simple_key_row(std::string *response,
     {
         return 0;
     }
+    std::string large_reply;
+    if (value_is_compressed(key_row->value_data_type))
+    {
+        const char *stored = (const char *)&key_row->value_start[2];
+        std::string *reply = value_reply(
+            response,
+            &large_reply,
+            compressed_value_original_len(stored, key_row->tot_value_len));
+        if (append_decompressed_value(reply,
+                                      stored,
+                                      key_row->tot_value_len) != 0)
+        {
+            assign_generic_err_to_response(response, FAILED_DECOMPRESS_VALUE);
+            return RONDB_INTERNAL_ERROR;
+        }
+        finish_value_reply(response, reply);
+        return 0;
+    }
     char header_buf[20];
     int header_len = snprintf(header_buf,
                               sizeof(header_buf),
@@ -427,10 +474,14 @@ int get_simple_key_row(std::string *response,
                               key_row->tot_value_len);
 
     // The total length of the expected response
-    response->reserve(header_len + key_row->tot_value_len + 2);
-    response->append(header_buf);
-    response->append((const char *)&key_row->value_start[2], key_row->tot_value_len);
-    response->append("\r\n");
+    std::string *reply = value_reply(response,
+                                     &large_reply,
+                                     key_row->tot_value_len);
+    reply->reserve(reply->size() + header_len + key_row->tot_value_len + 2);
+    reply->append(header_buf);
+    reply->append((const char *)&key_row->value_start[2], key_row->tot_value_len);
+    reply->append("\r\n");
+    finish_value_reply(response, reply);
     /*
         printf("Respond with tot_value_len: %u, string: %s\n",
            key_row->tot_value_len,
@@ -440,6 +491,7 @@ int get_simple_key_row(std::string *response,
 }
 
 int get_value_rows(std::string *response,
+                   std::string *value,
                    Ndb *ndb,
                    const NdbDictionary::Dictionary *dict,
                    NdbTransaction *trans,
@@ -467,6 +519,7 @@ int get_value_rows(std::string *response,
         NdbTransaction::ExecType commit_type = is_last_batch ? NdbTransaction::Commit : NdbTransaction::NoCommit;
 
         if (read_batched_value_rows(response,
+                                    value,
                                     trans,
                                     rondb_key,
                                     num_rows_to_read,
@@ -481,6 +534,7 @@ int get_value_rows(std::string *response,
 
 // Break up fetching large values to avoid blocking the network for other reads
 int read_batched_value_rows(std::string *response,
+                            std::string *value,
                             NdbTransaction *trans,
                             const Uint64 rondb_key,
                             const Uint32 num_rows_to_read,
@@ -510,7 +564,8 @@ int read_batched_value_rows(std::string *response,
         ordinal++;
     }
 
-    if (trans->execute(commit_type,
+    if (execute_traced(trans,
+                       commit_type,
                        NdbOperation::AbortOnError) != 0 ||
         trans->getNdbError().code != 0)
     {
@@ -520,11 +575,12 @@ int read_batched_value_rows(std::string *response,
         return -1;
     }
 
+    trace_value_rows(num_rows_to_read);
     for (Uint32 i = 0; i < num_rows_to_read; i++)
     {
         // Transfer char pointer to response's string
-        Uint32 row_value_len = get_length((char *)&value_rows->value[0]);
-        response->append((const char *)&value_rows[i].value[2], row_value_len);
+        Uint32 row_value_len = get_length((char *)&value_rows[i].value[0]);
+        value->append((const char *)&value_rows[i].value[2], row_value_len);
     }
     return 0;
 }
@@ -563,7 +619,8 @@ int get_complex_key_row(std::string *response,
                                    trans->getNdbError());
         return RONDB_INTERNAL_ERROR;
     }
-    if (trans->execute(NdbTransaction::NoCommit,
+    if (execute_traced(trans,
+                       NdbTransaction::NoCommit,
                        NdbOperation::AbortOnError) != 0 ||
         trans->getNdbError().code != 0)
     {
@@ -574,21 +631,60 @@ int get_complex_key_row(std::string *response,
     }
 
     // Got inline value, now getting the other value rows
+    Uint32 inline_value_len = get_length((char *)&key_row->value_start[0]);
 
-    // Writing the Redis header to the response (indicating value length)
+    if (value_is_compressed(key_row->value_data_type))
+    {
+        /*
+            LZ4 needs the whole compressed block, so collect the stored
+            bytes first and decompress straight into the response.
+        */
+        std::string stored;
+        stored.reserve(key_row->tot_value_len);
+        stored.append((const char *)&key_row->value_start[2], inline_value_len);
+        if (get_value_rows(response,
+                           &stored,
+                           ndb,
+                           dict,
+                           trans,
+                           key_row->num_rows,
+                           key_row->rondb_key,
+                           key_row->tot_value_len) != 0)
+        {
+            return RONDB_INTERNAL_ERROR;
+        }
+        std::string large_reply;
+        std::string *reply = value_reply(
+            response,
+            &large_reply,
+            compressed_value_original_len(stored.data(), stored.size()));
+        if (append_decompressed_value(reply, stored.data(), stored.size()) != 0)
+        {
+            assign_generic_err_to_response(response, FAILED_DECOMPRESS_VALUE);
+            return RONDB_INTERNAL_ERROR;
+        }
+        finish_value_reply(response, reply);
+        return 0;
+    }
+
+    // Writing the Redis header to the reply (indicating value length)
     char header_buf[20];
     int header_len = snprintf(header_buf,
                               sizeof(header_buf),
                               "$%u\r\n",
                               key_row->tot_value_len);
-    response->reserve(header_len + key_row->tot_value_len + 2);
-    response->append(header_buf);
+    std::string large_reply;
+    std::string *reply = value_reply(response,
+                                     &large_reply,
+                                     key_row->tot_value_len);
+    reply->reserve(reply->size() + header_len + key_row->tot_value_len + 2);
+    reply->append(header_buf);
 
-    // Append inline value to response
-    Uint32 inline_value_len = get_length((char *)&key_row->value_start[0]);
-    response->append((const char *)&key_row->value_start[2], inline_value_len);
+    // Append inline value to reply
+    reply->append((const char *)&key_row->value_start[2], inline_value_len);
 
     int ret_code = get_value_rows(response,
+                                  reply,
                                   ndb,
                                   dict,
                                   trans,
@@ -597,7 +693,8 @@ int get_complex_key_row(std::string *response,
                                   key_row->tot_value_len);
     if (ret_code == 0)
     {
-        response->append("\r\n");
+        reply->append("\r\n");
+        finish_value_reply(response, reply);
         return 0;
     }
     return RONDB_INTERNAL_ERROR;
@@ -689,7 +786,8 @@ void incr_key_row(std::string *response,
     }
 
     /* Send to RonDB and execute the INCR operation */
-    if (trans->execute(NdbTransaction::Commit,
+    if (execute_traced(trans,
+                       NdbTransaction::Commit,
                        NdbOperation::AbortOnError) != 0 ||
         trans->getNdbError().code != 0)
     {
@@ -716,6 +814,6 @@ void incr_key_row(std::string *response,
                               sizeof(header_buf),
                               ":%lld\r\n",
                               new_incremented_value);
-    response->assign(header_buf);
+    response->append(header_buf);
     return;
 }
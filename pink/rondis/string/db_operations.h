@@ -106,7 +106,12 @@ int get_complex_key_row(std::string *response,
                         struct key_table *row,
                         Uint32 key_len);
 
+/*
+    Value rows are appended to value, errors are written to response. They
+    are the same string unless the stored value needs post-processing.
+*/
 int get_value_rows(std::string *response,
+                   std::string *value,
                    Ndb *ndb,
                    const NdbDictionary::Dictionary *dict,
                    NdbTransaction *trans,
@@ -115,6 +120,7 @@ int get_value_rows(std::string *response,
                    const Uint32 tot_value_len);
 
 int read_batched_value_rows(std::string *response,
+                            std::string *value,
                             NdbTransaction *trans,
                             const Uint64 rondb_key,
                             const Uint32 num_rows_to_read,
@@ -0,0 +1,307 @@
+#include <string.h>
+#include <stdio.h>
+
+#include "value_compression.h"
+
+#define LZ4_MIN_MATCH 4
+// The last 5 bytes of a block are always literals
+#define LZ4_LAST_LITERALS 5
+// The last match must start at least 12 bytes before the end of the block
+#define LZ4_MF_LIMIT 12
+#define LZ4_MAX_OFFSET 65535
+#define LZ4_HASH_LOG 12
+// After this many misses in a row the search steps over more bytes
+#define LZ4_SKIP_TRIGGER 6
+
+static inline uint32_t read32(const unsigned char *p)
+{
+    uint32_t v;
+    memcpy(&v, p, sizeof(v));
+    return v;
+}
+
+static inline uint32_t lz4_hash(uint32_t sequence)
+{
+    return (sequence * 2654435761U) >> (32 - LZ4_HASH_LOG);
+}
+
+// Writes the 255-byte continuation of a length field
+static inline bool write_length(unsigned char **op,
+                                const unsigned char *oend,
+                                uint32_t len)
+{
+    while (len >= 255)
+    {
+        if (*op >= oend)
+            return false;
+        *(*op)++ = 255;
+        len -= 255;
+    }
+    if (*op >= oend)
+        return false;
+    *(*op)++ = (unsigned char)len;
+    return true;
+}
+
+static inline bool write_sequence(unsigned char **op,
+                                  const unsigned char *oend,
+                                  const unsigned char *literals,
+                                  uint32_t literal_len,
+                                  uint32_t offset,
+                                  uint32_t match_len)
+{
+    if (*op >= oend)
+        return false;
+    unsigned char *token = (*op)++;
+    *token = (unsigned char)((literal_len >= 15 ? 15 : literal_len) << 4);
+    if (literal_len >= 15 && !write_length(op, oend, literal_len - 15))
+        return false;
+    if (uint32_t(oend - *op) < literal_len)
+        return false;
+    memcpy(*op, literals, literal_len);
+    *op += literal_len;
+    if (match_len == 0)
+    {
+        // Last sequence, literals only
+        return true;
+    }
+    if (oend - *op < 2)
+        return false;
+    *(*op)++ = (unsigned char)(offset & 0xFF);
+    *(*op)++ = (unsigned char)(offset >> 8);
+    uint32_t ml = match_len - LZ4_MIN_MATCH;
+    *token |= (unsigned char)(ml >= 15 ? 15 : ml);
+    if (ml >= 15 && !write_length(op, oend, ml - 15))
+        return false;
+    return true;
+}
+
+int lz4_compress_block(const char *src, uint32_t src_len, char *dst, uint32_t dst_capacity)
+{
+    const unsigned char *base = (const unsigned char *)src;
+    const unsigned char *anchor = base;
+    unsigned char *op = (unsigned char *)dst;
+    const unsigned char *oend = op + dst_capacity;
+
+    if (src_len >= LZ4_MF_LIMIT + 1)
+    {
+        // Positions are stored + 1, 0 marks an empty slot
+        uint32_t table[1 << LZ4_HASH_LOG];
+        memset(table, 0, sizeof(table));
+        const unsigned char *ip = base;
+        const unsigned char *match_start_limit = base + src_len - LZ4_MF_LIMIT;
+        const unsigned char *match_end_limit = base + src_len - LZ4_LAST_LITERALS;
+        uint32_t misses = 0;
+        while (ip <= match_start_limit)
+        {
+            uint32_t sequence = read32(ip);
+            uint32_t h = lz4_hash(sequence);
+            uint32_t ref_pos = table[h];
+            table[h] = uint32_t(ip - base) + 1;
+            if (ref_pos == 0 ||
+                uint32_t(ip - base) + 1 - ref_pos > LZ4_MAX_OFFSET ||
+                read32(base + ref_pos - 1) != sequence)
+            {
+                ip += 1 + (misses++ >> LZ4_SKIP_TRIGGER);
+                continue;
+            }
+            misses = 0;
+            const unsigned char *ref = base + ref_pos - 1;
+            // Extend the match backwards into the pending literals
+            while (ip > anchor && ref > base && ip[-1] == ref[-1])
+            {
+                ip--;
+                ref--;
+            }
+            uint32_t match_len = LZ4_MIN_MATCH;
+            while (ip + match_len < match_end_limit && ip[match_len] == ref[match_len])
+            {
+                match_len++;
+            }
+            if (!write_sequence(&op,
+                                oend,
+                                anchor,
+                                uint32_t(ip - anchor),
+                                uint32_t(ip - ref),
+                                match_len))
+            {
+                return -1;
+            }
+            ip += match_len;
+            anchor = ip;
+            if (ip - 2 >= base && ip <= match_start_limit)
+            {
+                table[lz4_hash(read32(ip - 2))] = uint32_t(ip - 2 - base) + 1;
+            }
+        }
+    }
+    if (!write_sequence(&op,
+                        oend,
+                        anchor,
+                        uint32_t(base + src_len - anchor),
+                        0,
+                        0))
+    {
+        return -1;
+    }
+    return int(op - (unsigned char *)dst);
+}
+
+static inline bool read_length(const unsigned char **ip,
+                               const unsigned char *iend,
+                               uint32_t *len)
+{
+    unsigned char b;
+    do
+    {
+        if (*ip >= iend)
+            return false;
+        b = *(*ip)++;
+        *len += b;
+    } while (b == 255);
+    return true;
+}
+
+int lz4_decompress_block(const char *src, uint32_t src_len, char *dst, uint32_t dst_len)
+{
+    const unsigned char *ip = (const unsigned char *)src;
+    const unsigned char *iend = ip + src_len;
+    unsigned char *op = (unsigned char *)dst;
+    unsigned char *ostart = op;
+    unsigned char *oend = op + dst_len;
+
+    while (ip < iend)
+    {
+        unsigned char token = *ip++;
+        uint32_t literal_len = token >> 4;
+        if (literal_len == 15 && !read_length(&ip, iend, &literal_len))
+            return -1;
+        if (uint32_t(iend - ip) < literal_len || uint32_t(oend - op) < literal_len)
+            return -1;
+        memcpy(op, ip, literal_len);
+        ip += literal_len;
+        op += literal_len;
+        if (ip == iend)
+        {
+            // The last sequence has no match
+            break;
+        }
+        if (iend - ip < 2)
+            return -1;
+        uint32_t offset = uint32_t(ip[0]) | (uint32_t(ip[1]) << 8);
+        ip += 2;
+        if (offset == 0 || offset > uint32_t(op - ostart))
+            return -1;
+        uint32_t match_len = token & 15;
+        if (match_len == 15 && !read_length(&ip, iend, &match_len))
+            return -1;
+        match_len += LZ4_MIN_MATCH;
+        if (uint32_t(oend - op) < match_len)
+            return -1;
+        const unsigned char *match = op - offset;
+        if (offset >= match_len)
+        {
+            memcpy(op, match, match_len);
+            op += match_len;
+        }
+        else
+        {
+            // Overlapping copy, repeats the last offset bytes
+            for (uint32_t i = 0; i < match_len; i++)
+            {
+                *op++ = *match++;
+            }
+        }
+    }
+    return op == oend ? 0 : -1;
+}
+
+bool compress_value(const char *value,
+                    uint32_t value_len,
+                    std::string *compressed)
+{
+    if (!value_compression_wanted(value_len))
+    {
+        return false;
+    }
+    // Only worth it if we save at least 1/8 of the value
+    uint32_t capacity = value_len - value_len / 8;
+    compressed->resize(COMPRESSED_VALUE_HEADER_LEN + capacity);
+    char *dst = &(*compressed)[0];
+    dst[0] = char(value_len & 0xFF);
+    dst[1] = char((value_len >> 8) & 0xFF);
+    dst[2] = char((value_len >> 16) & 0xFF);
+    dst[3] = char((value_len >> 24) & 0xFF);
+    int compressed_len = lz4_compress_block(value,
+                                            value_len,
+                                            dst + COMPRESSED_VALUE_HEADER_LEN,
+                                            capacity);
+    if (compressed_len < 0)
+    {
+        return false;
+    }
+    compressed->resize(COMPRESSED_VALUE_HEADER_LEN + compressed_len);
+    return true;
+}
+
+uint32_t compressed_value_original_len(const char *stored, uint32_t stored_len)
+{
+    if (stored_len < COMPRESSED_VALUE_HEADER_LEN)
+    {
+        return 0;
+    }
+    const unsigned char *p = (const unsigned char *)stored;
+    return uint32_t(p[0]) |
+           (uint32_t(p[1]) << 8) |
+           (uint32_t(p[2]) << 16) |
+           (uint32_t(p[3]) << 24);
+}
+
+// Each byte of an LZ4 block decompresses to at most 255 bytes
+static bool original_len_possible(uint32_t stored_len, uint32_t original_len)
+{
+    return stored_len >= COMPRESSED_VALUE_HEADER_LEN &&
+           uint64_t(original_len) <=
+               uint64_t(stored_len - COMPRESSED_VALUE_HEADER_LEN) * 255;
+}
+
+int decompress_value(const char *stored, uint32_t stored_len, char *dst)
+{
+    uint32_t original_len = compressed_value_original_len(stored, stored_len);
+    if (!original_len_possible(stored_len, original_len))
+    {
+        return -1;
+    }
+    return lz4_decompress_block(stored + COMPRESSED_VALUE_HEADER_LEN,
+                                stored_len - COMPRESSED_VALUE_HEADER_LEN,
+                                dst,
+                                original_len);
+}
+
+int append_decompressed_value(std::string *response,
+                              const char *stored,
+                              uint32_t stored_len)
+{
+    uint32_t original_len = compressed_value_original_len(stored, stored_len);
+    if (!original_len_possible(stored_len, original_len))
+    {
+        return -1;
+    }
+    char header_buf[20];
+    int header_len = snprintf(header_buf,
+                              sizeof(header_buf),
+                              "$%u\r\n",
+                              original_len);
+    size_t reply_start = response->size();
+    response->reserve(reply_start + header_len + original_len + 2);
+    response->append(header_buf, header_len);
+    size_t value_pos = response->size();
+    response->resize(value_pos + original_len);
+    if (decompress_value(stored, stored_len, &(*response)[value_pos]) != 0)
+    {
+        response->resize(reply_start);
+        return -1;
+    }
+    response->append("\r\n");
+    return 0;
+}
@@ -0,0 +1,73 @@
+#include <stdint.h>
+#include <string>
+
+#ifndef STRING_VALUE_COMPRESSION_H
+#define STRING_VALUE_COMPRESSION_H
+/*
+    Compression of large STRING values.
+
+    The codec is a self-contained implementation of the LZ4 block format
+    (https://github.com/lz4/lz4/blob/dev/doc/lz4_Block_format.md). A
+    compressed value is stored as
+
+        [original length: 4 bytes, little endian][LZ4 block]
+
+    and flagged with VALUE_CODEC_LZ4 in the value_data_type column. The
+    stored (compressed) bytes are split into the inline value and the value
+    rows exactly like uncompressed values, tot_value_len is their length.
+*/
+
+#define VALUE_CODEC_LZ4 (1U << 16)
+#define VALUE_CODEC_MASK (0xFFU << 16)
+#define COMPRESSED_VALUE_HEADER_LEN 4
+
+/*
+    Whether a value is stored compressed, by its value_data_type. Values
+    written without a codec, including all values written before
+    compression existed, are stored as they are.
+*/
+inline bool value_is_compressed(uint32_t value_data_type)
+{
+    return (value_data_type & VALUE_CODEC_MASK) == VALUE_CODEC_LZ4;
+}
+
+/*
+    Whether a value of value_len bytes should be compressed, by the
+    value-compression parameters (config.cc). The codec needs neither them
+    nor the NDB API, so that it can be tested on its own.
+*/
+bool value_compression_wanted(uint32_t value_len);
+
+/*
+    Compresses value into compressed if compression is enabled, the value is
+    larger than value-compression-min-size and it shrinks by at least 1/8.
+    Returns false if the value should be stored as it is.
+*/
+bool compress_value(const char *value,
+                    uint32_t value_len,
+                    std::string *compressed);
+
+// Length of the value before compression, 0 if the header is missing
+uint32_t compressed_value_original_len(const char *stored, uint32_t stored_len);
+
+/*
+    Decompresses a stored value into dst, which must have room for
+    compressed_value_original_len() bytes. Returns -1 on corrupt data,
+    without reading or writing outside of stored and dst.
+*/
+int decompress_value(const char *stored, uint32_t stored_len, char *dst);
+
+/*
+    Appends the Redis bulk string reply for a compressed stored value to the
+    response, decompressing directly into the response buffer. Returns -1
+    with the response unchanged on corrupt data; an original length the
+    block cannot decompress to is rejected before anything is allocated.
+*/
+int append_decompressed_value(std::string *response,
+                              const char *stored,
+                              uint32_t stored_len);
+
+// Raw LZ4 block codec; both return -1 if dst is too small or src corrupt
+int lz4_compress_block(const char *src, uint32_t src_len, char *dst, uint32_t dst_capacity);
+int lz4_decompress_block(const char *src, uint32_t src_len, char *dst, uint32_t dst_len);
+#endif
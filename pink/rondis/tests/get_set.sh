@@ -27,6 +27,14 @@ EOF
         exit 1
     fi
     
+    get_and_check "$key" "$value"
+}
+
+# Function to retrieve a value and verify if it matches
+function get_and_check() {
+    local key="$1"
+    local value="$2"
+
     # GET the value
     local result=$(redis-cli GET "$key")
 
@@ -134,4 +142,27 @@ for i in {1..10}; do
     fi
 done
 
+echo "Testing values written with and without compression..."
+compression=$(redis-cli CONFIG GET value-compression | tail -n 1)
+redis-cli CONFIG SET value-compression 0
+for NUM_CHARS in 100 10000 70000; do
+    raw_value=$(head -c $NUM_CHARS < /dev/zero | tr '\0' 'c')
+    set_and_get "$KEY:raw_$NUM_CHARS" "$raw_value"
+done
+redis-cli CONFIG SET value-compression 1
+for NUM_CHARS in 100 10000 70000; do
+    compressed_value=$(head -c $NUM_CHARS < /dev/zero | tr '\0' 'd')
+    set_and_get "$KEY:compressed_$NUM_CHARS" "$compressed_value"
+    # Written before compression was turned on, read as they are
+    raw_value=$(head -c $NUM_CHARS < /dev/zero | tr '\0' 'c')
+    get_and_check "$KEY:raw_$NUM_CHARS" "$raw_value"
+done
+# Compressed values stay readable when compression is turned off
+redis-cli CONFIG SET value-compression 0
+for NUM_CHARS in 100 10000 70000; do
+    compressed_value=$(head -c $NUM_CHARS < /dev/zero | tr '\0' 'd')
+    get_and_check "$KEY:compressed_$NUM_CHARS" "$compressed_value"
+done
+redis-cli CONFIG SET value-compression "$compression"
+
 echo "All tests completed."
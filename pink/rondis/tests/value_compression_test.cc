@@ -0,0 +1,212 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <string>
+#include <vector>
+
+#include "../string/value_compression.h"
+
+/*
+    Tests of the STRING value codec, without a cluster or the NDB API.
+    Build and run with
+    make value_compression_test && ./value_compression_test
+
+    The parameters live in config.cc, which needs the command layer; these
+    stand in for value-compression and value-compression-min-size.
+*/
+static bool compression_enabled = true;
+static uint32_t compression_min_size = 1000;
+
+bool value_compression_wanted(uint32_t value_len)
+{
+    return compression_enabled && value_len >= compression_min_size;
+}
+
+static int failures = 0;
+
+#define CHECK(cond)                                            \
+    do                                                         \
+    {                                                          \
+        if (!(cond))                                           \
+        {                                                      \
+            printf("FAIL: %s:%d: %s\n", __FILE__, __LINE__, #cond); \
+            failures++;                                        \
+        }                                                      \
+    } while (0)
+
+static std::string random_bytes(uint32_t len)
+{
+    std::string value(len, '\0');
+    for (uint32_t i = 0; i < len; i++)
+    {
+        value[i] = char(rand());
+    }
+    return value;
+}
+
+static std::string json_like(uint32_t len)
+{
+    std::string value;
+    while (value.size() < len)
+    {
+        value += "{\"id\":" + std::to_string(value.size() % 977) +
+                 ",\"name\":\"value\",\"tags\":[\"a\",\"b\"]},";
+    }
+    value.resize(len);
+    return value;
+}
+
+/*
+    Decompresses into a buffer with guard bytes behind the value, they must
+    be untouched whatever the stored bytes are
+*/
+static int decompress_guarded(const std::string &stored, uint32_t dst_len)
+{
+    // Exactly sized, so reads past the end are caught by sanitizers
+    std::vector<char> src(stored.begin(), stored.end());
+    std::vector<char> dst(dst_len + 64, 'G');
+    int ret = decompress_value(src.data(), uint32_t(src.size()), dst.data());
+    for (uint32_t i = dst_len; i < dst.size(); i++)
+    {
+        if (dst[i] != 'G')
+        {
+            printf("FAIL: decompress_value wrote past the value\n");
+            failures++;
+            break;
+        }
+    }
+    return ret;
+}
+
+static void test_round_trip()
+{
+    std::vector<std::string> values;
+    values.push_back(json_like(1000));
+    values.push_back(json_like(70000));
+    values.push_back(std::string(300000, 'x'));
+    // Incompressible bytes between compressible ones
+    values.push_back(json_like(5000) + random_bytes(2000) + json_like(5000));
+    for (const std::string &value : values)
+    {
+        std::string stored;
+        CHECK(compress_value(value.data(), value.size(), &stored));
+        CHECK(stored.size() < value.size());
+        CHECK(compressed_value_original_len(stored.data(), stored.size()) ==
+              value.size());
+
+        std::string decompressed(value.size(), '\0');
+        CHECK(decompress_value(stored.data(), stored.size(), &decompressed[0]) == 0);
+        CHECK(decompressed == value);
+
+        std::string response = "+OK\r\n";
+        CHECK(append_decompressed_value(&response, stored.data(), stored.size()) == 0);
+        CHECK(response == "+OK\r\n$" + std::to_string(value.size()) + "\r\n" +
+                              value + "\r\n");
+    }
+    printf("PASS: round trip\n");
+}
+
+static void test_incompressible_stored_raw()
+{
+    std::string stored = "untouched";
+    std::string value = random_bytes(100000);
+    CHECK(!compress_value(value.data(), value.size(), &stored));
+
+    // Must save at least 1/8 of the value: 1/16 compressible is not enough
+    value = random_bytes(15000) + std::string(1000, 'x');
+    CHECK(!compress_value(value.data(), value.size(), &stored));
+    value = random_bytes(6000) + std::string(2000, 'x');
+    CHECK(compress_value(value.data(), value.size(), &stored));
+    printf("PASS: incompressible values are stored raw\n");
+}
+
+static void test_threshold()
+{
+    std::string stored;
+    std::string value = json_like(1000);
+    CHECK(!compress_value(value.data(), 999, &stored));
+    CHECK(compress_value(value.data(), 1000, &stored));
+
+    compression_enabled = false;
+    CHECK(!compress_value(value.data(), 1000, &stored));
+    compression_enabled = true;
+    printf("PASS: values below value-compression-min-size are stored raw\n");
+}
+
+static void test_corrupt()
+{
+    std::string value = json_like(20000) + random_bytes(500) + json_like(3000);
+    std::string stored;
+    CHECK(compress_value(value.data(), value.size(), &stored));
+
+    // No room for the header
+    std::string response = "+OK\r\n";
+    for (uint32_t len = 0; len < COMPRESSED_VALUE_HEADER_LEN; len++)
+    {
+        CHECK(decompress_guarded(stored.substr(0, len), 0) == -1);
+        CHECK(append_decompressed_value(&response, stored.data(), len) == -1);
+    }
+
+    // Wrong lengths in the header
+    uint32_t wrong_lens[] = {0, 1, uint32_t(value.size() - 1),
+                             uint32_t(value.size() + 1), 0xFFFFFFFF};
+    for (uint32_t wrong_len : wrong_lens)
+    {
+        std::string corrupt = stored;
+        corrupt[0] = char(wrong_len & 0xFF);
+        corrupt[1] = char((wrong_len >> 8) & 0xFF);
+        corrupt[2] = char((wrong_len >> 16) & 0xFF);
+        corrupt[3] = char((wrong_len >> 24) & 0xFF);
+        if (wrong_len <= value.size() + 1)
+        {
+            CHECK(decompress_guarded(corrupt, wrong_len) == -1);
+        }
+        // Rejected up front, no 4 GB reply is allocated
+        CHECK(append_decompressed_value(&response, corrupt.data(), corrupt.size()) == -1);
+    }
+
+    // Truncated and damaged blocks
+    for (uint32_t len = COMPRESSED_VALUE_HEADER_LEN; len < stored.size(); len += 7)
+    {
+        CHECK(decompress_guarded(stored.substr(0, len), value.size()) == -1);
+    }
+    for (int i = 0; i < 5000; i++)
+    {
+        std::string corrupt = stored;
+        uint32_t pos = COMPRESSED_VALUE_HEADER_LEN +
+                     rand() % (stored.size() - COMPRESSED_VALUE_HEADER_LEN);
+        corrupt[pos] = char(rand());
+        decompress_guarded(corrupt, value.size());
+    }
+    CHECK(response == "+OK\r\n");
+    printf("PASS: corrupt values fail cleanly\n");
+}
+
+static void test_values_without_codec()
+{
+    // Values written before compression existed have no codec bits
+    CHECK(!value_is_compressed(0));
+    CHECK(!value_is_compressed(0xFFFF));
+    CHECK(value_is_compressed(VALUE_CODEC_LZ4));
+    CHECK(value_is_compressed(VALUE_CODEC_LZ4 | 0xFFFF));
+    // An unknown codec is not taken for LZ4
+    CHECK(!value_is_compressed(VALUE_CODEC_LZ4 | (1U << 17)));
+    printf("PASS: values without a codec are not decompressed\n");
+}
+
+int main()
+{
+    srand(42);
+    test_round_trip();
+    test_incompressible_stored_raw();
+    test_threshold();
+    test_corrupt();
+    test_values_without_codec();
+    if (failures != 0)
+    {
+        printf("%d checks failed\n", failures);
+        return 1;
+    }
+    printf("All tests completed.\n");
+    return 0;
+}
@@ -4,7 +4,6 @@
 // of patent rights can be found in the PATENTS file in the same directory.
 
 #include "pink/include/bg_thread.h"
-#include <sys/time.h>
 
 #include "slash/include/slash_mutex.h"
 #include "slash/include/xdebug.h"
@@ -24,21 +23,26 @@ void BGThread::Schedule(void (*function)(void*), void* arg) {
 }
 
 void BGThread::QueueSize(int* pri_size, int* qu_size) {
+  *pri_size = has_timers_.load() ?
+    static_cast<int>(TimerService::Default()->pending(this)) : 0;
   slash::MutexLock l(&mu_);
-  *pri_size = timer_queue_.size();
   *qu_size = queue_.size();
 }
 
 void BGThread::QueueClear() {
+  // Not under mu_, the timer thread may be waiting for it
+  if (has_timers_.load()) {
+    TimerService::Default()->CancelAll(this);
+  }
   slash::MutexLock l(&mu_);
   std::queue<BGItem>().swap(queue_);
-  std::priority_queue<TimerItem>().swap(timer_queue_);
   wsignal_.Signal();
 }
 
 void BGThread::SwallowReadyTasks() {
-  // it's safe to swallow all the remain tasks in ready and timer queue,
-  // while the schedule function would stop to add any tasks.
+  // it's safe to swallow all the remain tasks in ready queue, while the
+  // schedule function would stop to add any tasks. Timers that came due
+  // are in it too.
   mu_.Lock();
   while (!queue_.empty()) {
     void (*function)(void*) = queue_.front().function;
@@ -49,57 +53,18 @@ void BGThread::SwallowReadyTasks() {
     mu_.Lock();
   }
   mu_.Unlock();
-
-  struct timeval now;
-  gettimeofday(&now, NULL);
-  uint64_t unow = now.tv_sec * 1000000 + now.tv_usec;
-  mu_.Lock();
-  while(!timer_queue_.empty()) {
-    TimerItem top_item = timer_queue_.top();
-    if (unow / 1000 < top_item.exec_time / 1000) {
-      break;
-    }
-    void (*function)(void*) = top_item.function;
-    void* arg = top_item.arg;
-    timer_queue_.pop();
-    // Don't lock while doing task
-    mu_.Unlock();
-    (*function)(arg);
-    mu_.Lock();
-  }
-  mu_.Unlock();
 }
 
 void *BGThread::ThreadMain() {
   while (!should_stop()) {
     mu_.Lock();
-    while (queue_.empty() && timer_queue_.empty() && !should_stop()) {
+    while (queue_.empty() && !should_stop()) {
       rsignal_.Wait();
     }
     if (should_stop()) {
       mu_.Unlock();
       break;
     }
-    if (!timer_queue_.empty()) {
-      struct timeval now;
-      gettimeofday(&now, NULL);
-
-      TimerItem timer_item = timer_queue_.top();
-      uint64_t unow = now.tv_sec * 1000000 + now.tv_usec;
-      if (unow / 1000 >= timer_item.exec_time / 1000) {
-        void (*function)(void*) = timer_item.function;
-        void* arg = timer_item.arg;
-        timer_queue_.pop();
-        mu_.Unlock();
-        (*function)(arg);
-        continue;
-      } else if (queue_.empty() && !should_stop()) {
-        rsignal_.TimedWait(
-            static_cast<uint32_t>((timer_item.exec_time - unow) / 1000));
-        mu_.Unlock();
-        continue;
-      }
-    }
     if (!queue_.empty()) {
       void (*function)(void*) = queue_.front().function;
       void* arg = queue_.front().arg;
@@ -117,23 +82,25 @@ void *BGThread::ThreadMain() {
 /*
  * timeout is in millisecond
  */
-void BGThread::DelaySchedule(
+uint64_t BGThread::DelaySchedule(
     uint64_t timeout, void (*function)(void *), void* arg) {
-  /*
-   * pthread_cond_timedwait api use absolute API
-   * so we need gettimeofday + timeout
-   */
-  struct timeval now;
-  gettimeofday(&now, NULL);
-  uint64_t exec_time;
-  exec_time = now.tv_sec * 1000000 + timeout * 1000 + now.tv_usec;
+  if (should_stop()) {
+    return 0;
+  }
+  has_timers_.store(true);
+  return TimerService::Default()->Add(timeout, this, function, arg);
+}
 
-  mu_.Lock();
-  if (!should_stop()) {
-    timer_queue_.push(TimerItem(exec_time, function, arg));
-    rsignal_.Signal();
+/*
+ * The tasks may go past full_, waiting would hold up the timer thread.
+ * They are kept while the thread is stopped
+ */
+void BGThread::ScheduleTimerTasks(const std::vector<TimerTask>& tasks) {
+  slash::MutexLock l(&mu_);
+  for (const TimerTask& task : tasks) {
+    queue_.push(BGItem(task.function, task.arg));
   }
-  mu_.Unlock();
+  rsignal_.Signal();
 }
 
 }  // namespace pink
@@ -0,0 +1,80 @@
+// Copyright (c) 2015-present, Qihoo, Inc.  All rights reserved.
+// This source code is licensed under the BSD-style license found in the
+// LICENSE file in the root directory of this source tree. An additional grant
+// of patent rights can be found in the PATENTS file in the same directory.
+
+#include "pink/src/big_buffer.h"
+
+#include <stdlib.h>
+
+#include <vector>
+
+#include "slash/include/slash_mutex.h"
+
+namespace pink {
+
+static const size_t kMinPooledShift = 15;  // 32KB
+static const size_t kMaxPooledShift = 24;  // 16MB
+static const size_t kMaxPooledBytes = 64 << 20;
+
+struct BigBufferPool {
+  BigBufferPool() : pooled_bytes(0) {}
+
+  slash::Mutex mu;
+  // Free buffers of 1 << (kMinPooledShift + i) bytes
+  std::vector<char*> free_lists[kMaxPooledShift - kMinPooledShift + 1];
+  size_t pooled_bytes;
+};
+
+static BigBufferPool* Pool() {
+  // Never destroyed, conns may give buffers back during exit
+  static BigBufferPool* pool = new BigBufferPool();
+  return pool;
+}
+
+char* AllocBigBuffer(size_t size, size_t* capacity) {
+  if (size > (static_cast<size_t>(1) << kMaxPooledShift)) {
+    *capacity = size;
+    return static_cast<char*>(malloc(size));
+  }
+  size_t shift = kMinPooledShift;
+  while ((static_cast<size_t>(1) << shift) < size) {
+    shift++;
+  }
+  *capacity = static_cast<size_t>(1) << shift;
+  BigBufferPool* pool = Pool();
+  {
+    slash::MutexLock l(&pool->mu);
+    std::vector<char*>& free_list = pool->free_lists[shift - kMinPooledShift];
+    if (!free_list.empty()) {
+      char* buf = free_list.back();
+      free_list.pop_back();
+      pool->pooled_bytes -= *capacity;
+      return buf;
+    }
+  }
+  return static_cast<char*>(malloc(*capacity));
+}
+
+void FreeBigBuffer(char* buf, size_t capacity) {
+  if (buf == nullptr) {
+    return;
+  }
+  size_t shift = kMinPooledShift;
+  while (shift <= kMaxPooledShift &&
+         (static_cast<size_t>(1) << shift) != capacity) {
+    shift++;
+  }
+  if (shift <= kMaxPooledShift) {
+    BigBufferPool* pool = Pool();
+    slash::MutexLock l(&pool->mu);
+    if (pool->pooled_bytes + capacity <= kMaxPooledBytes) {
+      pool->free_lists[shift - kMinPooledShift].push_back(buf);
+      pool->pooled_bytes += capacity;
+      return;
+    }
+  }
+  free(buf);
+}
+
+}  // namespace pink
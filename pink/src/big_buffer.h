@@ -0,0 +1,26 @@
+// Copyright (c) 2015-present, Qihoo, Inc.  All rights reserved.
+// This source code is licensed under the BSD-style license found in the
+// LICENSE file in the root directory of this source tree. An additional grant
+// of patent rights can be found in the PATENTS file in the same directory.
+
+#ifndef PINK_SRC_BIG_BUFFER_H_
+#define PINK_SRC_BIG_BUFFER_H_
+
+#include <stddef.h>
+
+namespace pink {
+
+/*
+ * Buffers for large request arguments, shared by all threads. Sizes up to
+ * 16MB are rounded up to a power of two and kept in a free list when
+ * given back, at most 64MB of them in all; larger ones are allocated with
+ * their exact size and freed right away.
+ */
+
+// A buffer of at least size bytes, its real size is stored in *capacity
+char* AllocBigBuffer(size_t size, size_t* capacity);
+// capacity as returned by AllocBigBuffer
+void FreeBigBuffer(char* buf, size_t capacity);
+
+}  // namespace pink
+#endif  // PINK_SRC_BIG_BUFFER_H_
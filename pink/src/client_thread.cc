@@ -308,57 +308,52 @@ void ClientThread::NotifyWrite(const std::string ip_port) {
 
 void ClientThread::ProcessNotifyEvents(const PinkFiredEvent* pfe) {
   if (pfe->mask & PinkEpoll::kRead) {
-    char bb[2048];
-    int32_t nread = read(pink_epoll_->notify_receive_fd(), bb, 2048);
-    if (nread == 0) {
-      return;
-    } else {
-      for (int32_t idx = 0; idx < nread; ++idx) {
-        PinkItem ti = pink_epoll_->notify_queue_pop();
-        std::string ip_port = ti.ip_port();
-        int fd = ti.fd();
-        if (ti.notify_type() == kNotiWrite) {
-          if (ipport_conns_.find(ip_port) == ipport_conns_.end()) {
-            std::string ip;
-            int port = 0;
-            if (!slash::ParseIpPortString(ip_port, ip, port)) {
-              continue;
-            }
-            Status s = ScheduleConnect(ip, port);
-            if (!s.ok()) {
-              std::string ip_port = ip + ":" + std::to_string(port);
-              handle_->DestConnectFailedHandle(ip_port, s.ToString());
-              log_info("Ip %s, port %d Connect err %s\n", ip.c_str(), port, s.ToString().c_str());
-              continue;
-            }
-          } else {
-            // connection exist
-            pink_epoll_->PinkModEvent(ipport_conns_[ip_port]->fd(), 0, PinkEpoll::kRead | PinkEpoll::kWrite);
-          }
-          {
-          slash::MutexLock l(&mu_);
-          auto iter = to_send_.find(ip_port);
-          if (iter == to_send_.end()) {
+    std::vector<PinkItem> notify_items;
+    pink_epoll_->DrainNotifyQueue(&notify_items);
+    for (const PinkItem& ti : notify_items) {
+      std::string ip_port = ti.ip_port();
+      int fd = ti.fd();
+      if (ti.notify_type() == kNotiWrite) {
+        if (ipport_conns_.find(ip_port) == ipport_conns_.end()) {
+          std::string ip;
+          int port = 0;
+          if (!slash::ParseIpPortString(ip_port, ip, port)) {
             continue;
           }
-          // get msg from to_send_
-          std::vector<std::string>& msgs = iter->second;
-          for (auto& msg : msgs) {
-            if (ipport_conns_[ip_port]->WriteResp(msg)) {
-              to_send_[ip_port].push_back(msg);
-              NotifyWrite(ip_port);
-            }
+          Status s = ScheduleConnect(ip, port);
+          if (!s.ok()) {
+            std::string ip_port = ip + ":" + std::to_string(port);
+            handle_->DestConnectFailedHandle(ip_port, s.ToString());
+            log_info("Ip %s, port %d Connect err %s\n", ip.c_str(), port, s.ToString().c_str());
+            continue;
           }
-          to_send_.erase(iter);
+        } else {
+          // connection exist
+          pink_epoll_->PinkModEvent(ipport_conns_[ip_port]->fd(), 0, PinkEpoll::kRead | PinkEpoll::kWrite);
+        }
+        {
+        slash::MutexLock l(&mu_);
+        auto iter = to_send_.find(ip_port);
+        if (iter == to_send_.end()) {
+          continue;
+        }
+        // get msg from to_send_
+        std::vector<std::string>& msgs = iter->second;
+        for (auto& msg : msgs) {
+          if (ipport_conns_[ip_port]->WriteResp(msg)) {
+            to_send_[ip_port].push_back(msg);
+            NotifyWrite(ip_port);
           }
-        } else if (ti.notify_type() == kNotiClose) {
-          log_info("received kNotiClose\n");
-          pink_epoll_->PinkDelEvent(fd, 0);
-          CloseFd(fd, ip_port);
-          fd_conns_.erase(fd);
-          ipport_conns_.erase(ip_port);
-          connecting_fds_.erase(fd);
         }
+        to_send_.erase(iter);
+        }
+      } else if (ti.notify_type() == kNotiClose) {
+        log_info("received kNotiClose\n");
+        pink_epoll_->PinkDelEvent(fd, 0);
+        CloseFd(fd, ip_port);
+        fd_conns_.erase(fd);
+        ipport_conns_.erase(ip_port);
+        connecting_fds_.erase(fd);
       }
     }
   }
@@ -473,6 +468,7 @@ void *ClientThread::ThreadMain() {
         }
       }
     }
+    pink_epoll_->RunTimers();
   }
   return nullptr;
 }
@@ -9,10 +9,21 @@
 
 #include "pink/src/pink_item.h"
 #include "pink/src/pink_epoll.h"
+#include "pink/src/server_socket.h"
+#include "pink/src/thread_placement.h"
 #include "pink/src/worker_thread.h"
 
 namespace pink {
 
+/*
+ * Busy times closer than this count as equal for placement, and the
+ * rebalancer only moves conns between workers this much apart
+ */
+static const int kPlacementSlackPermille = 100;
+static const int kRebalanceGapPermille = 200;
+// Below this nobody is waiting for a busy worker
+static const int kRebalanceMinBusyPermille = 300;
+
 DispatchThread::DispatchThread(int port,
                                int work_num, ConnFactory* conn_factory,
                                int cron_interval, int queue_limit,
@@ -63,6 +74,14 @@ DispatchThread::~DispatchThread() {
 }
 
 int DispatchThread::StartThread() {
+  if (reuse_port()) {
+    int ret = ListenOnWorkers();
+    if (ret != kSuccess) {
+      return ret;
+    }
+  }
+  std::vector<std::vector<int> > worker_cpus =
+    PlanThreadCpus(thread_placement(), work_num_);
   for (int i = 0; i < work_num_; i++) {
     int ret = handle_->CreateWorkerSpecificData(
         &(worker_thread_[i]->private_data_));
@@ -73,14 +92,46 @@ int DispatchThread::StartThread() {
     if (!thread_name().empty()) {
       worker_thread_[i]->set_thread_name("WorkerThread");
     }
+    worker_thread_[i]->set_cpu_affinity(worker_cpus[i]);
     ret = worker_thread_[i]->StartThread();
     if (ret != 0) {
       return ret;
     }
   }
+  if (rebalance_interval() > 0 && work_num_ > 1) {
+    pink_epoll_->AddTimer(rebalance_interval(), [this]() { Rebalance(); });
+  }
   return ServerThread::StartThread();
 }
 
+int DispatchThread::InitHandle() {
+  if (reuse_port()) {
+    return kSuccess;
+  }
+  return ServerThread::InitHandle();
+}
+
+int DispatchThread::ListenOnWorkers() {
+  if (ips_.find("0.0.0.0") != ips_.end()) {
+    ips_.clear();
+    ips_.insert("0.0.0.0");
+  }
+  for (int i = 0; i < work_num_; i++) {
+    for (const auto& ip : ips_) {
+      ServerSocket* socket_p = new ServerSocket(port_);
+      socket_p->set_reuse_port(true);
+      socket_p->set_profile(socket_profile(ip));
+      int ret = socket_p->Listen(ip);
+      if (ret != kSuccess) {
+        delete socket_p;
+        return ret;
+      }
+      worker_thread_[i]->AddServerSocket(socket_p);
+    }
+  }
+  return kSuccess;
+}
+
 int DispatchThread::StopThread() {
   for (int i = 0; i < work_num_; i++) {
     worker_thread_[i]->set_should_stop();
@@ -138,14 +189,71 @@ std::shared_ptr<PinkConn> DispatchThread::MoveConnOut(int fd) {
 }
 
 void DispatchThread::MoveConnIn(std::shared_ptr<PinkConn> conn, const NotifyType& type) {
-  WorkerThread* worker_thread = worker_thread_[last_thread_];
+  int next_thread = NextWorker();
+  WorkerThread* worker_thread = worker_thread_[next_thread];
   bool success = worker_thread->MoveConnIn(conn, type, true);
   if (success) {
-    last_thread_ = (last_thread_ + 1) % work_num_;
+    last_thread_ = (next_thread + 1) % work_num_;
     conn->set_pink_epoll(worker_thread->pink_epoll());
   }
 }
 
+int DispatchThread::NextWorker() const {
+  if (conn_placement() != kLeastLoadedPlacement) {
+    return last_thread_;
+  }
+  int best = last_thread_;
+  ServerThread::WorkerLoad best_load = worker_thread_[best]->load();
+  for (int cnt = 1; cnt < work_num_; cnt++) {
+    int i = (last_thread_ + cnt) % work_num_;
+    ServerThread::WorkerLoad load = worker_thread_[i]->load();
+    int busy = load.busy_permille / kPlacementSlackPermille;
+    int best_busy = best_load.busy_permille / kPlacementSlackPermille;
+    if (busy < best_busy ||
+        (busy == best_busy && load.conns < best_load.conns)) {
+      best = i;
+      best_load = load;
+    }
+  }
+  return best;
+}
+
+std::vector<ServerThread::WorkerLoad> DispatchThread::workers_load() const {
+  std::vector<ServerThread::WorkerLoad> result;
+  for (int i = 0; i < work_num_; ++i) {
+    result.push_back(worker_thread_[i]->load());
+  }
+  return result;
+}
+
+void DispatchThread::Rebalance() {
+  int busiest = 0;
+  int idlest = 0;
+  std::vector<ServerThread::WorkerLoad> loads = workers_load();
+  for (int i = 1; i < work_num_; i++) {
+    if (loads[i].busy_permille > loads[busiest].busy_permille) {
+      busiest = i;
+    }
+    if (loads[i].busy_permille < loads[idlest].busy_permille) {
+      idlest = i;
+    }
+  }
+  int gap = loads[busiest].busy_permille - loads[idlest].busy_permille;
+  if (loads[busiest].busy_permille >= kRebalanceMinBusyPermille &&
+      gap >= kRebalanceGapPermille) {
+    // Moving more than half the gap would only swap the two workers' roles
+    std::shared_ptr<PinkConn> conn =
+      worker_thread_[busiest]->MigrateConnOut(gap / 2);
+    if (conn != nullptr) {
+      log_info("move conn %s from worker(%d) busy %d to worker(%d) busy %d",
+               conn->ip_port().c_str(), busiest, loads[busiest].busy_permille,
+               idlest, loads[idlest].busy_permille);
+      worker_thread_[idlest]->MigrateConnIn(conn);
+    }
+  }
+  pink_epoll_->AddTimer(rebalance_interval(), [this]() { Rebalance(); });
+}
+
 bool DispatchThread::KillConn(const std::string& ip_port) {
   bool result = false;
   for (int i = 0; i < work_num_; ++i) {
@@ -163,7 +271,7 @@ void DispatchThread::HandleNewConn(
   // Slow workers may consume many fds.
   // We simply loop to find next legal worker.
   PinkItem ti(connfd, ip_port);
-  int next_thread = last_thread_;
+  int next_thread = NextWorker();
   bool find = false;
   for (int cnt = 0; cnt < work_num_; cnt++) {
     WorkerThread* worker_thread = worker_thread_[next_thread];
@@ -68,6 +68,9 @@ class DispatchThread : public ServerThread {
   void HandleNewConn(const int connfd, const std::string& ip_port) override;
 
   void SetQueueLimit(int queue_limit) override;
+
+  virtual std::vector<ServerThread::WorkerLoad> workers_load() const override;
+
  private:
   /*
    * Here we used auto poll to find the next work thread,
@@ -82,10 +85,24 @@ class DispatchThread : public ServerThread {
   int queue_limit_;
   std::map<WorkerThread*, void*> localdata_;
 
+  /*
+   * The worker for a new conn, starting from last_thread_ so that equally
+   * loaded workers take turns, see ServerThread::set_conn_placement
+   */
+  int NextWorker() const;
+  // Runs every rebalance_interval on the dispatch thread
+  void Rebalance();
+
   void HandleConnEvent(PinkFiredEvent *pfe) override {
     UNUSED(pfe);
   }
 
+  /*
+   * In reuse_port mode the workers listen instead of the dispatch thread
+   */
+  int InitHandle() override;
+  int ListenOnWorkers();
+
   // No copying allowed
   DispatchThread(const DispatchThread&);
   void operator=(const DispatchThread&);
@@ -9,6 +9,8 @@
 
 #include "pink/src/pink_epoll.h"
 #include "pink/src/pink_item.h"
+#include "pink/src/pink_util.h"
+#include "pink/src/thread_placement.h"
 #include "pink/include/pink_conn.h"
 #include "slash/include/xdebug.h"
 
@@ -56,7 +58,10 @@ std::vector<ServerThread::ConnInfo> HolyThread::conns_info() const {
     result.push_back({
                       conn.first,
                       conn.second->ip_port(),
-                      conn.second->last_interaction()
+                      conn.second->last_interaction(),
+                      conn.second->incoming_cpu(),
+                      0,
+                      0
                      });
   }
   return result;
@@ -71,6 +76,7 @@ std::shared_ptr<PinkConn> HolyThread::MoveConnOut(int fd) {
     conn = iter->second;
     pink_epoll_->PinkDelEvent(fd, 0);
     conns_.erase(iter);
+    conn->CancelTimers();
   }
   return conn;
 }
@@ -90,6 +96,7 @@ int HolyThread::StartThread() {
   if (ret != 0) {
     return ret;
   }
+  set_cpu_affinity(PlanThreadCpus(thread_placement(), 1)[0]);
   return ServerThread::StartThread();
 }
 
@@ -112,10 +119,81 @@ void HolyThread::HandleNewConn(const int connfd, const std::string &ip_port) {
     slash::WriteLock l(&rwlock_);
     conns_[connfd] = tc;
   }
+  ArmKeepaliveTimer(connfd, tc);
 
   pink_epoll_->PinkAddEvent(connfd, PinkEpoll::kRead);
 }
 
+void HolyThread::ArmKeepaliveTimer(int fd, std::shared_ptr<PinkConn> conn) {
+  int keepalive_timeout = keepalive_timeout_;
+  if (cron_interval_ <= 0 || keepalive_timeout <= 0) {
+    return;
+  }
+  struct timeval now;
+  gettimeofday(&now, NULL);
+  int timeout_ms = KeepaliveRemainingMs(conn->last_interaction(),
+                                        keepalive_timeout, now);
+  std::weak_ptr<PinkConn> weak_conn = conn;
+  pink_epoll_->AddTimer(timeout_ms, [this, fd, weak_conn]() {
+    KeepaliveTimer(fd, weak_conn);
+  });
+}
+
+void HolyThread::KeepaliveTimer(int fd, std::weak_ptr<PinkConn> weak_conn) {
+  std::shared_ptr<PinkConn> conn = weak_conn.lock();
+  if (conn == nullptr) {
+    return;
+  }
+  struct timeval now;
+  gettimeofday(&now, NULL);
+  {
+    slash::WriteLock l(&rwlock_);
+    auto iter = conns_.find(fd);
+    if (iter == conns_.end() || iter->second != conn) {
+      return;
+    }
+    // Check keepalive timeout connection
+    if (keepalive_timeout_ <= 0 ||
+        now.tv_sec - conn->last_interaction().tv_sec <= keepalive_timeout_) {
+      // Used since the timer was armed
+      ArmKeepaliveTimer(fd, conn);
+      return;
+    }
+    conns_.erase(iter);
+  }
+  CloseFd(conn);
+  handle_->FdTimeoutHandle(conn->fd(), conn->ip_port());
+}
+
+void HolyThread::MaybeArmResizeTimer(int fd, std::shared_ptr<PinkConn> conn) {
+  if (cron_interval_ <= 0 || conn->resize_timer_armed() ||
+      !conn->HasLargeBuffer()) {
+    return;
+  }
+  conn->set_resize_timer_armed(true);
+  std::weak_ptr<PinkConn> weak_conn = conn;
+  pink_epoll_->AddTimer(cron_interval_, [this, fd, weak_conn]() {
+    ResizeTimer(fd, weak_conn);
+  });
+}
+
+void HolyThread::ResizeTimer(int fd, std::weak_ptr<PinkConn> weak_conn) {
+  std::shared_ptr<PinkConn> conn = weak_conn.lock();
+  if (conn == nullptr) {
+    return;
+  }
+  {
+    slash::ReadLock l(&rwlock_);
+    auto iter = conns_.find(fd);
+    if (iter == conns_.end() || iter->second != conn) {
+      return;
+    }
+  }
+  conn->set_resize_timer_armed(false);
+  conn->TryResizeBuffer();
+  MaybeArmResizeTimer(fd, conn);
+}
+
 void HolyThread::HandleConnEvent(PinkFiredEvent *pfe) {
   if (pfe == nullptr) {
     return;
@@ -137,6 +215,7 @@ void HolyThread::HandleConnEvent(PinkFiredEvent *pfe) {
       struct timeval now;
       gettimeofday(&now, nullptr);
       in_conn->set_last_interaction(now);
+      MaybeArmResizeTimer(pfe->fd, in_conn);
       if (read_status == kReadAll) {
       // do nothing still watch EPOLLIN
       } else if (read_status == kReadHalf) {
@@ -145,6 +224,9 @@ void HolyThread::HandleConnEvent(PinkFiredEvent *pfe) {
         // kReadError kReadClose kFullError kParseError kDealError
         should_close = 1;
       }
+      if (!should_close && immediate_write() && in_conn->is_reply()) {
+        should_close = TryImmediateWrite(in_conn, pfe->fd);
+      }
     }
     if ((pfe->mask & PinkEpoll::kWrite) && in_conn->is_reply()) {
       WriteStatus write_status = in_conn->SendReply();
@@ -163,9 +245,15 @@ void HolyThread::HandleConnEvent(PinkFiredEvent *pfe) {
       struct timeval now;
       gettimeofday(&now, nullptr);
       in_conn->set_last_interaction(now);
+      MaybeArmResizeTimer(pfe->fd, in_conn);
       if (getRes != kReadAll && getRes != kReadHalf) {
         // kReadError kReadClose kFullError kParseError kDealError
         should_close = 1;
+      } else if (in_conn->is_reply() && immediate_write()) {
+        should_close = TryImmediateWrite(in_conn, pfe->fd);
+        if (!should_close) {
+          return;
+        }
       } else if (in_conn->is_reply()) {
         pink_epoll_->PinkModEvent(pfe->fd, 0, PinkEpoll::kWrite);
       } else {
@@ -196,16 +284,33 @@ void HolyThread::HandleConnEvent(PinkFiredEvent *pfe) {
   }
 }
 
+/*
+ * Writes the reply without waiting for EPOLLOUT, see set_immediate_write.
+ * Returns 1 if the connection should be closed.
+ */
+int HolyThread::TryImmediateWrite(std::shared_ptr<PinkConn> conn, int fd) {
+  WriteStatus write_status = conn->SendReply();
+  if (write_status == kWriteAll) {
+    conn->set_is_reply(false);
+    return 0;
+  } else if (write_status == kWriteHalf) {
+    // Socket buffer is full, continue on EPOLLOUT
+    pink_epoll_->PinkModEvent(fd, 0, PinkEpoll::kWrite);
+    return 0;
+  }
+  return 1;
+}
+
 void HolyThread::DoCronTask() {
-  struct timeval now;
-  gettimeofday(&now, NULL);
   std::vector<std::shared_ptr<PinkConn>> to_close;
-  std::vector<std::shared_ptr<PinkConn>> to_timeout;
   {
+    slash::MutexLock kl(&killer_mutex_);
+    if (deleting_conn_ipport_.empty()) {
+      return;
+    }
     slash::WriteLock l(&rwlock_);
 
     // Check whether close all connection
-    slash::MutexLock kl(&killer_mutex_);
     if (deleting_conn_ipport_.count(kKillAllConnsTask)) {
       for (auto& conn : conns_) {
         to_close.push_back(conn.second);
@@ -225,32 +330,16 @@ void HolyThread::DoCronTask() {
         iter = conns_.erase(iter);
         continue;
       }
-
-      // Check keepalive timeout connection
-      if (keepalive_timeout_ > 0 &&
-          (now.tv_sec - conn->last_interaction().tv_sec >
-           keepalive_timeout_)) {
-        to_timeout.push_back(conn);
-        iter = conns_.erase(iter);
-        continue;
-      }
-
-      // Maybe resize connection buffer
-      conn->TryResizeBuffer();
-
       ++iter;
     }
   }
   for (const auto & conn : to_close) {
     CloseFd(conn);
   }
-  for (const auto & conn : to_timeout) {
-    CloseFd(conn);
-    handle_->FdTimeoutHandle(conn->fd(), conn->ip_port());
-  }
 }
 
 void HolyThread::CloseFd(std::shared_ptr<PinkConn> conn) {
+  conn->CancelTimers();
   close(conn->fd());
   handle_->FdClosedHandle(conn->fd(), conn->ip_port());
 }
@@ -293,30 +382,24 @@ bool HolyThread::KillConn(const std::string& ip_port) {
 
 void HolyThread::ProcessNotifyEvents(const pink::PinkFiredEvent* pfe) {
   if (pfe->mask & PinkEpoll::kRead) {
-    char bb[2048];
-    int32_t nread = read(pink_epoll_->notify_receive_fd(), bb, 2048);
-    //  log_info("notify_received bytes %d\n", nread);
-    if (nread == 0) {
-      return;
-    } else {
-      for (int32_t idx = 0; idx < nread; ++idx) {
-        pink::PinkItem ti = pink_epoll_->notify_queue_pop();
-        std::string ip_port = ti.ip_port();
-        int fd = ti.fd();
-        if (ti.notify_type() == pink::kNotiWrite) {
-          pink_epoll_->PinkModEvent(ti.fd(), 0, PinkEpoll::kRead | PinkEpoll::kWrite);
-        } else if (ti.notify_type() == pink::kNotiClose) {
-          log_info("receive noti close\n");
-          std::shared_ptr<pink::PinkConn> conn = get_conn(fd);
-          if (conn == nullptr) {
-            continue;
-          }
-          CloseFd(conn);
-          conn = nullptr;
-          {
-            slash::WriteLock l(&rwlock_);
-            conns_.erase(fd);
-          }
+    std::vector<PinkItem> notify_items;
+    pink_epoll_->DrainNotifyQueue(&notify_items);
+    for (const PinkItem& ti : notify_items) {
+      std::string ip_port = ti.ip_port();
+      int fd = ti.fd();
+      if (ti.notify_type() == pink::kNotiWrite) {
+        pink_epoll_->PinkModEvent(ti.fd(), 0, PinkEpoll::kRead | PinkEpoll::kWrite);
+      } else if (ti.notify_type() == pink::kNotiClose) {
+        log_info("receive noti close\n");
+        std::shared_ptr<pink::PinkConn> conn = get_conn(fd);
+        if (conn == nullptr) {
+          continue;
+        }
+        CloseFd(conn);
+        conn = nullptr;
+        {
+          slash::WriteLock l(&rwlock_);
+          conns_.erase(fd);
         }
       }
     }
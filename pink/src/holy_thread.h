@@ -68,12 +68,23 @@ class HolyThread: public ServerThread {
   bool async_;
 
   void DoCronTask() override;
+  /*
+   * Timers of each conn, like WorkerThread's: the keepalive timer fires
+   * when the conn would time out, the resize timer runs every
+   * cron_interval only while the conn has a large buffer
+   */
+  void ArmKeepaliveTimer(int fd, std::shared_ptr<PinkConn> conn);
+  void KeepaliveTimer(int fd, std::weak_ptr<PinkConn> weak_conn);
+  // After reading into the conn
+  void MaybeArmResizeTimer(int fd, std::shared_ptr<PinkConn> conn);
+  void ResizeTimer(int fd, std::weak_ptr<PinkConn> weak_conn);
 
   slash::Mutex killer_mutex_;
   std::set<std::string> deleting_conn_ipport_;
 
   void HandleNewConn(int connfd, const std::string &ip_port) override;
   void HandleConnEvent(PinkFiredEvent *pfe) override;
+  int TryImmediateWrite(std::shared_ptr<PinkConn> conn, int fd);
 
   void CloseFd(std::shared_ptr<PinkConn> conn);
   void Cleanup();
@@ -0,0 +1,32 @@
+// Copyright (c) 2015-present, Qihoo, Inc.  All rights reserved.
+// This source code is licensed under the BSD-style license found in the
+// LICENSE file in the root directory of this source tree. An additional grant
+// of patent rights can be found in the PATENTS file in the same directory.
+
+#ifndef PINK_SRC_NEWLINE_SCANNER_H_
+#define PINK_SRC_NEWLINE_SCANNER_H_
+
+namespace pink {
+
+/*
+ * Scanners for the '\n' that ends a RESP header or an inline command,
+ * returning end when there is none. RedisParser uses the widest one the
+ * CPU supports, picked once at startup; PINK_RESP_SCAN=scalar|sse2|avx2
+ * overrides it.
+ */
+typedef const char* (*NewlineScanner)(const char* p, const char* end);
+
+enum NewlineScannerType {
+  kNewlineScalar = 0,
+  kNewlineSSE2 = 1,
+  kNewlineAVX2 = 2,
+};
+
+// nullptr if the build or the CPU lacks it
+NewlineScanner GetNewlineScanner(NewlineScannerType type);
+
+// Makes RedisParser use scanner, for tests; no parser may be running
+void SetNewlineScanner(NewlineScanner scanner);
+
+}  // namespace pink
+#endif  // PINK_SRC_NEWLINE_SCANNER_H_
@@ -0,0 +1,181 @@
+// Copyright (c) 2015-present, Qihoo, Inc.  All rights reserved.
+// This source code is licensed under the BSD-style license found in the
+// LICENSE file in the root directory of this source tree. An additional grant
+// of patent rights can be found in the PATENTS file in the same directory.
+
+#include "pink/src/output_chain.h"
+
+#include <errno.h>
+#include <sys/uio.h>
+#include <unistd.h>
+
+namespace pink {
+
+// Segments handed to one writev
+static const int kMaxIov = 64;
+// Empty blocks kept for reuse
+static const size_t kMaxPoolSize = 4;
+
+OutputChain::OutputChain()
+    : size_(0) {
+}
+
+std::string* OutputChain::TailBlock(size_t len) {
+  if (segments_.empty()) {
+    return nullptr;
+  }
+  Segment& tail = segments_.back();
+  if (tail.ref != nullptr) {
+    return nullptr;
+  }
+  if (tail.buf.size() + len <= tail.buf.capacity() ||
+      (tail.pos == 0 && tail.buf.size() + len <= kMaxPooledBlock)) {
+    return &tail.buf;
+  }
+  return nullptr;
+}
+
+// Makes *data the new last segment and leaves a pooled block in it
+void OutputChain::PushBlock(std::string* data) {
+  size_ += data->size();
+  segments_.push_back(Segment());
+  segments_.back().buf.swap(*data);
+  segments_.back().pos = 0;
+  if (!pool_.empty()) {
+    data->swap(pool_.back());
+    pool_.pop_back();
+  }
+}
+
+void OutputChain::Append(const char* data, size_t len) {
+  if (len == 0) {
+    return;
+  }
+  std::string* block = TailBlock(len);
+  if (block == nullptr) {
+    std::string buf;
+    if (!pool_.empty()) {
+      buf.swap(pool_.back());
+      pool_.pop_back();
+    }
+    PushBlock(&buf);
+    block = &segments_.back().buf;
+  }
+  block->append(data, len);
+  size_ += len;
+}
+
+void OutputChain::Append(std::string&& data) {
+  if (data.empty()) {
+    return;
+  }
+  std::string* block = nullptr;
+  if (data.size() < kCopyLimit) {
+    block = TailBlock(data.size());
+  }
+  if (block != nullptr) {
+    block->append(data);
+    size_ += data.size();
+    data.clear();
+    return;
+  }
+  PushBlock(&data);
+}
+
+void OutputChain::Append(std::shared_ptr<const std::string> data) {
+  if (data == nullptr || data->empty()) {
+    return;
+  }
+  size_ += data->size();
+  segments_.push_back(Segment());
+  segments_.back().ref = std::move(data);
+  segments_.back().pos = 0;
+}
+
+void OutputChain::PopFront() {
+  Segment& seg = segments_.front();
+  if (seg.ref == nullptr && seg.buf.capacity() <= kMaxPooledBlock &&
+      pool_.size() < kMaxPoolSize) {
+    seg.buf.clear();
+    pool_.push_back(std::string());
+    pool_.back().swap(seg.buf);
+  }
+  segments_.pop_front();
+}
+
+ssize_t OutputChain::WriteTo(int fd) {
+  ssize_t total = 0;
+  while (!segments_.empty()) {
+    struct iovec iov[kMaxIov];
+    int iovcnt = FillIov(iov, kMaxIov);
+    size_t want = 0;
+    for (int i = 0; i < iovcnt; i++) {
+      want += iov[i].iov_len;
+    }
+    ssize_t nwritten = writev(fd, iov, iovcnt);
+    if (nwritten <= 0) {
+      if (total == 0) {
+        return nwritten == 0 ? 0 : -1;
+      }
+      break;
+    }
+    total += nwritten;
+    Consume(nwritten);
+    if (static_cast<size_t>(nwritten) < want) {
+      // The socket buffer is full
+      break;
+    }
+  }
+  return total;
+}
+
+int OutputChain::FillIov(struct iovec* iov, int max_iov) const {
+  int iovcnt = 0;
+  for (const Segment& seg : segments_) {
+    if (iovcnt == max_iov) {
+      break;
+    }
+    const std::string& data = seg.data();
+    iov[iovcnt].iov_base = const_cast<char*>(data.data()) + seg.pos;
+    iov[iovcnt].iov_len = data.size() - seg.pos;
+    iovcnt++;
+  }
+  return iovcnt;
+}
+
+void OutputChain::Consume(size_t len) {
+  size_ -= len;
+  while (len > 0) {
+    Segment& seg = segments_.front();
+    size_t seg_left = seg.data().size() - seg.pos;
+    if (len < seg_left) {
+      seg.pos += len;
+      break;
+    }
+    len -= seg_left;
+    PopFront();
+  }
+}
+
+void OutputChain::MoveTo(OutputChain* out) {
+  for (Segment& seg : segments_) {
+    out->segments_.push_back(std::move(seg));
+  }
+  out->size_ += size_;
+  segments_.clear();
+  size_ = 0;
+  // The blocks come back once out has written them
+  while (!out->pool_.empty() && pool_.size() < kMaxPoolSize) {
+    pool_.push_back(std::move(out->pool_.back()));
+    out->pool_.pop_back();
+  }
+}
+
+void OutputChain::Clear() {
+  while (!segments_.empty()) {
+    PopFront();
+  }
+  size_ = 0;
+}
+
+}  // namespace pink
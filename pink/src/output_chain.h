@@ -0,0 +1,114 @@
+// Copyright (c) 2015-present, Qihoo, Inc.  All rights reserved.
+// This source code is licensed under the BSD-style license found in the
+// LICENSE file in the root directory of this source tree. An additional grant
+// of patent rights can be found in the PATENTS file in the same directory.
+
+#ifndef PINK_SRC_OUTPUT_CHAIN_H_
+#define PINK_SRC_OUTPUT_CHAIN_H_
+
+#include <stddef.h>
+#include <sys/types.h>
+#include <sys/uio.h>
+
+#include <deque>
+#include <memory>
+#include <string>
+#include <vector>
+
+namespace pink {
+
+/*
+ * Bytes waiting to be written to a socket, as a list of segments that are
+ * written in order with one writev. A segment either owns its buffer or
+ * references a shared one, so large payloads are queued without copying.
+ * Small appends are copied into the last owned block; fully written blocks
+ * of up to kMaxPooledBlock bytes are kept for reuse.
+ *
+ * Not thread safe, it belongs to one conn.
+ */
+class OutputChain {
+ public:
+  // Appends below this size are copied into the current block
+  static const size_t kCopyLimit = 16384;
+  static const size_t kMaxPooledBlock = 262144;
+
+  OutputChain();
+
+  // Copies data
+  void Append(const char* data, size_t len);
+  void Append(const std::string& data) {
+    Append(data.data(), data.size());
+  }
+  /*
+   * Takes data over. Small data is copied if the last block has room for
+   * it, else its buffer becomes a segment and data gets an empty pooled
+   * block in exchange, so a caller reusing data keeps some capacity
+   */
+  void Append(std::string&& data);
+  // References *data until it has been written
+  void Append(std::shared_ptr<const std::string> data);
+
+  size_t size() const {
+    return size_;
+  }
+  bool empty() const {
+    return size_ == 0;
+  }
+
+  /*
+   * Writes as much as fd takes. Returns the number of bytes written, or -1
+   * with errno set if nothing could be written
+   */
+  ssize_t WriteTo(int fd);
+
+  /*
+   * For writing elsewhere: FillIov points up to max_iov iovecs at the
+   * first unwritten bytes and returns how many it used, Consume then drops
+   * the len bytes that were written. Appends keep the iovecs valid, except
+   * for the last one, which may point into the block appended to.
+   */
+  int FillIov(struct iovec* iov, int max_iov) const;
+  void Consume(size_t len);
+
+  /*
+   * Moves the unwritten bytes to the end of *out without copying them,
+   * and takes over empty blocks of out in exchange
+   */
+  void MoveTo(OutputChain* out);
+
+  void Clear();
+
+ private:
+  struct Segment {
+    // Owned bytes, unused if ref is set
+    std::string buf;
+    std::shared_ptr<const std::string> ref;
+    // Bytes already written
+    size_t pos;
+
+    const std::string& data() const {
+      return ref != nullptr ? *ref : buf;
+    }
+  };
+
+  std::deque<Segment> segments_;
+  size_t size_;
+  // Empty blocks with their capacity kept
+  std::vector<std::string> pool_;
+
+  /*
+   * The last segment if len more bytes may be copied into it: it is owned
+   * and has room, or is still small and no write has started on it.
+   * nullptr otherwise
+   */
+  std::string* TailBlock(size_t len);
+  void PushBlock(std::string* data);
+  void PopFront();
+
+  // No copying allowed
+  OutputChain(const OutputChain&);
+  void operator=(const OutputChain&);
+};
+
+}  // namespace pink
+#endif  // PINK_SRC_OUTPUT_CHAIN_H_
@@ -0,0 +1,318 @@
+// Copyright (c) 2015-present, Qihoo, Inc.  All rights reserved.
+// This source code is licensed under the BSD-style license found in the
+// LICENSE file in the root directory of this source tree. An additional grant
+// of patent rights can be found in the PATENTS file in the same directory.
+
+#include "pink/src/pattern_index.h"
+
+#include <algorithm>
+
+namespace pink {
+
+namespace {
+
+/*
+ * Whether the class starting at pattern[pos], just after '[', matches c,
+ * the same way stringmatchlen does. *end is set to the position of the
+ * closing ']', or to the last byte of pattern if the class is unterminated.
+ */
+bool ClassMatches(const std::string& pattern, size_t pos, char c,
+                  size_t* end) {
+  const size_t len = pattern.size();
+  bool nott = pos < len && pattern[pos] == '^';
+  if (nott) {
+    pos++;
+  }
+  bool match = false;
+  while (true) {
+    if (pos < len && pattern[pos] == '\\') {
+      pos++;
+      // A trailing '\' compares with the terminating NUL
+      char escaped = pos < len ? pattern[pos] : '\0';
+      if (escaped == c) {
+        match = true;
+      }
+      if (pos >= len) {
+        pos = len - 1;
+        break;
+      }
+    } else if (pos < len && pattern[pos] == ']') {
+      break;
+    } else if (pos >= len) {
+      pos = len - 1;
+      break;
+    } else if (pos + 2 < len && pattern[pos + 1] == '-') {
+      int start = pattern[pos];
+      int stop = pattern[pos + 2];
+      if (start > stop) {
+        std::swap(start, stop);
+      }
+      pos += 2;
+      if (c >= start && c <= stop) {
+        match = true;
+      }
+    } else if (pattern[pos] == c) {
+      match = true;
+    }
+    pos++;
+  }
+  *end = pos;
+  return nott ? !match : match;
+}
+
+}  // namespace
+
+GlobPattern::GlobPattern(const std::string& pattern) {
+  const size_t len = pattern.size();
+  bool in_prefix = true;
+  for (size_t pos = 0; pos < len; pos++) {
+    Token token;
+    token.arg = 0;
+    switch (pattern[pos]) {
+      case '*':
+        while (pos + 1 < len && pattern[pos + 1] == '*') {
+          pos++;
+        }
+        token.type = kStar;
+        break;
+      case '?':
+        token.type = kAnyByte;
+        break;
+      case '[': {
+        std::bitset<256> bytes;
+        size_t end = pos + 1;
+        for (int c = 0; c < 256; c++) {
+          if (ClassMatches(pattern, pos + 1, static_cast<char>(c), &end)) {
+            bytes.set(c);
+          }
+        }
+        pos = end;
+        token.type = kClass;
+        token.arg = static_cast<uint32_t>(classes_.size());
+        classes_.push_back(bytes);
+        break;
+      }
+      case '\\':
+        if (pos + 1 < len) {
+          pos++;
+        }
+        // fall through
+      default:
+        token.type = kByte;
+        token.arg = static_cast<unsigned char>(pattern[pos]);
+        break;
+    }
+    if (in_prefix && token.type == kByte) {
+      prefix_.push_back(static_cast<char>(token.arg));
+      continue;
+    }
+    in_prefix = false;
+    tokens_.push_back(token);
+  }
+}
+
+bool GlobPattern::Match(const char* str, size_t len) const {
+  const size_t n = tokens_.size();
+  size_t t = 0;
+  size_t s = 0;
+  // Where the last '*' is, and where it stopped matching
+  size_t star_t = n;
+  size_t star_s = 0;
+  while (s < len) {
+    if (t < n && tokens_[t].type == kStar) {
+      star_t = t++;
+      star_s = s;
+      continue;
+    }
+    if (t < n) {
+      const Token& token = tokens_[t];
+      unsigned char c = static_cast<unsigned char>(str[s]);
+      bool match = token.type == kAnyByte
+          || (token.type == kByte && token.arg == c)
+          || (token.type == kClass && classes_[token.arg].test(c));
+      if (match) {
+        t++;
+        s++;
+        continue;
+      }
+    }
+    if (star_t == n) {
+      return false;
+    }
+    // Let the last '*' take one more byte
+    t = star_t + 1;
+    s = ++star_s;
+  }
+  while (t < n && tokens_[t].type == kStar) {
+    t++;
+  }
+  return t == n;
+}
+
+PatternIndex::PatternIndex()
+    : size_(0) {
+  nodes_.push_back(Node());
+  nodes_[0].parent = -1;
+  nodes_[0].byte = 0;
+}
+
+PatternIndex::~PatternIndex() {
+  for (size_t i = 0; i < entries_.size(); i++) {
+    delete entries_[i];
+  }
+}
+
+int32_t PatternIndex::FindChild(int32_t node, unsigned char byte) const {
+  const std::vector<std::pair<unsigned char, int32_t> >& children =
+      nodes_[node].children;
+  std::vector<std::pair<unsigned char, int32_t> >::const_iterator iter =
+      std::lower_bound(children.begin(), children.end(),
+                       std::make_pair(byte, static_cast<int32_t>(-1)));
+  if (iter == children.end() || iter->first != byte) {
+    return -1;
+  }
+  return iter->second;
+}
+
+int32_t PatternIndex::AddChild(int32_t node, unsigned char byte) {
+  int32_t child = FindChild(node, byte);
+  if (child != -1) {
+    return child;
+  }
+  if (free_nodes_.empty()) {
+    child = static_cast<int32_t>(nodes_.size());
+    nodes_.push_back(Node());
+  } else {
+    child = free_nodes_.back();
+    free_nodes_.pop_back();
+  }
+  nodes_[child].parent = node;
+  nodes_[child].byte = byte;
+  std::vector<std::pair<unsigned char, int32_t> >& children =
+      nodes_[node].children;
+  children.insert(std::lower_bound(children.begin(), children.end(),
+                                   std::make_pair(byte, child)),
+                  std::make_pair(byte, child));
+  return child;
+}
+
+int32_t PatternIndex::FindNode(const std::string& prefix) const {
+  int32_t node = 0;
+  for (size_t i = 0; i < prefix.size() && node != -1; i++) {
+    node = FindChild(node, static_cast<unsigned char>(prefix[i]));
+  }
+  return node;
+}
+
+void PatternIndex::Prune(int32_t node) {
+  while (node != 0) {
+    Node& n = nodes_[node];
+    if (!n.children.empty() || !n.literals.empty()
+        || !n.prefix_stars.empty() || !n.globs.empty()) {
+      return;
+    }
+    std::vector<std::pair<unsigned char, int32_t> >& siblings =
+        nodes_[n.parent].children;
+    siblings.erase(std::lower_bound(siblings.begin(), siblings.end(),
+                                    std::make_pair(n.byte, node)));
+    std::vector<std::pair<unsigned char, int32_t> >().swap(n.children);
+    free_nodes_.push_back(node);
+    node = n.parent;
+  }
+}
+
+bool PatternIndex::Add(const std::string& pattern, void* data) {
+  Entry* entry = new Entry(pattern, data);
+  const std::string& prefix = entry->glob.prefix();
+  int32_t node = 0;
+  for (size_t i = 0; i < prefix.size(); i++) {
+    node = AddChild(node, static_cast<unsigned char>(prefix[i]));
+  }
+  std::vector<int32_t>* list = &nodes_[node].globs;
+  if (entry->glob.literal()) {
+    list = &nodes_[node].literals;
+  } else if (entry->glob.prefix_star()) {
+    list = &nodes_[node].prefix_stars;
+  }
+  for (size_t i = 0; i < list->size(); i++) {
+    if (entries_[(*list)[i]]->pattern == pattern) {
+      delete entry;
+      return false;
+    }
+  }
+
+  int32_t index;
+  if (free_entries_.empty()) {
+    index = static_cast<int32_t>(entries_.size());
+    entries_.push_back(entry);
+  } else {
+    index = free_entries_.back();
+    free_entries_.pop_back();
+    entries_[index] = entry;
+  }
+  list->push_back(index);
+  size_++;
+  return true;
+}
+
+bool PatternIndex::Remove(const std::string& pattern) {
+  GlobPattern glob(pattern);
+  int32_t node = FindNode(glob.prefix());
+  if (node == -1) {
+    return false;
+  }
+  std::vector<int32_t>* list = &nodes_[node].globs;
+  if (glob.literal()) {
+    list = &nodes_[node].literals;
+  } else if (glob.prefix_star()) {
+    list = &nodes_[node].prefix_stars;
+  }
+  for (size_t i = 0; i < list->size(); i++) {
+    int32_t index = (*list)[i];
+    if (entries_[index]->pattern == pattern) {
+      (*list)[i] = list->back();
+      list->pop_back();
+      delete entries_[index];
+      entries_[index] = nullptr;
+      free_entries_.push_back(index);
+      size_--;
+      Prune(node);
+      return true;
+    }
+  }
+  return false;
+}
+
+size_t PatternIndex::Match(const std::string& channel,
+                           std::vector<void*>* matches) const {
+  size_t evaluated = 0;
+  const char* str = channel.data();
+  const size_t len = channel.size();
+  int32_t node = 0;
+  size_t depth = 0;
+  while (node != -1) {
+    const Node& n = nodes_[node];
+    for (size_t i = 0; i < n.prefix_stars.size(); i++) {
+      matches->push_back(entries_[n.prefix_stars[i]]->data);
+    }
+    if (depth == len) {
+      for (size_t i = 0; i < n.literals.size(); i++) {
+        matches->push_back(entries_[n.literals[i]]->data);
+      }
+    }
+    for (size_t i = 0; i < n.globs.size(); i++) {
+      const Entry* entry = entries_[n.globs[i]];
+      evaluated++;
+      if (entry->glob.Match(str + depth, len - depth)) {
+        matches->push_back(entry->data);
+      }
+    }
+    if (depth == len) {
+      break;
+    }
+    node = FindChild(node, static_cast<unsigned char>(str[depth++]));
+  }
+  return evaluated;
+}
+
+}  // namespace pink
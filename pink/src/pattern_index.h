@@ -0,0 +1,129 @@
+// Copyright (c) 2015-present, Qihoo, Inc.  All rights reserved.
+// This source code is licensed under the BSD-style license found in the
+// LICENSE file in the root directory of this source tree. An additional grant
+// of patent rights can be found in the PATENTS file in the same directory.
+
+#ifndef PINK_SRC_PATTERN_INDEX_H_
+#define PINK_SRC_PATTERN_INDEX_H_
+
+#include <stddef.h>
+#include <stdint.h>
+
+#include <bitset>
+#include <string>
+#include <vector>
+
+namespace pink {
+
+/*
+ * A glob pattern, as understood by slash::stringmatchlen without nocase,
+ * compiled once: the literal prefix, and the rest as a list of tokens that
+ * match one byte each or, for '*', any run of bytes. Character classes
+ * become a table of the bytes they match.
+ *
+ * The empty string is only matched by patterns of nothing but '*', where
+ * stringmatchlen would read past its end for some.
+ */
+class GlobPattern {
+ public:
+  explicit GlobPattern(const std::string& pattern);
+
+  const std::string& prefix() const {
+    return prefix_;
+  }
+  // Nothing but the prefix, or the prefix followed by '*'
+  bool literal() const {
+    return tokens_.empty();
+  }
+  bool prefix_star() const {
+    return tokens_.size() == 1 && tokens_[0].type == kStar;
+  }
+
+  // Whether str, which starts with the prefix, matches the whole pattern
+  bool Match(const char* str, size_t len) const;
+
+ private:
+  enum TokenType {
+    kByte,
+    kAnyByte,
+    kClass,
+    kStar,
+  };
+  struct Token {
+    TokenType type;
+    // The byte for kByte, the index into classes_ for kClass
+    uint32_t arg;
+  };
+
+  std::string prefix_;
+  std::vector<Token> tokens_;
+  std::vector<std::bitset<256> > classes_;
+};
+
+/*
+ * The patterns of PSUBSCRIBE by their literal prefix, in a trie, so a
+ * channel is only matched against the patterns whose prefix it starts
+ * with. Patterns that are a literal or a prefix followed by '*' need no
+ * matching at all. Each pattern carries data for the caller.
+ *
+ * Not thread safe.
+ */
+class PatternIndex {
+ public:
+  PatternIndex();
+  ~PatternIndex();
+
+  // False if pattern is already in the index
+  bool Add(const std::string& pattern, void* data);
+  // False if pattern is not in the index
+  bool Remove(const std::string& pattern);
+
+  /*
+   * Appends the data of the patterns that match channel, and returns the
+   * number of compiled patterns that had to be run to find them
+   */
+  size_t Match(const std::string& channel, std::vector<void*>* matches) const;
+
+  size_t size() const {
+    return size_;
+  }
+
+ private:
+  struct Entry {
+    std::string pattern;
+    GlobPattern glob;
+    void* data;
+    Entry(const std::string& _pattern, void* _data)
+        : pattern(_pattern), glob(_pattern), data(_data) {}
+  };
+  struct Node {
+    int32_t parent;
+    unsigned char byte;
+    // By byte
+    std::vector<std::pair<unsigned char, int32_t> > children;
+    // Patterns whose prefix ends here, by Entry index
+    std::vector<int32_t> literals;
+    std::vector<int32_t> prefix_stars;
+    std::vector<int32_t> globs;
+  };
+
+  int32_t FindChild(int32_t node, unsigned char byte) const;
+  int32_t AddChild(int32_t node, unsigned char byte);
+  // The node of prefix, -1 if there is none
+  int32_t FindNode(const std::string& prefix) const;
+  // Frees node and its ancestors while they are empty
+  void Prune(int32_t node);
+
+  std::vector<Node> nodes_;
+  std::vector<int32_t> free_nodes_;
+  std::vector<Entry*> entries_;
+  std::vector<int32_t> free_entries_;
+  size_t size_;
+
+  // No copying allowed
+  PatternIndex(const PatternIndex&);
+  void operator=(const PatternIndex&);
+};
+
+}  // namespace pink
+#endif  // PINK_SRC_PATTERN_INDEX_H_
@@ -199,6 +199,10 @@ void PbConn::TryResizeBuffer() {
   }
 }
 
+bool PbConn::HasLargeBuffer() {
+  return rbuf_len_ > PB_IOBUF_LEN;
+}
+
 void PbConn::NotifyWrite() {
   pink::PinkItem ti(fd(), ip_port(), pink::kNotiWrite);
   pink_epoll()->Register(ti, true);
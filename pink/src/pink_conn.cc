@@ -4,6 +4,7 @@
 // of patent rights can be found in the PATENTS file in the same directory.
 
 #include <stdio.h>
+#include <sys/socket.h>
 #include <unistd.h>
 
 #include "slash/include/xdebug.h"
@@ -21,11 +22,15 @@ PinkConn::PinkConn(const int fd,
       ip_port_(ip_port),
       is_reply_(false),
       close_(false),
+      resize_timer_armed_(false),
+      conn_class_(kNormalConnClass),
+      output_soft_since_ms_(0),
 #ifdef __ENABLE_SSL
       ssl_(nullptr),
 #endif
       thread_(thread),
-      pink_epoll_(pink_epoll) {
+      pink_epoll_(pink_epoll),
+      timer_epoch_(0) {
   gettimeofday(&last_interaction_, nullptr);
 }
 
@@ -36,6 +41,33 @@ PinkConn::~PinkConn() {
 #endif
 }
 
+uint64_t PinkConn::AddTimer(int timeout_ms,
+                            const std::function<void()>& cb) {
+  if (pink_epoll_ == nullptr) {
+    return 0;
+  }
+  std::weak_ptr<PinkConn> weak = shared_from_this();
+  uint64_t epoch = timer_epoch_.load(std::memory_order_relaxed);
+  return pink_epoll_->AddTimer(timeout_ms, [weak, epoch, cb]() {
+    std::shared_ptr<PinkConn> conn = weak.lock();
+    if (conn != nullptr &&
+        conn->timer_epoch_.load(std::memory_order_relaxed) == epoch) {
+      cb();
+    }
+  });
+}
+
+bool PinkConn::CancelTimer(uint64_t id) {
+  if (pink_epoll_ == nullptr || id == 0) {
+    return false;
+  }
+  return pink_epoll_->CancelTimer(id);
+}
+
+void PinkConn::CancelTimers() {
+  timer_epoch_.fetch_add(1, std::memory_order_relaxed);
+}
+
 bool PinkConn::SetNonblock() {
   flags_ = Setnonblocking(fd());
   if (flags_ == -1) {
@@ -44,6 +76,35 @@ bool PinkConn::SetNonblock() {
   return true;
 }
 
+int PinkConn::incoming_cpu() const {
+#ifdef SO_INCOMING_CPU
+  int cpu = -1;
+  socklen_t len = sizeof(cpu);
+  if (getsockopt(fd(), SOL_SOCKET, SO_INCOMING_CPU, &cpu, &len) == 0) {
+    return cpu;
+  }
+#endif
+  return -1;
+}
+
+bool PinkConn::OutputLimitReached(size_t output_bytes,
+                                  const OutputBufferLimit& limit,
+                                  uint64_t now_ms) {
+  if (limit.hard_bytes > 0 && output_bytes >= limit.hard_bytes) {
+    return true;
+  }
+  if (limit.soft_bytes == 0 || output_bytes < limit.soft_bytes) {
+    output_soft_since_ms_ = 0;
+    return false;
+  }
+  if (output_soft_since_ms_ == 0) {
+    output_soft_since_ms_ = now_ms;
+    return false;
+  }
+  return now_ms - output_soft_since_ms_ >=
+    static_cast<uint64_t>(limit.soft_seconds) * 1000;
+}
+
 #ifdef __ENABLE_SSL
 bool PinkConn::CreateSSL(SSL_CTX* ssl_ctx) {
   ssl_ = SSL_new(ssl_ctx);
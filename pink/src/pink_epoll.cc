@@ -8,8 +8,12 @@
 #ifdef __APPLE__
 #else
 #include <linux/version.h>
+#include <sys/eventfd.h>
+#include <sys/timerfd.h>
 #endif
 #include <fcntl.h>
+#include <time.h>
+#include <unistd.h>
 
 #include "pink/include/pink_define.h"
 #include "slash/include/xdebug.h"
@@ -17,8 +21,44 @@
 namespace pink {
 
 static const int kPinkMaxClients = 10240;
+/*
+ * Ring size bounds, forced items beyond the ring go to the overflow list
+ */
+static const size_t kNotifyRingMinSize = 256;
+static const size_t kNotifyRingMaxSize = 65536;
+
+static uint64_t MonotonicMs() {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return static_cast<uint64_t>(ts.tv_sec) * 1000 + ts.tv_nsec / 1000000;
+}
+
+static size_t NotifyRingSize(int queue_limit) {
+  size_t want = queue_limit > 0 ? static_cast<size_t>(queue_limit) : 0;
+  size_t size = kNotifyRingMinSize;
+  while (size < want && size < kNotifyRingMaxSize) {
+    size <<= 1;
+  }
+  return size;
+}
+
+PinkEpoll::PinkEpoll(int queue_limit)
+    : last_poll_ns_(0),
+      queue_limit_(queue_limit),
+      notify_ring_(NotifyRingSize(queue_limit)),
+      notify_ring_mask_(notify_ring_.size() - 1),
+      notify_tail_(0),
+      notify_head_(0),
+      notify_queue_size_(0),
+      notify_overflow_size_(0),
+      notify_wakeup_pending_(false),
+      timers_(MonotonicMs()),
+      timer_armed_ms_(UINT64_MAX),
+      timer_fd_(-1) {
+  for (size_t i = 0; i < notify_ring_.size(); i++) {
+    notify_ring_[i].seq.store(i, std::memory_order_relaxed);
+  }
 
-PinkEpoll::PinkEpoll(int queue_limit) : queue_limit_(queue_limit) {
 #ifdef __APPLE__
   epfd_ = ::kqueue();
 #else
@@ -43,6 +83,7 @@ PinkEpoll::PinkEpoll(int queue_limit) : queue_limit_(queue_limit) {
   firedevent_ = reinterpret_cast<PinkFiredEvent*>(malloc(
       sizeof(PinkFiredEvent) * kPinkMaxClients));
 
+#ifdef __APPLE__
   int fds[2];
   if (pipe(fds)) {
     exit(-1);
@@ -52,31 +93,67 @@ PinkEpoll::PinkEpoll(int queue_limit) : queue_limit_(queue_limit) {
 
   fcntl(notify_receive_fd_, F_SETFD, fcntl(notify_receive_fd_, F_GETFD) | FD_CLOEXEC);
   fcntl(notify_send_fd_, F_SETFD, fcntl(notify_send_fd_, F_GETFD) | FD_CLOEXEC);
+  fcntl(notify_receive_fd_, F_SETFL, fcntl(notify_receive_fd_, F_GETFL) | O_NONBLOCK);
+  fcntl(notify_send_fd_, F_SETFL, fcntl(notify_send_fd_, F_GETFL) | O_NONBLOCK);
+#else
+  notify_receive_fd_ = eventfd(0, EFD_CLOEXEC | EFD_NONBLOCK);
+  if (notify_receive_fd_ < 0) {
+    log_err("eventfd create fail");
+    exit(-1);
+  }
+  notify_send_fd_ = notify_receive_fd_;
+#endif
 
   PinkAddEvent(notify_receive_fd_, kRead);
 }
 
+void PinkEpoll::LocalizeEventBuffers() {
+  // Pages are placed on the node of the thread touching them first
+#ifdef __APPLE__
+  std::vector<struct kevent>(kPinkMaxClients).swap(events_);
+#else
+  std::vector<struct epoll_event>(kPinkMaxClients).swap(events_);
+#endif
+  free(firedevent_);
+  firedevent_ = reinterpret_cast<PinkFiredEvent*>(calloc(
+      kPinkMaxClients, sizeof(PinkFiredEvent)));
+}
+
 PinkEpoll::~PinkEpoll() {
   free(firedevent_);
   close(epfd_);
+  close(notify_receive_fd_);
+  if (notify_send_fd_ != notify_receive_fd_) {
+    close(notify_send_fd_);
+  }
+  if (timer_fd_ >= 0) {
+    close(timer_fd_);
+  }
 }
 
-int PinkEpoll::PinkAddEvent(const int fd, const int mask) {
+#ifndef __APPLE__
+static inline uint64_t EpollData(int fd, uint32_t tag) {
+  return (static_cast<uint64_t>(tag) << 32) | static_cast<uint32_t>(fd);
+}
+#endif
+
+int PinkEpoll::PinkAddEvent(const int fd, const int mask, const uint32_t tag) {
 #ifdef __APPLE__
   int cnt = 0;
   struct kevent change[2];
+  void* udata = reinterpret_cast<void*>(static_cast<uintptr_t>(tag));
   if (mask & kRead) {
-    EV_SET(change + cnt, fd, EVFILT_READ, EV_ADD, 0, 0, nullptr);
+    EV_SET(change + cnt, fd, EVFILT_READ, EV_ADD, 0, 0, udata);
     ++cnt;
   }
   if (mask & kWrite) {
-    EV_SET(change + cnt, fd, EVFILT_WRITE, EV_ADD, 0, 0, nullptr);
+    EV_SET(change + cnt, fd, EVFILT_WRITE, EV_ADD, 0, 0, udata);
     ++cnt;
   }
   return kevent(epfd_, change, cnt, nullptr, 0, nullptr);
 #else
   struct epoll_event ee;
-  ee.data.fd = fd;
+  ee.data.u64 = EpollData(fd, tag);
   if (mask & kRead) {
     ee.events |= EPOLLIN;
   }
@@ -88,16 +165,17 @@ int PinkEpoll::PinkAddEvent(const int fd, const int mask) {
 #endif
 }
 
-int PinkEpoll::PinkModEvent(const int fd, const int old_mask, const int mask) {
+int PinkEpoll::PinkModEvent(const int fd, const int old_mask, const int mask,
+                            const uint32_t tag) {
 #ifdef __APPLE__
   int ret = PinkDelEvent(fd, kRead | kWrite);
   if (mask == 0) {
     return ret;
   }
-  return PinkAddEvent(fd, mask);
+  return PinkAddEvent(fd, mask, tag);
 #else
   struct epoll_event ee;
-  ee.data.fd = fd;
+  ee.data.u64 = EpollData(fd, tag);
   ee.events = 0;
   if ((old_mask | mask) & kRead) {
     ee.events |= EPOLLIN;
@@ -136,29 +214,107 @@ int PinkEpoll::PinkDelEvent(const int fd, [[maybe_unused]] int mask) {
 #endif
 }
 
+bool PinkEpoll::RingPush(const PinkItem& it) {
+  uint64_t pos = notify_tail_.load(std::memory_order_relaxed);
+  NotifySlot* slot;
+  while (true) {
+    slot = &notify_ring_[pos & notify_ring_mask_];
+    uint64_t seq = slot->seq.load(std::memory_order_acquire);
+    int64_t diff = static_cast<int64_t>(seq - pos);
+    if (diff == 0) {
+      if (notify_tail_.compare_exchange_weak(pos, pos + 1,
+                                             std::memory_order_relaxed)) {
+        break;
+      }
+    } else if (diff < 0) {
+      // The consumer has not taken the item one lap ago yet
+      return false;
+    } else {
+      pos = notify_tail_.load(std::memory_order_relaxed);
+    }
+  }
+  slot->item = it;
+  slot->seq.store(pos + 1, std::memory_order_release);
+  return true;
+}
+
+bool PinkEpoll::RingPop(PinkItem* it) {
+  NotifySlot* slot = &notify_ring_[notify_head_ & notify_ring_mask_];
+  if (slot->seq.load(std::memory_order_acquire) != notify_head_ + 1) {
+    // Empty, or the producer of the next item has not published it yet
+    return false;
+  }
+  *it = std::move(slot->item);
+  slot->seq.store(notify_head_ + notify_ring_.size(), std::memory_order_release);
+  notify_head_++;
+  return true;
+}
+
 bool PinkEpoll::Register(const PinkItem& it, bool force) {
-  bool success = false;
-  notify_queue_protector_.Lock();
-  if (force ||
-      queue_limit_ == kUnlimitedQueue ||
-      notify_queue_.size() < static_cast<size_t>(queue_limit_)) {
-    notify_queue_.push(it);
-    success = true;
-  }
-  notify_queue_protector_.Unlock();
-  if (success) {
+  size_t queued = notify_queue_size_.fetch_add(1, std::memory_order_relaxed);
+  if (!force &&
+      queue_limit_ != kUnlimitedQueue &&
+      queued >= static_cast<size_t>(queue_limit_)) {
+    notify_queue_size_.fetch_sub(1, std::memory_order_relaxed);
+    return false;
+  }
+
+  if (notify_overflow_size_.load(std::memory_order_acquire) != 0 ||
+      !RingPush(it)) {
+    slash::MutexLock l(&notify_overflow_protector_);
+    notify_overflow_.push_back(it);
+    notify_overflow_size_.store(notify_overflow_.size(),
+                                std::memory_order_release);
+  }
+
+  if (!notify_wakeup_pending_.exchange(true, std::memory_order_seq_cst)) {
+#ifdef __APPLE__
     write(notify_send_fd_, "", 1);
+#else
+    uint64_t one = 1;
+    write(notify_send_fd_, &one, sizeof(one));
+#endif
   }
-  return success;
+  return true;
 }
 
-PinkItem PinkEpoll::notify_queue_pop() {
+size_t PinkEpoll::DrainNotifyQueue(std::vector<PinkItem>* items) {
+  char buf[64];
+  while (read(notify_receive_fd_, buf, sizeof(buf)) == sizeof(buf)) {
+  }
+  /*
+   * Producers that find the flag set skip the wakeup, so clear it before
+   * looking at the queue: an item pushed from now on is either seen below
+   * or followed by a new wakeup
+   */
+  notify_wakeup_pending_.store(false, std::memory_order_seq_cst);
+  std::atomic_thread_fence(std::memory_order_seq_cst);
+
+  size_t start = items->size();
   PinkItem it;
-  notify_queue_protector_.Lock();
-  it = notify_queue_.front();
-  notify_queue_.pop();
-  notify_queue_protector_.Unlock();
-  return it;
+  while (RingPop(&it)) {
+    items->push_back(std::move(it));
+  }
+  /*
+   * Items in the overflow list were pushed after everything in the ring, so
+   * they wait while a producer is still publishing into the ring; that
+   * producer writes a new wakeup once it is done
+   */
+  if (notify_overflow_size_.load(std::memory_order_acquire) != 0 &&
+      notify_tail_.load(std::memory_order_acquire) == notify_head_) {
+    std::deque<PinkItem> overflow;
+    {
+      slash::MutexLock l(&notify_overflow_protector_);
+      overflow.swap(notify_overflow_);
+      notify_overflow_size_.store(0, std::memory_order_release);
+    }
+    for (auto& oit : overflow) {
+      items->push_back(std::move(oit));
+    }
+  }
+  size_t drained = items->size() - start;
+  notify_queue_size_.fetch_sub(drained, std::memory_order_relaxed);
+  return drained;
 }
 
 int PinkEpoll::PinkPoll(const int timeout) {
@@ -166,10 +322,19 @@ int PinkEpoll::PinkPoll(const int timeout) {
 #ifdef __APPLE__
   struct timespec* p_timeout = nullptr;
   struct timespec s_timeout;
-  if (timeout >= 0) {
+  int wait_ms = timeout;
+  if (timer_armed_ms_ != UINT64_MAX) {
+    uint64_t now = MonotonicMs();
+    int until = timer_armed_ms_ > now ?
+      static_cast<int>(timer_armed_ms_ - now) : 0;
+    if (wait_ms < 0 || until < wait_ms) {
+      wait_ms = until;
+    }
+  }
+  if (wait_ms >= 0) {
     p_timeout = &s_timeout;
-    s_timeout.tv_sec = timeout / 1000;
-    s_timeout.tv_nsec = timeout % 1000 * 1000000;
+    s_timeout.tv_sec = wait_ms / 1000;
+    s_timeout.tv_nsec = wait_ms % 1000 * 1000000;
   }
   num_events = ::kevent(epfd_, nullptr, 0, &events_[0], PINK_MAX_CLIENTS, p_timeout);
   if (num_events <= 0) {
@@ -178,6 +343,8 @@ int PinkEpoll::PinkPoll(const int timeout) {
   for (int i = 0; i < num_events; i++) {
     PinkFiredEvent& ev = firedevent_[i];
     ev.fd = events_[i].ident;
+    ev.tag = static_cast<uint32_t>(
+        reinterpret_cast<uintptr_t>(events_[i].udata));
     ev.mask = 0;
 
     if (events_[i].filter == EVFILT_READ) {
@@ -195,10 +362,20 @@ int PinkEpoll::PinkPoll(const int timeout) {
 #else
   int retval = epoll_wait(epfd_, events_.data(), PINK_MAX_CLIENTS, timeout);
   if (retval > 0) {
-    num_events = retval;
-    for (int i = 0; i < num_events; i++) {
+    for (int i = 0; i < retval; i++) {
+      int fd = static_cast<int>(events_[i].data.u64 & 0xffffffff);
+      if (fd == timer_fd_) {
+        // Only wakes the poll, the owner calls RunTimers
+        uint64_t expirations;
+        if (read(timer_fd_, &expirations, sizeof(expirations)) < 0) {
+          // Nothing to consume
+        }
+        continue;
+      }
       int mask = 0;
-      firedevent_[i].fd = events_[i].data.fd;
+      firedevent_[num_events].fd = fd;
+      firedevent_[num_events].tag =
+        static_cast<uint32_t>(events_[i].data.u64 >> 32);
 
       if (events_[i].events & EPOLLIN) {
         mask |= kRead;
@@ -212,11 +389,76 @@ int PinkEpoll::PinkPoll(const int timeout) {
       if (events_[i].events & EPOLLHUP) {
         mask |= kError;
       }
-      firedevent_[i].mask = mask;
+      firedevent_[num_events].mask = mask;
+      num_events++;
     }
   }
 #endif
+  if (num_events > 0) {
+    UpdateLastPollTime();
+  }
   return num_events;
 }
 
+uint64_t PinkEpoll::AddTimer(int timeout_ms,
+                             const std::function<void()>& cb) {
+  uint64_t expire = MonotonicMs() + (timeout_ms > 0 ? timeout_ms : 0);
+  uint64_t id = timers_.Add(expire, cb);
+  if (expire < timer_armed_ms_) {
+    ArmTimer();
+  }
+  return id;
+}
+
+bool PinkEpoll::CancelTimer(uint64_t id) {
+  // A wakeup set for a canceled timer just finds nothing to run
+  return timers_.Cancel(id);
+}
+
+void PinkEpoll::RunTimers() {
+  if (timer_armed_ms_ == UINT64_MAX) {
+    return;
+  }
+  uint64_t now = MonotonicMs();
+  if (now < timer_armed_ms_) {
+    return;
+  }
+  timers_.Advance(now);
+  ArmTimer();
+}
+
+void PinkEpoll::ArmTimer() {
+  uint64_t next = timers_.NextWakeup();
+  if (next == timer_armed_ms_) {
+    return;
+  }
+  timer_armed_ms_ = next;
+#ifndef __APPLE__
+  if (timer_fd_ < 0) {
+    if (next == UINT64_MAX) {
+      return;
+    }
+    timer_fd_ = timerfd_create(CLOCK_MONOTONIC, TFD_NONBLOCK | TFD_CLOEXEC);
+    if (timer_fd_ < 0) {
+      log_err("timerfd_create failed: %s", strerror(errno));
+      return;
+    }
+    PinkAddEvent(timer_fd_, kRead);
+  }
+  struct itimerspec its;
+  memset(&its, 0, sizeof(its));
+  if (next != UINT64_MAX) {
+    its.it_value.tv_sec = next / 1000;
+    its.it_value.tv_nsec = (next % 1000) * 1000000;
+  }
+  timerfd_settime(timer_fd_, TFD_TIMER_ABSTIME, &its, nullptr);
+#endif
+}
+
+void PinkEpoll::UpdateLastPollTime() {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  last_poll_ns_ = static_cast<uint64_t>(ts.tv_sec) * 1000000000 + ts.tv_nsec;
+}
+
 }  // namespace pink
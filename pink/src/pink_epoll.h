@@ -5,7 +5,11 @@
 
 #ifndef PINK_SRC_PINK_EPOLL_H_
 #define PINK_SRC_PINK_EPOLL_H_
-#include <queue>
+#include <stdint.h>
+
+#include <atomic>
+#include <deque>
+#include <functional>
 #include <vector>
 #ifdef __APPLE__
 #include <sys/types.h>
@@ -16,6 +20,7 @@
 #endif
 
 #include "pink/src/pink_item.h"
+#include "pink/src/timer_wheel.h"
 #include "slash/include/slash_mutex.h"
 
 namespace pink {
@@ -23,6 +28,8 @@ namespace pink {
 struct PinkFiredEvent {
   int fd;
   int mask;
+  // The tag the fd was added with
+  uint32_t tag;
 };
 
 class PinkEpoll {
@@ -34,25 +41,73 @@ class PinkEpoll {
 
   PinkEpoll(int queue_limit = kUnlimitedQueue);
   ~PinkEpoll();
-  int PinkAddEvent(const int fd, const int mask);
+  /*
+   * tag is handed back in the PinkFiredEvent, so that events for a closed
+   * fd are not mistaken for those of a new fd with the same number
+   */
+  int PinkAddEvent(const int fd, const int mask, const uint32_t tag = 0);
   int PinkDelEvent(const int fd, int mask);
-  int PinkModEvent(const int fd, const int old_mask, const int mask);
+  int PinkModEvent(const int fd, const int old_mask, const int mask,
+                   const uint32_t tag = 0);
 
   int PinkPoll(const int timeout);
 
+  /*
+   * CLOCK_MONOTONIC time in nanoseconds when PinkPoll last returned events,
+   * lets connections measure how long they waited behind other events
+   */
+  uint64_t last_poll_ns() const { return last_poll_ns_; }
+  // For loops that wait somewhere else, e.g. in io_uring_enter
+  void UpdateLastPollTime();
+
+  int epoll_fd() const { return epfd_; }
+
   PinkFiredEvent *firedevent() const { return firedevent_; }
 
+  /*
+   * Allocates the event buffers anew from the calling thread, so that
+   * they sit on the NUMA node of the thread that polls, not of the one
+   * that constructed us. Called by a pinned loop thread before its first
+   * PinkPoll.
+   */
+  void LocalizeEventBuffers();
+
+  /*
+   * On Linux both are the same eventfd, elsewhere the two ends of a pipe
+   */
   int notify_receive_fd() {
     return notify_receive_fd_;
   }
   int notify_send_fd() {
     return notify_send_fd_;
   }
-  PinkItem notify_queue_pop();
 
+  /*
+   * Called by the thread owning this PinkEpoll when notify_receive_fd() is
+   * readable. Consumes the wakeup and appends every queued item to items,
+   * items of the same producer keep their Register order.
+   * Returns the number of items appended.
+   */
+  size_t DrainNotifyQueue(std::vector<PinkItem>* items);
+
+  /*
+   * May be called from any thread. Fails if queue_limit items are already
+   * queued, unless force is set.
+   */
   bool Register(const PinkItem& it, bool force);
   bool Deregister(const PinkItem& it) { return false; }
 
+  /*
+   * Timers of the thread owning this PinkEpoll, only that thread may use
+   * them. It calls RunTimers after handling the events of every poll, the
+   * event loops of pink all do. On Linux a timerfd in the
+   * epoll set wakes the poll when a timer is due, elsewhere PinkPoll
+   * shortens its timeout. AddTimer returns the id for CancelTimer.
+   */
+  uint64_t AddTimer(int timeout_ms, const std::function<void()>& cb);
+  bool CancelTimer(uint64_t id);
+  void RunTimers();
+
  private:
   int epfd_;
 #ifdef __APPLE__
@@ -61,19 +116,54 @@ class PinkEpoll {
   std::vector<struct epoll_event> events_;
 #endif
   PinkFiredEvent *firedevent_;
+  uint64_t last_poll_ns_;
 
   /*
-   * The PbItem queue is the fd queue, receive from dispatch thread
+   * The PinkItem queue is the fd queue, receive from dispatch thread and
+   * from connections handled asynchronously.
+   *
+   * It is a bounded multi producer, single consumer ring: a producer claims
+   * a slot by advancing notify_tail_ and publishes the item by setting the
+   * slot sequence, the consumer takes published slots in order. Items
+   * forced in while the ring is full go to notify_overflow_, and as long as
+   * it is not empty all producers append there, which keeps the order.
    */
+  struct NotifySlot {
+    std::atomic<uint64_t> seq;
+    PinkItem item;
+  };
+  bool RingPush(const PinkItem& it);
+  bool RingPop(PinkItem* it);
+
   int queue_limit_;
-  slash::Mutex notify_queue_protector_;
-  std::queue<PinkItem> notify_queue_;
+  std::vector<NotifySlot> notify_ring_;
+  uint64_t notify_ring_mask_;
+  std::atomic<uint64_t> notify_tail_;
+  uint64_t notify_head_;
+  // Items in the ring and the overflow list, checked against queue_limit_
+  std::atomic<size_t> notify_queue_size_;
+  slash::Mutex notify_overflow_protector_;
+  std::deque<PinkItem> notify_overflow_;
+  std::atomic<size_t> notify_overflow_size_;
+
+  /*
+   * Set by the producer that writes the wakeup and cleared by the consumer
+   * before it drains, so a burst of Register calls costs a single write
+   */
+  std::atomic<bool> notify_wakeup_pending_;
 
   /*
    * These two fd receive the notify from dispatch thread
    */
   int notify_receive_fd_;
   int notify_send_fd_;
+
+  TimerWheel timers_;
+  // CLOCK_MONOTONIC ms the wakeup is set for, UINT64_MAX for none
+  uint64_t timer_armed_ms_;
+  // Created with the first timer, Linux only
+  int timer_fd_;
+  void ArmTimer();
 };
 
 }  // namespace pink
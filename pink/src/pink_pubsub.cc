@@ -5,35 +5,57 @@
 
 #include <vector>
 #include <algorithm>
-#include <sstream>
 
 #include "pink/src/worker_thread.h"
 
 #include "pink/include/pink_conn.h"
 #include "pink/src/pink_item.h"
 #include "pink/src/pink_epoll.h"
+#include "pink/src/pattern_index.h"
 #include "pink/include/pink_pubsub.h"
 
 namespace pink {
 
-static std::string ConstructPublishResp(const std::string& subscribe_channel,
-                           const std::string& publish_channel,
-                           const std::string& msg,
-                           const bool pattern) {
-  std::stringstream resp;
-  std::string common_msg = "message";
-  std::string pattern_msg = "pmessage";
+struct PubSubThread::PublishItem {
+  std::string channel;
+  std::string msg;
+  PublishCallback cb;
+  PublishItem* next;
+};
+
+typedef std::pair<const std::string,
+                  std::vector<std::shared_ptr<PinkConn> > > PatternEntry;
+
+static bool PatternLess(void* a, void* b) {
+  return static_cast<PatternEntry*>(a)->first
+      < static_cast<PatternEntry*>(b)->first;
+}
+
+static void AppendBulk(std::string* resp, const std::string& str) {
+  resp->append("$");
+  resp->append(std::to_string(str.size()));
+  resp->append("\r\n");
+  resp->append(str);
+  resp->append("\r\n");
+}
+
+static std::shared_ptr<const std::string> ConstructPublishResp(
+    const std::string& subscribe_channel,
+    const std::string& publish_channel,
+    const std::string& msg,
+    const bool pattern) {
+  std::shared_ptr<std::string> resp = std::make_shared<std::string>();
+  resp->reserve(subscribe_channel.size() + publish_channel.size() +
+                msg.size() + 64);
   if (pattern) {
-    resp << "*4\r\n" << "$" << pattern_msg.length()       << "\r\n" << pattern_msg       << "\r\n" <<
-                        "$" << subscribe_channel.length() << "\r\n" << subscribe_channel << "\r\n" <<
-                        "$" << publish_channel.length()   << "\r\n" << publish_channel   << "\r\n" <<
-                        "$" << msg.length()               << "\r\n" << msg               << "\r\n";
+    resp->append("*4\r\n$8\r\npmessage\r\n");
+    AppendBulk(resp.get(), subscribe_channel);
   } else {
-    resp << "*3\r\n" << "$" << common_msg.length()        << "\r\n" << common_msg        << "\r\n" <<
-                        "$" << publish_channel.length()   << "\r\n" << publish_channel   << "\r\n" <<
-                        "$" << msg.length()               << "\r\n" << msg               << "\r\n";
+    resp->append("*3\r\n$7\r\nmessage\r\n");
   }
-  return resp.str();
+  AppendBulk(resp.get(), publish_channel);
+  AppendBulk(resp.get(), msg);
+  return resp;
 }
 
 void CloseFd(std::shared_ptr<PinkConn> conn) {
@@ -49,8 +71,13 @@ bool PubSubThread::ConnHandle::IsReady() {
 }
 
 PubSubThread::PubSubThread()
-      : receiver_rsignal_(&receiver_mutex_),
-        receivers_(-1)  {
+      : publish_head_(nullptr),
+        pattern_index_(new PatternIndex()),
+        pattern_publishes_(0),
+        patterns_evaluated_(0),
+        patterns_matched_(0),
+        output_buffer_limit_({32 * 1024 * 1024, 8 * 1024 * 1024, 60}),
+        output_limit_closed_(0) {
   set_thread_name("PubSubThread");
   pink_epoll_ = new PinkEpoll();
   if (pipe(msg_pfd_)) {
@@ -64,7 +91,9 @@ PubSubThread::PubSubThread()
 
 PubSubThread::~PubSubThread() {
   StopThread();
+  DropPublishes();
   delete(pink_epoll_);
+  delete pattern_index_;
 }
 
 void PubSubThread::MoveConnOut(std::shared_ptr<PinkConn> conn) {
@@ -96,6 +125,18 @@ void PubSubThread::UpdateConnReadyState(int fd, const ReadyState& state) {
   it->second->UpdateReadyState(state);
 }
 
+bool PubSubThread::OutputLimitReached(PinkConn* conn) {
+  size_t output_bytes = conn->output_bytes();
+  if (!conn->OutputLimitReached(output_bytes, output_buffer_limit_,
+                                pink_epoll_->last_poll_ns() / 1000000)) {
+    return false;
+  }
+  output_limit_closed_.fetch_add(1, std::memory_order_relaxed);
+  log_info("close subscriber %s, output buffer limit reached with %zu bytes",
+           conn->ip_port().c_str(), output_bytes);
+  return true;
+}
+
 bool PubSubThread::IsReady(int fd) {
   slash::ReadLock l(&rwlock_);
   const auto& it = conns_.find(fd);
@@ -113,6 +154,9 @@ void PubSubThread::RemoveConn(std::shared_ptr<PinkConn> conn) {
               conn_ptr++) {
       if ((*conn_ptr) == conn) {
         conn_ptr = it->second.erase(conn_ptr);
+        if (it->second.empty()) {
+          pattern_index_->Remove(it->first);
+        }
         break;
       }
     }
@@ -134,26 +178,160 @@ void PubSubThread::RemoveConn(std::shared_ptr<PinkConn> conn) {
 }
 
 int PubSubThread::Publish(const std::string& channel, const std::string &msg) {
-  // TODO(LIBA-S): change the Publish Mode to Asynchronous
-  int receivers;
-  pub_mutex_.Lock();
-
-  channel_ = channel;
-  message_ = msg;
-  // Send signal to ThreadMain()
-  write(msg_pfd_[1], "", 1);
-  receiver_mutex_.Lock();
-  while (receivers_ == -1) {
-    receiver_rsignal_.Wait();
-  }
-  receivers = receivers_;
-  receivers_ = -1;
-  receiver_mutex_.Unlock();
-
-  pub_mutex_.Unlock();
+  slash::Mutex mu;
+  slash::CondVar cv(&mu);
+  int receivers = -1;
+  PublishAsync(channel, msg, [&mu, &cv, &receivers](int n) {
+    slash::MutexLock l(&mu);
+    receivers = n;
+    cv.Signal();
+  });
+  slash::MutexLock l(&mu);
+  while (receivers == -1) {
+    cv.Wait();
+  }
   return receivers;
 }
 
+void PubSubThread::PublishAsync(std::string channel, std::string msg,
+                                PublishCallback cb) {
+  if (should_stop()) {
+    if (cb) {
+      cb(0);
+    }
+    return;
+  }
+  PublishItem* item = new PublishItem();
+  item->channel = std::move(channel);
+  item->msg = std::move(msg);
+  item->cb = std::move(cb);
+  item->next = publish_head_.load(std::memory_order_relaxed);
+  while (!publish_head_.compare_exchange_weak(item->next, item,
+                                              std::memory_order_acq_rel,
+                                              std::memory_order_relaxed)) {
+  }
+  if (should_stop()) {
+    /*
+     * The thread may have dropped the publishes already, before this one
+     * was queued. Whoever takes the list first calls back its items.
+     */
+    DropPublishes();
+    return;
+  }
+  if (item->next == nullptr) {
+    // Send signal to ThreadMain()
+    write(msg_pfd_[1], "", 1);
+  }
+}
+
+void PubSubThread::HandlePublishes() {
+  PublishItem* item = publish_head_.exchange(nullptr,
+                                             std::memory_order_acquire);
+  // Oldest first
+  PublishItem* items = nullptr;
+  while (item != nullptr) {
+    PublishItem* next = item->next;
+    item->next = items;
+    items = item;
+    item = next;
+  }
+
+  std::vector<void*> matched;
+  while (items != nullptr) {
+    item = items;
+    items = item->next;
+    int receivers = 0;
+    {
+      slash::MutexLock l(&channel_mutex_);
+      auto it = pubsub_channel_.find(item->channel);
+      if (it != pubsub_channel_.end()) {
+        receivers += Deliver(it->second, it->first, item->channel, item->msg,
+                             false);
+      }
+    }
+    {
+      slash::MutexLock l(&pattern_mutex_);
+      matched.clear();
+      size_t evaluated = pattern_index_->Match(item->channel, &matched);
+      // In pattern order, as subscribers got them from a scan of the map
+      std::sort(matched.begin(), matched.end(), PatternLess);
+      for (void* data : matched) {
+        PatternEntry* entry = static_cast<PatternEntry*>(data);
+        receivers += Deliver(entry->second, entry->first, item->channel,
+                             item->msg, true);
+      }
+      pattern_publishes_.fetch_add(1, std::memory_order_relaxed);
+      patterns_evaluated_.fetch_add(evaluated, std::memory_order_relaxed);
+      patterns_matched_.fetch_add(matched.size(), std::memory_order_relaxed);
+    }
+    if (item->cb) {
+      item->cb(receivers);
+    }
+    delete item;
+  }
+
+  // Write to every subscriber once for the whole batch
+  std::vector<std::shared_ptr<PinkConn> > to_close;
+  for (const auto& conn : publish_conns_) {
+    if (!IsReady(conn->fd())) {
+      continue;
+    }
+    WriteStatus write_status = conn->SendReply();
+    if (write_status == kWriteHalf && OutputLimitReached(conn.get())) {
+      write_status = kWriteError;
+    }
+    if (write_status == kWriteHalf) {
+      pink_epoll_->PinkModEvent(conn->fd(), PinkEpoll::kRead, PinkEpoll::kWrite);
+    } else if (write_status == kWriteError) {
+      to_close.push_back(conn);
+    }
+  }
+  publish_conns_.clear();
+  publish_conns_set_.clear();
+
+  for (const auto& conn : to_close) {
+    if (IsReady(conn->fd())) {
+      MoveConnOut(conn);
+      CloseFd(conn);
+    }
+  }
+}
+
+int PubSubThread::Deliver(const std::vector<std::shared_ptr<PinkConn> >& conns,
+                          const std::string& subscribe_channel,
+                          const std::string& channel, const std::string& msg,
+                          bool pattern) {
+  int receivers = 0;
+  std::shared_ptr<const std::string> resp;
+  for (const auto& conn : conns) {
+    if (!IsReady(conn->fd())) {
+      continue;
+    }
+    if (resp == nullptr) {
+      resp = ConstructPublishResp(subscribe_channel, channel, msg, pattern);
+    }
+    conn->WriteSharedResp(resp);
+    if (publish_conns_set_.insert(conn.get()).second) {
+      publish_conns_.push_back(conn);
+    }
+    receivers++;
+  }
+  return receivers;
+}
+
+void PubSubThread::DropPublishes() {
+  PublishItem* item = publish_head_.exchange(nullptr,
+                                             std::memory_order_acq_rel);
+  while (item != nullptr) {
+    PublishItem* next = item->next;
+    if (item->cb) {
+      item->cb(0);
+    }
+    delete item;
+    item = next;
+  }
+}
+
 /*
  * return the number of channels that the specific connection currently subscribed
  */
@@ -192,6 +370,7 @@ void PubSubThread::Subscribe(std::shared_ptr<PinkConn> conn,
   int subscribed = ClientChannelSize(conn);
 
   if (subscribed == 0) {
+    conn->set_conn_class(kPubSubConnClass);
     MoveConnIn(conn, pink::NotifyType::kNotiWait);
   }
 
@@ -204,11 +383,15 @@ void PubSubThread::Subscribe(std::shared_ptr<PinkConn> conn,
                                   conn);
         if (conn_ptr == pubsub_pattern_[channels[i]].end()) {   // the connection first subscrbied
           pubsub_pattern_[channels[i]].push_back(conn);
+          if (pubsub_pattern_[channels[i]].size() == 1) {
+            pattern_index_->Add(channels[i], &*pubsub_pattern_.find(channels[i]));
+          }
           ++subscribed;
         }
       } else {    // the channel first subscribed
         std::vector<std::shared_ptr<PinkConn> > conns = {conn};
         pubsub_pattern_[channels[i]] = conns;
+        pattern_index_->Add(channels[i], &*pubsub_pattern_.find(channels[i]));
         ++subscribed;
       }
       result->push_back(std::make_pair(channels[i], subscribed));
@@ -269,6 +452,7 @@ int PubSubThread::UnSubscribe(std::shared_ptr<PinkConn> conn,
     }
     if (exist) {
       MoveConnOut(conn);
+      conn->set_conn_class(kNormalConnClass);
     }
     return 0;
   }
@@ -287,6 +471,9 @@ int PubSubThread::UnSubscribe(std::shared_ptr<PinkConn> conn,
                                                 channel_ptr->second.end(),
                                                 conn),
                                       channel_ptr->second.end());
+          if (channel_ptr->second.empty()) {
+            pattern_index_->Remove(channel_ptr->first);
+          }
           result->push_back(std::make_pair(channels[i], --subscribed));
         } else {
           result->push_back(std::make_pair(channels[i], subscribed));
@@ -362,6 +549,14 @@ void PubSubThread::PubSubNumSub(const std::vector<std::string> & channels,
   }
 }
 
+PubSubThread::PatternMatchStats PubSubThread::pattern_match_stats() const {
+  PatternMatchStats stats;
+  stats.publishes = pattern_publishes_.load(std::memory_order_relaxed);
+  stats.patterns_evaluated = patterns_evaluated_.load(std::memory_order_relaxed);
+  stats.patterns_matched = patterns_matched_.load(std::memory_order_relaxed);
+  return stats;
+}
+
 int PubSubThread::PubSubNumPat() {
   int subscribed = 0;
   slash::MutexLock l(&pattern_mutex_);
@@ -376,7 +571,8 @@ void *PubSubThread::ThreadMain() {
   PinkFiredEvent *pfe;
   slash::Status s;
   std::shared_ptr<PinkConn> in_conn = nullptr;
-  char triger[1];
+  char triger[64];
+  std::vector<PinkItem> notify_items;
 
   while (!should_stop()) {
     nfds = pink_epoll_->PinkPoll(PINK_CRON_INTERVAL);
@@ -384,9 +580,9 @@ void *PubSubThread::ThreadMain() {
       pfe = (pink_epoll_->firedevent()) + i;
       if (pfe->fd == pink_epoll_->notify_receive_fd()) {        // New connection comming
         if (pfe->mask & PinkEpoll::kRead) {
-          read(pink_epoll_->notify_receive_fd(), triger, 1);
-          {
-            PinkItem ti = pink_epoll_->notify_queue_pop();
+          notify_items.clear();
+          pink_epoll_->DrainNotifyQueue(&notify_items);
+          for (const PinkItem& ti : notify_items) {
             if (ti.notify_type() == kNotiClose) {
             } else if (ti.notify_type() == kNotiEpollout) {
               pink_epoll_->PinkModEvent(ti.fd(), 0, PinkEpoll::kWrite);
@@ -404,77 +600,8 @@ void *PubSubThread::ThreadMain() {
       }
       if (pfe->fd == msg_pfd_[0]) {           // Publish message
         if (pfe->mask & PinkEpoll::kRead) {
-          read(msg_pfd_[0], triger, 1);
-          std::string channel, msg;
-          int32_t receivers = 0;
-          channel = channel_;
-          msg = message_;
-          channel_.clear();
-          message_.clear();
-
-          // Send message to clients
-          channel_mutex_.Lock();
-          for (auto it = pubsub_channel_.begin(); it != pubsub_channel_.end(); it++) {
-            if (channel == it->first) {
-              for (size_t i = 0; i < it->second.size(); i++) {
-                if (!IsReady(it->second[i]->fd())) {
-                  continue;
-                }
-                std::string resp = ConstructPublishResp(it->first, channel, msg, false);
-                it->second[i]->WriteResp(resp);
-                WriteStatus write_status = it->second[i]->SendReply();
-                if (write_status == kWriteHalf) {
-                  pink_epoll_->PinkModEvent(it->second[i]->fd(),
-                                            PinkEpoll::kRead, PinkEpoll::kWrite);
-                } else if (write_status == kWriteError) {
-                  channel_mutex_.Unlock();
-
-                  MoveConnOut(it->second[i]);
-
-                  channel_mutex_.Lock();
-                  CloseFd(it->second[i]);
-                } else if (write_status == kWriteAll) {
-                  receivers++;
-                }
-              }
-            }
-          }
-          channel_mutex_.Unlock();
-
-          // Send message to clients
-          pattern_mutex_.Lock();
-          for (auto it = pubsub_pattern_.begin(); it != pubsub_pattern_.end(); it++) {
-            if (slash::stringmatchlen(it->first.c_str(), it->first.size(),
-                                      channel.c_str(), channel.size(), 0)) {
-              for (size_t i = 0; i < it->second.size(); i++) {
-                if (!IsReady(it->second[i]->fd())) {
-                  continue;
-                }
-                std::string resp = ConstructPublishResp(it->first, channel, msg, true);
-                it->second[i]->WriteResp(resp);
-                WriteStatus write_status = it->second[i]->SendReply();
-                if (write_status == kWriteHalf) {
-                  pink_epoll_->PinkModEvent(it->second[i]->fd(),
-                                            PinkEpoll::kRead, PinkEpoll::kWrite);
-                } else if (write_status == kWriteError) {
-                  pattern_mutex_.Unlock();
-
-                  MoveConnOut(it->second[i]);
-
-                  pattern_mutex_.Lock();
-                  CloseFd(it->second[i]);
-                } else if (write_status == kWriteAll) {
-                  receivers++;
-                }
-              }
-            }
-          }
-          pattern_mutex_.Unlock();
-
-          receiver_mutex_.Lock();
-          receivers_ = receivers;
-          receiver_rsignal_.Signal();
-          receiver_mutex_.Unlock();
+          read(msg_pfd_[0], triger, sizeof(triger));
+          HandlePublishes();
         } else {
           continue;
         }
@@ -498,10 +625,14 @@ void *PubSubThread::ThreadMain() {
           if (write_status == kWriteAll) {
             in_conn->set_is_reply(false);
             pink_epoll_->PinkModEvent(pfe->fd, 0, PinkEpoll::kRead);  // Remove EPOLLOUT
+            OutputLimitReached(in_conn.get());
           } else if (write_status == kWriteHalf) {
-            continue;  //  send all write buffer,
-                       //  in case of next GetRequest()
-                       //  pollute the write buffer
+            if (!OutputLimitReached(in_conn.get())) {
+              continue;  //  send all write buffer,
+                         //  in case of next GetRequest()
+                         //  pollute the write buffer
+            }
+            should_close = true;
           } else if (write_status == kWriteError) {
             should_close = true;
           }
@@ -535,12 +666,14 @@ void *PubSubThread::ThreadMain() {
         }
       }
     }
+    pink_epoll_->RunTimers();
   }
   Cleanup();
   return NULL;
 }
 
 void PubSubThread::Cleanup() {
+  DropPublishes();
   slash::WriteLock l(&rwlock_);
   for (auto& iter : conns_) {
     CloseFd(iter.second->conn);
@@ -5,6 +5,7 @@
 
 #include "pink/include/pink_thread.h"
 #include "pink/src/pink_thread_name.h"
+#include "pink/src/thread_placement.h"
 #include "slash/include/xdebug.h"
 #include "pink/include/pink_define.h"
 
@@ -24,6 +25,10 @@ void* Thread::RunThread(void *arg) {
   if (!(thread->thread_name().empty())) {
     SetThreadName(pthread_self(), thread->thread_name());
   }
+  if (PinThread(pthread_self(), thread->cpu_affinity()) != 0) {
+    log_warn("failed to pin thread %s to its cpus",
+             thread->thread_name().c_str());
+  }
   thread->ThreadMain();
   return nullptr;
 }
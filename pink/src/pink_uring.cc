@@ -0,0 +1,432 @@
+// Copyright (c) 2015-present, Qihoo, Inc.  All rights reserved.
+// This source code is licensed under the BSD-style license found in the
+// LICENSE file in the root directory of this source tree. An additional grant
+// of patent rights can be found in the PATENTS file in the same directory.
+
+#include "pink/src/pink_uring.h"
+
+#ifdef PINK_HAVE_IO_URING
+
+#include <errno.h>
+#include <poll.h>
+#include <signal.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/socket.h>
+#include <sys/syscall.h>
+
+#include "slash/include/xdebug.h"
+
+#ifndef IORING_RECV_MULTISHOT
+#define IORING_RECV_MULTISHOT (1U << 1)
+#endif
+
+namespace pink {
+
+static const uint16_t kBufGroup = 0;
+
+static int SysIoUringSetup(unsigned entries, struct io_uring_params* p) {
+  return static_cast<int>(syscall(__NR_io_uring_setup, entries, p));
+}
+
+static int SysIoUringEnter(int fd, unsigned to_submit, unsigned min_complete,
+                           unsigned flags, void* arg, size_t argsz) {
+  return static_cast<int>(syscall(__NR_io_uring_enter, fd, to_submit,
+                                  min_complete, flags, arg, argsz));
+}
+
+static int SysIoUringRegister(int fd, unsigned opcode, void* arg,
+                              unsigned nr_args) {
+  return static_cast<int>(syscall(__NR_io_uring_register, fd, opcode, arg,
+                                  nr_args));
+}
+
+// Completes the receive of ProbeMultishotRecv
+static const uint64_t kProbeUserData = ~0ULL;
+
+PinkUring::PinkUring()
+    : ring_fd_(-1),
+      multishot_recv_(false),
+      sq_ptr_(MAP_FAILED),
+      sq_ptr_size_(0),
+      sqes_(nullptr),
+      sqes_size_(0),
+      sqe_tail_(0),
+      sqe_submitted_(0),
+      cq_ptr_(MAP_FAILED),
+      cq_ptr_size_(0),
+      buf_count_(0),
+      buf_size_(0),
+      bufs_(nullptr),
+      bufs_size_(0),
+      buf_ring_(nullptr),
+      buf_ring_size_(0),
+      buf_ring_mask_(0),
+      buf_ring_tail_(0) {
+}
+
+PinkUring::~PinkUring() {
+  if (ring_fd_ >= 0) {
+    close(ring_fd_);
+  }
+  if (sqes_ != nullptr) {
+    munmap(sqes_, sqes_size_);
+  }
+  if (cq_ptr_ != MAP_FAILED && cq_ptr_ != sq_ptr_) {
+    munmap(cq_ptr_, cq_ptr_size_);
+  }
+  if (sq_ptr_ != MAP_FAILED) {
+    munmap(sq_ptr_, sq_ptr_size_);
+  }
+  if (bufs_ != nullptr) {
+    munmap(bufs_, bufs_size_);
+  }
+  if (buf_ring_ != nullptr) {
+    munmap(buf_ring_, buf_ring_size_);
+  }
+}
+
+int PinkUring::Init(unsigned entries, unsigned buf_count, unsigned buf_size) {
+  struct io_uring_params p;
+  memset(&p, 0, sizeof(p));
+  p.flags = IORING_SETUP_CQSIZE | IORING_SETUP_COOP_TASKRUN;
+  // Multishot receives produce many completions per request
+  p.cq_entries = entries * 4;
+  ring_fd_ = SysIoUringSetup(entries, &p);
+  if (ring_fd_ < 0) {
+    return -errno;
+  }
+  if (!(p.features & IORING_FEAT_SINGLE_MMAP) ||
+      !(p.features & IORING_FEAT_NODROP) ||
+      !(p.features & IORING_FEAT_EXT_ARG)) {
+    return -EOPNOTSUPP;
+  }
+
+  sq_ptr_size_ = p.sq_off.array + p.sq_entries * sizeof(unsigned);
+  cq_ptr_size_ = p.cq_off.cqes + p.cq_entries * sizeof(struct io_uring_cqe);
+  if (cq_ptr_size_ > sq_ptr_size_) {
+    sq_ptr_size_ = cq_ptr_size_;
+  }
+  cq_ptr_size_ = sq_ptr_size_;
+  sq_ptr_ = mmap(nullptr, sq_ptr_size_, PROT_READ | PROT_WRITE,
+                 MAP_SHARED | MAP_POPULATE, ring_fd_, IORING_OFF_SQ_RING);
+  if (sq_ptr_ == MAP_FAILED) {
+    return -errno;
+  }
+  cq_ptr_ = sq_ptr_;
+
+  char* sq = static_cast<char*>(sq_ptr_);
+  sq_head_ = reinterpret_cast<unsigned*>(sq + p.sq_off.head);
+  sq_tail_ = reinterpret_cast<unsigned*>(sq + p.sq_off.tail);
+  sq_mask_ = *reinterpret_cast<unsigned*>(sq + p.sq_off.ring_mask);
+  sq_entries_ = *reinterpret_cast<unsigned*>(sq + p.sq_off.ring_entries);
+  sq_array_ = reinterpret_cast<unsigned*>(sq + p.sq_off.array);
+  sqe_tail_ = *sq_tail_;
+  sqe_submitted_ = sqe_tail_;
+
+  sqes_size_ = p.sq_entries * sizeof(struct io_uring_sqe);
+  void* sqes = mmap(nullptr, sqes_size_, PROT_READ | PROT_WRITE,
+                    MAP_SHARED | MAP_POPULATE, ring_fd_, IORING_OFF_SQES);
+  if (sqes == MAP_FAILED) {
+    return -errno;
+  }
+  sqes_ = static_cast<struct io_uring_sqe*>(sqes);
+
+  char* cq = static_cast<char*>(cq_ptr_);
+  cq_head_ = reinterpret_cast<unsigned*>(cq + p.cq_off.head);
+  cq_tail_ = reinterpret_cast<unsigned*>(cq + p.cq_off.tail);
+  cq_mask_ = *reinterpret_cast<unsigned*>(cq + p.cq_off.ring_mask);
+  cqes_ = reinterpret_cast<struct io_uring_cqe*>(cq + p.cq_off.cqes);
+
+  /*
+   * The buffers are a mapping of their own, the kernel can never write
+   * into memory that has been reused for something else. They go into a
+   * registered buffer ring, where giving one back is a store to shared
+   * memory; if the kernel refuses the ring they are handed over with
+   * IORING_OP_PROVIDE_BUFFERS.
+   */
+  buf_count_ = buf_count;
+  buf_size_ = buf_size;
+  bufs_size_ = static_cast<size_t>(buf_count_) * buf_size_;
+  void* bufs = mmap(nullptr, bufs_size_, PROT_READ | PROT_WRITE,
+                    MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+  if (bufs == MAP_FAILED) {
+    return -errno;
+  }
+  bufs_ = static_cast<char*>(bufs);
+  if (RegisterBufRing() != 0) {
+    PrepProvideBuffers(0, buf_count_, 0);
+    int ret = Submit(1, -1);
+    if (ret < 0) {
+      return ret;
+    }
+    struct io_uring_cqe* cqe = PeekCqe();
+    ret = (cqe == nullptr) ? -EIO : cqe->res;
+    if (cqe != nullptr) {
+      CqeSeen();
+    }
+    if (ret < 0) {
+      return ret;
+    }
+  }
+
+  multishot_recv_ = ProbeMultishotRecv();
+  return 0;
+}
+
+int PinkUring::RegisterBufRing() {
+  // The ring size must be a power of 2
+  unsigned entries = 1;
+  while (entries < buf_count_) {
+    entries <<= 1;
+  }
+  if (entries > 32768) {
+    return -EINVAL;
+  }
+  size_t size = entries * sizeof(struct io_uring_buf);
+  void* ring = mmap(nullptr, size, PROT_READ | PROT_WRITE,
+                    MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+  if (ring == MAP_FAILED) {
+    return -errno;
+  }
+  struct io_uring_buf_reg reg;
+  memset(&reg, 0, sizeof(reg));
+  reg.ring_addr = reinterpret_cast<uint64_t>(ring);
+  reg.ring_entries = entries;
+  reg.bgid = kBufGroup;
+  if (SysIoUringRegister(ring_fd_, IORING_REGISTER_PBUF_RING, &reg, 1) != 0) {
+    int err = errno;
+    munmap(ring, size);
+    return -err;
+  }
+  buf_ring_ = static_cast<struct io_uring_buf*>(ring);
+  buf_ring_size_ = size;
+  buf_ring_mask_ = entries - 1;
+  buf_ring_tail_ = 0;
+  for (unsigned bid = 0; bid < buf_count_; bid++) {
+    AddRingBuffer(static_cast<uint16_t>(bid));
+  }
+  __atomic_store_n(&buf_ring_[0].resv, buf_ring_tail_, __ATOMIC_RELEASE);
+  return 0;
+}
+
+void PinkUring::AddRingBuffer(uint16_t bid) {
+  // Leaves resv alone, in the first entry it is the tail
+  struct io_uring_buf* buf = &buf_ring_[buf_ring_tail_ & buf_ring_mask_];
+  buf->addr = reinterpret_cast<uint64_t>(buffer(bid));
+  buf->len = buf_size_;
+  buf->bid = bid;
+  buf_ring_tail_++;
+}
+
+/*
+ * Kernels before 6.0 reject IORING_RECV_MULTISHOT with -EINVAL. A taken
+ * one completes with IORING_CQE_F_MORE for the byte waiting on the
+ * socket, then without it for the end of the stream.
+ */
+bool PinkUring::ProbeMultishotRecv() {
+  int sv[2];
+  if (socketpair(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0, sv) != 0) {
+    return false;
+  }
+  bool supported = false;
+  if (write(sv[1], "x", 1) == 1 && shutdown(sv[1], SHUT_WR) == 0) {
+    multishot_recv_ = true;
+    PrepRecv(sv[0], kProbeUserData);
+    multishot_recv_ = false;
+    bool more = true;
+    while (more) {
+      if (Submit(1, 1000) < 0) {
+        break;
+      }
+      struct io_uring_cqe* cqe = PeekCqe();
+      if (cqe == nullptr) {
+        // Timed out, do not leave it armed
+        PrepCancel(kProbeUserData, 0);
+        Submit(0, 0);
+        break;
+      }
+      if (cqe->user_data == kProbeUserData) {
+        if (cqe->flags & IORING_CQE_F_BUFFER) {
+          RecycleBuffer(
+              static_cast<uint16_t>(cqe->flags >> IORING_CQE_BUFFER_SHIFT));
+        }
+        more = cqe->flags & IORING_CQE_F_MORE;
+        if (more && cqe->res > 0) {
+          supported = true;
+        }
+      }
+      CqeSeen();
+    }
+  }
+  close(sv[0]);
+  close(sv[1]);
+  return supported;
+}
+
+struct io_uring_sqe* PinkUring::GetSqe() {
+  unsigned head = __atomic_load_n(sq_head_, __ATOMIC_ACQUIRE);
+  if (sqe_tail_ - head >= sq_entries_) {
+    Submit(0, 0);
+    head = __atomic_load_n(sq_head_, __ATOMIC_ACQUIRE);
+  }
+  struct io_uring_sqe* sqe = &sqes_[sqe_tail_ & sq_mask_];
+  sq_array_[sqe_tail_ & sq_mask_] = sqe_tail_ & sq_mask_;
+  sqe_tail_++;
+  memset(sqe, 0, sizeof(*sqe));
+  return sqe;
+}
+
+void PinkUring::PrepMultishotAccept(int fd, uint64_t user_data) {
+  struct io_uring_sqe* sqe = GetSqe();
+  sqe->opcode = IORING_OP_ACCEPT;
+  sqe->fd = fd;
+  sqe->ioprio = IORING_ACCEPT_MULTISHOT;
+  sqe->accept_flags = SOCK_NONBLOCK | SOCK_CLOEXEC;
+  sqe->user_data = user_data;
+}
+
+void PinkUring::PrepRecv(int fd, uint64_t user_data) {
+  struct io_uring_sqe* sqe = GetSqe();
+  sqe->opcode = IORING_OP_RECV;
+  sqe->fd = fd;
+  sqe->flags = IOSQE_BUFFER_SELECT;
+  sqe->buf_group = kBufGroup;
+  if (multishot_recv_) {
+    sqe->ioprio = IORING_RECV_MULTISHOT;
+  }
+  sqe->user_data = user_data;
+}
+
+void PinkUring::PrepSend(int fd, const void* buf, size_t len,
+                         uint64_t user_data) {
+  struct io_uring_sqe* sqe = GetSqe();
+  sqe->opcode = IORING_OP_SEND;
+  sqe->fd = fd;
+  sqe->addr = reinterpret_cast<uint64_t>(buf);
+  sqe->len = static_cast<uint32_t>(len);
+  sqe->msg_flags = MSG_NOSIGNAL;
+  sqe->user_data = user_data;
+}
+
+void PinkUring::PrepSendmsg(int fd, const struct msghdr* msg,
+                            uint64_t user_data) {
+  struct io_uring_sqe* sqe = GetSqe();
+  sqe->opcode = IORING_OP_SENDMSG;
+  sqe->fd = fd;
+  sqe->addr = reinterpret_cast<uint64_t>(msg);
+  sqe->len = 1;
+  sqe->msg_flags = MSG_NOSIGNAL;
+  sqe->user_data = user_data;
+}
+
+void PinkUring::PrepPollMultishot(int fd, uint32_t poll_mask,
+                                  uint64_t user_data) {
+  struct io_uring_sqe* sqe = GetSqe();
+  sqe->opcode = IORING_OP_POLL_ADD;
+  sqe->fd = fd;
+  sqe->poll32_events = poll_mask;
+  sqe->len = IORING_POLL_ADD_MULTI;
+  sqe->user_data = user_data;
+}
+
+void PinkUring::PrepCancel(uint64_t target, uint64_t user_data) {
+  struct io_uring_sqe* sqe = GetSqe();
+  sqe->opcode = IORING_OP_ASYNC_CANCEL;
+  sqe->fd = -1;
+  sqe->addr = target;
+  sqe->user_data = user_data;
+}
+
+void PinkUring::PrepCancelFd(int fd, uint64_t user_data) {
+  struct io_uring_sqe* sqe = GetSqe();
+  sqe->opcode = IORING_OP_ASYNC_CANCEL;
+  sqe->fd = fd;
+  sqe->cancel_flags = IORING_ASYNC_CANCEL_FD | IORING_ASYNC_CANCEL_ALL;
+  sqe->user_data = user_data;
+}
+
+void PinkUring::PrepCancelAll(uint64_t user_data) {
+  struct io_uring_sqe* sqe = GetSqe();
+  sqe->opcode = IORING_OP_ASYNC_CANCEL;
+  sqe->fd = -1;
+  sqe->cancel_flags = IORING_ASYNC_CANCEL_ANY;
+  sqe->user_data = user_data;
+}
+
+int PinkUring::Submit(unsigned wait_nr, int timeout_ms) {
+  unsigned to_submit = sqe_tail_ - sqe_submitted_;
+  if (to_submit > 0) {
+    __atomic_store_n(sq_tail_, sqe_tail_, __ATOMIC_RELEASE);
+    sqe_submitted_ = sqe_tail_;
+  }
+  if (to_submit == 0 && wait_nr == 0) {
+    return 0;
+  }
+
+  unsigned flags = 0;
+  struct io_uring_getevents_arg arg;
+  struct __kernel_timespec ts;
+  void* argp = nullptr;
+  size_t argsz = 0;
+  if (wait_nr > 0) {
+    flags |= IORING_ENTER_GETEVENTS;
+    if (timeout_ms >= 0) {
+      ts.tv_sec = timeout_ms / 1000;
+      ts.tv_nsec = static_cast<long long>(timeout_ms % 1000) * 1000000;
+      memset(&arg, 0, sizeof(arg));
+      arg.sigmask_sz = _NSIG / 8;
+      arg.ts = reinterpret_cast<uint64_t>(&ts);
+      flags |= IORING_ENTER_EXT_ARG;
+      argp = &arg;
+      argsz = sizeof(arg);
+    }
+  }
+  int ret = SysIoUringEnter(ring_fd_, to_submit, wait_nr, flags, argp, argsz);
+  if (ret < 0) {
+    if (errno == ETIME || errno == EINTR) {
+      return 0;
+    }
+    return -errno;
+  }
+  return ret;
+}
+
+struct io_uring_cqe* PinkUring::PeekCqe() {
+  unsigned head = *cq_head_;
+  if (head == __atomic_load_n(cq_tail_, __ATOMIC_ACQUIRE)) {
+    return nullptr;
+  }
+  return &cqes_[head & cq_mask_];
+}
+
+void PinkUring::CqeSeen() {
+  __atomic_store_n(cq_head_, *cq_head_ + 1, __ATOMIC_RELEASE);
+}
+
+void PinkUring::PrepProvideBuffers(uint16_t bid, unsigned count,
+                                   uint8_t sqe_flags) {
+  struct io_uring_sqe* sqe = GetSqe();
+  sqe->opcode = IORING_OP_PROVIDE_BUFFERS;
+  sqe->fd = static_cast<int>(count);
+  sqe->addr = reinterpret_cast<uint64_t>(buffer(bid));
+  sqe->len = buf_size_;
+  sqe->off = bid;
+  sqe->buf_group = kBufGroup;
+  sqe->flags = sqe_flags;
+}
+
+void PinkUring::RecycleBuffer(uint16_t bid) {
+  if (buf_ring_ != nullptr) {
+    AddRingBuffer(bid);
+    __atomic_store_n(&buf_ring_[0].resv, buf_ring_tail_, __ATOMIC_RELEASE);
+    return;
+  }
+  // Queued in front of any receive that is re-armed after it
+  PrepProvideBuffers(bid, 1, IOSQE_CQE_SKIP_SUCCESS);
+}
+
+}  // namespace pink
+
+#endif  // PINK_HAVE_IO_URING
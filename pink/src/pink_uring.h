@@ -0,0 +1,145 @@
+// Copyright (c) 2015-present, Qihoo, Inc.  All rights reserved.
+// This source code is licensed under the BSD-style license found in the
+// LICENSE file in the root directory of this source tree. An additional grant
+// of patent rights can be found in the PATENTS file in the same directory.
+
+#ifndef PINK_SRC_PINK_URING_H_
+#define PINK_SRC_PINK_URING_H_
+
+#include <stdint.h>
+#include <stddef.h>
+#include <sys/socket.h>
+
+#ifdef __linux__
+#include <linux/io_uring.h>
+#endif
+
+/*
+ * Provided buffer rings and multishot accept came with Linux 5.19, older
+ * kernel headers only get the stub
+ */
+#if defined(__linux__) && defined(IORING_ACCEPT_MULTISHOT)
+#define PINK_HAVE_IO_URING 1
+#endif
+
+namespace pink {
+
+#ifdef PINK_HAVE_IO_URING
+
+/*
+ * A thin io_uring wrapper on the raw system calls, with one group of
+ * provided buffers that receives pick their buffers from. Needs Linux 5.19;
+ * receives are multishot if the kernel takes them (6.0) and re-armed after
+ * every completion otherwise. Only the owning thread may use it.
+ */
+class PinkUring {
+ public:
+  PinkUring();
+  ~PinkUring();
+
+  /*
+   * Returns 0 on success, -errno if io_uring or one of the features we
+   * need is not available
+   */
+  int Init(unsigned entries, unsigned buf_count, unsigned buf_size);
+
+  bool multishot_recv() const {
+    return multishot_recv_;
+  }
+
+  /*
+   * Queue a request, it is passed to the kernel by the next Submit. If the
+   * submission queue is full the queued requests are submitted first.
+   */
+  void PrepMultishotAccept(int fd, uint64_t user_data);
+  void PrepRecv(int fd, uint64_t user_data);
+  void PrepSend(int fd, const void* buf, size_t len, uint64_t user_data);
+  // *msg and its iovecs must stay valid until the completion
+  void PrepSendmsg(int fd, const struct msghdr* msg, uint64_t user_data);
+  void PrepPollMultishot(int fd, uint32_t poll_mask, uint64_t user_data);
+  // Cancels the request with user_data target
+  void PrepCancel(uint64_t target, uint64_t user_data);
+  // Cancels all requests on fd
+  void PrepCancelFd(int fd, uint64_t user_data);
+  // Cancels every request of the ring
+  void PrepCancelAll(uint64_t user_data);
+
+  /*
+   * Submits the queued requests and waits until wait_nr completions are
+   * there or timeout_ms passed, a negative timeout waits forever.
+   * Returns the number of submitted requests or -errno.
+   */
+  int Submit(unsigned wait_nr, int timeout_ms);
+
+  // The next completion or nullptr, call CqeSeen once it is handled
+  struct io_uring_cqe* PeekCqe();
+  void CqeSeen();
+
+  // The provided buffer a receive completion points to
+  char* buffer(uint16_t bid) {
+    return bufs_ + static_cast<size_t>(bid) * buf_size_;
+  }
+  /*
+   * Gives a provided buffer back to the kernel: right away through the
+   * buffer ring, else with the next Submit, where failures complete with
+   * user_data 0
+   */
+  void RecycleBuffer(uint16_t bid);
+
+ private:
+  struct io_uring_sqe* GetSqe();
+  // Returns 0 or -errno, the buffers are then in the ring
+  int RegisterBufRing();
+  void AddRingBuffer(uint16_t bid);
+  void PrepProvideBuffers(uint16_t bid, unsigned count, uint8_t sqe_flags);
+  // Whether a multishot receive is taken, tried on a socketpair
+  bool ProbeMultishotRecv();
+
+  int ring_fd_;
+  bool multishot_recv_;
+
+  // Submission queue
+  void* sq_ptr_;
+  size_t sq_ptr_size_;
+  unsigned* sq_head_;
+  unsigned* sq_tail_;
+  unsigned sq_mask_;
+  unsigned sq_entries_;
+  unsigned* sq_array_;
+  struct io_uring_sqe* sqes_;
+  size_t sqes_size_;
+  unsigned sqe_tail_;
+  unsigned sqe_submitted_;
+
+  // Completion queue
+  void* cq_ptr_;
+  size_t cq_ptr_size_;
+  unsigned* cq_head_;
+  unsigned* cq_tail_;
+  unsigned cq_mask_;
+  struct io_uring_cqe* cqes_;
+
+  // Provided buffers, group 0
+  unsigned buf_count_;
+  unsigned buf_size_;
+  char* bufs_;
+  size_t bufs_size_;
+  /*
+   * Registered ring of the free buffers, nullptr without one. Indexed as
+   * an array: in C++ the bufs member of struct io_uring_buf_ring does not
+   * start at offset 0. The tail is the resv field of the first entry.
+   */
+  struct io_uring_buf* buf_ring_;
+  size_t buf_ring_size_;
+  unsigned buf_ring_mask_;
+  uint16_t buf_ring_tail_;
+
+  // No copying allowed
+  PinkUring(const PinkUring&);
+  void operator=(const PinkUring&);
+};
+
+#endif  // PINK_HAVE_IO_URING
+
+}  // namespace pink
+#endif  // PINK_SRC_PINK_URING_H_
@@ -4,10 +4,13 @@
 // of patent rights can be found in the PATENTS file in the same directory.
 #include "pink/src/pink_util.h"
 #include <fcntl.h>
+#include <stdint.h>
 #include <netinet/in.h>
 #include <sys/socket.h>
 #include <unistd.h>
 
+#include <algorithm>
+
 #include "pink/include/pink_define.h"
 
 namespace pink {
@@ -18,6 +21,10 @@ int Setnonblocking(int sockfd) {
     close(sockfd);
     return -1;
   }
+  if (flags & O_NONBLOCK) {
+    // Already set, e.g. by accept4
+    return flags;
+  }
   flags |= O_NONBLOCK;
   if (fcntl(sockfd, F_SETFL, flags) < 0) {
     close(sockfd);
@@ -26,4 +33,20 @@ int Setnonblocking(int sockfd) {
   return flags;
 }
 
+int KeepaliveRemainingMs(const struct timeval& last_interaction,
+                         int keepalive_timeout, const struct timeval& now) {
+  // Timed out once a whole second more than keepalive_timeout has passed
+  int64_t deadline_ms =
+      (static_cast<int64_t>(last_interaction.tv_sec) + keepalive_timeout + 1)
+      * 1000;
+  int64_t now_ms = static_cast<int64_t>(now.tv_sec) * 1000
+      + now.tv_usec / 1000;
+  if (deadline_ms <= now_ms) {
+    return 1;
+  }
+  // Long timeouts are checked again every hour on the way
+  return static_cast<int>(std::min<int64_t>(deadline_ms - now_ms,
+                                            3600 * 1000));
+}
+
 }  // namespace pink
@@ -6,10 +6,20 @@
 #ifndef PINK_SRC_PINK_UTIL_H_
 #define PINK_SRC_PINK_UTIL_H_
 
+#include <sys/time.h>
+
 namespace pink {
 
 int Setnonblocking(int sockfd);
 
+/*
+ * Milliseconds from now until a conn last used at last_interaction is
+ * idle for more than keepalive_timeout seconds, at least 1 and at most an
+ * hour
+ */
+int KeepaliveRemainingMs(const struct timeval& last_interaction,
+                         int keepalive_timeout, const struct timeval& now);
+
 }  // namespace pink
 
 #endif  //  PINK_SRC_PINK_UTIL_H_
@@ -7,15 +7,56 @@
 
 #include <stdlib.h>
 #include <limits.h>
+#include <string.h>
 
+#include <algorithm>
 #include <string>
 #include <sstream>
 
 #include "slash/include/xdebug.h"
 #include "slash/include/slash_string.h"
+#include "pink/src/big_buffer.h"
 
 namespace pink {
 
+class ThreadPoolOffloadExecutor : public RedisOffloadExecutor {
+ public:
+  explicit ThreadPoolOffloadExecutor(ThreadPool* pool) : pool_(pool) {}
+  virtual void Schedule(TaskFunc func, void* arg) override {
+    pool_->Schedule(func, arg);
+  }
+
+ private:
+  ThreadPool* pool_;
+};
+
+RedisOffloadExecutor* NewThreadPoolOffloadExecutor(ThreadPool* pool) {
+  return new ThreadPoolOffloadExecutor(pool);
+}
+
+class WorkStealingPoolOffloadExecutor : public RedisOffloadExecutor {
+ public:
+  explicit WorkStealingPoolOffloadExecutor(WorkStealingPool* pool)
+      : pool_(pool) {}
+  virtual void Schedule(TaskFunc func, void* arg) override {
+    pool_->Schedule(func, arg);
+  }
+
+ private:
+  WorkStealingPool* pool_;
+};
+
+RedisOffloadExecutor* NewWorkStealingPoolOffloadExecutor(
+    WorkStealingPool* pool) {
+  return new WorkStealingPoolOffloadExecutor(pool);
+}
+
+struct RedisConn::OffloadTask {
+  std::weak_ptr<PinkConn> conn;
+  uint64_t seq;
+  RedisCmdArgsType argv;
+};
+
 RedisConn::RedisConn(const int fd,
                      const std::string& ip_port,
                      Thread* thread,
@@ -27,19 +68,28 @@ RedisConn::RedisConn(const int fd,
       rbuf_(nullptr),
       rbuf_len_(0),
       rbuf_max_len_(rbuf_max_len),
-      msg_peak_(0),
+      big_rbuf_(false),
+      small_rbuf_(nullptr),
+      small_rbuf_len_(0),
       command_len_(0),
-      wbuf_pos_(0),
       last_read_pos_(-1),
-      bulk_len_(-1) {
+      bulk_missing_(0),
+      process_sync_cmds_(true),
+      offload_executor_(nullptr),
+      offload_next_seq_(0),
+      offload_ready_(false),
+      offload_reply_(nullptr) {
   RedisParserSettings settings;
-  settings.DealMessage = ParserDealMessageCb;
-  settings.Complete = ParserCompleteCb;
+  settings.DealSliceMessage = ParserDealMessageCb;
   redis_parser_.RedisParserInit(REDIS_PARSER_REQUEST, settings);
   redis_parser_.data = this;
 }
 
 RedisConn::~RedisConn() {
+  if (big_rbuf_) {
+    FreeBigBuffer(rbuf_, rbuf_len_);
+    rbuf_ = small_rbuf_;
+  }
   free(rbuf_);
 }
 
@@ -71,46 +121,69 @@ ReadStatus RedisConn::ParseRedisParserStatus(RedisParserStatus status) {
   }
 }
 
-ReadStatus RedisConn::GetRequest() {
-  ssize_t nread = 0;
+int RedisConn::ReserveReadSpace() {
   int next_read_pos = last_read_pos_ + 1;
 
   int remain = rbuf_len_ - next_read_pos;  // Remain buffer size
   int new_size = 0;
-  if (remain == 0) {
+  if (remain < bulk_missing_) {
+    // Room for exactly the rest of the bulk argument
+    new_size = next_read_pos + bulk_missing_;
+  } else if (remain == 0) {
     new_size = rbuf_len_ + REDIS_IOBUF_LEN;
-    remain += REDIS_IOBUF_LEN;
-  } else if (remain < bulk_len_) {
-    new_size = next_read_pos + bulk_len_;
-    remain = bulk_len_;
   }
   if (new_size > rbuf_len_) {
     if (new_size > rbuf_max_len_) {
-      return kFullError;
+      return -1;
     }
-    rbuf_ = static_cast<char*>(realloc(rbuf_, new_size));
-    if (rbuf_ == nullptr) {
-      return kFullError;
+    if (new_size >= REDIS_MBULK_BIG_ARG || big_rbuf_) {
+      if (!UseBigBuffer(new_size)) {
+        return -1;
+      }
+    } else {
+      char* buf = static_cast<char*>(realloc(rbuf_, new_size));
+      if (buf == nullptr) {
+        return -1;
+      }
+      rbuf_ = buf;
+      rbuf_len_ = new_size;
     }
-    rbuf_len_ = new_size;
   }
+  return rbuf_len_ - next_read_pos;
+}
 
-  nread = read(fd(), rbuf_ + next_read_pos, remain);
-  if (nread == -1) {
-    if (errno == EAGAIN) {
-      nread = 0;
-      return kReadHalf; // HALF
-    } else {
-      // error happened, close client
-      return kReadError;
-    }
-  } else if (nread == 0) {
-    // client closed, close client
-    return kReadClose;
+bool RedisConn::UseBigBuffer(int size) {
+  size_t capacity;
+  char* buf = AllocBigBuffer(size, &capacity);
+  if (buf == nullptr) {
+    return false;
   }
-  // assert(nread > 0);
+  memcpy(buf, rbuf_, last_read_pos_ + 1);
+  if (big_rbuf_) {
+    FreeBigBuffer(rbuf_, rbuf_len_);
+  } else {
+    small_rbuf_ = rbuf_;
+    small_rbuf_len_ = rbuf_len_;
+    big_rbuf_ = true;
+  }
+  rbuf_ = buf;
+  rbuf_len_ = static_cast<int>(
+      std::min(capacity, static_cast<size_t>(rbuf_max_len_)));
+  return true;
+}
+
+void RedisConn::ReleaseBigBuffer() {
+  memcpy(small_rbuf_, rbuf_, last_read_pos_ + 1);
+  FreeBigBuffer(rbuf_, rbuf_len_);
+  rbuf_ = small_rbuf_;
+  rbuf_len_ = small_rbuf_len_;
+  small_rbuf_ = nullptr;
+  small_rbuf_len_ = 0;
+  big_rbuf_ = false;
+}
+
+ReadStatus RedisConn::ConsumeRead(int nread) {
   last_read_pos_ += nread;
-  msg_peak_ = last_read_pos_;
   command_len_ += nread;
   if (command_len_ >= rbuf_max_len_) {
     log_info("close conn command_len %d, rbuf_max_len %d", command_len_, rbuf_max_len_);
@@ -118,57 +191,111 @@ ReadStatus RedisConn::GetRequest() {
   }
 
   int processed_len = 0;
-  RedisParserStatus ret = redis_parser_.ProcessInputBuffer(
-      rbuf_ + next_read_pos, nread, &processed_len);
+  RedisParserStatus ret = redis_parser_.ProcessInputBufferInPlace(
+      rbuf_, last_read_pos_ + 1, &processed_len);
   ReadStatus read_status = ParseRedisParserStatus(ret);
   if (read_status == kReadAll || read_status == kReadHalf) {
-    if (read_status == kReadAll) {
-      command_len_ = 0;
+    int left = last_read_pos_ + 1 - processed_len;
+    if (left > 0 && processed_len > 0) {
+      memmove(rbuf_, rbuf_ + processed_len, left);
+    }
+    last_read_pos_ = left - 1;
+    command_len_ = left;
+    bulk_missing_ = redis_parser_.get_bulk_missing();
+    if (big_rbuf_ && processed_len > 0 && left <= small_rbuf_len_) {
+      // The large command has been handled
+      ReleaseBigBuffer();
     }
-    last_read_pos_ = -1;
-    bulk_len_ = redis_parser_.get_bulk_len();
   }
-  if (!response_.empty()) {
+  if (read_status == kReadAll && !cmd_argvs_.empty()) {
+    ProcessRedisCmds(cmd_argvs_, handle_type_ == HandleType::kAsynchronous,
+                     &response_);
+    cmd_argvs_.clear();
+  }
+  if (!response_.empty() || !output_.empty()) {
     set_is_reply(true);
+  } else if (read_status == kReadAll && OffloadPending()) {
+    /*
+     * Nothing to write yet, waiting for EPOLLOUT would spin. The replies
+     * are written on the kNotiWrite of the executor
+     */
+    read_status = kReadHalf;
   }
   return read_status; // OK || HALF || FULL_ERROR || PARSE_ERROR
 }
 
-WriteStatus RedisConn::SendReply() {
-  ssize_t nwritten = 0;
-  size_t wbuf_len = response_.size();
-  while (wbuf_len > 0) {
-    nwritten = write(fd(), response_.data() + wbuf_pos_, wbuf_len - wbuf_pos_);
-    if (nwritten <= 0) {
-      break;
-    }
-    wbuf_pos_ += nwritten;
-    if (wbuf_pos_ == wbuf_len) {
-      // Have sended all response data
-      if (wbuf_len > DEFAULT_WBUF_SIZE) {
-        std::string buf;
-        buf.reserve(DEFAULT_WBUF_SIZE);
-        response_.swap(buf);
-      }
-      response_.clear();
-
-      wbuf_len = 0;
-      wbuf_pos_ = 0;
-    }
+ReadStatus RedisConn::GetRequest() {
+  int remain = ReserveReadSpace();
+  if (remain < 0) {
+    return kFullError;
   }
-  if (nwritten == -1) {
+
+  ssize_t nread = read(fd(), rbuf_ + last_read_pos_ + 1, remain);
+  if (nread == -1) {
     if (errno == EAGAIN) {
-      return kWriteHalf;
+      nread = 0;
+      return kReadHalf; // HALF
     } else {
-      // Here we should close the connection
-      return kWriteError;
+      // error happened, close client
+      return kReadError;
+    }
+  } else if (nread == 0) {
+    // client closed, close client
+    return kReadClose;
+  }
+  // assert(nread > 0);
+  return ConsumeRead(static_cast<int>(nread));
+}
+
+bool RedisConn::SupportsCompletionIO() {
+#ifdef __ENABLE_SSL
+  return !security();
+#else
+  return true;
+#endif
+}
+
+ReadStatus RedisConn::ProcessInput(const char* data, size_t len) {
+  ReadStatus read_status = kReadHalf;
+  while (len > 0) {
+    int remain = ReserveReadSpace();
+    if (remain < 0) {
+      return kFullError;
     }
+    int n = len < static_cast<size_t>(remain) ? static_cast<int>(len) : remain;
+    memcpy(rbuf_ + last_read_pos_ + 1, data, n);
+    read_status = ConsumeRead(n);
+    if (read_status != kReadAll && read_status != kReadHalf) {
+      return read_status;
+    }
+    data += n;
+    len -= n;
   }
-  if (wbuf_len == 0) {
+  return read_status;
+}
+
+bool RedisConn::TakeOutput(OutputChain* output) {
+  CollectOffloaded();
+  set_is_reply(false);
+  output_.Append(std::move(response_));
+  if (output_.empty()) {
+    return false;
+  }
+  output_.MoveTo(output);
+  return true;
+}
+
+WriteStatus RedisConn::SendReply() {
+  CollectOffloaded();
+  output_.Append(std::move(response_));
+  if (output_.empty()) {
     return kWriteAll;
-  } else {
-    return kWriteHalf;
   }
+  if (output_.WriteTo(fd()) < 0 && errno != EAGAIN) {
+    // Here we should close the connection
+    return kWriteError;
+  }
+  return output_.empty() ? kWriteAll : kWriteHalf;
 }
 
 int RedisConn::WriteResp(const std::string& resp) {
@@ -177,24 +304,76 @@ int RedisConn::WriteResp(const std::string& resp) {
   return 0;
 }
 
+int RedisConn::WriteSharedResp(std::shared_ptr<const std::string> resp) {
+  AppendReply(std::move(resp));
+  return 0;
+}
+
+void RedisConn::AppendReply(std::string&& reply) {
+  if (offload_reply_ != nullptr) {
+    offload_reply_->append(reply);
+    return;
+  }
+  output_.Append(std::move(response_));
+  output_.Append(std::move(reply));
+  set_is_reply(true);
+}
+
+void RedisConn::AppendReply(std::shared_ptr<const std::string> reply) {
+  if (offload_reply_ != nullptr) {
+    offload_reply_->append(*reply);
+    return;
+  }
+  output_.Append(std::move(response_));
+  output_.Append(std::move(reply));
+  set_is_reply(true);
+}
+
+bool RedisConn::CanMigrate() {
+  return handle_type_ == kSynchronous && !is_reply() &&
+         response_.empty() && output_.empty() && !OffloadPending();
+}
+
+bool RedisConn::is_reply() {
+  return offload_ready_.load(std::memory_order_acquire) ||
+         PinkConn::is_reply();
+}
+
+size_t RedisConn::input_bytes() {
+  return static_cast<size_t>(last_read_pos_ + 1);
+}
+
+size_t RedisConn::output_bytes() {
+  return response_.size() + output_.size();
+}
+
 void RedisConn::TryResizeBuffer() {
+  if (!big_rbuf_) {
+    return;
+  }
+  /*
+   * Still waiting for the rest of a large command. If its sender has
+   * stalled, keep only what has been received so far
+   */
   struct timeval now;
   gettimeofday(&now, nullptr);
   int idletime = now.tv_sec - last_interaction().tv_sec;
-  if (rbuf_len_ > REDIS_MBULK_BIG_ARG &&
-      ((rbuf_len_ / (msg_peak_ + 1)) > 2 || idletime > 2)) {
-    int new_size =
-      ((last_read_pos_ + REDIS_IOBUF_LEN) / REDIS_IOBUF_LEN) * REDIS_IOBUF_LEN;
-    if (new_size < rbuf_len_) {
-      rbuf_ = static_cast<char*>(realloc(rbuf_, new_size));
-      rbuf_len_ = new_size;
-      log_info("Resize buffer to %d, last_read_pos_: %d\n",
-               rbuf_len_, last_read_pos_);
+  int used = last_read_pos_ + 1;
+  if (idletime > 2 && used < rbuf_len_ / 2) {
+    if (used <= small_rbuf_len_) {
+      ReleaseBigBuffer();
+    } else {
+      UseBigBuffer(used);
     }
-    msg_peak_ = 0;
+    log_info("Resize buffer to %d, last_read_pos_: %d\n",
+             rbuf_len_, last_read_pos_);
   }
 }
 
+bool RedisConn::HasLargeBuffer() {
+  return big_rbuf_;
+}
+
 void RedisConn::SetHandleType(const HandleType& handle_type) {
   handle_type_ = handle_type;
 }
@@ -204,6 +383,10 @@ HandleType RedisConn::GetHandleType() {
 }
 
 void RedisConn::ProcessRedisCmds(const std::vector<RedisCmdArgsType>& argvs, bool async, std::string* response) {
+  if (!async) {
+    // Not overridden, no need to copy the commands any more
+    process_sync_cmds_ = false;
+  }
 }
 
 void RedisConn::NotifyEpoll(bool success) {
@@ -211,20 +394,132 @@ void RedisConn::NotifyEpoll(bool success) {
   pink_epoll()->Register(ti, true);
 }
 
-int RedisConn::ParserDealMessageCb(RedisParser* parser, const RedisCmdArgsType& argv) {
+int RedisConn::DealMessage(const RedisCmdArgsSlice& argv, std::string* response) {
+  RedisCmdArgsType args;
+  args.reserve(argv.size());
+  for (const auto& arg : argv) {
+    args.emplace_back(arg.data(), arg.size());
+  }
+  return DealMessage(args, response);
+}
+
+int RedisConn::ParserDealMessageCb(RedisParser* parser, const RedisCmdArgsSlice& argv) {
   RedisConn* conn = reinterpret_cast<RedisConn*>(parser->data);
-  if (conn->GetHandleType() == HandleType::kSynchronous) {
-    return conn->DealMessage(argv, &(conn->response_));
-  } else {
+  bool sync = conn->GetHandleType() == HandleType::kSynchronous;
+  if (!sync || conn->process_sync_cmds_) {
+    // Passed to ProcessRedisCmds later, so the arguments are copied
+    RedisCmdArgsType args;
+    args.reserve(argv.size());
+    for (const auto& arg : argv) {
+      args.emplace_back(arg.data(), arg.size());
+    }
+    conn->cmd_argvs_.push_back(std::move(args));
+  }
+  if (!sync) {
     return 0;
   }
+  if (conn->offload_executor_ != nullptr) {
+    return conn->OffloadOrDeal(argv);
+  }
+  return conn->DealMessage(argv, &(conn->response_));
 }
 
-int RedisConn::ParserCompleteCb(RedisParser* parser, const std::vector<RedisCmdArgsType>& argvs) {
-  RedisConn* conn = reinterpret_cast<RedisConn*>(parser->data);
-  bool async = conn->GetHandleType() == HandleType::kAsynchronous;
-  conn->ProcessRedisCmds(argvs, async, &(conn->response_));
+void RedisConn::SetOffloadExecutor(RedisOffloadExecutor* executor) {
+  offload_executor_ = executor;
+}
+
+int RedisConn::OffloadOrDeal(const RedisCmdArgsSlice& argv) {
+  if (ShouldOffload(argv)) {
+    OffloadTask* task = new OffloadTask;
+    task->conn = shared_from_this();
+    task->argv.reserve(argv.size());
+    for (const auto& arg : argv) {
+      task->argv.emplace_back(arg.data(), arg.size());
+    }
+    {
+      slash::MutexLock l(&offload_mu_);
+      task->seq = offload_next_seq_++;
+      offload_queue_.push_back({task->seq, std::string(), false, false});
+    }
+    offload_executor_->Schedule(RunOffloadTask, task);
+    return 0;
+  }
+  if (!OffloadPending()) {
+    return DealMessage(argv, &response_);
+  }
+  // Its reply has to wait behind the offloaded ones
+  std::string reply;
+  offload_reply_ = &reply;
+  int ret = DealMessage(argv, &reply);
+  offload_reply_ = nullptr;
+  slash::MutexLock l(&offload_mu_);
+  offload_queue_.push_back({offload_next_seq_++, std::string(), true, ret != 0});
+  offload_queue_.back().reply.swap(reply);
   return 0;
 }
 
+// Runs on the executor
+void RedisConn::RunOffloadTask(void* arg) {
+  OffloadTask* task = static_cast<OffloadTask*>(arg);
+  std::shared_ptr<PinkConn> conn = task->conn.lock();
+  if (conn != nullptr) {
+    RedisConn* redis_conn = static_cast<RedisConn*>(conn.get());
+    std::string reply;
+    int ret = redis_conn->DealMessage(task->argv, &reply);
+    redis_conn->OffloadDone(task->seq, &reply, ret != 0);
+  }
+  // The conn may have been closed meanwhile, then the reply is dropped
+  delete task;
+}
+
+void RedisConn::OffloadDone(uint64_t seq, std::string* reply, bool failed) {
+  {
+    slash::MutexLock l(&offload_mu_);
+    OffloadSlot& slot = offload_queue_[seq - offload_queue_.front().seq];
+    slot.reply.swap(*reply);
+    slot.done = true;
+    slot.failed = failed;
+    if (seq != offload_queue_.front().seq) {
+      // Written along with the head once that completes
+      return;
+    }
+  }
+  offload_ready_.store(true, std::memory_order_release);
+  PinkItem ti(fd(), ip_port(), kNotiWrite);
+  pink_epoll()->Register(ti, true);
+}
+
+void RedisConn::CollectOffloaded() {
+  if (offload_executor_ == nullptr) {
+    return;
+  }
+  offload_ready_.store(false, std::memory_order_release);
+  slash::MutexLock l(&offload_mu_);
+  if (offload_queue_.empty() || !offload_queue_.front().done) {
+    return;
+  }
+  // The replies in response_ came before the first offloaded command
+  output_.Append(std::move(response_));
+  while (!offload_queue_.empty() && offload_queue_.front().done) {
+    OffloadSlot& slot = offload_queue_.front();
+    output_.Append(std::move(slot.reply));
+    slot.reply.clear();
+    if (slot.failed) {
+      // Stays at the head, nothing after it is written
+      SetClose(true);
+      break;
+    }
+    offload_queue_.pop_front();
+  }
+  set_is_reply(true);
+}
+
+bool RedisConn::OffloadPending() {
+  if (offload_executor_ == nullptr) {
+    return false;
+  }
+  slash::MutexLock l(&offload_mu_);
+  return !offload_queue_.empty();
+}
+
 }  // namespace pink
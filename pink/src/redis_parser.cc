@@ -6,9 +6,16 @@
 #include "pink/include/redis_parser.h"
 
 #include <assert.h>     /* assert */
+#include <stdlib.h>
+#include <string.h>
+#if defined(__x86_64__) && defined(__GNUC__)
+#include <immintrin.h>
+#define PINK_RESP_SCAN_X86 1
+#endif
 
 #include "slash/include/slash_string.h"
 #include "slash/include/xdebug.h"
+#include "pink/src/newline_scanner.h"
 
 namespace pink {
 
@@ -128,18 +135,114 @@ static int split2args(const std::string& req_buf, RedisCmdArgsType& argv) {
 }
 
 
+static const char* FindNewlineScalar(const char* p, const char* end) {
+  while (p < end && *p != '\n') {
+    p++;
+  }
+  return p;
+}
+
+#ifdef PINK_RESP_SCAN_X86
+static const char* FindNewlineSSE2(const char* p, const char* end) {
+  const __m128i nl = _mm_set1_epi8('\n');
+  while (end - p >= 16) {
+    __m128i v = _mm_loadu_si128(reinterpret_cast<const __m128i*>(p));
+    unsigned mask = _mm_movemask_epi8(_mm_cmpeq_epi8(v, nl));
+    if (mask != 0) {
+      return p + __builtin_ctz(mask);
+    }
+    p += 16;
+  }
+  return FindNewlineScalar(p, end);
+}
+
+__attribute__((target("avx2")))
+static const char* FindNewlineAVX2(const char* p, const char* end) {
+  const __m256i nl = _mm256_set1_epi8('\n');
+  while (end - p >= 32) {
+    __m256i v = _mm256_loadu_si256(reinterpret_cast<const __m256i*>(p));
+    unsigned mask = _mm256_movemask_epi8(_mm256_cmpeq_epi8(v, nl));
+    if (mask != 0) {
+      return p + __builtin_ctz(mask);
+    }
+    p += 32;
+  }
+  return FindNewlineSSE2(p, end);
+}
+#endif
+
+static NewlineScanner SelectNewlineScanner() {
+  const char* name = getenv("PINK_RESP_SCAN");
+  if (name != NULL && strcmp(name, "scalar") == 0) {
+    return FindNewlineScalar;
+  }
+#ifdef PINK_RESP_SCAN_X86
+  __builtin_cpu_init();
+  if (__builtin_cpu_supports("avx2") &&
+      (name == NULL || strcmp(name, "sse2") != 0)) {
+    return FindNewlineAVX2;
+  }
+  return FindNewlineSSE2;
+#else
+  return FindNewlineScalar;
+#endif
+}
+
+static NewlineScanner find_newline = SelectNewlineScanner();
+
+NewlineScanner GetNewlineScanner(NewlineScannerType type) {
+  switch (type) {
+    case kNewlineScalar:
+      return FindNewlineScalar;
+#ifdef PINK_RESP_SCAN_X86
+    case kNewlineSSE2:
+      return FindNewlineSSE2;
+    case kNewlineAVX2:
+      __builtin_cpu_init();
+      return __builtin_cpu_supports("avx2") ? FindNewlineAVX2 : nullptr;
+#endif
+    default:
+      return nullptr;
+  }
+}
+
+void SetNewlineScanner(NewlineScanner scanner) {
+  find_newline = scanner;
+}
+
+/*
+ * Parses the digits of a "*<num>" or "$<num>" header, collecting a bad
+ * digit flag instead of branching on every byte. Signs and anything long
+ * enough to overflow go through string2l.
+ */
+static bool ParseHeaderNum(const char* s, int len, long* value) {
+  if (len <= 0) {
+    return false;
+  }
+  if (len > 18) {
+    return slash::string2l(s, len, value);
+  }
+  unsigned long v = 0;
+  unsigned bad = 0;
+  for (int i = 0; i < len; i++) {
+    unsigned d = static_cast<unsigned char>(s[i]) - '0';
+    bad |= (d > 9);
+    v = v * 10 + d;
+  }
+  if (bad) {
+    return slash::string2l(s, len, value);
+  }
+  *value = static_cast<long>(v);
+  return true;
+}
+
 int RedisParser::FindNextSeparators() {
   if (cur_pos_ > length_ - 1) {
     return -1;
   }
-  int pos = cur_pos_;
-  while (pos <= length_ - 1) {
-    if (input_buf_[pos] == '\n') {
-      return pos;
-    }
-    pos++;
-  }
-  return -1;
+  const char* end = input_buf_ + length_;
+  const char* p = find_newline(input_buf_ + cur_pos_, end);
+  return p == end ? -1 : static_cast<int>(p - input_buf_);
 }
 
 int RedisParser::GetNextNum(int pos, long* value) {
@@ -149,21 +252,49 @@ int RedisParser::GetNextNum(int pos, long* value) {
   //      |    |
   //      *3\r\n
   // [cur_pos_ + 1, pos - cur_pos_ - 2]
-  if (slash::string2l(input_buf_ + cur_pos_ + 1,
-                            pos - cur_pos_ - 2,
-                            value)) {
+  if (ParseHeaderNum(input_buf_ + cur_pos_ + 1, pos - cur_pos_ - 2, value)) {
     return 0; // Success
   }
   return -1; // Failed
 }
 
+int RedisParser::ParseHeader(long* value) {
+  // Fast path: the digits directly followed by "\r\n", read in one pass
+  const char* digits = input_buf_ + cur_pos_ + 1;
+  const char* end = input_buf_ + length_;
+  const char* p = digits;
+  unsigned long v = 0;
+  while (p < end && p - digits < 18) {
+    unsigned d = static_cast<unsigned char>(*p) - '0';
+    if (d > 9) {
+      break;
+    }
+    v = v * 10 + d;
+    p++;
+  }
+  if (p != digits && end - p >= 2 && p[0] == '\r' && p[1] == '\n') {
+    *value = static_cast<long>(v);
+    return static_cast<int>(p + 1 - input_buf_);
+  }
+
+  int pos = FindNextSeparators();
+  if (pos == -1) {
+    return -1;
+  }
+  return GetNextNum(pos, value) == 0 ? pos : -2;
+}
+
 RedisParser::RedisParser()
   : status_code_(kRedisParserNone),
     error_code_(kRedisParserOk),
     redis_type_(0),
     multibulk_len_(0),
     bulk_len_(-1),
+    bulk_missing_(0),
     redis_parser_type_(REDIS_PARSER_REQUEST),
+    in_place_(false),
+    in_place_buf_(NULL),
+    command_start_(0),
     cur_pos_(0),
     input_buf_(NULL),
     length_(0) {
@@ -172,7 +303,12 @@ RedisParser::RedisParser()
 void RedisParser::SetParserStatus(RedisParserStatus status,
     RedisParserError error) {
   if (status == kRedisParserHalf) {
-    CacheHalfArgv();
+    if (in_place_) {
+      // Parsed again from its start next time
+      cur_pos_ = command_start_;
+    } else {
+      CacheHalfArgv();
+    }
   }
   status_code_ = status;
   error_code_ = error;
@@ -224,6 +360,13 @@ RedisParserStatus RedisParser::ProcessInlineBuffer() {
     SetParserStatus(kRedisParserError, kRedisParserProtoError);
     return status_code_;
   }
+  if (in_place_) {
+    // Unquoting may change the arguments, they stay in argv_
+    argv_slices_.clear();
+    for (const auto& arg : argv_) {
+      argv_slices_.emplace_back(arg.data(), arg.size());
+    }
+  }
   SetParserStatus(kRedisParserDone);
   return status_code_;
 }
@@ -232,15 +375,16 @@ RedisParserStatus RedisParser::ProcessMultibulkBuffer() {
   int pos = 0;
   if (multibulk_len_ == 0) {
     /* The client should have been reset */
-    pos = FindNextSeparators();
+    pos = ParseHeader(&multibulk_len_);
     if (pos != -1) {
-      if (GetNextNum(pos, &multibulk_len_) != 0) {
+      if (pos == -2) {
         // Protocol error: invalid multibulk length
         SetParserStatus(kRedisParserError, kRedisParserProtoError);
         return status_code_;
       }
       cur_pos_ = pos + 1;
       argv_.clear();
+      argv_slices_.clear();
       if (cur_pos_ > length_ - 1) {
         SetParserStatus(kRedisParserHalf);
         return status_code_;
@@ -252,14 +396,14 @@ RedisParserStatus RedisParser::ProcessMultibulkBuffer() {
   }
   while (multibulk_len_) {
     if (bulk_len_ == -1) {
-      pos = FindNextSeparators();
+      pos = ParseHeader(&bulk_len_);
       if (pos != -1) {
         if (input_buf_[cur_pos_] != '$') {
           SetParserStatus(kRedisParserError, kRedisParserProtoError);
           return status_code_;  // PARSE_ERROR
         }
 
-        if (GetNextNum(pos, &bulk_len_) != 0) {
+        if (pos == -2) {
             // Protocol error: invalid bulk length
           SetParserStatus(kRedisParserError, kRedisParserProtoError);
           return status_code_;
@@ -273,9 +417,15 @@ RedisParserStatus RedisParser::ProcessMultibulkBuffer() {
     }
     if ((length_ - 1) - cur_pos_ + 1 < bulk_len_ + 2) {
       // Data not enough
+      bulk_missing_ = bulk_len_ + 2 - (length_ - cur_pos_);
       break;
     } else {
-      argv_.emplace_back(input_buf_ + cur_pos_, bulk_len_);
+      if (in_place_) {
+        in_place_buf_[cur_pos_ + bulk_len_] = '\0';
+        argv_slices_.emplace_back(input_buf_ + cur_pos_, bulk_len_);
+      } else {
+        argv_.emplace_back(input_buf_ + cur_pos_, bulk_len_);
+      }
       cur_pos_ = cur_pos_ + bulk_len_ + 2;
       bulk_len_ = -1;
       multibulk_len_--;
@@ -335,6 +485,30 @@ RedisParserStatus RedisParser::ProcessInputBuffer(
   return status_code_;
 }
 
+RedisParserStatus RedisParser::ProcessInputBufferInPlace(
+    char* input_buf, int length, int* parsed_len) {
+  if ((status_code_ != kRedisParserInitDone &&
+       status_code_ != kRedisParserHalf &&
+       status_code_ != kRedisParserDone) ||
+      redis_parser_type_ != REDIS_PARSER_REQUEST) {
+    SetParserStatus(kRedisParserError, kRedisParserInitError);
+    return status_code_;
+  }
+  in_place_ = true;
+  in_place_buf_ = input_buf;
+  input_buf_ = input_buf;
+  length_ = length;
+  // An incomplete command is parsed again from its start
+  ResetCommandStatus();
+  ProcessRequestBuffer();
+  *parsed_len = cur_pos_;
+  ResetRedisParser();
+  in_place_ = false;
+  in_place_buf_ = NULL;
+  argv_slices_.clear();
+  return status_code_;
+}
+
 // TODO AZ
 RedisParserStatus RedisParser::ProcessResponseBuffer() {
   SetParserStatus(kRedisParserDone);
@@ -343,6 +517,8 @@ RedisParserStatus RedisParser::ProcessResponseBuffer() {
 
 RedisParserStatus RedisParser::ProcessRequestBuffer() {
   RedisParserStatus ret;
+  command_start_ = cur_pos_;
+  bulk_missing_ = 0;
   while (cur_pos_ <= length_ - 1) {
     if (!redis_type_) {
       if (input_buf_[cur_pos_] == '*') {
@@ -366,6 +542,18 @@ RedisParserStatus RedisParser::ProcessRequestBuffer() {
       // Unknown requeset type;
       return kRedisParserError;
     }
+    if (in_place_) {
+      if (!argv_slices_.empty() && parser_settings_.DealSliceMessage &&
+          parser_settings_.DealSliceMessage(this, argv_slices_) != 0) {
+        SetParserStatus(kRedisParserError, kRedisParserDealError);
+        return status_code_;
+      }
+      argv_slices_.clear();
+      argv_.clear();
+      ResetCommandStatus();
+      command_start_ = cur_pos_;
+      continue;
+    }
     if (!argv_.empty()) {
       argvs_.push_back(argv_);
       if (parser_settings_.DealMessage) {
@@ -379,7 +567,7 @@ RedisParserStatus RedisParser::ProcessRequestBuffer() {
     // Reset
     ResetCommandStatus();
   }
-  if (parser_settings_.Complete) {
+  if (parser_settings_.Complete && !in_place_) {
     if (parser_settings_.Complete(this, argvs_) != 0) {
       SetParserStatus(kRedisParserError, kRedisParserCompleteError);
       return status_code_;
@@ -9,6 +9,7 @@
 #include <netinet/in.h>
 #include <arpa/inet.h>
 #include <sys/socket.h>
+#include <netinet/tcp.h>
 #include <fcntl.h>
 #include <string.h>
 
@@ -23,12 +24,9 @@ ServerSocket::ServerSocket(int port, bool is_block)
       send_timeout_(0),
       recv_timeout_(0),
       accept_timeout_(0),
-      accept_backlog_(1024),
-      tcp_send_buffer_(0),
-      tcp_recv_buffer_(0),
-      keep_alive_(false),
+      reuse_port_(false),
       listening_(false),
-  is_block_(is_block) {
+      is_block_(is_block) {
 }
 
 ServerSocket::~ServerSocket() {
@@ -49,6 +47,14 @@ int ServerSocket::Listen(const std::string &bind_ip) {
   if (ret < 0) {
     return kSetSockOptError;
   }
+#ifdef SO_REUSEPORT
+  if (reuse_port_) {
+    ret = setsockopt(sockfd_, SOL_SOCKET, SO_REUSEPORT, &yes, sizeof(yes));
+    if (ret < 0) {
+      return kSetSockOptError;
+    }
+  }
+#endif
 
   servaddr_.sin_family = AF_INET;
   if (bind_ip.empty()) {
@@ -60,11 +66,16 @@ int ServerSocket::Listen(const std::string &bind_ip) {
 
   fcntl(sockfd_, F_SETFD, fcntl(sockfd_, F_GETFD) | FD_CLOEXEC);
 
+  ret = SetListenOptions();
+  if (ret != kSuccess) {
+    return ret;
+  }
+
   ret = bind(sockfd_, (struct sockaddr *) &servaddr_, sizeof(servaddr_));
   if (ret < 0) {
     return kBindError;
   }
-  ret = listen(sockfd_, accept_backlog_);
+  ret = listen(sockfd_, profile_.backlog);
   if (ret < 0) {
     return kListenError;
   }
@@ -76,6 +87,81 @@ int ServerSocket::Listen(const std::string &bind_ip) {
   return kSuccess;
 }
 
+static int SetIntOption(int fd, int level, int name, int value) {
+  return setsockopt(fd, level, name, &value, sizeof(value));
+}
+
+/*
+ * Linux hands buffer sizes, TCP_NODELAY and SO_KEEPALIVE of the listener
+ * down to the accepted connections, which saves a few system calls per
+ * connection. Buffer sizes must be set before listen to be taken into
+ * account for the window scaling.
+ */
+int ServerSocket::SetListenOptions() {
+#ifdef __linux__
+  if ((profile_.send_buffer > 0 &&
+       SetIntOption(sockfd_, SOL_SOCKET, SO_SNDBUF, profile_.send_buffer) < 0) ||
+      (profile_.recv_buffer > 0 &&
+       SetIntOption(sockfd_, SOL_SOCKET, SO_RCVBUF, profile_.recv_buffer) < 0) ||
+      (profile_.tcp_nodelay &&
+       SetIntOption(sockfd_, IPPROTO_TCP, TCP_NODELAY, 1) < 0) ||
+      (profile_.keep_alive &&
+       SetIntOption(sockfd_, SOL_SOCKET, SO_KEEPALIVE, 1) < 0)) {
+    return kSetSockOptError;
+  }
+#endif
+#ifdef TCP_DEFER_ACCEPT
+  if (profile_.defer_accept > 0 &&
+      SetIntOption(sockfd_, IPPROTO_TCP, TCP_DEFER_ACCEPT,
+                   profile_.defer_accept) < 0) {
+    return kSetSockOptError;
+  }
+#endif
+  return kSuccess;
+}
+
+void ServerSocket::SetConnOptions(int connfd) const {
+#ifndef __linux__
+  if (profile_.send_buffer > 0) {
+    SetIntOption(connfd, SOL_SOCKET, SO_SNDBUF, profile_.send_buffer);
+  }
+  if (profile_.recv_buffer > 0) {
+    SetIntOption(connfd, SOL_SOCKET, SO_RCVBUF, profile_.recv_buffer);
+  }
+  if (profile_.tcp_nodelay) {
+    SetIntOption(connfd, IPPROTO_TCP, TCP_NODELAY, 1);
+  }
+  if (profile_.keep_alive) {
+    SetIntOption(connfd, SOL_SOCKET, SO_KEEPALIVE, 1);
+  }
+#endif
+#ifdef TCP_QUICKACK
+  if (profile_.quick_ack) {
+    SetIntOption(connfd, IPPROTO_TCP, TCP_QUICKACK, 1);
+  }
+#endif
+}
+
+int ServerSocket::Accept(struct sockaddr_in* cliaddr) {
+  socklen_t clilen = sizeof(*cliaddr);
+#ifdef __linux__
+  int connfd = accept4(sockfd_, (struct sockaddr *) cliaddr, &clilen,
+                       SOCK_NONBLOCK | SOCK_CLOEXEC);
+  if (connfd == -1) {
+    return -1;
+  }
+#else
+  int connfd = accept(sockfd_, (struct sockaddr *) cliaddr, &clilen);
+  if (connfd == -1) {
+    return -1;
+  }
+  fcntl(connfd, F_SETFD, fcntl(connfd, F_GETFD) | FD_CLOEXEC);
+  fcntl(connfd, F_SETFL, fcntl(connfd, F_GETFL) | O_NONBLOCK);
+#endif
+  SetConnOptions(connfd);
+  return connfd;
+}
+
 int ServerSocket::SetNonBlock() {
   flags_ = Setnonblocking(sockfd());
   if (flags_ == -1) {
@@ -12,6 +12,8 @@
 #include <string>
 #include <iostream>
 
+#include "pink/include/pink_define.h"
+
 namespace pink {
 
 class ServerSocket {
@@ -26,6 +28,17 @@ class ServerSocket {
    */
   int Listen(const std::string &bind_ip = std::string());
 
+  /*
+   * Accepts a connection, nonblocking and close-on-exec, with the conn
+   * options of the profile set. Returns -1 with errno if there is none
+   */
+  int Accept(struct sockaddr_in* cliaddr);
+  /*
+   * Sets the options of the profile that connections do not inherit from
+   * their listener, for those accepted elsewhere, e.g. through io_uring
+   */
+  void SetConnOptions(int connfd) const;
+
   void Close();
 
   /*
@@ -40,10 +53,18 @@ class ServerSocket {
   }
 
   void set_keep_alive(bool keep_alive) {
-    keep_alive_ = keep_alive;
+    profile_.keep_alive = keep_alive;
   }
   bool keep_alive() const {
-    return keep_alive_;
+    return profile_.keep_alive;
+  }
+
+  // Must be set before Listen
+  void set_profile(const SocketProfile& profile) {
+    profile_ = profile;
+  }
+  const SocketProfile& profile() const {
+    return profile_;
   }
 
   void set_send_timeout(int send_timeout) {
@@ -61,6 +82,17 @@ class ServerSocket {
     return recv_timeout_;
   }
 
+  /*
+   * Set SO_REUSEPORT, so several sockets can listen on the same port,
+   * must be called before Listen
+   */
+  void set_reuse_port(bool reuse_port) {
+    reuse_port_ = reuse_port;
+  }
+  bool reuse_port() const {
+    return reuse_port_;
+  }
+
   int sockfd() const {
     return sockfd_;
   }
@@ -71,6 +103,8 @@ class ServerSocket {
 
  private:
   int SetNonBlock();
+  // The options of the profile accepted connections inherit
+  int SetListenOptions();
   /*
    * The tcp server port and address
    */
@@ -79,10 +113,8 @@ class ServerSocket {
   int send_timeout_;
   int recv_timeout_;
   int accept_timeout_;
-  int accept_backlog_;
-  int tcp_send_buffer_;
-  int tcp_recv_buffer_;
-  bool keep_alive_;
+  SocketProfile profile_;
+  bool reuse_port_;
   bool listening_;
   bool is_block_;
 
@@ -12,6 +12,7 @@
 #include <netinet/in.h>
 #include <netinet/tcp.h>
 
+#include <algorithm>
 
 #include "slash/include/xdebug.h"
 #include "pink/src/pink_epoll.h"
@@ -69,7 +70,17 @@ ServerThread::ServerThread(int port,
 #ifdef __ENABLE_SSL
       security_(false),
 #endif
-      port_(port) {
+      port_(port),
+      immediate_write_(false),
+      reuse_port_(false),
+      io_backend_(kEpollBackend),
+      conn_placement_(kRoundRobinPlacement),
+      rebalance_interval_(0),
+      busy_poll_us_(0),
+      output_high_watermark_(0),
+      output_low_watermark_(0),
+      output_limit_closed_(0) {
+  SetDefaultOutputBufferLimits();
   pink_epoll_ = new PinkEpoll();
   ips_.insert("0.0.0.0");
 }
@@ -82,7 +93,17 @@ ServerThread::ServerThread(const std::string& bind_ip, int port,
 #ifdef __ENABLE_SSL
       security_(false),
 #endif
-      port_(port) {
+      port_(port),
+      immediate_write_(false),
+      reuse_port_(false),
+      io_backend_(kEpollBackend),
+      conn_placement_(kRoundRobinPlacement),
+      rebalance_interval_(0),
+      busy_poll_us_(0),
+      output_high_watermark_(0),
+      output_low_watermark_(0),
+      output_limit_closed_(0) {
+  SetDefaultOutputBufferLimits();
   pink_epoll_ = new PinkEpoll();
   ips_.insert(bind_ip);
 }
@@ -95,11 +116,43 @@ ServerThread::ServerThread(const std::set<std::string>& bind_ips, int port,
 #ifdef __ENABLE_SSL
       security_(false),
 #endif
-      port_(port) {
+      port_(port),
+      immediate_write_(false),
+      reuse_port_(false),
+      io_backend_(kEpollBackend),
+      conn_placement_(kRoundRobinPlacement),
+      rebalance_interval_(0),
+      busy_poll_us_(0),
+      output_high_watermark_(0),
+      output_low_watermark_(0),
+      output_limit_closed_(0) {
+  SetDefaultOutputBufferLimits();
   pink_epoll_ = new PinkEpoll();
   ips_ = bind_ips;
 }
 
+void ServerThread::SetDefaultOutputBufferLimits() {
+  // Those of Redis
+  output_buffer_limits_[kNormalConnClass] = {0, 0, 0};
+  output_buffer_limits_[kReplicaConnClass] =
+    {256 * 1024 * 1024, 64 * 1024 * 1024, 60};
+  output_buffer_limits_[kPubSubConnClass] =
+    {32 * 1024 * 1024, 8 * 1024 * 1024, 60};
+}
+
+ServerThread::BufferedBytes ServerThread::buffered_bytes() const {
+  BufferedBytes result = {0, 0, 0, 0};
+  for (const ConnInfo& info : conns_info()) {
+    result.input_bytes += info.input_bytes;
+    result.output_bytes += info.output_bytes;
+    result.max_output_bytes = std::max(result.max_output_bytes,
+                                       info.output_bytes);
+  }
+  result.limit_closed_conns =
+    output_limit_closed_.load(std::memory_order_relaxed);
+  return result;
+}
+
 ServerThread::~ServerThread() {
 #ifdef __ENABLE_SSL
   if (security_) {
@@ -124,6 +177,20 @@ int ServerThread::SetTcpNoDelay(int connfd) {
   return setsockopt(connfd, IPPROTO_TCP, TCP_NODELAY, &val, sizeof(val));
 }
 
+void ServerThread::SetBusyPoll(int connfd) {
+#ifdef SO_BUSY_POLL
+  int val = busy_poll_us_;
+  if (setsockopt(connfd, SOL_SOCKET, SO_BUSY_POLL, &val, sizeof(val)) == -1) {
+    // Needs CAP_NET_ADMIN above net.core.busy_read, spinning works without
+    return;
+  }
+#ifdef SO_PREFER_BUSY_POLL
+  val = 1;
+  setsockopt(connfd, SOL_SOCKET, SO_PREFER_BUSY_POLL, &val, sizeof(val));
+#endif
+#endif
+}
+
 int ServerThread::StartThread() {
   int ret = 0;
   ret = InitHandle();
@@ -143,6 +210,7 @@ int ServerThread::InitHandle() {
        iter != ips_.end();
        ++iter) {
     socket_p = new ServerSocket(port_);
+    socket_p->set_profile(socket_profile(*iter));
     server_sockets_.push_back(socket_p);
     ret = socket_p->Listen(*iter);
     if (ret != kSuccess) {
@@ -152,11 +220,72 @@ int ServerThread::InitHandle() {
     // init pool
     pink_epoll_->PinkAddEvent(
         socket_p->sockfd(), PinkEpoll::kRead | PinkEpoll::kError);
-    server_fds_.insert(socket_p->sockfd());
   }
   return kSuccess;
 }
 
+const SocketProfile& ServerThread::socket_profile(
+    const std::string& bind_ip) const {
+  auto iter = ip_socket_profiles_.find(bind_ip);
+  return iter != ip_socket_profiles_.end() ? iter->second : socket_profile_;
+}
+
+ServerSocket* ServerThread::FindServerSocket(int fd) const {
+  for (ServerSocket* server_socket : server_sockets_) {
+    if (server_socket->sockfd() == fd) {
+      return server_socket;
+    }
+  }
+  return nullptr;
+}
+
+void ServerThread::AcceptConns(
+    ServerSocket* listener,
+    const std::function<void(int, const std::string&)>& handle_conn) {
+  std::string ip_port;
+  for (int i = 0; i < listener->profile().accept_batch; i++) {
+    struct sockaddr_in cliaddr;
+    int connfd = listener->Accept(&cliaddr);
+    if (connfd == -1) {
+      if (errno == ECONNABORTED || errno == EINTR) {
+        continue;
+      }
+      if (errno != EAGAIN && errno != EWOULDBLOCK) {
+        log_warn("accept error, errno numberis %d, error reason %s",
+                 errno, strerror(errno));
+      }
+      return;
+    }
+    if (SetupAcceptedConn(connfd, cliaddr, &ip_port) != -1) {
+      handle_conn(connfd, ip_port);
+    }
+  }
+}
+
+int ServerThread::SetupAcceptedConn(int connfd,
+                                    const struct sockaddr_in& cliaddr,
+                                    std::string* ip_port) {
+  if (busy_poll_us_ > 0) {
+    SetBusyPoll(connfd);
+  }
+
+  // Just ip
+  char ip_addr[INET_ADDRSTRLEN] = "";
+  *ip_port = inet_ntop(AF_INET, &cliaddr.sin_addr, ip_addr, sizeof(ip_addr));
+
+  if (!handle_->AccessHandle(*ip_port) ||
+      !handle_->AccessHandle(connfd, *ip_port)) {
+    close(connfd);
+    return -1;
+  }
+
+  char port_buf[32];
+  ip_port->append(":");
+  snprintf(port_buf, sizeof(port_buf), "%d", ntohs(cliaddr.sin_port));
+  ip_port->append(port_buf);
+  return connfd;
+}
+
 void ServerThread::DoCronTask() {
 }
 
@@ -168,9 +297,7 @@ void *ServerThread::ThreadMain() {
   int nfds;
   PinkFiredEvent *pfe;
   Status s;
-  struct sockaddr_in cliaddr;
-  socklen_t clilen = sizeof(struct sockaddr);
-  int fd, connfd;
+  int fd;
 
   struct timeval when;
   gettimeofday(&when, nullptr);
@@ -183,9 +310,17 @@ void *ServerThread::ThreadMain() {
     timeout = PINK_CRON_INTERVAL;
   }
 
-  std::string ip_port;
-  char port_buf[32];
-  char ip_addr[INET_ADDRSTRLEN] = "";
+  auto handle_new_conn = [this](int connfd, const std::string& ip_port) {
+    /*
+     * Handle new connection,
+     * implemented in derived class
+     */
+    HandleNewConn(connfd, ip_port);
+  };
+
+  if (!cpu_affinity().empty()) {
+    pink_epoll_->LocalizeEventBuffers();
+  }
 
   while (!should_stop()) {
     if (cron_interval_ > 0) {
@@ -218,44 +353,10 @@ void *ServerThread::ThreadMain() {
       /*
        * Handle server event
        */
-      if (server_fds_.find(fd) != server_fds_.end()) {
+      ServerSocket* listener = FindServerSocket(fd);
+      if (listener != nullptr) {
         if (pfe->mask & PinkEpoll::kRead) {
-          connfd = accept(fd, (struct sockaddr *) &cliaddr, &clilen);
-          if (connfd == -1) {
-            log_warn("accept error, errno numberis %d, error reason %s",
-                     errno, strerror(errno));
-            continue;
-          }
-          fcntl(connfd, F_SETFD, fcntl(connfd, F_GETFD) | FD_CLOEXEC);
-
-          // not use nagel to avoid tcp 40ms delay
-          if (SetTcpNoDelay(connfd) == -1) {
-            log_warn("setsockopt error, errno numberis %d, error reason %s",
-                     errno, strerror(errno));
-            close(connfd);
-            continue;
-          }
-
-          // Just ip
-          ip_port =
-            inet_ntop(AF_INET, &cliaddr.sin_addr, ip_addr, sizeof(ip_addr));
-
-          if (!handle_->AccessHandle(ip_port) ||
-              !handle_->AccessHandle(connfd, ip_port)) {
-            close(connfd);
-            continue;
-          }
-
-          ip_port.append(":");
-          snprintf(port_buf, sizeof(port_buf), "%d", ntohs(cliaddr.sin_port));
-          ip_port.append(port_buf);
-
-          /*
-           * Handle new connection,
-           * implemented in derived class
-           */
-          HandleNewConn(connfd, ip_port);
-
+          AcceptConns(listener, handle_new_conn);
         } else if (pfe->mask & PinkEpoll::kError) {
           /*
            * this branch means there is error on the listen fd
@@ -271,6 +372,7 @@ void *ServerThread::ThreadMain() {
         HandleConnEvent(pfe);
       }
     }
+    pink_epoll_->RunTimers();
   }
 
   for (auto iter = server_sockets_.begin(); iter != server_sockets_.end();
@@ -278,7 +380,6 @@ void *ServerThread::ThreadMain() {
     delete *iter;
   }
   server_sockets_.clear();
-  server_fds_.clear();
 
   return nullptr;
 }
@@ -0,0 +1,133 @@
+// Copyright (c) 2015-present, Qihoo, Inc.  All rights reserved.
+// This source code is licensed under the BSD-style license found in the
+// LICENSE file in the root directory of this source tree. An additional grant
+// of patent rights can be found in the PATENTS file in the same directory.
+
+#include "pink/src/output_chain.h"
+
+#include <errno.h>
+#include <fcntl.h>
+#include <sys/socket.h>
+#include <unistd.h>
+
+#include <memory>
+#include <string>
+
+#include "gmock/gmock.h"
+
+using pink::OutputChain;
+
+class OutputChainTest : public ::testing::Test {
+ protected:
+  void SetUp() override {
+    ASSERT_EQ(0, socketpair(AF_UNIX, SOCK_STREAM, 0, fds_));
+    int sndbuf = 4096;
+    setsockopt(fds_[0], SOL_SOCKET, SO_SNDBUF, &sndbuf, sizeof(sndbuf));
+    fcntl(fds_[0], F_SETFL, fcntl(fds_[0], F_GETFL) | O_NONBLOCK);
+    fcntl(fds_[1], F_SETFL, fcntl(fds_[1], F_GETFL) | O_NONBLOCK);
+  }
+
+  void TearDown() override {
+    close(fds_[0]);
+    close(fds_[1]);
+  }
+
+  std::string Drain() {
+    std::string result;
+    char buf[65536];
+    ssize_t n;
+    while ((n = read(fds_[1], buf, sizeof(buf))) > 0) {
+      result.append(buf, n);
+    }
+    return result;
+  }
+
+  int fds_[2];
+};
+
+TEST_F(OutputChainTest, WritesSegmentsInOrder) {
+  OutputChain chain;
+  std::string expected;
+  std::string small = "+OK\r\n";
+  std::string big(100000, 'x');
+  std::shared_ptr<const std::string> shared =
+    std::make_shared<const std::string>(200000, 'y');
+  for (int i = 0; i < 100; i++) {
+    chain.Append(small);
+    expected += small;
+    if (i % 10 == 0) {
+      std::string moved = big;
+      moved[0] = static_cast<char>('a' + i / 10);
+      expected += moved;
+      chain.Append(std::move(moved));
+      chain.Append(shared);
+      expected += *shared;
+    }
+  }
+  EXPECT_EQ(expected.size(), chain.size());
+
+  // Partial writes resume in the middle of a segment
+  std::string received;
+  int rounds = 0;
+  while (!chain.empty()) {
+    ssize_t n = chain.WriteTo(fds_[0]);
+    if (n < 0) {
+      ASSERT_EQ(EAGAIN, errno);
+    }
+    received += Drain();
+    rounds++;
+  }
+  received += Drain();
+  EXPECT_GT(rounds, 1);
+  EXPECT_EQ(expected, received);
+  EXPECT_EQ(0u, chain.size());
+  // The chain has let go of the shared payload
+  EXPECT_EQ(1, shared.use_count());
+}
+
+TEST_F(OutputChainTest, MoveToAndBlockReuse) {
+  OutputChain chain;
+  std::string response = "$40\r\n" + std::string(40, 'f') + "\r\n";
+  const char* response_data = response.data();
+  chain.Append(std::move(response));
+  EXPECT_TRUE(response.empty());
+  std::shared_ptr<const std::string> shared =
+    std::make_shared<const std::string>("bar");
+  chain.Append(shared);
+  chain.Append("baz", 3);
+
+  OutputChain out;
+  out.Append("+OK\r\n", 5);
+  chain.MoveTo(&out);
+  EXPECT_TRUE(chain.empty());
+  EXPECT_EQ(58u, out.size());
+
+  // The segments were moved, not copied
+  struct iovec iov[8];
+  ASSERT_EQ(4, out.FillIov(iov, 8));
+  EXPECT_EQ(response_data, iov[1].iov_base);
+  EXPECT_EQ(shared->data(), iov[2].iov_base);
+  EXPECT_EQ(1, out.FillIov(iov, 1));
+
+  // Consuming resumes in the middle of a segment
+  out.Consume(7);
+  ASSERT_EQ(3, out.FillIov(iov, 8));
+  EXPECT_EQ(response_data + 2, iov[0].iov_base);
+  EXPECT_EQ(45u, iov[0].iov_len);
+  out.Consume(out.size());
+  EXPECT_TRUE(out.empty());
+  EXPECT_EQ(0, out.FillIov(iov, 8));
+
+  // Written blocks go back to the chain they were moved from
+  chain.Append(std::string(1000, 'r'));
+  chain.MoveTo(&out);
+  while (!out.empty()) {
+    out.WriteTo(fds_[0]);
+    Drain();
+  }
+  chain.MoveTo(&out);
+  std::string next = "+PONG\r\n";
+  chain.Append(std::move(next));
+  EXPECT_GE(next.capacity(), 1000u);
+  EXPECT_TRUE(next.empty());
+}
@@ -0,0 +1,133 @@
+// Copyright (c) 2015-present, Qihoo, Inc.  All rights reserved.
+// This source code is licensed under the BSD-style license found in the
+// LICENSE file in the root directory of this source tree. An additional grant
+// of patent rights can be found in the PATENTS file in the same directory.
+
+#include "pink/src/pattern_index.h"
+
+#include <stdlib.h>
+
+#include <algorithm>
+#include <string>
+#include <vector>
+
+#include "slash/include/slash_string.h"
+#include "gmock/gmock.h"
+
+using pink::PatternIndex;
+
+namespace {
+
+const char* kPieces[] = {
+  "a", "b", "c", "*", "?", "\\*", "\\a", "[abc]", "[^a]", "[a-b]", "[c-a]",
+  "[\\]]", "[]", "ab", "*b",
+};
+
+std::string RandomPattern() {
+  std::string pattern;
+  int pieces = rand() % 5;
+  for (int i = 0; i < pieces; i++) {
+    pattern += kPieces[rand() % (sizeof(kPieces) / sizeof(kPieces[0]))];
+  }
+  return pattern;
+}
+
+std::string RandomChannel() {
+  const char bytes[] = "abc*]\\";
+  std::string channel;
+  int len = 1 + rand() % 5;
+  for (int i = 0; i < len; i++) {
+    channel.push_back(bytes[rand() % (sizeof(bytes) - 1)]);
+  }
+  return channel;
+}
+
+std::vector<std::string> Matches(const PatternIndex& index,
+                                 const std::string& channel,
+                                 size_t* evaluated = nullptr) {
+  std::vector<void*> data;
+  size_t n = index.Match(channel, &data);
+  if (evaluated != nullptr) {
+    *evaluated = n;
+  }
+  std::vector<std::string> patterns;
+  for (size_t i = 0; i < data.size(); i++) {
+    patterns.push_back(*static_cast<std::string*>(data[i]));
+  }
+  std::sort(patterns.begin(), patterns.end());
+  return patterns;
+}
+
+}  // namespace
+
+TEST(PatternIndexTest, MatchesLikeStringmatchlen) {
+  srand(42);
+  std::vector<std::string> patterns;
+  for (int i = 0; i < 300; i++) {
+    patterns.push_back(RandomPattern());
+  }
+  std::sort(patterns.begin(), patterns.end());
+  patterns.erase(std::unique(patterns.begin(), patterns.end()),
+                 patterns.end());
+
+  PatternIndex index;
+  for (size_t i = 0; i < patterns.size(); i++) {
+    ASSERT_TRUE(index.Add(patterns[i], &patterns[i]));
+  }
+  EXPECT_EQ(patterns.size(), index.size());
+
+  for (int i = 0; i < 2000; i++) {
+    std::string channel = RandomChannel();
+    std::vector<std::string> expected;
+    for (size_t j = 0; j < patterns.size(); j++) {
+      if (slash::stringmatchlen(patterns[j].data(), patterns[j].size(),
+                                channel.data(), channel.size(), 0)) {
+        expected.push_back(patterns[j]);
+      }
+    }
+    ASSERT_EQ(expected, Matches(index, channel)) << "channel: " << channel;
+  }
+
+  std::vector<std::string> expected;
+  for (size_t j = 0; j < patterns.size(); j++) {
+    if (patterns[j].find_first_not_of('*') == std::string::npos) {
+      expected.push_back(patterns[j]);
+    }
+  }
+  EXPECT_EQ(expected, Matches(index, ""));
+}
+
+TEST(PatternIndexTest, EvaluatesOnlyCandidates) {
+  std::string patterns[] = {
+    "news.*", "news.sport", "news.[ab]*", "weather.*", "weather.?",
+    "*.log",
+  };
+  PatternIndex index;
+  for (size_t i = 0; i < sizeof(patterns) / sizeof(patterns[0]); i++) {
+    ASSERT_TRUE(index.Add(patterns[i], &patterns[i]));
+  }
+  EXPECT_FALSE(index.Add("news.*", nullptr));
+
+  size_t evaluated = 0;
+  std::vector<std::string> expected = {"news.*", "news.sport"};
+  EXPECT_EQ(expected, Matches(index, "news.sport", &evaluated));
+  // news.[ab]* and *.log, the prefix and the literal need no matching
+  EXPECT_EQ(2u, evaluated);
+
+  expected = {"*.log"};
+  EXPECT_EQ(expected, Matches(index, "app.log", &evaluated));
+  EXPECT_EQ(1u, evaluated);
+
+  EXPECT_TRUE(index.Remove("news.*"));
+  EXPECT_FALSE(index.Remove("news.*"));
+  EXPECT_TRUE(index.Remove("news.[ab]*"));
+  expected = {"news.sport"};
+  EXPECT_EQ(expected, Matches(index, "news.sport", &evaluated));
+  EXPECT_EQ(1u, evaluated);
+  EXPECT_EQ(4u, index.size());
+
+  // Removed nodes are reused
+  ASSERT_TRUE(index.Add("news.*", &patterns[0]));
+  expected = {"news.*"};
+  EXPECT_EQ(expected, Matches(index, "news.b", &evaluated));
+}
@@ -0,0 +1,120 @@
+// Copyright (c) 2015-present, Qihoo, Inc.  All rights reserved.
+// This source code is licensed under the BSD-style license found in the
+// LICENSE file in the root directory of this source tree. An additional grant
+// of patent rights can be found in the PATENTS file in the same directory.
+
+#include "pink/src/pink_epoll.h"
+
+#include <poll.h>
+
+#include <atomic>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include "gmock/gmock.h"
+
+using pink::PinkEpoll;
+using pink::PinkItem;
+
+namespace {
+
+// Waits up to 1s for a wakeup, then drains like a worker does
+size_t WaitAndDrain(PinkEpoll* epoll, std::vector<PinkItem>* items) {
+  struct pollfd pfd = {epoll->notify_receive_fd(), POLLIN, 0};
+  if (poll(&pfd, 1, 1000) <= 0) {
+    return 0;
+  }
+  return epoll->DrainNotifyQueue(items);
+}
+
+}  // namespace
+
+TEST(PinkEpollTest, QueueLimit) {
+  PinkEpoll epoll(3);
+  for (int i = 0; i < 3; i++) {
+    EXPECT_TRUE(epoll.Register(PinkItem(i, ""), false));
+  }
+  EXPECT_FALSE(epoll.Register(PinkItem(3, ""), false));
+  EXPECT_TRUE(epoll.Register(PinkItem(4, ""), true));
+
+  std::vector<PinkItem> items;
+  EXPECT_EQ(4u, WaitAndDrain(&epoll, &items));
+  ASSERT_EQ(4u, items.size());
+  EXPECT_EQ(0, items[0].fd());
+  EXPECT_EQ(4, items[3].fd());
+  // Room again once drained
+  EXPECT_TRUE(epoll.Register(PinkItem(5, ""), false));
+}
+
+TEST(PinkEpollTest, ProducersKeepTheirOrder) {
+  const int kProducers = 4;
+  // Each producer alone fills the ring of 256 slots many times over
+  const int kItems = 100000;
+  // Items move between ring and overflow list at racy moments, so repeat
+  for (int round = 0; round < 5; round++) {
+    PinkEpoll epoll;
+
+    /*
+     * The consumer first lets every producer fill the ring and push some
+     * into the overflow list, then drains while they keep pushing, so
+     * items go back and forth between the two
+     */
+    std::atomic<int> started(0);
+    std::vector<std::thread> producers;
+    for (int p = 0; p < kProducers; p++) {
+      producers.push_back(std::thread([&epoll, &started, p, kItems]() {
+        for (int i = 0; i < kItems; i++) {
+          if (i == 1000) {
+            started.fetch_add(1);
+          }
+          epoll.Register(PinkItem(p, std::to_string(i)), true);
+        }
+      }));
+    }
+    while (started.load() < kProducers) {
+      std::this_thread::yield();
+    }
+
+    std::vector<int> next(kProducers, 0);
+    size_t received = 0;
+    std::string error;
+    int idle = 0;
+    std::vector<PinkItem> items;
+    while (received < static_cast<size_t>(kProducers * kItems) && idle < 10) {
+      items.clear();
+      if (WaitAndDrain(&epoll, &items) == 0) {
+        idle++;
+        continue;
+      }
+      idle = 0;
+      for (const PinkItem& item : items) {
+        int p = item.fd();
+        // Neither lost, duplicated nor reordered
+        if (error.empty() &&
+            (p < 0 || p >= kProducers ||
+             item.ip_port() != std::to_string(next[p]))) {
+          error = "producer " + std::to_string(p) + " item " +
+              item.ip_port() + " instead of " + std::to_string(next[p]);
+        }
+        if (p >= 0 && p < kProducers) {
+          next[p]++;
+        }
+      }
+      received += items.size();
+    }
+    for (std::thread& producer : producers) {
+      producer.join();
+    }
+
+    ASSERT_EQ("", error) << "round " << round;
+    ASSERT_EQ(static_cast<size_t>(kProducers * kItems), received);
+    for (int p = 0; p < kProducers; p++) {
+      EXPECT_EQ(kItems, next[p]);
+    }
+    // Nothing left behind
+    EXPECT_TRUE(epoll.Register(PinkItem(0, ""), false));
+    items.clear();
+    EXPECT_EQ(1u, WaitAndDrain(&epoll, &items));
+  }
+}
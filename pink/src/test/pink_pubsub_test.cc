@@ -0,0 +1,165 @@
+// Copyright (c) 2015-present, Qihoo, Inc.  All rights reserved.
+// This source code is licensed under the BSD-style license found in the
+// LICENSE file in the root directory of this source tree. An additional grant
+// of patent rights can be found in the PATENTS file in the same directory.
+
+#include "pink/include/pink_pubsub.h"
+
+#include <fcntl.h>
+#include <poll.h>
+#include <sys/socket.h>
+#include <unistd.h>
+
+#include <memory>
+#include <string>
+#include <utility>
+#include <vector>
+
+#include "gmock/gmock.h"
+#include "pink/include/redis_conn.h"
+
+using pink::PubSubThread;
+
+namespace {
+
+class SubscriberConn : public pink::RedisConn {
+ public:
+  explicit SubscriberConn(int fd)
+      : RedisConn(fd, "subscriber", nullptr) {}
+
+ protected:
+  virtual int DealMessage(const pink::RedisCmdArgsType&,
+                          std::string*) override {
+    return 0;
+  }
+};
+
+std::string Bulk(const std::string& str) {
+  return "$" + std::to_string(str.size()) + "\r\n" + str + "\r\n";
+}
+
+std::string Message(const std::string& channel, const std::string& msg) {
+  return "*3\r\n" + Bulk("message") + Bulk(channel) + Bulk(msg);
+}
+
+std::string PMessage(const std::string& pattern, const std::string& channel,
+                     const std::string& msg) {
+  return "*4\r\n" + Bulk("pmessage") + Bulk(pattern) + Bulk(channel)
+      + Bulk(msg);
+}
+
+}  // namespace
+
+class PubSubTest : public ::testing::Test {
+ protected:
+  void SetUp() override {
+    ASSERT_EQ(pink::kSuccess, pubsub_.StartThread());
+  }
+
+  void TearDown() override {
+    pubsub_.StopThread();
+    for (size_t i = 0; i < client_fds_.size(); i++) {
+      close(client_fds_[i]);
+    }
+  }
+
+  // Returns the fd the subscriber's messages are read from
+  int Subscribe(const std::vector<std::string>& channels, bool pattern) {
+    int fds[2];
+    EXPECT_EQ(0, socketpair(AF_UNIX, SOCK_STREAM, 0, fds));
+    fcntl(fds[0], F_SETFL, fcntl(fds[0], F_GETFL) | O_NONBLOCK);
+    std::shared_ptr<pink::PinkConn> conn =
+        std::make_shared<SubscriberConn>(fds[0]);
+    std::vector<std::pair<std::string, int> > result;
+    pubsub_.Subscribe(conn, channels, pattern, &result);
+    EXPECT_EQ(channels.size(), result.size());
+    conn->set_is_writable(true);
+    pubsub_.UpdateConnReadyState(fds[0], PubSubThread::kReady);
+    client_fds_.push_back(fds[1]);
+    return fds[1];
+  }
+
+  // Reads until len bytes arrived or nothing more comes for a second
+  std::string Read(int fd, size_t len) {
+    std::string data;
+    char buf[4096];
+    while (data.size() < len) {
+      struct pollfd pfd = {fd, POLLIN, 0};
+      if (poll(&pfd, 1, 1000) <= 0) {
+        break;
+      }
+      ssize_t n = read(fd, buf, sizeof(buf));
+      if (n <= 0) {
+        break;
+      }
+      data.append(buf, n);
+    }
+    return data;
+  }
+
+  PubSubThread pubsub_;
+  std::vector<int> client_fds_;
+};
+
+TEST_F(PubSubTest, CountsReceivers) {
+  int sub = Subscribe({"news", "sport"}, false);
+  int psub = Subscribe({"n*", "x*"}, true);
+
+  EXPECT_EQ(2, pubsub_.Publish("news", "hello"));
+  EXPECT_EQ(1, pubsub_.Publish("nothing", "x"));
+  EXPECT_EQ(0, pubsub_.Publish("weather", "x"));
+
+  std::string expected = Message("news", "hello");
+  EXPECT_EQ(expected, Read(sub, expected.size()));
+  expected = PMessage("n*", "news", "hello")
+      + PMessage("n*", "nothing", "x");
+  EXPECT_EQ(expected, Read(psub, expected.size()));
+
+  PubSubThread::PatternMatchStats stats = pubsub_.pattern_match_stats();
+  EXPECT_EQ(3u, stats.publishes);
+  EXPECT_EQ(2u, stats.patterns_matched);
+}
+
+TEST_F(PubSubTest, DeliversInOrder) {
+  int sub = Subscribe({"news"}, false);
+  int psub = Subscribe({"ne?s"}, true);
+
+  const int kMessages = 1000;
+  std::string expected;
+  std::string pexpected;
+  slash::Mutex mu;
+  int receivers = 0;
+  for (int i = 0; i < kMessages; i++) {
+    std::string msg = std::to_string(i);
+    expected += Message("news", msg);
+    pexpected += PMessage("ne?s", "news", msg);
+    pubsub_.PublishAsync("news", msg, [&mu, &receivers](int n) {
+      slash::MutexLock l(&mu);
+      receivers += n;
+    });
+  }
+  // Handled after all of the asynchronous ones
+  EXPECT_EQ(2, pubsub_.Publish("news", "last"));
+  expected += Message("news", "last");
+  pexpected += PMessage("ne?s", "news", "last");
+  {
+    slash::MutexLock l(&mu);
+    EXPECT_EQ(2 * kMessages, receivers);
+  }
+
+  EXPECT_EQ(expected, Read(sub, expected.size()));
+  EXPECT_EQ(pexpected, Read(psub, pexpected.size()));
+}
+
+TEST_F(PubSubTest, PublishAfterStop) {
+  Subscribe({"news"}, false);
+  pubsub_.StopThread();
+
+  // Neither waits for the stopped thread
+  EXPECT_EQ(0, pubsub_.Publish("news", "hello"));
+  int receivers = -1;
+  pubsub_.PublishAsync("news", "hello", [&receivers](int n) {
+    receivers = n;
+  });
+  EXPECT_EQ(0, receivers);
+}
@@ -0,0 +1,245 @@
+// Copyright (c) 2015-present, Qihoo, Inc.  All rights reserved.
+// This source code is licensed under the BSD-style license found in the
+// LICENSE file in the root directory of this source tree. An additional grant
+// of patent rights can be found in the PATENTS file in the same directory.
+
+#include "pink/include/redis_conn.h"
+
+#include <fcntl.h>
+#include <sys/socket.h>
+#include <sys/uio.h>
+#include <unistd.h>
+
+#include <atomic>
+#include <memory>
+#include <string>
+#include <utility>
+#include <vector>
+
+#include "gmock/gmock.h"
+#include "pink/src/output_chain.h"
+#include "pink/src/pink_epoll.h"
+
+using pink::RedisConn;
+
+namespace {
+
+std::atomic<int> deal_count(0);
+// Buffer of the last reply handed over by a "big" command
+const char* big_reply = nullptr;
+
+/*
+ * Replies +<command>, commands starting with "slow" are offloaded,
+ * commands containing "fail" fail after replying -ERR and commands starting
+ * with "big" hand a large reply over with AppendReply
+ */
+class OffloadConn : public RedisConn {
+ public:
+  OffloadConn(int fd, pink::PinkEpoll* pink_epoll)
+      : RedisConn(fd, "offload", nullptr, pink_epoll) {}
+
+  virtual bool ShouldOffload(const pink::RedisCmdArgsSlice& argv) override {
+    return argv[0].starts_with("slow");
+  }
+
+ protected:
+  virtual int DealMessage(const pink::RedisCmdArgsType& argv,
+                          std::string* response) override {
+    deal_count.fetch_add(1);
+    if (argv[0].find("fail") != std::string::npos) {
+      response->append("-ERR " + argv[0] + "\r\n");
+      return -1;
+    }
+    if (argv[0].compare(0, 3, "big") == 0) {
+      std::string reply = "$65536\r\n" + std::string(65536, 'v') + "\r\n";
+      big_reply = reply.data();
+      AppendReply(std::move(reply));
+      return 0;
+    }
+    response->append("+" + argv[0] + "\r\n");
+    return 0;
+  }
+};
+
+// Sees the commands of a kSynchronous conn again in ProcessRedisCmds
+class ProcessingConn : public OffloadConn {
+ public:
+  ProcessingConn(int fd, pink::PinkEpoll* pink_epoll)
+      : OffloadConn(fd, pink_epoll) {}
+
+  virtual void ProcessRedisCmds(
+      const std::vector<pink::RedisCmdArgsType>& argvs, bool async,
+      std::string* response) override {
+    EXPECT_FALSE(async);
+    std::vector<std::string> names;
+    for (size_t i = 0; i < argvs.size(); i++) {
+      names.push_back(argvs[i][0]);
+    }
+    processed.push_back(names);
+    response->append("+processed\r\n");
+  }
+
+  std::vector<std::vector<std::string> > processed;
+};
+
+// Keeps the offloaded tasks for the test to run in any order
+class ManualExecutor : public pink::RedisOffloadExecutor {
+ public:
+  virtual void Schedule(pink::TaskFunc func, void* arg) override {
+    tasks_.push_back(std::make_pair(func, arg));
+  }
+  size_t size() const {
+    return tasks_.size();
+  }
+  void Run(size_t i) {
+    tasks_[i].first(tasks_[i].second);
+  }
+
+ private:
+  std::vector<std::pair<pink::TaskFunc, void*> > tasks_;
+};
+
+}  // namespace
+
+class RedisConnOffloadTest : public ::testing::Test {
+ protected:
+  void SetUp() override {
+    deal_count.store(0);
+    ASSERT_EQ(0, socketpair(AF_UNIX, SOCK_STREAM, 0, fds_));
+    fcntl(fds_[0], F_SETFL, fcntl(fds_[0], F_GETFL) | O_NONBLOCK);
+    fcntl(fds_[1], F_SETFL, fcntl(fds_[1], F_GETFL) | O_NONBLOCK);
+    conn_ = std::make_shared<OffloadConn>(fds_[0], &epoll_);
+    conn_->SetOffloadExecutor(&executor_);
+  }
+
+  void TearDown() override {
+    close(fds_[0]);
+    close(fds_[1]);
+  }
+
+  // Sends the commands, one argument each, and lets the conn read them
+  void Send(const std::vector<std::string>& commands) {
+    Send(commands, conn_.get());
+  }
+  void Send(const std::vector<std::string>& commands, RedisConn* conn) {
+    std::string input;
+    for (size_t i = 0; i < commands.size(); i++) {
+      input += "*1\r\n$" + std::to_string(commands[i].size()) + "\r\n"
+          + commands[i] + "\r\n";
+    }
+    ASSERT_EQ(static_cast<ssize_t>(input.size()),
+              write(fds_[1], input.data(), input.size()));
+    pink::ReadStatus status = conn->GetRequest();
+    ASSERT_TRUE(status == pink::kReadAll || status == pink::kReadHalf);
+  }
+
+  // What the conn writes now
+  std::string Written() {
+    return Written(conn_.get());
+  }
+  std::string Written(RedisConn* conn) {
+    EXPECT_EQ(pink::kWriteAll, conn->SendReply());
+    std::string data;
+    char buf[4096];
+    ssize_t n;
+    while ((n = read(fds_[1], buf, sizeof(buf))) > 0) {
+      data.append(buf, n);
+    }
+    return data;
+  }
+
+  int fds_[2];
+  pink::PinkEpoll epoll_;
+  ManualExecutor executor_;
+  std::shared_ptr<OffloadConn> conn_;
+};
+
+TEST_F(RedisConnOffloadTest, RepliesInRequestOrder) {
+  Send({"slow1", "slow2", "slow3"});
+  ASSERT_EQ(3u, executor_.size());
+
+  executor_.Run(2);
+  EXPECT_EQ("", Written());
+  executor_.Run(0);
+  EXPECT_EQ("+slow1\r\n", Written());
+  executor_.Run(1);
+  EXPECT_EQ("+slow2\r\n+slow3\r\n", Written());
+  EXPECT_FALSE(conn_->IsClose());
+}
+
+TEST_F(RedisConnOffloadTest, FailedCommandClosesAfterEarlierReplies) {
+  Send({"slow1", "slowfail", "slow3"});
+  ASSERT_EQ(3u, executor_.size());
+
+  executor_.Run(2);
+  executor_.Run(1);
+  executor_.Run(0);
+  EXPECT_EQ("+slow1\r\n-ERR slowfail\r\n", Written());
+  EXPECT_TRUE(conn_->IsClose());
+  // Nothing after the failed command is ever written
+  EXPECT_EQ("", Written());
+}
+
+TEST_F(RedisConnOffloadTest, SynchronousCommandsWaitBehindOffloaded) {
+  Send({"get1", "slow2", "get3", "slow4"});
+  ASSERT_EQ(2u, executor_.size());
+  // Nothing was pending for get1
+  EXPECT_EQ("+get1\r\n", Written());
+
+  executor_.Run(1);
+  EXPECT_EQ("", Written());
+  Send({"get5"});
+  executor_.Run(0);
+  EXPECT_EQ("+slow2\r\n+get3\r\n+slow4\r\n+get5\r\n", Written());
+
+  // Handled right away again once the queue has drained
+  Send({"get6"});
+  EXPECT_EQ("+get6\r\n", Written());
+  EXPECT_EQ(4 + 2, deal_count.load());
+}
+
+TEST_F(RedisConnOffloadTest, ConnDestroyedWhileOffloaded) {
+  Send({"slow1"});
+  ASSERT_EQ(1u, executor_.size());
+  std::weak_ptr<OffloadConn> weak = conn_;
+  conn_.reset();
+  EXPECT_TRUE(weak.expired());
+
+  // The task only holds the conn weakly and drops the command
+  executor_.Run(0);
+  EXPECT_EQ(0, deal_count.load());
+}
+
+TEST_F(RedisConnOffloadTest, SynchronousCommandsReachProcessRedisCmds) {
+  ProcessingConn conn(fds_[0], &epoll_);
+  Send({"get1", "get2"}, &conn);
+  Send({"get3"}, &conn);
+  std::vector<std::vector<std::string> > expected = {{"get1", "get2"},
+                                                     {"get3"}};
+  EXPECT_EQ(expected, conn.processed);
+  EXPECT_EQ("+get1\r\n+get2\r\n+processed\r\n+get3\r\n+processed\r\n",
+            Written(&conn));
+}
+
+TEST_F(RedisConnOffloadTest, LargeReplyIsNotCopied) {
+  conn_->SetOffloadExecutor(nullptr);
+  Send({"get1", "big2", "get3"});
+  pink::OutputChain output;
+  ASSERT_TRUE(conn_->TakeOutput(&output));
+
+  // The reply is written from the buffer it was built in
+  struct iovec iov[8];
+  int n = output.FillIov(iov, 8);
+  std::string written;
+  bool found = false;
+  for (int i = 0; i < n; i++) {
+    if (iov[i].iov_base == big_reply) {
+      found = true;
+    }
+    written.append(static_cast<const char*>(iov[i].iov_base), iov[i].iov_len);
+  }
+  EXPECT_TRUE(found);
+  EXPECT_EQ("+get1\r\n$65536\r\n" + std::string(65536, 'v') + "\r\n+get3\r\n",
+            written);
+  EXPECT_EQ(written.size(), output.size());
+}
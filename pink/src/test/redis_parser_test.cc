@@ -0,0 +1,271 @@
+// Copyright (c) 2015-present, Qihoo, Inc.  All rights reserved.
+// This source code is licensed under the BSD-style license found in the
+// LICENSE file in the root directory of this source tree. An additional grant
+// of patent rights can be found in the PATENTS file in the same directory.
+
+#include "pink/include/redis_parser.h"
+
+#include <string.h>
+
+#include <string>
+#include <utility>
+#include <vector>
+
+#include "gmock/gmock.h"
+#include "pink/src/newline_scanner.h"
+
+using pink::RedisCmdArgsType;
+using pink::RedisParser;
+
+namespace {
+
+struct ParseResult {
+  std::vector<RedisCmdArgsType> argvs;
+  // get_bulk_missing() after the first call
+  long bulk_missing;
+  bool error;
+};
+
+int DealMessage(RedisParser* parser, const RedisCmdArgsType& argv) {
+  static_cast<ParseResult*>(parser->data)->argvs.push_back(argv);
+  return 0;
+}
+
+int DealSliceMessage(RedisParser* parser, const pink::RedisCmdArgsSlice& argv) {
+  RedisCmdArgsType copy;
+  for (size_t i = 0; i < argv.size(); i++) {
+    // Each argument is also a C string
+    EXPECT_EQ('\0', argv[i].data()[argv[i].size()]);
+    copy.push_back(argv[i].ToString());
+  }
+  static_cast<ParseResult*>(parser->data)->argvs.push_back(copy);
+  return 0;
+}
+
+// Feeds input in the pieces ending at cuts, like reads from a socket
+ParseResult ParseCopying(const std::string& input,
+                         const std::vector<size_t>& cuts) {
+  ParseResult result;
+  result.bulk_missing = -1;
+  result.error = false;
+  pink::RedisParserSettings settings;
+  settings.DealMessage = DealMessage;
+  RedisParser parser;
+  parser.data = &result;
+  parser.RedisParserInit(REDIS_PARSER_REQUEST, settings);
+  size_t fed = 0;
+  for (size_t i = 0; i < cuts.size(); i++) {
+    int parsed = 0;
+    pink::RedisParserStatus status = parser.ProcessInputBuffer(
+        input.data() + fed, static_cast<int>(cuts[i] - fed), &parsed);
+    if (i == 0) {
+      result.bulk_missing = parser.get_bulk_missing();
+    }
+    if (status == pink::kRedisParserError) {
+      result.error = true;
+    }
+    fed = cuts[i];
+  }
+  return result;
+}
+
+// Like RedisConn: the unparsed rest is passed again with the next piece
+ParseResult ParseInPlace(const std::string& input,
+                         const std::vector<size_t>& cuts) {
+  ParseResult result;
+  result.bulk_missing = -1;
+  result.error = false;
+  pink::RedisParserSettings settings;
+  settings.DealSliceMessage = DealSliceMessage;
+  RedisParser parser;
+  parser.data = &result;
+  parser.RedisParserInit(REDIS_PARSER_REQUEST, settings);
+  std::string buf;
+  size_t fed = 0;
+  for (size_t i = 0; i < cuts.size(); i++) {
+    buf.append(input, fed, cuts[i] - fed);
+    fed = cuts[i];
+    int parsed = 0;
+    pink::RedisParserStatus status = parser.ProcessInputBufferInPlace(
+        &buf[0], static_cast<int>(buf.size()), &parsed);
+    if (i == 0) {
+      result.bulk_missing = parser.get_bulk_missing();
+    }
+    if (status == pink::kRedisParserError) {
+      result.error = true;
+    }
+    buf.erase(0, parsed);
+  }
+  EXPECT_EQ("", buf);
+  return result;
+}
+
+/*
+ * Pipelined commands and what they parse to. bulks holds where the data
+ * of each bulk argument starts and where its "\r\n" ends.
+ */
+struct Pipeline {
+  std::string input;
+  std::vector<RedisCmdArgsType> argvs;
+  std::vector<std::pair<size_t, size_t> > bulks;
+
+  void Multibulk(const RedisCmdArgsType& argv) {
+    input += "*" + std::to_string(argv.size()) + "\r\n";
+    for (size_t i = 0; i < argv.size(); i++) {
+      input += "$" + std::to_string(argv[i].size()) + "\r\n";
+      size_t start = input.size();
+      input += argv[i] + "\r\n";
+      bulks.push_back(std::make_pair(start, input.size()));
+    }
+    argvs.push_back(argv);
+  }
+  void Inline(const std::string& line, const RedisCmdArgsType& argv) {
+    input += line;
+    argvs.push_back(argv);
+  }
+
+  // What get_bulk_missing() returns when the input ends at cut
+  long BulkMissing(size_t cut) const {
+    for (size_t i = 0; i < bulks.size(); i++) {
+      if (bulks[i].first < cut && cut < bulks[i].second) {
+        return static_cast<long>(bulks[i].second - cut);
+      }
+    }
+    return 0;
+  }
+};
+
+Pipeline MakePipeline() {
+  Pipeline p;
+  p.Multibulk({"SET", "key", "value"});
+  p.Inline("PING\r\n", {"PING"});
+  // Lengths around the 16 and 32 byte vectors
+  p.Multibulk({"SET", std::string(15, 'k'), std::string(16, 'v')});
+  p.Multibulk({"SET", std::string(31, 'k'), std::string(32, 'v')});
+  p.Multibulk({"GET", ""});
+  p.Inline("set k \"a b\"\r\n", {"set", "k", "a b"});
+  // Separators inside a bulk argument are data
+  p.Multibulk({"SET", "k", "a\r\n$3\r\n*1\r\nb\n"});
+  p.Multibulk({"SET", "big", std::string(1000, 'x')});
+  p.Inline("GET " + std::string(40, 'g') + "\r\n", {"GET", std::string(40, 'g')});
+  p.Multibulk({"INCR", "counter"});
+  return p;
+}
+
+std::vector<std::pair<std::string, pink::NewlineScanner> > Scanners() {
+  std::vector<std::pair<std::string, pink::NewlineScanner> > scanners;
+  scanners.push_back(std::make_pair(
+        "scalar", pink::GetNewlineScanner(pink::kNewlineScalar)));
+  if (pink::GetNewlineScanner(pink::kNewlineSSE2) != nullptr) {
+    scanners.push_back(std::make_pair(
+          "sse2", pink::GetNewlineScanner(pink::kNewlineSSE2)));
+  }
+  if (pink::GetNewlineScanner(pink::kNewlineAVX2) != nullptr) {
+    scanners.push_back(std::make_pair(
+          "avx2", pink::GetNewlineScanner(pink::kNewlineAVX2)));
+  }
+  return scanners;
+}
+
+}  // namespace
+
+class RedisParserTest : public ::testing::Test {
+ protected:
+  void TearDown() override {
+    // Back to the widest one
+    std::vector<std::pair<std::string, pink::NewlineScanner> > scanners =
+        Scanners();
+    pink::SetNewlineScanner(scanners.back().second);
+  }
+};
+
+TEST_F(RedisParserTest, ScannersFindTheFirstNewline) {
+  std::vector<std::pair<std::string, pink::NewlineScanner> > scanners =
+      Scanners();
+  pink::NewlineScanner scalar = scanners[0].second;
+  char buf[160];
+  for (size_t s = 1; s < scanners.size(); s++) {
+    pink::NewlineScanner scan = scanners[s].second;
+    // Every start alignment, every length and every position of "\r\n"
+    for (int start = 0; start < 32; start++) {
+      for (int len = 0; len <= 96; len++) {
+        const char* p = buf + start;
+        const char* end = p + len;
+        memset(buf, 'a', sizeof(buf));
+        ASSERT_EQ(end, scan(p, end)) << scanners[s].first;
+        // A newline just past the end is not found
+        buf[start + len] = '\n';
+        ASSERT_EQ(end, scan(p, end)) << scanners[s].first;
+        for (int pos = 0; pos < len; pos++) {
+          memset(buf, 'a', sizeof(buf));
+          if (pos > 0) {
+            buf[start + pos - 1] = '\r';
+          }
+          buf[start + pos] = '\n';
+          if (pos + 8 < len) {
+            buf[start + pos + 8] = '\n';
+          }
+          ASSERT_EQ(p + pos, scan(p, end))
+              << scanners[s].first << " start " << start << " len " << len
+              << " pos " << pos;
+          ASSERT_EQ(scalar(p, end), scan(p, end));
+        }
+      }
+    }
+  }
+}
+
+TEST_F(RedisParserTest, NewlineOnVectorBoundary) {
+  std::vector<std::pair<std::string, pink::NewlineScanner> > scanners =
+      Scanners();
+  for (size_t s = 0; s < scanners.size(); s++) {
+    pink::SetNewlineScanner(scanners[s].second);
+    // The '\n' of the inline command at 15, 16, 31, 32, ... into the input
+    for (size_t n = 1; n <= 100; n++) {
+      std::string input = std::string(n, 'a') + "\r\n";
+      std::vector<RedisCmdArgsType> expected = {{std::string(n, 'a')}};
+      std::vector<size_t> cuts = {input.size()};
+      ParseResult copying = ParseCopying(input, cuts);
+      ParseResult in_place = ParseInPlace(input, cuts);
+      ASSERT_FALSE(copying.error);
+      ASSERT_FALSE(in_place.error);
+      ASSERT_EQ(expected, copying.argvs) << scanners[s].first << " " << n;
+      ASSERT_EQ(expected, in_place.argvs) << scanners[s].first << " " << n;
+    }
+  }
+}
+
+TEST_F(RedisParserTest, SplitAtEveryOffset) {
+  Pipeline pipeline = MakePipeline();
+  const std::string& input = pipeline.input;
+  std::vector<std::pair<std::string, pink::NewlineScanner> > scanners =
+      Scanners();
+  for (size_t s = 0; s < scanners.size(); s++) {
+    pink::SetNewlineScanner(scanners[s].second);
+    for (size_t cut = 0; cut <= input.size(); cut++) {
+      std::vector<size_t> cuts = {cut, input.size()};
+      ParseResult copying = ParseCopying(input, cuts);
+      ParseResult in_place = ParseInPlace(input, cuts);
+      ASSERT_FALSE(copying.error) << scanners[s].first << " cut " << cut;
+      ASSERT_FALSE(in_place.error) << scanners[s].first << " cut " << cut;
+      ASSERT_EQ(pipeline.argvs, copying.argvs)
+          << scanners[s].first << " cut " << cut;
+      ASSERT_EQ(pipeline.argvs, in_place.argvs)
+          << scanners[s].first << " cut " << cut;
+      if (cut < input.size()) {
+        ASSERT_EQ(pipeline.BulkMissing(cut), copying.bulk_missing)
+            << scanners[s].first << " cut " << cut;
+        ASSERT_EQ(pipeline.BulkMissing(cut), in_place.bulk_missing)
+            << scanners[s].first << " cut " << cut;
+      }
+    }
+
+    // One byte at a time
+    std::vector<size_t> cuts;
+    for (size_t cut = 1; cut <= input.size(); cut++) {
+      cuts.push_back(cut);
+    }
+    ASSERT_EQ(pipeline.argvs, ParseCopying(input, cuts).argvs);
+    ASSERT_EQ(pipeline.argvs, ParseInPlace(input, cuts).argvs);
+  }
+}
@@ -0,0 +1,190 @@
+// Copyright (c) 2015-present, Qihoo, Inc.  All rights reserved.
+// This source code is licensed under the BSD-style license found in the
+// LICENSE file in the root directory of this source tree. An additional grant
+// of patent rights can be found in the PATENTS file in the same directory.
+
+#include "pink/include/timer_service.h"
+
+#include <stdint.h>
+
+#include <algorithm>
+#include <thread>
+#include <vector>
+
+#include "gmock/gmock.h"
+#include "slash/include/slash_mutex.h"
+
+using pink::TimerService;
+using pink::TimerTask;
+
+namespace {
+
+// Long enough to never come due while a test runs
+const uint64_t kNever = 3600 * 1000;
+
+/*
+ * Records the tasks handed over, and how many at once. While blocked, the
+ * timer thread is held in ScheduleTimerTasks.
+ */
+class RecordingTarget : public pink::TimerTarget {
+ public:
+  RecordingTarget() : cv_(&mu_), blocked_(false), entered_(0) {}
+  virtual void ScheduleTimerTasks(
+      const std::vector<TimerTask>& tasks) override {
+    slash::MutexLock l(&mu_);
+    entered_++;
+    cv_.SignalAll();
+    while (blocked_) {
+      cv_.Wait();
+    }
+    for (const TimerTask& task : tasks) {
+      fired_.push_back(*static_cast<int*>(task.arg));
+    }
+    batches_.push_back(tasks.size());
+    cv_.SignalAll();
+  }
+
+  // Waits up to 10s for count tasks
+  std::vector<int> WaitFor(size_t count) {
+    slash::MutexLock l(&mu_);
+    for (int i = 0; i < 100 && fired_.size() < count; i++) {
+      cv_.TimedWait(100);
+    }
+    return fired_;
+  }
+  // Waits up to 10s for the timer thread to be held
+  bool WaitEntered(int count) {
+    slash::MutexLock l(&mu_);
+    for (int i = 0; i < 100 && entered_ < count; i++) {
+      cv_.TimedWait(100);
+    }
+    return entered_ >= count;
+  }
+  void set_blocked(bool blocked) {
+    slash::MutexLock l(&mu_);
+    blocked_ = blocked;
+    cv_.SignalAll();
+  }
+  std::vector<size_t> batches() {
+    slash::MutexLock l(&mu_);
+    return batches_;
+  }
+
+ private:
+  slash::Mutex mu_;
+  slash::CondVar cv_;
+  bool blocked_;
+  int entered_;
+  std::vector<int> fired_;
+  std::vector<size_t> batches_;
+};
+
+void Nothing(void*) {}
+
+}  // namespace
+
+TEST(TimerServiceTest, CancelAndReschedule) {
+  TimerService service;
+  ASSERT_EQ(0, service.StartThread());
+  RecordingTarget target;
+  int ids[] = {1, 2, 3, 4};
+  uint64_t first = service.Add(kNever, &target, &Nothing, &ids[0]);
+  uint64_t canceled = service.Add(kNever, &target, &Nothing, &ids[1]);
+  uint64_t moved = service.Add(kNever, &target, &Nothing, &ids[2]);
+  uint64_t last = service.Add(kNever, &target, &Nothing, &ids[3]);
+  EXPECT_NE(0u, first);
+  EXPECT_EQ(4u, service.pending(&target));
+
+  EXPECT_TRUE(service.Cancel(canceled));
+  EXPECT_FALSE(service.Cancel(canceled));
+  EXPECT_FALSE(service.Reschedule(canceled, 0));
+  EXPECT_EQ(3u, service.pending(&target));
+  EXPECT_EQ(3u, service.size());
+
+  // Only the rescheduled timers come due, in the order they were moved
+  EXPECT_TRUE(service.Reschedule(moved, 0));
+  std::vector<int> expected = {3};
+  EXPECT_EQ(expected, target.WaitFor(1));
+  EXPECT_TRUE(service.Reschedule(last, 1));
+  expected.push_back(4);
+  EXPECT_EQ(expected, target.WaitFor(2));
+  EXPECT_EQ(1u, service.pending(&target));
+  EXPECT_TRUE(service.Reschedule(first, 0));
+  expected.push_back(1);
+  EXPECT_EQ(expected, target.WaitFor(3));
+
+  EXPECT_EQ(0u, service.pending(&target));
+  EXPECT_EQ(0u, service.size());
+  // Handles of timers that came due are stale
+  EXPECT_FALSE(service.Reschedule(first, 10));
+  EXPECT_FALSE(service.Cancel(moved));
+}
+
+TEST(TimerServiceTest, DueTimersComeInBatches) {
+  TimerService service;
+  ASSERT_EQ(0, service.StartThread());
+  RecordingTarget target;
+  std::vector<int> ids(1001);
+  for (size_t i = 0; i < ids.size(); i++) {
+    ids[i] = static_cast<int>(i);
+  }
+
+  // Hold the timer thread in the first batch
+  target.set_blocked(true);
+  service.Add(0, &target, &Nothing, &ids[0]);
+  ASSERT_TRUE(target.WaitEntered(1));
+  // All due by the time the thread looks again
+  for (size_t i = 1; i < ids.size(); i++) {
+    service.Add(0, &target, &Nothing, &ids[i]);
+  }
+  target.set_blocked(false);
+  // Timers due at once run in no particular order
+  std::vector<int> fired = target.WaitFor(ids.size());
+  std::sort(fired.begin(), fired.end());
+  EXPECT_EQ(ids, fired);
+  std::vector<size_t> expected = {1, ids.size() - 1};
+  EXPECT_EQ(expected, target.batches());
+
+  service.Add(kNever, &target, &Nothing, &ids[0]);
+  service.CancelAll(&target);
+  EXPECT_EQ(0u, service.pending(&target));
+  EXPECT_EQ(0u, service.size());
+}
+
+TEST(TimerServiceTest, CancelAllWaitsForTheTarget) {
+  TimerService service;
+  ASSERT_EQ(0, service.StartThread());
+  RecordingTarget target;
+  int id = 1;
+  target.set_blocked(true);
+  service.Add(0, &target, &Nothing, &id);
+  ASSERT_TRUE(target.WaitEntered(1));
+
+  // The task is being handed over, CancelAll returns once that is done
+  std::vector<size_t> batches;
+  slash::Mutex mu;
+  slash::CondVar cv(&mu);
+  bool done = false;
+  std::thread canceler([&]() {
+    service.CancelAll(&target);
+    batches = target.batches();
+    slash::MutexLock l(&mu);
+    done = true;
+    cv.Signal();
+  });
+  {
+    slash::MutexLock l(&mu);
+    EXPECT_FALSE(done);
+  }
+  target.set_blocked(false);
+  {
+    slash::MutexLock l(&mu);
+    for (int i = 0; i < 100 && !done; i++) {
+      cv.TimedWait(100);
+    }
+    EXPECT_TRUE(done);
+  }
+  canceler.join();
+  std::vector<size_t> expected = {1};
+  EXPECT_EQ(expected, batches);
+}
@@ -0,0 +1,112 @@
+// Copyright (c) 2015-present, Qihoo, Inc.  All rights reserved.
+// This source code is licensed under the BSD-style license found in the
+// LICENSE file in the root directory of this source tree. An additional grant
+// of patent rights can be found in the PATENTS file in the same directory.
+
+#include "pink/src/timer_wheel.h"
+
+#include <stdint.h>
+#include <vector>
+
+#include "gmock/gmock.h"
+
+using pink::TimerWheel;
+
+TEST(TimerWheelTest, RunsInOrderAcrossLevels) {
+  const uint64_t start = 1000003;
+  TimerWheel wheel(start);
+  std::vector<uint64_t> fired;
+  const uint64_t delays[] = {70000, 1, 300, 255, 256, 20000000, 65536, 2};
+  for (uint64_t delay : delays) {
+    wheel.Add(start + delay, [&fired, delay]() {
+      fired.push_back(delay);
+    });
+  }
+  EXPECT_EQ(8u, wheel.size());
+
+  uint64_t now = start;
+  while (wheel.size() > 0) {
+    uint64_t next = wheel.NextWakeup();
+    ASSERT_GT(next, now);
+    // Nothing may be due before the announced wakeup
+    EXPECT_EQ(0u, wheel.Advance(next - 1));
+    now = next;
+    wheel.Advance(now);
+    if (!fired.empty()) {
+      EXPECT_LE(start + fired.back(), now);
+    }
+  }
+  std::vector<uint64_t> expected = {1, 2, 255, 256, 300, 65536, 70000, 20000000};
+  EXPECT_EQ(expected, fired);
+  EXPECT_EQ(UINT64_MAX, wheel.NextWakeup());
+}
+
+TEST(TimerWheelTest, FiresAtExpiry) {
+  TimerWheel wheel(0);
+  int count = 0;
+  wheel.Add(1000, [&count]() { count++; });
+  EXPECT_EQ(0u, wheel.Advance(999));
+  EXPECT_EQ(0, count);
+  EXPECT_EQ(1u, wheel.Advance(1000));
+  EXPECT_EQ(1, count);
+
+  // Already expired runs with the next Advance
+  wheel.Add(10, [&count]() { count++; });
+  EXPECT_EQ(1u, wheel.Advance(1001));
+  EXPECT_EQ(2, count);
+}
+
+TEST(TimerWheelTest, Cancel) {
+  TimerWheel wheel(0);
+  int count = 0;
+  uint64_t a = wheel.Add(100, [&count]() { count += 1; });
+  uint64_t b = wheel.Add(100000, [&count]() { count += 10; });
+  EXPECT_NE(0u, a);
+  EXPECT_TRUE(wheel.Cancel(b));
+  EXPECT_FALSE(wheel.Cancel(b));
+  EXPECT_EQ(1u, wheel.size());
+  wheel.Advance(200000);
+  EXPECT_EQ(1, count);
+  // Ran already, and its node may be reused by a new timer
+  EXPECT_FALSE(wheel.Cancel(a));
+  uint64_t c = wheel.Add(200100, [&count]() { count += 100; });
+  EXPECT_NE(a, c);
+  EXPECT_FALSE(wheel.Cancel(a));
+  EXPECT_TRUE(wheel.Cancel(c));
+  EXPECT_EQ(0u, wheel.size());
+}
+
+TEST(TimerWheelTest, CallbacksAddAndCancel) {
+  TimerWheel wheel(0);
+  std::vector<int> fired;
+  uint64_t victim = wheel.Add(50, [&fired]() { fired.push_back(-1); });
+  wheel.Add(50, [&]() {
+    fired.push_back(1);
+    wheel.Cancel(victim);
+    // Re-arming from the callback, the periodic timer pattern
+    wheel.Add(60, [&fired]() { fired.push_back(2); });
+    wheel.Add(50, [&fired]() { fired.push_back(3); });
+  });
+  wheel.Advance(100);
+  ASSERT_EQ(3u, fired.size());
+  EXPECT_EQ(1, fired[0]);
+  EXPECT_EQ(3, fired[1]);
+  EXPECT_EQ(2, fired[2]);
+}
+
+TEST(TimerWheelTest, BeyondTopLevel) {
+  TimerWheel wheel(5);
+  bool fired = false;
+  const uint64_t far = (1ULL << 33) + 12345;
+  wheel.Add(far, [&fired]() { fired = true; });
+  uint64_t now = 5;
+  int wakeups = 0;
+  while (!fired) {
+    now = wheel.NextWakeup();
+    ASSERT_LE(now, far);
+    wheel.Advance(now);
+    wakeups++;
+  }
+  EXPECT_EQ(far, now);
+  EXPECT_LT(wakeups, 20);
+}
@@ -0,0 +1,130 @@
+// Copyright (c) 2015-present, Qihoo, Inc.  All rights reserved.
+// This source code is licensed under the BSD-style license found in the
+// LICENSE file in the root directory of this source tree. An additional grant
+// of patent rights can be found in the PATENTS file in the same directory.
+
+#include "pink/include/work_stealing_pool.h"
+
+#include <atomic>
+#include <future>
+#include <memory>
+#include <stdexcept>
+#include <thread>
+#include <vector>
+
+#include "gmock/gmock.h"
+
+using pink::WorkStealingPool;
+
+namespace {
+
+void Increment(void* arg) {
+  static_cast<std::atomic<int>*>(arg)->fetch_add(1);
+}
+
+// Move-only, like a callable holding a buffer it hands over
+struct MoveOnlyTask {
+  explicit MoveOnlyTask(int value) : value(new int(value)) {}
+  int operator()() {
+    return *value;
+  }
+  std::unique_ptr<int> value;
+};
+
+}  // namespace
+
+TEST(WorkStealingPoolTest, RunsEveryTaskFromManyThreads) {
+  WorkStealingPool pool(16);
+  ASSERT_EQ(pink::kSuccess, pool.start_thread_pool());
+  std::atomic<int> count(0);
+  const int kThreads = 4;
+  const int kTasks = 20000;
+  std::vector<std::thread> threads;
+  for (int i = 0; i < kThreads; i++) {
+    threads.push_back(std::thread([&pool, &count]() {
+      for (int j = 0; j < kTasks; j++) {
+        if (j % 2 == 0) {
+          pool.Schedule(&Increment, &count);
+        } else {
+          pool.Post([&count]() { count.fetch_add(1); });
+        }
+      }
+    }));
+  }
+  for (std::thread& thread : threads) {
+    thread.join();
+  }
+  // Stopping waits for everything scheduled so far
+  EXPECT_EQ(0, pool.stop_thread_pool());
+  EXPECT_EQ(kThreads * kTasks, count.load());
+  size_t qsize = 1;
+  pool.cur_queue_size(&qsize);
+  EXPECT_EQ(0u, qsize);
+}
+
+TEST(WorkStealingPoolTest, TasksFromWorkersAreStolen) {
+  WorkStealingPool pool(4);
+  ASSERT_EQ(pink::kSuccess, pool.start_thread_pool());
+  std::atomic<int> count(0);
+  const int kChildren = 50000;
+  // Children go to the deque of the worker running the parent
+  std::future<void> parent = pool.Submit([&pool, &count]() {
+    for (int i = 0; i < kChildren; i++) {
+      pool.Post([&count]() { count.fetch_add(1); });
+    }
+  });
+  parent.get();
+  EXPECT_EQ(0, pool.stop_thread_pool());
+  EXPECT_EQ(kChildren, count.load());
+}
+
+TEST(WorkStealingPoolTest, SubmitReturnsResult) {
+  WorkStealingPool pool(2);
+  ASSERT_EQ(pink::kSuccess, pool.start_thread_pool());
+
+  std::future<int> sum = pool.Submit([]() { return 40 + 2; });
+  EXPECT_EQ(42, sum.get());
+
+  std::future<int> moved = pool.Submit(MoveOnlyTask(7));
+  EXPECT_EQ(7, moved.get());
+
+  std::future<int> failed = pool.Submit([]() -> int {
+    throw std::runtime_error("failed");
+  });
+  EXPECT_THROW(failed.get(), std::runtime_error);
+}
+
+TEST(WorkStealingPoolTest, SubmitWithContinuation) {
+  WorkStealingPool pool(2);
+  ASSERT_EQ(pink::kSuccess, pool.start_thread_pool());
+
+  std::promise<int> result;
+  pool.Submit(MoveOnlyTask(5), [&result](int value) {
+    result.set_value(value * 2);
+  });
+  EXPECT_EQ(10, result.get_future().get());
+
+  std::atomic<int> count(0);
+  std::promise<int> done;
+  pool.Submit([&count]() { count.fetch_add(1); },
+              [&count, &done]() { done.set_value(count.load()); });
+  EXPECT_EQ(1, done.get_future().get());
+}
+
+TEST(WorkStealingPoolTest, ScheduledBeforeStart) {
+  WorkStealingPool pool(3);
+  std::atomic<int> count(0);
+  for (int i = 0; i < 100; i++) {
+    pool.Schedule(&Increment, &count);
+  }
+  EXPECT_EQ(0, count.load());
+  ASSERT_EQ(pink::kSuccess, pool.start_thread_pool());
+  EXPECT_EQ(0, pool.stop_thread_pool());
+  EXPECT_EQ(100, count.load());
+
+  // A stopped pool can be started again
+  pool.Schedule(&Increment, &count);
+  ASSERT_EQ(pink::kSuccess, pool.start_thread_pool());
+  EXPECT_EQ(0, pool.stop_thread_pool());
+  EXPECT_EQ(101, count.load());
+}
@@ -0,0 +1,207 @@
+// Copyright (c) 2015-present, Qihoo, Inc.  All rights reserved.
+// This source code is licensed under the BSD-style license found in the
+// LICENSE file in the root directory of this source tree. An additional grant
+// of patent rights can be found in the PATENTS file in the same directory.
+
+#include "pink/src/thread_placement.h"
+
+#include <dirent.h>
+#include <sched.h>
+#include <stdio.h>
+
+#include <algorithm>
+#include <map>
+#include <string>
+#include <utility>
+
+#include "slash/include/xdebug.h"
+
+namespace pink {
+
+#if defined(__linux__)
+
+// -1 if the file is missing
+static int ReadIntFile(const std::string& path) {
+  FILE* f = fopen(path.c_str(), "r");
+  if (f == nullptr) {
+    return -1;
+  }
+  int value = -1;
+  if (fscanf(f, "%d", &value) != 1) {
+    value = -1;
+  }
+  fclose(f);
+  return value;
+}
+
+// Parses a sysfs cpu list like "0-7,16-23"
+static std::vector<int> ReadCpuList(const std::string& path) {
+  std::vector<int> cpus;
+  FILE* f = fopen(path.c_str(), "r");
+  if (f == nullptr) {
+    return cpus;
+  }
+  int first, last;
+  char sep;
+  while (fscanf(f, "%d", &first) == 1) {
+    last = first;
+    if (fscanf(f, "%c", &sep) == 1 && sep == '-') {
+      if (fscanf(f, "%d", &last) != 1) {
+        break;
+      }
+      if (fscanf(f, "%c", &sep) != 1) {
+        sep = '\n';
+      }
+    }
+    for (int cpu = first; cpu <= last; cpu++) {
+      cpus.push_back(cpu);
+    }
+    if (sep != ',') {
+      break;
+    }
+  }
+  fclose(f);
+  return cpus;
+}
+
+static std::vector<int> AllowedCpus() {
+  std::vector<int> cpus;
+  cpu_set_t set;
+  CPU_ZERO(&set);
+  if (sched_getaffinity(0, sizeof(set), &set) != 0) {
+    return cpus;
+  }
+  for (int cpu = 0; cpu < CPU_SETSIZE; cpu++) {
+    if (CPU_ISSET(cpu, &set)) {
+      cpus.push_back(cpu);
+    }
+  }
+  return cpus;
+}
+
+static bool Contains(const std::vector<int>& v, int x) {
+  return std::find(v.begin(), v.end(), x) != v.end();
+}
+
+// The allowed cpus of every node by node id, node 0 if there is no NUMA
+static std::map<int, std::vector<int> > NodeCpus(const std::vector<int>& allowed) {
+  std::map<int, std::vector<int> > nodes;
+  // Node ids may have holes, so list them instead of counting up
+  DIR* dir = opendir("/sys/devices/system/node");
+  if (dir != nullptr) {
+    struct dirent* entry;
+    while ((entry = readdir(dir)) != nullptr) {
+      int node;
+      char tail;
+      if (sscanf(entry->d_name, "node%d%c", &node, &tail) != 1) {
+        continue;
+      }
+      std::vector<int> cpus = ReadCpuList("/sys/devices/system/node/" +
+                                          std::string(entry->d_name) +
+                                          "/cpulist");
+      for (int cpu : cpus) {
+        if (Contains(allowed, cpu)) {
+          nodes[node].push_back(cpu);
+        }
+      }
+    }
+    closedir(dir);
+  }
+  if (nodes.empty()) {
+    nodes[0] = allowed;
+  }
+  return nodes;
+}
+
+std::vector<std::vector<int> > PlanThreadCpus(const ThreadPlacement& placement,
+                                              int num_threads) {
+  std::vector<std::vector<int> > plan(num_threads);
+  std::vector<int> allowed = AllowedCpus();
+  if (placement.policy == ThreadPlacement::kNoPlacement || allowed.empty() ||
+      num_threads <= 0) {
+    return plan;
+  }
+
+  if (placement.policy == ThreadPlacement::kCpuListPlacement) {
+    std::vector<int> cpus;
+    for (int cpu : placement.cpus) {
+      if (Contains(allowed, cpu)) {
+        cpus.push_back(cpu);
+      }
+    }
+    if (cpus.empty()) {
+      log_warn("none of the placement cpus is available, threads not pinned");
+      return plan;
+    }
+    for (int i = 0; i < num_threads; i++) {
+      plan[i].push_back(cpus[i % cpus.size()]);
+    }
+  } else if (placement.policy == ThreadPlacement::kPhysicalCorePlacement) {
+    // The first hardware thread of every core, ordered by package and core
+    std::map<std::pair<int, int>, int> cores;
+    for (int cpu : allowed) {
+      std::string topology = "/sys/devices/system/cpu/cpu" +
+        std::to_string(cpu) + "/topology/";
+      std::pair<int, int> core(ReadIntFile(topology + "physical_package_id"),
+                               ReadIntFile(topology + "core_id"));
+      if (core.second == -1) {
+        // No topology, every cpu is a core of its own
+        core.second = cpu;
+      }
+      if (cores.find(core) == cores.end()) {
+        cores[core] = cpu;
+      }
+    }
+    std::vector<int> cpus;
+    for (const auto& core : cores) {
+      cpus.push_back(core.second);
+    }
+    for (int i = 0; i < num_threads; i++) {
+      plan[i].push_back(cpus[i % cpus.size()]);
+    }
+  } else if (placement.policy == ThreadPlacement::kNumaNodePlacement) {
+    std::map<int, std::vector<int> > node_cpus = NodeCpus(allowed);
+    std::vector<std::vector<int> > nodes;
+    for (const auto& node : node_cpus) {
+      if (!node.second.empty() &&
+          (placement.nodes.empty() || Contains(placement.nodes, node.first))) {
+        nodes.push_back(node.second);
+      }
+    }
+    if (nodes.empty()) {
+      log_warn("none of the placement nodes is available, threads not pinned");
+      return plan;
+    }
+    for (int i = 0; i < num_threads; i++) {
+      plan[i] = nodes[i % nodes.size()];
+    }
+  }
+  return plan;
+}
+
+int PinThread(pthread_t thread, const std::vector<int>& cpus) {
+  if (cpus.empty()) {
+    return 0;
+  }
+  cpu_set_t set;
+  CPU_ZERO(&set);
+  for (int cpu : cpus) {
+    CPU_SET(cpu, &set);
+  }
+  return pthread_setaffinity_np(thread, sizeof(set), &set);
+}
+
+#else
+
+std::vector<std::vector<int> > PlanThreadCpus(const ThreadPlacement& placement,
+                                              int num_threads) {
+  return std::vector<std::vector<int> >(num_threads > 0 ? num_threads : 0);
+}
+
+int PinThread(pthread_t thread, const std::vector<int>& cpus) {
+  return 0;
+}
+
+#endif
+
+}  // namespace pink
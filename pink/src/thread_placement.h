@@ -0,0 +1,29 @@
+// Copyright (c) 2015-present, Qihoo, Inc.  All rights reserved.
+// This source code is licensed under the BSD-style license found in the
+// LICENSE file in the root directory of this source tree. An additional grant
+// of patent rights can be found in the PATENTS file in the same directory.
+
+#ifndef PINK_SRC_THREAD_PLACEMENT_H_
+#define PINK_SRC_THREAD_PLACEMENT_H_
+
+#include <pthread.h>
+
+#include <vector>
+
+#include "pink/include/pink_thread.h"
+
+namespace pink {
+
+/*
+ * The cpus each of num_threads threads may run on under placement, an
+ * empty set leaves the thread unpinned. The topology is read from sysfs,
+ * only cpus the process may run on are used.
+ */
+std::vector<std::vector<int> > PlanThreadCpus(const ThreadPlacement& placement,
+                                              int num_threads);
+
+// Returns 0 on success, also if cpus is empty or not on Linux
+int PinThread(pthread_t thread, const std::vector<int>& cpus);
+
+}  // namespace pink
+#endif  // PINK_SRC_THREAD_PLACEMENT_H_
@@ -5,8 +5,8 @@
 
 #include "pink/include/thread_pool.h"
 #include "pink/src/pink_thread_name.h"
-
-#include <sys/time.h>
+#include "pink/src/thread_placement.h"
+#include "slash/include/xdebug.h"
 
 namespace pink {
 
@@ -23,6 +23,10 @@ int ThreadPool::Worker::start() {
     } else {
       start_.store(true);
       SetThreadName(thread_id_, thread_pool_->thread_pool_name() + "Worker");
+      if (PinThread(thread_id_, cpu_affinity_) != 0) {
+        log_warn("failed to pin %s worker to its cpus",
+                 thread_pool_->thread_pool_name().c_str());
+      }
     }
   }
   return 0;
@@ -45,6 +49,7 @@ ThreadPool::ThreadPool(size_t worker_num,
   worker_num_(worker_num),
   max_queue_size_(max_queue_size),
   thread_pool_name_(thread_pool_name),
+  has_timers_(false),
   running_(false),
   should_stop_(false),
   mu_(),
@@ -53,13 +58,19 @@ ThreadPool::ThreadPool(size_t worker_num,
 
 ThreadPool::~ThreadPool() {
   stop_thread_pool();
+  if (has_timers_.load()) {
+    TimerService::Default()->CancelAll(this);
+  }
 }
 
 int ThreadPool::start_thread_pool() {
   if (!running_.load()) {
     should_stop_.store(false);
+    std::vector<std::vector<int> > worker_cpus =
+      PlanThreadCpus(thread_placement_, static_cast<int>(worker_num_));
     for (size_t i = 0; i < worker_num_; ++i) {
       workers_.push_back(new Worker(this));
+      workers_[i]->set_cpu_affinity(worker_cpus[i]);
       int res = workers_[i]->start();
       if (res != 0) {
         return kCreateThreadError;
@@ -113,23 +124,29 @@ void ThreadPool::Schedule(TaskFunc func, void* arg) {
 /*
  * timeout is in millisecond
  */
-void ThreadPool::DelaySchedule(
+uint64_t ThreadPool::DelaySchedule(
     uint64_t timeout, TaskFunc func, void* arg) {
-  /*
-   * pthread_cond_timedwait api use absolute API
-   * so we need gettimeofday + timeout
-   */
-  struct timeval now;
-  gettimeofday(&now, NULL);
-  uint64_t exec_time;
-  exec_time = now.tv_sec * 1000000 + timeout * 1000 + now.tv_usec;
+  if (should_stop()) {
+    return 0;
+  }
+  has_timers_.store(true);
+  return TimerService::Default()->Add(timeout, this, func, arg);
+}
 
-  mu_.Lock();
-  if (!should_stop()) {
-    time_queue_.push(TimeTask(exec_time, func, arg));
+/*
+ * The tasks may go past max_queue_size, waiting would hold up the timer
+ * thread. They are kept while the pool is stopped
+ */
+void ThreadPool::ScheduleTimerTasks(const std::vector<TimerTask>& tasks) {
+  slash::MutexLock l(&mu_);
+  for (const TimerTask& task : tasks) {
+    queue_.push(Task(task.function, task.arg));
+  }
+  if (tasks.size() > 1) {
+    rsignal_.SignalAll();
+  } else {
     rsignal_.Signal();
   }
-  mu_.Unlock();
 }
 
 size_t ThreadPool::max_queue_size() {
@@ -142,8 +159,7 @@ void ThreadPool::cur_queue_size(size_t* qsize) {
 }
 
 void ThreadPool::cur_time_queue_size(size_t* qsize) {
-  slash::MutexLock l(&mu_);
-  *qsize = time_queue_.size();
+  *qsize = has_timers_.load() ? TimerService::Default()->pending(this) : 0;
 }
 
 std::string ThreadPool::thread_pool_name() {
@@ -153,33 +169,13 @@ std::string ThreadPool::thread_pool_name() {
 void ThreadPool::runInThread() {
   while (!should_stop()) {
     mu_.Lock();
-    while (queue_.empty() && time_queue_.empty() && !should_stop()) {
+    while (queue_.empty() && !should_stop()) {
       rsignal_.Wait();
     }
     if (should_stop()) {
       mu_.Unlock();
       break;
     }
-    if (!time_queue_.empty()) {
-      struct timeval now;
-      gettimeofday(&now, NULL);
-
-      TimeTask time_task = time_queue_.top();
-      uint64_t unow = now.tv_sec * 1000000 + now.tv_usec;
-      if (unow / 1000 >= time_task.exec_time / 1000) {
-        TaskFunc func = time_task.func;
-        void* arg = time_task.arg;
-        time_queue_.pop();
-        mu_.Unlock();
-        (*func)(arg);
-        continue;
-      } else if (queue_.empty() && !should_stop()) {
-        rsignal_.TimedWait(
-            static_cast<uint32_t>((time_task.exec_time - unow) / 1000));
-        mu_.Unlock();
-        continue;
-      }
-    }
     if (!queue_.empty()) {
       TaskFunc func = queue_.front().func;
       void* arg = queue_.front().arg;
@@ -0,0 +1,210 @@
+// Copyright (c) 2015-present, Qihoo, Inc.  All rights reserved.
+// This source code is licensed under the BSD-style license found in the
+// LICENSE file in the root directory of this source tree. An additional grant
+// of patent rights can be found in the PATENTS file in the same directory.
+
+#include "pink/include/timer_service.h"
+
+#include <time.h>
+
+#include <algorithm>
+
+#include "pink/src/timer_wheel.h"
+
+namespace pink {
+
+// Longest wait of the timer thread, keeps the wheel's clock current
+static const uint64_t kMaxWaitMs = 60 * 1000;
+
+static uint64_t NowMs() {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return static_cast<uint64_t>(ts.tv_sec) * 1000 + ts.tv_nsec / 1000000;
+}
+
+TimerService::TimerService()
+    : cv_(&mu_),
+      wheel_(new TimerWheel(NowMs())),
+      wakeup_ms_(UINT64_MAX),
+      dispatching_(false),
+      dispatched_(&mu_) {
+  set_thread_name("PinkTimer");
+}
+
+TimerService::~TimerService() {
+  StopThread();
+  delete wheel_;
+}
+
+TimerService* TimerService::Default() {
+  static TimerService* service = []() {
+    TimerService* s = new TimerService();
+    s->StartThread();
+    return s;
+  }();
+  return service;
+}
+
+uint64_t TimerService::Add(uint64_t timeout_ms, TimerTarget* target,
+                           void (*function)(void*), void* arg) {
+  slash::MutexLock l(&mu_);
+  uint32_t slot;
+  if (!free_slots_.empty()) {
+    slot = free_slots_.back();
+    free_slots_.pop_back();
+  } else {
+    slot = static_cast<uint32_t>(timers_.size());
+    timers_.push_back(Timer());
+    timers_[slot].gen = 1;
+  }
+  Timer& timer = timers_[slot];
+  timer.target = target;
+  timer.function = function;
+  timer.arg = arg;
+  pending_[target]++;
+  Arm(slot, timeout_ms);
+  return (static_cast<uint64_t>(timer.gen) << 32) | slot;
+}
+
+bool TimerService::Cancel(uint64_t id) {
+  slash::MutexLock l(&mu_);
+  int64_t slot = FindSlot(id);
+  if (slot < 0) {
+    return false;
+  }
+  wheel_->Cancel(timers_[slot].wheel_id);
+  FreeSlot(static_cast<uint32_t>(slot));
+  return true;
+}
+
+bool TimerService::Reschedule(uint64_t id, uint64_t timeout_ms) {
+  slash::MutexLock l(&mu_);
+  int64_t slot = FindSlot(id);
+  if (slot < 0) {
+    return false;
+  }
+  wheel_->Cancel(timers_[slot].wheel_id);
+  Arm(static_cast<uint32_t>(slot), timeout_ms);
+  return true;
+}
+
+void TimerService::CancelAll(TimerTarget* target) {
+  slash::MutexLock l(&mu_);
+  if (pending_.count(target) > 0) {
+    for (uint32_t slot = 0; slot < timers_.size(); slot++) {
+      if (timers_[slot].target == target) {
+        wheel_->Cancel(timers_[slot].wheel_id);
+        FreeSlot(slot);
+      }
+    }
+  }
+  while (dispatching_) {
+    dispatched_.Wait();
+  }
+}
+
+size_t TimerService::pending(TimerTarget* target) {
+  slash::MutexLock l(&mu_);
+  std::unordered_map<TimerTarget*, size_t>::const_iterator it =
+    pending_.find(target);
+  return it == pending_.end() ? 0 : it->second;
+}
+
+size_t TimerService::size() {
+  slash::MutexLock l(&mu_);
+  return wheel_->size();
+}
+
+int TimerService::StopThread() {
+  {
+    slash::MutexLock l(&mu_);
+    should_stop_ = true;
+    cv_.Signal();
+  }
+  return Thread::StopThread();
+}
+
+int64_t TimerService::FindSlot(uint64_t id) {
+  uint32_t slot = static_cast<uint32_t>(id);
+  if (slot >= timers_.size() ||
+      timers_[slot].gen != static_cast<uint32_t>(id >> 32) ||
+      timers_[slot].target == nullptr) {
+    return -1;
+  }
+  return slot;
+}
+
+void TimerService::FreeSlot(uint32_t slot) {
+  Timer& timer = timers_[slot];
+  std::unordered_map<TimerTarget*, size_t>::iterator it =
+    pending_.find(timer.target);
+  if (--it->second == 0) {
+    pending_.erase(it);
+  }
+  timer.target = nullptr;
+  if (++timer.gen == 0) {
+    timer.gen = 1;
+  }
+  free_slots_.push_back(slot);
+}
+
+void TimerService::Arm(uint32_t slot, uint64_t timeout_ms) {
+  uint64_t now = NowMs();
+  if (wheel_->size() == 0) {
+    // Nothing to run, only brings the wheel's clock up to date
+    wheel_->Advance(now);
+  }
+  uint64_t expire = now + timeout_ms;
+  timers_[slot].wheel_id = wheel_->Add(expire, [this, slot]() {
+    Expire(slot);
+  });
+  if (expire < wakeup_ms_) {
+    wakeup_ms_ = expire;
+    cv_.Signal();
+  }
+}
+
+void TimerService::Expire(uint32_t slot) {
+  Timer& timer = timers_[slot];
+  size_t i = 0;
+  while (i < due_.size() && due_[i].first != timer.target) {
+    i++;
+  }
+  if (i == due_.size()) {
+    due_.push_back(std::make_pair(timer.target, std::vector<TimerTask>()));
+  }
+  due_[i].second.push_back(TimerTask(timer.function, timer.arg));
+  FreeSlot(slot);
+}
+
+void* TimerService::ThreadMain() {
+  std::vector<std::pair<TimerTarget*, std::vector<TimerTask> > > due;
+  mu_.Lock();
+  while (!should_stop()) {
+    uint64_t now = NowMs();
+    wheel_->Advance(now);
+    if (!due_.empty()) {
+      // Every target gets its due tasks at once, outside of mu_
+      due.swap(due_);
+      dispatching_ = true;
+      mu_.Unlock();
+      for (size_t i = 0; i < due.size(); i++) {
+        due[i].first->ScheduleTimerTasks(due[i].second);
+      }
+      due.clear();
+      mu_.Lock();
+      dispatching_ = false;
+      dispatched_.SignalAll();
+      continue;
+    }
+    uint64_t next = wheel_->NextWakeup();
+    uint64_t wait_ms = std::min(next - now, kMaxWaitMs);
+    wakeup_ms_ = next;
+    cv_.TimedWait(static_cast<uint32_t>(wait_ms));
+  }
+  wakeup_ms_ = UINT64_MAX;
+  mu_.Unlock();
+  return nullptr;
+}
+
+}  // namespace pink
@@ -0,0 +1,168 @@
+// Copyright (c) 2015-present, Qihoo, Inc.  All rights reserved.
+// This source code is licensed under the BSD-style license found in the
+// LICENSE file in the root directory of this source tree. An additional grant
+// of patent rights can be found in the PATENTS file in the same directory.
+
+#include "pink/src/timer_wheel.h"
+
+namespace pink {
+
+TimerWheel::TimerWheel(uint64_t now_ms)
+    : now_(now_ms),
+      size_(0) {
+  for (int i = 0; i < kLevels * kSlots; i++) {
+    heads_[i] = -1;
+  }
+}
+
+uint64_t TimerWheel::Add(uint64_t expire_ms, const Callback& cb) {
+  int32_t idx;
+  if (!free_nodes_.empty()) {
+    idx = free_nodes_.back();
+    free_nodes_.pop_back();
+  } else {
+    idx = static_cast<int32_t>(nodes_.size());
+    nodes_.push_back(Node());
+    nodes_[idx].gen = 1;
+  }
+  Node& node = nodes_[idx];
+  node.expire = expire_ms > now_ ? expire_ms : now_ + 1;
+  node.cb = cb;
+  Link(idx);
+  size_++;
+  return (static_cast<uint64_t>(node.gen) << 32) | static_cast<uint32_t>(idx);
+}
+
+bool TimerWheel::Cancel(uint64_t id) {
+  uint32_t idx = static_cast<uint32_t>(id);
+  if (idx >= nodes_.size() ||
+      nodes_[idx].gen != static_cast<uint32_t>(id >> 32) ||
+      nodes_[idx].list < 0) {
+    return false;
+  }
+  Unlink(idx);
+  nodes_[idx].cb = nullptr;
+  Free(idx);
+  return true;
+}
+
+size_t TimerWheel::Advance(uint64_t now_ms) {
+  size_t ran = 0;
+  while (size_ > 0) {
+    // Skips the milliseconds in which nothing happens
+    uint64_t next = NextWakeup();
+    if (next > now_ms) {
+      break;
+    }
+    now_ = next;
+    if ((now_ & kSlotMask) == 0) {
+      // The higher levels whose current slot changes now, top down
+      int top = 1;
+      while (top < kLevels - 1 &&
+             (now_ & ((1ULL << (kSlotBits * (top + 1))) - 1)) == 0) {
+        top++;
+      }
+      for (int level = top; level >= 1; level--) {
+        Cascade(level);
+      }
+    }
+
+    int32_t* head = &heads_[now_ & kSlotMask];
+    while (*head != -1) {
+      int32_t idx = *head;
+      Unlink(idx);
+      Callback cb;
+      cb.swap(nodes_[idx].cb);
+      Free(idx);
+      // May add timers, nodes_ must not be referenced across it
+      cb();
+      ran++;
+    }
+  }
+  if (now_ < now_ms) {
+    now_ = now_ms;
+  }
+  return ran;
+}
+
+uint64_t TimerWheel::NextWakeup() const {
+  if (size_ == 0) {
+    return UINT64_MAX;
+  }
+  for (int level = 0; level < kLevels; level++) {
+    int shift = kSlotBits * level;
+    uint64_t cur = now_ >> shift;
+    for (uint64_t slot = (cur & kSlotMask) + 1; slot < kSlots; slot++) {
+      if (heads_[level * kSlots + slot] != -1) {
+        return ((cur & ~kSlotMask) | slot) << shift;
+      }
+    }
+  }
+  // Only timers beyond the range of the top level, parked in its slot 0
+  int shift = kSlotBits * kLevels;
+  return ((now_ >> shift) + 1) << shift;
+}
+
+void TimerWheel::Link(int32_t idx) {
+  Node& node = nodes_[idx];
+  int level = 0;
+  while (level < kLevels &&
+         (node.expire >> (kSlotBits * (level + 1))) !=
+         (now_ >> (kSlotBits * (level + 1)))) {
+    level++;
+  }
+  uint64_t slot;
+  if (level == kLevels) {
+    /*
+     * Too far out. Top level slot 0 is never ahead of now_, it is only
+     * cascaded when the top level turns around.
+     */
+    level = kLevels - 1;
+    slot = 0;
+  } else {
+    slot = (node.expire >> (kSlotBits * level)) & kSlotMask;
+  }
+  int32_t list = level * kSlots + static_cast<int32_t>(slot);
+  node.list = list;
+  node.prev = -1;
+  node.next = heads_[list];
+  if (node.next != -1) {
+    nodes_[node.next].prev = idx;
+  }
+  heads_[list] = idx;
+}
+
+void TimerWheel::Unlink(int32_t idx) {
+  Node& node = nodes_[idx];
+  if (node.prev != -1) {
+    nodes_[node.prev].next = node.next;
+  } else {
+    heads_[node.list] = node.next;
+  }
+  if (node.next != -1) {
+    nodes_[node.next].prev = node.prev;
+  }
+  node.list = -1;
+}
+
+void TimerWheel::Free(int32_t idx) {
+  if (++nodes_[idx].gen == 0) {
+    nodes_[idx].gen = 1;
+  }
+  free_nodes_.push_back(idx);
+  size_--;
+}
+
+void TimerWheel::Cascade(int level) {
+  int32_t list = level * kSlots +
+    static_cast<int32_t>((now_ >> (kSlotBits * level)) & kSlotMask);
+  int32_t idx = heads_[list];
+  heads_[list] = -1;
+  while (idx != -1) {
+    int32_t next = nodes_[idx].next;
+    Link(idx);
+    idx = next;
+  }
+}
+
+}  // namespace pink
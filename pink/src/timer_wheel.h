@@ -0,0 +1,92 @@
+// Copyright (c) 2015-present, Qihoo, Inc.  All rights reserved.
+// This source code is licensed under the BSD-style license found in the
+// LICENSE file in the root directory of this source tree. An additional grant
+// of patent rights can be found in the PATENTS file in the same directory.
+
+#ifndef PINK_SRC_TIMER_WHEEL_H_
+#define PINK_SRC_TIMER_WHEEL_H_
+
+#include <stddef.h>
+#include <stdint.h>
+
+#include <functional>
+#include <vector>
+
+namespace pink {
+
+/*
+ * Hierarchical timing wheel with a resolution of one millisecond: four
+ * levels of 256 slots, level n holds the timers due within the current
+ * 256^(n+1) ms and is cascaded down one level when its slot comes up.
+ * Adding and canceling are O(1), Advance jumps from one non-empty slot to
+ * the next and costs the timers it runs or cascades.
+ *
+ * Not thread safe, it belongs to one event loop.
+ */
+class TimerWheel {
+ public:
+  typedef std::function<void()> Callback;
+
+  explicit TimerWheel(uint64_t now_ms);
+
+  /*
+   * Calls cb from the Advance that reaches expire_ms, expire_ms in the past
+   * means the next Advance. Returns the timer id, never 0.
+   */
+  uint64_t Add(uint64_t expire_ms, const Callback& cb);
+
+  // False if the timer has already run or been canceled
+  bool Cancel(uint64_t id);
+
+  /*
+   * Runs the timers that expired up to now_ms and returns their number.
+   * The callbacks may add and cancel timers.
+   */
+  size_t Advance(uint64_t now_ms);
+
+  /*
+   * When the next Advance has work to do: the expiry of the earliest timer
+   * or a cascade before it. UINT64_MAX if there are no timers.
+   */
+  uint64_t NextWakeup() const;
+
+  size_t size() const {
+    return size_;
+  }
+
+ private:
+  static const int kLevels = 4;
+  static const int kSlotBits = 8;
+  static const int kSlots = 1 << kSlotBits;
+  static const uint64_t kSlotMask = kSlots - 1;
+
+  struct Node {
+    uint64_t expire;
+    // Part of the id, changes when the node is freed
+    uint32_t gen;
+    int32_t prev;
+    int32_t next;
+    // Index into heads_, -1 while not scheduled
+    int32_t list;
+    Callback cb;
+  };
+
+  void Link(int32_t idx);
+  void Unlink(int32_t idx);
+  void Free(int32_t idx);
+  void Cascade(int level);
+
+  // Every timer with expire <= now_ has run
+  uint64_t now_;
+  size_t size_;
+  std::vector<Node> nodes_;
+  std::vector<int32_t> free_nodes_;
+  int32_t heads_[kLevels * kSlots];
+
+  // No copying allowed
+  TimerWheel(const TimerWheel&);
+  void operator=(const TimerWheel&);
+};
+
+}  // namespace pink
+#endif  // PINK_SRC_TIMER_WHEEL_H_
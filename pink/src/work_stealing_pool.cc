@@ -0,0 +1,484 @@
+// Copyright (c) 2015-present, Qihoo, Inc.  All rights reserved.
+// This source code is licensed under the BSD-style license found in the
+// LICENSE file in the root directory of this source tree. An additional grant
+// of patent rights can be found in the PATENTS file in the same directory.
+
+#include "pink/include/work_stealing_pool.h"
+
+#include <algorithm>
+#include <climits>
+#include <deque>
+
+#ifdef __linux__
+#include <linux/futex.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+#endif
+
+#include "pink/src/pink_thread_name.h"
+#include "pink/src/thread_placement.h"
+#include "slash/include/xdebug.h"
+
+namespace pink {
+
+namespace {
+
+typedef WorkStealingPool::Task PoolTask;
+
+// Keeps the hot atomics of different workers on their own cache lines
+const size_t kCacheLine = 64;
+// Tasks a worker moves from an injection shard to its deque at once
+const size_t kMaxShardBatch = 32;
+
+/*
+ * The Chase-Lev deque, with the memory orders of Le et al., "Correct and
+ * Efficient Work-Stealing for Weak Memory Models". The owner pushes and
+ * pops at the bottom, other workers steal from the top. A full array is
+ * replaced by one twice its size; the old one is kept, as a thief may
+ * still read from it, until the deque is destroyed.
+ */
+class TaskDeque {
+ public:
+  TaskDeque() : top_(0), bottom_(0), array_(new Array(256)) {}
+  ~TaskDeque() {
+    delete array_.load(std::memory_order_relaxed);
+    for (Array* array : retired_) {
+      delete array;
+    }
+  }
+
+  // Owner only
+  void Push(PoolTask* task) {
+    int64_t b = bottom_.load(std::memory_order_relaxed);
+    int64_t t = top_.load(std::memory_order_acquire);
+    Array* array = array_.load(std::memory_order_relaxed);
+    if (b - t > array->capacity - 1) {
+      array = Grow(array, t, b);
+    }
+    array->Put(b, task);
+    bottom_.store(b + 1, std::memory_order_release);
+  }
+
+  // Owner only
+  PoolTask* Pop() {
+    int64_t b = bottom_.load(std::memory_order_relaxed) - 1;
+    Array* array = array_.load(std::memory_order_relaxed);
+    bottom_.store(b, std::memory_order_relaxed);
+    std::atomic_thread_fence(std::memory_order_seq_cst);
+    int64_t t = top_.load(std::memory_order_relaxed);
+    if (t > b) {
+      bottom_.store(b + 1, std::memory_order_relaxed);
+      return nullptr;
+    }
+    PoolTask* task = array->Get(b);
+    if (t == b) {
+      // The last one, a thief may be taking it too
+      if (!top_.compare_exchange_strong(t, t + 1, std::memory_order_seq_cst,
+                                        std::memory_order_relaxed)) {
+        task = nullptr;
+      }
+      bottom_.store(b + 1, std::memory_order_relaxed);
+    }
+    return task;
+  }
+
+  /*
+   * Any thread. contended is set if another thread took the task first
+   * while more may be left
+   */
+  PoolTask* Steal(bool* contended) {
+    *contended = false;
+    int64_t t = top_.load(std::memory_order_acquire);
+    std::atomic_thread_fence(std::memory_order_seq_cst);
+    int64_t b = bottom_.load(std::memory_order_acquire);
+    if (t >= b) {
+      return nullptr;
+    }
+    Array* array = array_.load(std::memory_order_acquire);
+    PoolTask* task = array->Get(t);
+    if (!top_.compare_exchange_strong(t, t + 1, std::memory_order_seq_cst,
+                                      std::memory_order_relaxed)) {
+      *contended = true;
+      return nullptr;
+    }
+    return task;
+  }
+
+  // Any thread, a snapshot
+  size_t size() const {
+    int64_t b = bottom_.load(std::memory_order_relaxed);
+    int64_t t = top_.load(std::memory_order_relaxed);
+    return b > t ? static_cast<size_t>(b - t) : 0;
+  }
+
+ private:
+  struct Array {
+    explicit Array(int64_t _capacity)
+        : capacity(_capacity),
+          slots(new std::atomic<PoolTask*>[_capacity]) {}
+    ~Array() {
+      delete[] slots;
+    }
+    PoolTask* Get(int64_t i) const {
+      return slots[i & (capacity - 1)].load(std::memory_order_relaxed);
+    }
+    void Put(int64_t i, PoolTask* task) {
+      slots[i & (capacity - 1)].store(task, std::memory_order_relaxed);
+    }
+    const int64_t capacity;
+    std::atomic<PoolTask*>* const slots;
+  };
+
+  Array* Grow(Array* array, int64_t t, int64_t b) {
+    Array* bigger = new Array(array->capacity * 2);
+    for (int64_t i = t; i < b; i++) {
+      bigger->Put(i, array->Get(i));
+    }
+    retired_.push_back(array);
+    array_.store(bigger, std::memory_order_release);
+    return bigger;
+  }
+
+  alignas(kCacheLine) std::atomic<int64_t> top_;
+  alignas(kCacheLine) std::atomic<int64_t> bottom_;
+  std::atomic<Array*> array_;
+  std::vector<Array*> retired_;
+
+  TaskDeque(const TaskDeque&);
+  void operator=(const TaskDeque&);
+};
+
+// The Worker running on this thread, if it is a pool's worker
+thread_local void* current_worker = nullptr;
+
+/*
+ * The injection shard of a thread that is not a worker. Fixed per thread,
+ * so a thread scheduling a lot mostly takes the same lock.
+ */
+size_t ThreadShardHint() {
+  static std::atomic<size_t> next_hint(0);
+  thread_local size_t hint = next_hint.fetch_add(1, std::memory_order_relaxed);
+  return hint;
+}
+
+#ifdef __linux__
+void FutexWait(std::atomic<uint32_t>* addr, uint32_t expected) {
+  syscall(SYS_futex, reinterpret_cast<uint32_t*>(addr), FUTEX_WAIT_PRIVATE,
+          expected, nullptr, nullptr, 0);
+}
+
+void FutexWake(std::atomic<uint32_t>* addr, int num) {
+  syscall(SYS_futex, reinterpret_cast<uint32_t*>(addr), FUTEX_WAKE_PRIVATE,
+          num, nullptr, nullptr, 0);
+}
+#endif
+
+}  // namespace
+
+struct alignas(kCacheLine) WorkStealingPool::Worker {
+  Worker(WorkStealingPool* _pool, size_t _index)
+      : pool(_pool), index(_index), started(false), rand(_index + 1) {}
+
+  static void* WorkerMain(void* arg) {
+    Worker* worker = static_cast<Worker*>(arg);
+    current_worker = worker;
+    worker->pool->RunWorker(worker);
+    current_worker = nullptr;
+    return nullptr;
+  }
+
+  // xorshift, to pick the first worker to steal from
+  size_t NextRand() {
+    rand ^= rand << 13;
+    rand ^= rand >> 7;
+    rand ^= rand << 17;
+    return static_cast<size_t>(rand);
+  }
+
+  WorkStealingPool* const pool;
+  const size_t index;
+  pthread_t thread_id;
+  bool started;
+  std::vector<int> cpus;
+  uint64_t rand;
+  TaskDeque deque;
+};
+
+struct alignas(kCacheLine) WorkStealingPool::Shard {
+  Shard() : size(0) {}
+  slash::Mutex mu;
+  std::deque<Task*> tasks;
+  // tasks.size(), for looking without the lock
+  std::atomic<size_t> size;
+};
+
+WorkStealingPool::WorkStealingPool(size_t worker_num,
+                                   const std::string& thread_pool_name)
+    : worker_num_(worker_num),
+      thread_pool_name_(thread_pool_name),
+      running_(false),
+      should_stop_(false),
+      steal_count_(0),
+      epoch_(0),
+      sleepers_(0),
+      waking_(false)
+#ifndef __linux__
+      , park_cv_(&park_mu_)
+#endif
+{
+  for (size_t i = 0; i < worker_num_; i++) {
+    workers_.push_back(new Worker(this, i));
+  }
+  size_t shard_num = worker_num_ > 0 ? worker_num_ : 1;
+  for (size_t i = 0; i < shard_num; i++) {
+    shards_.push_back(new Shard());
+  }
+}
+
+WorkStealingPool::~WorkStealingPool() {
+  stop_thread_pool();
+  for (Worker* worker : workers_) {
+    Task* task;
+    while ((task = worker->deque.Pop()) != nullptr) {
+      delete task;
+    }
+    delete worker;
+  }
+  for (Shard* shard : shards_) {
+    for (Task* task : shard->tasks) {
+      delete task;
+    }
+    delete shard;
+  }
+}
+
+int WorkStealingPool::start_thread_pool() {
+  if (!running_.load()) {
+    should_stop_.store(false);
+    std::vector<std::vector<int> > worker_cpus =
+      PlanThreadCpus(thread_placement_, static_cast<int>(worker_num_));
+    for (size_t i = 0; i < worker_num_; i++) {
+      Worker* worker = workers_[i];
+      worker->cpus = worker_cpus[i];
+      if (pthread_create(&worker->thread_id, NULL, &Worker::WorkerMain,
+                         worker)) {
+        return kCreateThreadError;
+      }
+      worker->started = true;
+      SetThreadName(worker->thread_id, thread_pool_name_ + "Worker");
+      if (PinThread(worker->thread_id, worker->cpus) != 0) {
+        log_warn("failed to pin %s worker to its cpus",
+                 thread_pool_name_.c_str());
+      }
+    }
+    running_.store(true);
+  }
+  return kSuccess;
+}
+
+int WorkStealingPool::stop_thread_pool() {
+  int res = 0;
+  bool any_started = false;
+  for (Worker* worker : workers_) {
+    any_started = any_started || worker->started;
+  }
+  if (running_.load() || any_started) {
+    should_stop_.store(true);
+    WakeAll();
+    for (Worker* worker : workers_) {
+      if (worker->started) {
+        if (pthread_join(worker->thread_id, nullptr)) {
+          res = -1;
+          break;
+        }
+        worker->started = false;
+      }
+    }
+    running_.store(false);
+  }
+  return res;
+}
+
+void WorkStealingPool::Schedule(Task* task) {
+  Worker* worker = static_cast<Worker*>(current_worker);
+  if (worker != nullptr && worker->pool == this) {
+    worker->deque.Push(task);
+  } else {
+    Shard* shard = shards_[ThreadShardHint() % shards_.size()];
+    slash::MutexLock l(&shard->mu);
+    shard->tasks.push_back(task);
+    shard->size.store(shard->tasks.size(), std::memory_order_relaxed);
+  }
+  WakeOne();
+}
+
+void WorkStealingPool::Schedule(TaskFunc func, void* arg) {
+  Post([func, arg]() { (*func)(arg); });
+}
+
+void WorkStealingPool::cur_queue_size(size_t* qsize) {
+  size_t size = 0;
+  for (Shard* shard : shards_) {
+    size += shard->size.load(std::memory_order_relaxed);
+  }
+  for (Worker* worker : workers_) {
+    size += worker->deque.size();
+  }
+  *qsize = size;
+}
+
+void WorkStealingPool::RunWorker(Worker* worker) {
+  bool woken = false;
+  while (true) {
+    Task* task = FindTask(worker);
+    if (task != nullptr) {
+      // Hand the wakeup on if there is more than we can take, see waking_
+      if (woken && HasTask()) {
+        WakeOne();
+      }
+      woken = false;
+      task->Run();
+      delete task;
+      continue;
+    }
+    if (should_stop_.load()) {
+      // Drained, tasks still running elsewhere queue on their own workers
+      if (!HasTask()) {
+        break;
+      }
+      continue;
+    }
+    Park();
+    woken = true;
+  }
+}
+
+WorkStealingPool::Task* WorkStealingPool::FindTask(Worker* worker) {
+  Task* task = worker->deque.Pop();
+  if (task != nullptr) {
+    return task;
+  }
+  for (size_t i = 0; i < shards_.size(); i++) {
+    task = PopShard(shards_[(worker->index + i) % shards_.size()], worker);
+    if (task != nullptr) {
+      return task;
+    }
+  }
+  if (workers_.size() < 2) {
+    return nullptr;
+  }
+  size_t start = worker->NextRand() % workers_.size();
+  for (size_t i = 0; i < workers_.size(); i++) {
+    Worker* victim = workers_[(start + i) % workers_.size()];
+    if (victim == worker) {
+      continue;
+    }
+    bool contended;
+    do {
+      task = victim->deque.Steal(&contended);
+    } while (task == nullptr && contended);
+    if (task != nullptr) {
+      steal_count_.fetch_add(1, std::memory_order_relaxed);
+      return task;
+    }
+  }
+  return nullptr;
+}
+
+/*
+ * Takes the first task of shard and moves up to half of the rest to
+ * worker's deque, where idle workers can steal them without the lock
+ */
+WorkStealingPool::Task* WorkStealingPool::PopShard(Shard* shard,
+                                                 Worker* worker) {
+  if (shard->size.load(std::memory_order_relaxed) == 0) {
+    return nullptr;
+  }
+  Task* task = nullptr;
+  size_t moved = 0;
+  {
+    slash::MutexLock l(&shard->mu);
+    if (shard->tasks.empty()) {
+      return nullptr;
+    }
+    task = shard->tasks.front();
+    shard->tasks.pop_front();
+    size_t batch = std::min(shard->tasks.size() / 2, kMaxShardBatch);
+    for (; moved < batch; moved++) {
+      worker->deque.Push(shard->tasks.front());
+      shard->tasks.pop_front();
+    }
+    shard->size.store(shard->tasks.size(), std::memory_order_relaxed);
+  }
+  if (moved > 0) {
+    WakeOne();
+  }
+  return task;
+}
+
+bool WorkStealingPool::HasTask() {
+  for (Shard* shard : shards_) {
+    if (shard->size.load(std::memory_order_relaxed) > 0) {
+      return true;
+    }
+  }
+  for (Worker* worker : workers_) {
+    if (worker->deque.size() > 0) {
+      return true;
+    }
+  }
+  return false;
+}
+
+void WorkStealingPool::Park() {
+  uint32_t epoch = epoch_.load(std::memory_order_acquire);
+  sleepers_.fetch_add(1, std::memory_order_relaxed);
+  /*
+   * A wakeup may be flagged whose sleeper left before it came, the flag
+   * would then hold off all others. Clearing it costs a spare wakeup at
+   * most. The fence pairs with the one in WakeOne, see epoch_
+   */
+  waking_.store(false, std::memory_order_relaxed);
+  std::atomic_thread_fence(std::memory_order_seq_cst);
+  if (!HasTask() && !should_stop_.load(std::memory_order_relaxed)) {
+#ifdef __linux__
+    FutexWait(&epoch_, epoch);
+#else
+    slash::MutexLock l(&park_mu_);
+    while (epoch_.load() == epoch) {
+      park_cv_.Wait();
+    }
+#endif
+  }
+  sleepers_.fetch_sub(1, std::memory_order_relaxed);
+  waking_.store(false, std::memory_order_relaxed);
+  std::atomic_thread_fence(std::memory_order_seq_cst);
+}
+
+void WorkStealingPool::WakeOne() {
+  std::atomic_thread_fence(std::memory_order_seq_cst);
+  if (sleepers_.load(std::memory_order_relaxed) == 0 ||
+      waking_.exchange(true, std::memory_order_relaxed)) {
+    return;
+  }
+  epoch_.fetch_add(1, std::memory_order_release);
+#ifdef __linux__
+  FutexWake(&epoch_, 1);
+#else
+  slash::MutexLock l(&park_mu_);
+  park_cv_.Signal();
+#endif
+}
+
+void WorkStealingPool::WakeAll() {
+  std::atomic_thread_fence(std::memory_order_seq_cst);
+  epoch_.fetch_add(1, std::memory_order_release);
+#ifdef __linux__
+  FutexWake(&epoch_, INT_MAX);
+#else
+  slash::MutexLock l(&park_mu_);
+  park_cv_.SignalAll();
+#endif
+}
+
+}  // namespace pink
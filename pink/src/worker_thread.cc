@@ -3,6 +3,13 @@
 // LICENSE file in the root directory of this source tree. An additional grant
 // of patent rights can be found in the PATENTS file in the same directory.
 
+#include <errno.h>
+#include <poll.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <time.h>
+
+#include <algorithm>
 #include <vector>
 
 #include "pink/src/worker_thread.h"
@@ -10,9 +17,19 @@
 #include "pink/include/pink_conn.h"
 #include "pink/src/pink_item.h"
 #include "pink/src/pink_epoll.h"
+#include "pink/src/server_socket.h"
+#include "pink/src/pink_util.h"
 
 namespace pink {
 
+// Period of WorkerThread::PublishLoad
+static const int kLoadPeriodMs = 500;
+
+static uint64_t MonotonicNs() {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return static_cast<uint64_t>(ts.tv_sec) * 1000000000 + ts.tv_nsec;
+}
 
 WorkerThread::WorkerThread(ConnFactory *conn_factory,
                            ServerThread* server_thread,
@@ -22,7 +39,26 @@ WorkerThread::WorkerThread(ConnFactory *conn_factory,
         server_thread_(server_thread),
         conn_factory_(conn_factory),
         cron_interval_(cron_interval),
-        keepalive_timeout_(kDefaultKeepAliveTime) {
+        keepalive_timeout_(kDefaultKeepAliveTime),
+        next_gen_(0),
+        conn_num_(0),
+        busy_start_ns_(0),
+        period_start_ns_(0),
+        period_busy_ns_(0),
+        period_spin_ns_(0),
+        period_events_(0),
+        busy_permille_(0),
+        spin_permille_(0),
+        events_per_sec_(0),
+        pending_conns_(0),
+        busy_poll_ns_(0),
+        spin_until_ns_(0),
+        loop_running_(false)
+#ifdef PINK_HAVE_IO_URING
+        , uring_(nullptr),
+        uring_next_id_(1)
+#endif
+        {
   /*
    * install the protobuf handler here
    */
@@ -30,61 +66,426 @@ WorkerThread::WorkerThread(ConnFactory *conn_factory,
 }
 
 WorkerThread::~WorkerThread() {
+  for (ServerSocket* server_socket : server_sockets_) {
+    delete server_socket;
+  }
   delete(pink_epoll_);
 }
 
+void WorkerThread::AddServerSocket(ServerSocket* server_socket) {
+  server_sockets_.push_back(server_socket);
+  pink_epoll_->PinkAddEvent(server_socket->sockfd(),
+                            PinkEpoll::kRead | PinkEpoll::kError);
+}
+
+ServerSocket* WorkerThread::FindServerSocket(int fd) const {
+  for (ServerSocket* server_socket : server_sockets_) {
+    if (server_socket->sockfd() == fd) {
+      return server_socket;
+    }
+  }
+  return nullptr;
+}
+
+// The WorkerThread whose ThreadMain runs on this thread
+static thread_local WorkerThread* current_worker = nullptr;
+
 int WorkerThread::conn_num() const {
-  slash::ReadLock l(&rwlock_);
-  return conns_.size();
+  return conn_num_.load(std::memory_order_relaxed);
 }
 
-std::vector<ServerThread::ConnInfo> WorkerThread::conns_info() const {
-  std::vector<ServerThread::ConnInfo> result;
-  slash::ReadLock l(&rwlock_);
-  for (auto& conn : conns_) {
-    result.push_back({
-                      conn.first,
-                      conn.second->ip_port(),
-                      conn.second->last_interaction()
-                     });
+WorkerThread::ConnSlot* WorkerThread::FindSlot(int fd) {
+  if (fd < 0 || static_cast<size_t>(fd) >= conn_slots_.size() ||
+      conn_slots_[fd].conn == nullptr) {
+    return nullptr;
+  }
+  return &conn_slots_[fd];
+}
+
+WorkerThread::ConnSlot* WorkerThread::AddSlot(std::shared_ptr<PinkConn> conn) {
+  size_t fd = conn->fd();
+  if (fd >= conn_slots_.size()) {
+    conn_slots_.resize(std::max(fd + 1, conn_slots_.size() * 2));
+  }
+  ConnSlot* slot = &conn_slots_[fd];
+  if (slot->conn == nullptr) {
+    conn_num_.fetch_add(1, std::memory_order_relaxed);
+  }
+  slot->conn = conn;
+  // 0 is the tag of fds that are not conns
+  if (++next_gen_ == 0) {
+    next_gen_ = 1;
+  }
+  slot->gen = next_gen_;
+  slot->events = 0;
+  slot->last_events = 0;
+  slot->write_events = 0;
+  // Armed again by this thread if needed
+  conn->set_resize_timer_armed(false);
+  if (cron_interval_ > 0) {
+    ArmKeepaliveTimer(static_cast<int>(fd), slot->gen, conn.get());
+    MaybeArmResizeTimer(static_cast<int>(fd), slot->gen);
   }
+  return slot;
+}
+
+void WorkerThread::ReleaseSlot(int fd) {
+  ConnSlot* slot = FindSlot(fd);
+  if (slot != nullptr) {
+    released_conns_.push_back(std::move(slot->conn));
+    conn_num_.fetch_sub(1, std::memory_order_relaxed);
+  }
+}
+
+void WorkerThread::ArmKeepaliveTimer(int fd, uint32_t gen,
+                                     const PinkConn* conn) {
+  int keepalive_timeout = keepalive_timeout_;
+  if (keepalive_timeout <= 0) {
+    return;
+  }
+  struct timeval now;
+  gettimeofday(&now, NULL);
+  int timeout_ms = KeepaliveRemainingMs(conn->last_interaction(),
+                                        keepalive_timeout, now);
+  pink_epoll_->AddTimer(timeout_ms, [this, fd, gen]() {
+    KeepaliveTimer(fd, gen);
+  });
+}
+
+void WorkerThread::KeepaliveTimer(int fd, uint32_t gen) {
+  ConnSlot* slot = FindSlot(fd);
+  if (slot == nullptr || slot->gen != gen) {
+    return;
+  }
+  std::shared_ptr<PinkConn> conn = slot->conn;
+  struct timeval now;
+  gettimeofday(&now, NULL);
+  // Check keepalive timeout connection
+  if (keepalive_timeout_ > 0 &&
+      (now.tv_sec - conn->last_interaction().tv_sec > keepalive_timeout_)) {
+    ReleaseSlot(fd);
+    CloseFd(conn);
+    server_thread_->handle_->FdTimeoutHandle(conn->fd(), conn->ip_port());
+    return;
+  }
+  // Used since the timer was armed
+  ArmKeepaliveTimer(fd, gen, conn.get());
+}
+
+void WorkerThread::MaybeArmResizeTimer(int fd, uint32_t gen) {
+  ConnSlot* slot = FindSlot(fd);
+  if (cron_interval_ <= 0 || slot == nullptr || slot->gen != gen ||
+      slot->conn->resize_timer_armed() || !slot->conn->HasLargeBuffer()) {
+    return;
+  }
+  slot->conn->set_resize_timer_armed(true);
+  pink_epoll_->AddTimer(cron_interval_, [this, fd, gen]() {
+    ResizeTimer(fd, gen);
+  });
+}
+
+void WorkerThread::ResizeTimer(int fd, uint32_t gen) {
+  ConnSlot* slot = FindSlot(fd);
+  if (slot == nullptr || slot->gen != gen) {
+    return;
+  }
+  slot->conn->set_resize_timer_armed(false);
+  slot->conn->TryResizeBuffer();
+  MaybeArmResizeTimer(fd, gen);
+}
+
+bool WorkerThread::OutputLimitReached(PinkConn* conn, size_t output_bytes) {
+  if (!conn->OutputLimitReached(
+          output_bytes, server_thread_->output_buffer_limit(conn->conn_class()),
+          pink_epoll_->last_poll_ns() / 1000000)) {
+    return false;
+  }
+  server_thread_->output_limit_closed_.fetch_add(1, std::memory_order_relaxed);
+  log_info("close conn %s, output buffer limit reached with %zu bytes",
+           conn->ip_port().c_str(), output_bytes);
+  return true;
+}
+
+bool WorkerThread::WriteHalf(int fd, uint32_t gen) {
+  ConnSlot* slot = FindSlot(fd);
+  if (slot == nullptr || slot->gen != gen) {
+    return true;
+  }
+  PinkConn* conn = slot->conn.get();
+  size_t output_bytes = conn->output_bytes();
+  if (OutputLimitReached(conn, output_bytes)) {
+    return false;
+  }
+  uint32_t events = PinkEpoll::kWrite;
+  size_t high = server_thread_->output_high_watermark();
+  // With output pending, 0 means the conn does not report it
+  if (high > 0 && output_bytes > 0) {
+    bool paused = slot->write_events == PinkEpoll::kWrite;
+    if (paused ? output_bytes <= server_thread_->output_low_watermark()
+               : output_bytes < high) {
+      events |= PinkEpoll::kRead;
+    }
+  }
+  if (events != slot->write_events) {
+    pink_epoll_->PinkModEvent(fd, 0, events, gen);
+    slot->write_events = events;
+  }
+  return true;
+}
+
+void WorkerThread::WriteAll(int fd, uint32_t gen, bool epollout) {
+  ConnSlot* slot = FindSlot(fd);
+  if (slot == nullptr || slot->gen != gen) {
+    return;
+  }
+  if (epollout || slot->write_events != 0) {
+    pink_epoll_->PinkModEvent(fd, 0, PinkEpoll::kRead, gen);
+    slot->write_events = 0;
+  }
+  // Ends the soft limit period
+  OutputLimitReached(slot->conn.get(), 0);
+}
+
+std::vector<ServerThread::ConnInfo> WorkerThread::conns_info() {
+  std::vector<ServerThread::ConnInfo> result;
+  RunInLoop([this, &result]() {
+    for (const ConnSlot& slot : conn_slots_) {
+      if (slot.conn != nullptr) {
+        size_t output_bytes = slot.conn->output_bytes();
+#ifdef PINK_HAVE_IO_URING
+        auto iter = uring_fds_.find(slot.conn->fd());
+        if (iter != uring_fds_.end()) {
+          const UringConn& uc = uring_conns_[iter->second];
+          output_bytes += uc.output.size();
+        }
+#endif
+        result.push_back({
+                          slot.conn->fd(),
+                          slot.conn->ip_port(),
+                          slot.conn->last_interaction(),
+                          slot.conn->incoming_cpu(),
+                          slot.conn->input_bytes(),
+                          output_bytes
+                         });
+      }
+    }
+  }, true);
   return result;
 }
 
 std::shared_ptr<PinkConn> WorkerThread::MoveConnOut(int fd) {
-  slash::WriteLock l(&rwlock_);
   std::shared_ptr<PinkConn> conn = nullptr;
-  auto iter = conns_.find(fd);
-  if (iter != conns_.end()) {
-    int fd = iter->first;
-    conn = iter->second;
-    pink_epoll_->PinkDelEvent(fd, 0);
-    conns_.erase(iter);
-  }
+  RunInLoop([this, fd, &conn]() {
+    ConnSlot* slot = FindSlot(fd);
+    if (slot != nullptr) {
+      conn = slot->conn;
+      pink_epoll_->PinkDelEvent(fd, 0);
+      ReleaseSlot(fd);
+      conn->CancelTimers();
+    }
+  }, true);
   return conn;
 }
 
 bool WorkerThread::MoveConnIn(std::shared_ptr<PinkConn> conn, const NotifyType& notify_type, bool force) {
   PinkItem it(conn->fd(), conn->ip_port(), notify_type);
-  bool success = MoveConnIn(it, force);
-  if (success) {
-    slash::WriteLock l(&rwlock_);
-    conns_[conn->fd()] = conn;
-  }
-  return success;
+  return RunInLoop([this, conn, it]() {
+    AddSlot(conn);
+    HandleNotify(it);
+  }, false, force);
 }
 
 bool WorkerThread::MoveConnIn(const PinkItem& it, bool force) {
-  return pink_epoll_->Register(it, force);
+  if (!pink_epoll_->Register(it, force)) {
+    return false;
+  }
+  if (it.notify_type() == kNotiConnect) {
+    pending_conns_.fetch_add(1, std::memory_order_relaxed);
+  }
+  return true;
+}
+
+ServerThread::WorkerLoad WorkerThread::load() const {
+  ServerThread::WorkerLoad load;
+  load.conns = conn_num() + pending_conns_.load(std::memory_order_relaxed);
+  load.events_per_sec = events_per_sec_.load(std::memory_order_relaxed);
+  load.busy_permille = busy_permille_.load(std::memory_order_relaxed);
+  load.spin_permille = spin_permille_.load(std::memory_order_relaxed);
+  load.sleep_permille =
+    std::max(0, 1000 - load.busy_permille - load.spin_permille);
+  return load;
+}
+
+std::shared_ptr<PinkConn> WorkerThread::MigrateConnOut(int max_permille) {
+  std::shared_ptr<PinkConn> conn = nullptr;
+  RunInLoop([this, max_permille, &conn]() {
+    uint64_t total = 0;
+    for (const ConnSlot& slot : conn_slots_) {
+      if (slot.conn != nullptr) {
+        total += slot.last_events;
+      }
+    }
+    if (total == 0) {
+      return;
+    }
+    // The conn's share of the busy time, estimated from its events
+    uint64_t busy = busy_permille_.load(std::memory_order_relaxed);
+    ConnSlot* best = nullptr;
+    for (ConnSlot& slot : conn_slots_) {
+      if (slot.conn == nullptr || slot.last_events == 0 ||
+          busy * slot.last_events / total > static_cast<uint64_t>(max_permille) ||
+          (best != nullptr && slot.last_events <= best->last_events)) {
+        continue;
+      }
+#ifdef PINK_HAVE_IO_URING
+      if (uring_fds_.count(slot.conn->fd()) != 0) {
+        continue;
+      }
+#endif
+      if (slot.conn->CanMigrate()) {
+        best = &slot;
+      }
+    }
+    if (best != nullptr) {
+      conn = best->conn;
+      pink_epoll_->PinkDelEvent(conn->fd(), 0);
+      ReleaseSlot(conn->fd());
+      conn->CancelTimers();
+    }
+  }, true);
+  return conn;
+}
+
+void WorkerThread::MigrateConnIn(std::shared_ptr<PinkConn> conn) {
+  RunInLoop([this, conn]() {
+    conn->set_pink_epoll(pink_epoll_);
+    conn->Migrated(private_data_);
+    ConnSlot* slot = AddSlot(conn);
+    pink_epoll_->PinkAddEvent(conn->fd(), PinkEpoll::kRead, slot->gen);
+  }, false);
+}
+
+void WorkerThread::AccountLoad(int events, uint64_t spin_start_ns) {
+  uint64_t now = MonotonicNs();
+  if (spin_start_ns == 0) {
+    period_busy_ns_ += now - busy_start_ns_;
+  } else if (events == 0) {
+    period_spin_ns_ += now - spin_start_ns;
+  } else {
+    period_spin_ns_ += busy_start_ns_ - spin_start_ns;
+    period_busy_ns_ += now - busy_start_ns_;
+  }
+  period_events_ += events;
+  if (events > 0 && busy_poll_ns_ > 0) {
+    spin_until_ns_ = now + busy_poll_ns_;
+  }
+}
+
+void WorkerThread::PublishLoad() {
+  uint64_t now = MonotonicNs();
+  uint64_t elapsed = now - period_start_ns_;
+  if (elapsed > 0) {
+    int busy = static_cast<int>(
+        std::min<uint64_t>(1000, period_busy_ns_ * 1000 / elapsed));
+    int spin = static_cast<int>(
+        std::min<uint64_t>(1000, period_spin_ns_ * 1000 / elapsed));
+    int events = static_cast<int>(period_events_ * 1000000000 / elapsed);
+    // Averaged with the last period, so that a single burst counts half
+    busy_permille_.store(
+        (busy_permille_.load(std::memory_order_relaxed) + busy) / 2,
+        std::memory_order_relaxed);
+    spin_permille_.store(
+        (spin_permille_.load(std::memory_order_relaxed) + spin) / 2,
+        std::memory_order_relaxed);
+    events_per_sec_.store(
+        (events_per_sec_.load(std::memory_order_relaxed) + events) / 2,
+        std::memory_order_relaxed);
+  }
+  period_start_ns_ = now;
+  period_busy_ns_ = 0;
+  period_spin_ns_ = 0;
+  period_events_ = 0;
+  if (server_thread_->rebalance_interval() > 0) {
+    for (ConnSlot& slot : conn_slots_) {
+      slot.last_events = slot.events;
+      slot.events = 0;
+    }
+  }
+  pink_epoll_->AddTimer(kLoadPeriodMs, [this]() { PublishLoad(); });
+}
+
+bool WorkerThread::RunInLoop(const std::function<void()>& task, bool wait,
+                             bool force) {
+  if (current_worker == this) {
+    task();
+    return true;
+  }
+
+  struct Done {
+    Done() : cv(&mu), done(false) {}
+    slash::Mutex mu;
+    slash::CondVar cv;
+    bool done;
+  };
+  std::shared_ptr<Done> done;
+  {
+    slash::MutexLock l(&tasks_mu_);
+    if (!loop_running_) {
+      task();
+      return true;
+    }
+    /*
+     * Registered before the task is queued, the worker takes tasks_mu_ to
+     * run it so it cannot miss it
+     */
+    if (!pink_epoll_->Register(PinkItem(-1, "", kNotiTask), force)) {
+      return false;
+    }
+    if (wait) {
+      done = std::make_shared<Done>();
+      tasks_.push_back([task, done]() {
+        task();
+        slash::MutexLock dl(&done->mu);
+        done->done = true;
+        done->cv.Signal();
+      });
+    } else {
+      tasks_.push_back(task);
+    }
+  }
+  if (!wait) {
+    return true;
+  }
+
+  slash::MutexLock dl(&done->mu);
+  while (!done->done) {
+    if (current_worker != nullptr) {
+      done->mu.Unlock();
+      current_worker->RunTasks();
+      done->mu.Lock();
+      if (!done->done) {
+        done->cv.TimedWait(1);
+      }
+    } else {
+      done->cv.Wait();
+    }
+  }
+  return true;
+}
+
+void WorkerThread::RunTasks() {
+  std::vector<std::function<void()>> tasks;
+  {
+    slash::MutexLock l(&tasks_mu_);
+    tasks.swap(tasks_);
+  }
+  for (const auto& task : tasks) {
+    task();
+  }
 }
 
 void *WorkerThread::ThreadMain() {
   int nfds;
-  PinkFiredEvent *pfe = NULL;
-  char bb[2048];
-  PinkItem ti;
-  std::shared_ptr<PinkConn> in_conn = nullptr;
-
   struct timeval when;
   gettimeofday(&when, NULL);
   struct timeval now = when;
@@ -96,6 +497,25 @@ void *WorkerThread::ThreadMain() {
     timeout = PINK_CRON_INTERVAL;
   }
 
+  if (!cpu_affinity().empty()) {
+    pink_epoll_->LocalizeEventBuffers();
+  }
+
+  current_worker = this;
+  {
+    slash::MutexLock l(&tasks_mu_);
+    loop_running_ = true;
+  }
+
+#ifdef PINK_HAVE_IO_URING
+  if (server_thread_->io_backend() == kIoUringBackend) {
+    StartUring();
+  }
+#endif
+  period_start_ns_ = MonotonicNs();
+  pink_epoll_->AddTimer(kLoadPeriodMs, [this]() { PublishLoad(); });
+  busy_poll_ns_ = static_cast<uint64_t>(server_thread_->busy_poll()) * 1000;
+
   while (!should_stop()) {
     if (cron_interval_ > 0) {
       gettimeofday(&now, NULL);
@@ -111,199 +531,317 @@ void *WorkerThread::ThreadMain() {
       }
     }
 
-    nfds = pink_epoll_->PinkPoll(timeout);
+    uint64_t spin_start_ns = 0;
+    int poll_timeout = timeout;
+    if (busy_poll_ns_ > 0) {
+      uint64_t now_ns = MonotonicNs();
+      if (now_ns < spin_until_ns_) {
+        spin_start_ns = now_ns;
+        poll_timeout = 0;
+      }
+    }
 
-    for (int i = 0; i < nfds; i++) {
-      pfe = (pink_epoll_->firedevent()) + i;
-      if (pfe->fd == pink_epoll_->notify_receive_fd()) {
-        if (pfe->mask & PinkEpoll::kRead) {
-          int32_t nread = read(pink_epoll_->notify_receive_fd(), bb, 2048);
-          if (nread == 0) {
-            continue;
-          } else if (nread == -1) {
-            log_warn("Read error on notify_receive_fd for fd");
-            continue;
-          } else {
-            for (int32_t idx = 0; idx < nread; ++idx) {
-              PinkItem ti = pink_epoll_->notify_queue_pop();
-              if (ti.notify_type() == kNotiConnect) {
-                std::shared_ptr<PinkConn> tc = conn_factory_->NewPinkConn(
-                    ti.fd(), ti.ip_port(),
-                    server_thread_, private_data_, pink_epoll_);
-                if (!tc || !tc->SetNonblock()) {
-                  continue;
-                }
+#ifdef PINK_HAVE_IO_URING
+    if (uring_ != nullptr) {
+      nfds = UringPoll(poll_timeout, now);
+      pink_epoll_->RunTimers();
+      released_conns_.clear();
+      AccountLoad(nfds, spin_start_ns);
+      continue;
+    }
+#endif
+    nfds = pink_epoll_->PinkPoll(poll_timeout);
+    busy_start_ns_ = MonotonicNs();
+    ProcessEvents(nfds, now);
+    pink_epoll_->RunTimers();
+    released_conns_.clear();
+    AccountLoad(nfds, spin_start_ns);
+  }  // while (!should_stop())
 
-#ifdef __ENABLE_SSL
-                // Create SSL failed
-                if (server_thread_->security() &&
-                  !tc->CreateSSL(server_thread_->ssl_ctx())) {
-                  CloseFd(tc);
-                  continue;
-                }
+  Cleanup();
+#ifdef PINK_HAVE_IO_URING
+  StopUring();
 #endif
+  {
+    /*
+     * From now on RunInLoop runs tasks right away, under tasks_mu_ like
+     * the ones that are left
+     */
+    slash::MutexLock l(&tasks_mu_);
+    loop_running_ = false;
+    for (const auto& task : tasks_) {
+      task();
+    }
+    tasks_.clear();
+  }
+  current_worker = nullptr;
+  return NULL;
+}
 
-                {
-                  slash::WriteLock l(&rwlock_);
-                  conns_[ti.fd()] = tc;
-                }
-                pink_epoll_->PinkAddEvent(ti.fd(), PinkEpoll::kRead);
-              } else if (ti.notify_type() == kNotiClose) {
-                // should close?
-              } else if (ti.notify_type() == kNotiEpollout) {
-                pink_epoll_->PinkModEvent(ti.fd(), 0, PinkEpoll::kWrite);
-              } else if (ti.notify_type() == kNotiEpollin) {
-                pink_epoll_->PinkModEvent(ti.fd(), 0, PinkEpoll::kRead);
-              } else if (ti.notify_type() == kNotiEpolloutAndEpollin) {
-                pink_epoll_->PinkModEvent(ti.fd(), 0, PinkEpoll::kRead | PinkEpoll::kWrite);
-              } else if (ti.notify_type() == kNotiWait) {
-                // do not register events
-                pink_epoll_->PinkAddEvent(ti.fd(), 0);
-              }
-            }
-          }
-        } else {
-          continue;
+void WorkerThread::HandleNotify(const PinkItem& ti) {
+#ifdef PINK_HAVE_IO_URING
+  if (uring_ != nullptr && UringNotify(ti)) {
+    return;
+  }
+#endif
+  if (ti.notify_type() == kNotiConnect) {
+    pending_conns_.fetch_sub(1, std::memory_order_relaxed);
+    NewConn(ti.fd(), ti.ip_port());
+    return;
+  } else if (ti.notify_type() == kNotiTask) {
+    RunTasks();
+    return;
+  }
+  ConnSlot* slot = FindSlot(ti.fd());
+  if (slot == nullptr) {
+    // Closed in the meantime
+    return;
+  }
+  if (ti.notify_type() == kNotiClose) {
+    // should close?
+  } else if (ti.notify_type() == kNotiEpollout) {
+    pink_epoll_->PinkModEvent(ti.fd(), 0, PinkEpoll::kWrite, slot->gen);
+    slot->write_events = PinkEpoll::kWrite;
+  } else if (ti.notify_type() == kNotiEpollin) {
+    pink_epoll_->PinkModEvent(ti.fd(), 0, PinkEpoll::kRead, slot->gen);
+    slot->write_events = 0;
+  } else if (ti.notify_type() == kNotiEpolloutAndEpollin) {
+    pink_epoll_->PinkModEvent(ti.fd(), 0, PinkEpoll::kRead | PinkEpoll::kWrite,
+                              slot->gen);
+    slot->write_events = PinkEpoll::kRead | PinkEpoll::kWrite;
+  } else if (ti.notify_type() == kNotiWait) {
+    // do not register events
+    pink_epoll_->PinkAddEvent(ti.fd(), 0, slot->gen);
+    slot->write_events = 0;
+  } else if (ti.notify_type() == kNotiWrite) {
+    /*
+     * Replies completed on another thread, written right away like after
+     * a read. Nothing may be left if an earlier write took them already
+     */
+    std::shared_ptr<PinkConn> conn = slot->conn;
+    if (!conn->is_reply()) {
+      return;
+    }
+    const uint32_t gen = slot->gen;
+    WriteStatus write_status = conn->SendReply();
+    if (write_status == kWriteAll) {
+      conn->set_is_reply(false);
+      if (!conn->IsClose()) {
+        // EPOLLOUT may still be set from an earlier partial write
+        WriteAll(ti.fd(), gen, true);
+        return;
+      }
+    } else if (write_status == kWriteHalf && WriteHalf(ti.fd(), gen)) {
+      return;
+    }
+    pink_epoll_->PinkDelEvent(ti.fd(), 0);
+    ReleaseSlot(ti.fd());
+    CloseFd(conn);
+  }
+}
+
+void WorkerThread::ProcessEvents(int nfds, const struct timeval& now) {
+  PinkFiredEvent *pfe = NULL;
+  ServerSocket* listener;
+  const bool immediate_write = server_thread_->immediate_write();
+
+  for (int i = 0; i < nfds; i++) {
+    pfe = (pink_epoll_->firedevent()) + i;
+    if (pfe->fd == pink_epoll_->notify_receive_fd()) {
+      if (pfe->mask & PinkEpoll::kRead) {
+        notify_items_.clear();
+        pink_epoll_->DrainNotifyQueue(&notify_items_);
+        for (const PinkItem& ti : notify_items_) {
+          HandleNotify(ti);
         }
       } else {
-        in_conn = NULL;
-        int should_close = 0;
-        if (pfe == NULL) {
-          continue;
-        }
+        continue;
+      }
+    } else if (!server_sockets_.empty() &&
+               (listener = FindServerSocket(pfe->fd)) != nullptr) {
+      if (pfe->mask & PinkEpoll::kRead) {
+        server_thread_->AcceptConns(
+            listener, [this](int connfd, const std::string& ip_port) {
+              NewConn(connfd, ip_port);
+            });
+      } else if (pfe->mask & PinkEpoll::kError) {
+        log_warn("error on listen fd %d", pfe->fd);
+      }
+    } else {
+      int should_close = 0;
+      if (pfe == NULL) {
+        continue;
+      }
 
-        {
-          slash::ReadLock l(&rwlock_);
-          std::map<int, std::shared_ptr<PinkConn>>::iterator iter = conns_.find(pfe->fd);
-          if (iter == conns_.end()) {
-            pink_epoll_->PinkDelEvent(pfe->fd, 0);
+      ConnSlot* slot = FindSlot(pfe->fd);
+      if (slot == nullptr) {
+        pink_epoll_->PinkDelEvent(pfe->fd, 0);
+        continue;
+      }
+      if (slot->gen != pfe->tag) {
+        // Fired for a conn closed earlier in this batch
+        continue;
+      }
+      slot->events++;
+      /*
+       * The handlers may move the conn out or another one in, in_conn stays
+       * valid through released_conns_ and gen tells if the slot changed
+       */
+      const uint32_t gen = slot->gen;
+      PinkConn* in_conn = slot->conn.get();
+
+      if ((pfe->mask & PinkEpoll::kWrite) && in_conn->is_reply()) {
+        WriteStatus write_status = in_conn->SendReply();
+        in_conn->set_last_interaction(now);
+        if (write_status == kWriteAll) {
+          WriteAll(pfe->fd, gen, true);
+          in_conn->set_is_reply(false);
+          if (in_conn->IsClose()) {
+            // If the application wants to close the connection
+            should_close = 1;
+          }
+        } else if (write_status == kWriteHalf) {
+          if (!WriteHalf(pfe->fd, gen)) {
+            should_close = 1;
+          } else if (slot->write_events == PinkEpoll::kWrite) {
             continue;
           }
-          in_conn = iter->second;
+        } else {
+          should_close = 1;
         }
+      }
 
-        if ((pfe->mask & PinkEpoll::kWrite) && in_conn->is_reply()) {
-          WriteStatus write_status = in_conn->SendReply();
-          in_conn->set_last_interaction(now);
-          if (write_status == kWriteAll) {
-            pink_epoll_->PinkModEvent(pfe->fd, 0, PinkEpoll::kRead);
-            in_conn->set_is_reply(false);
-            if (in_conn->IsClose()) {
-              // If the application wants to close the connection
+      if (!should_close && (pfe->mask & PinkEpoll::kRead)) {
+        ReadStatus read_status = in_conn->GetRequest();
+        in_conn->set_last_interaction(now);
+        MaybeArmResizeTimer(pfe->fd, gen);
+        if (read_status != kReadAll && read_status != kReadHalf) {
+          should_close = 1;
+        } else if (immediate_write) {
+          // Replies that are not ready yet (asynchronous handling) are
+          // announced by the conn itself through NotifyEpoll
+          if (in_conn->is_reply()) {
+            WriteStatus write_status = in_conn->SendReply();
+            if (write_status == kWriteAll) {
+              WriteAll(pfe->fd, gen, false);
+              in_conn->set_is_reply(false);
+              if (in_conn->IsClose()) {
+                should_close = 1;
+              }
+            } else if (write_status == kWriteHalf) {
+              // Socket buffer is full, continue on EPOLLOUT
+              if (!WriteHalf(pfe->fd, gen)) {
+                should_close = 1;
+              }
+            } else {
               should_close = 1;
             }
-          } else if (write_status == kWriteHalf) {
-            continue;
-          } else {
-            should_close = 1;
           }
-        }
-
-        if (!should_close && (pfe->mask & PinkEpoll::kRead)) {
-          ReadStatus read_status = in_conn->GetRequest();
-          in_conn->set_last_interaction(now);
-          if (read_status == kReadAll) {
-            pink_epoll_->PinkModEvent(pfe->fd, 0, PinkEpoll::kWrite);
-            // Wait for the conn complete asynchronous task and
-            // Mod Event to EPOLLOUT
-          } else if (read_status == kReadHalf) {
+          if (!should_close) {
             continue;
-          } else {
-            should_close = 1;
           }
+        } else if (read_status == kReadAll) {
+          pink_epoll_->PinkModEvent(pfe->fd, 0, PinkEpoll::kWrite, gen);
+          slot = FindSlot(pfe->fd);
+          if (slot != nullptr && slot->gen == gen) {
+            slot->write_events = PinkEpoll::kWrite;
+          }
+          // Wait for the conn complete asynchronous task and
+          // Mod Event to EPOLLOUT
+        } else {
+          continue;
         }
+      }
 
-        if ((pfe->mask & PinkEpoll::kError) || should_close) {
+      if ((pfe->mask & PinkEpoll::kError) || should_close) {
+        slot = FindSlot(pfe->fd);
+        if (slot != nullptr && slot->gen == gen) {
+          std::shared_ptr<PinkConn> conn = slot->conn;
           pink_epoll_->PinkDelEvent(pfe->fd, 0);
-          CloseFd(in_conn);
-          in_conn = NULL;
-          {
-            slash::WriteLock l(&rwlock_);
-            conns_.erase(pfe->fd);
-          }
-          should_close = 0;
+          ReleaseSlot(pfe->fd);
+          CloseFd(conn);
         }
-      }  // connection event
-    }  // for (int i = 0; i < nfds; i++)
-  }  // while (!should_stop())
+        should_close = 0;
+      }
+    }  // connection event
+  }  // for (int i = 0; i < nfds; i++)
+}
 
-  Cleanup();
-  return NULL;
+void WorkerThread::NewConn(int fd, const std::string& ip_port) {
+  std::shared_ptr<PinkConn> tc = conn_factory_->NewPinkConn(
+      fd, ip_port, server_thread_, private_data_, pink_epoll_);
+  if (!tc || !tc->SetNonblock()) {
+    return;
+  }
+
+#ifdef __ENABLE_SSL
+  // Create SSL failed
+  if (server_thread_->security() &&
+    !tc->CreateSSL(server_thread_->ssl_ctx())) {
+    CloseFd(tc);
+    return;
+  }
+#endif
+
+  ConnSlot* slot = AddSlot(tc);
+#ifdef PINK_HAVE_IO_URING
+  if (uring_ != nullptr && tc->SupportsCompletionIO()) {
+    UringAddConn(tc);
+    return;
+  }
+#endif
+  pink_epoll_->PinkAddEvent(fd, PinkEpoll::kRead, slot->gen);
 }
 
 void WorkerThread::DoCronTask() {
-  struct timeval now;
-  gettimeofday(&now, NULL);
+  if (deleting_conn_ipport_.empty()) {
+    return;
+  }
   std::vector<std::shared_ptr<PinkConn>> to_close;
-  std::vector<std::shared_ptr<PinkConn>> to_timeout;
-  {
-    slash::WriteLock l(&rwlock_);
-
-    // Check whether close all connection
-    slash::MutexLock kl(&killer_mutex_);
-    if (deleting_conn_ipport_.count(kKillAllConnsTask)) {
-      for (auto& conn : conns_) {
-        to_close.push_back(conn.second);
-      }
-      conns_.clear();
-      deleting_conn_ipport_.clear();
-      return;
+  bool kill_all = deleting_conn_ipport_.count(kKillAllConnsTask);
+  for (ConnSlot& slot : conn_slots_) {
+    if (slot.conn == nullptr) {
+      continue;
     }
-
-    std::map<int, std::shared_ptr<PinkConn>>::iterator iter = conns_.begin();
-    while (iter != conns_.end()) {
-      std::shared_ptr<PinkConn> conn = iter->second;
-      // Check connection should be closed
-      if (deleting_conn_ipport_.count(conn->ip_port())) {
-        to_close.push_back(conn);
-        deleting_conn_ipport_.erase(conn->ip_port());
-        iter = conns_.erase(iter);
-        continue;
-      }
-
-      // Check keepalive timeout connection
-      if (keepalive_timeout_ > 0 &&
-          (now.tv_sec - conn->last_interaction().tv_sec > keepalive_timeout_)) {
-        to_timeout.push_back(conn);
-        iter = conns_.erase(iter);
-        continue;
-      }
-
-      // Maybe resize connection buffer
-      conn->TryResizeBuffer();
-
-      ++iter;
+    std::shared_ptr<PinkConn> conn = slot.conn;
+    // Check connection should be closed
+    if (kill_all || deleting_conn_ipport_.count(conn->ip_port())) {
+      to_close.push_back(conn);
+      deleting_conn_ipport_.erase(conn->ip_port());
+      ReleaseSlot(conn->fd());
     }
   }
+  deleting_conn_ipport_.clear();
   for (const auto & conn : to_close) {
     CloseFd(conn);
   }
-  for (const auto & conn : to_timeout) {
-    CloseFd(conn);
-    server_thread_->handle_->FdTimeoutHandle(conn->fd(), conn->ip_port());
-  }
 }
 
 bool WorkerThread::TryKillConn(const std::string& ip_port) {
   bool find = false;
-  if (ip_port != kKillAllConnsTask) {
-    slash::ReadLock l(&rwlock_);
-    for (auto& iter : conns_) {
-      if (iter.second->ip_port() == ip_port) {
-        find = true;
-        break;
+  RunInLoop([this, &ip_port, &find]() {
+    if (ip_port != kKillAllConnsTask) {
+      for (const ConnSlot& slot : conn_slots_) {
+        if (slot.conn != nullptr && slot.conn->ip_port() == ip_port) {
+          find = true;
+          break;
+        }
       }
     }
-  }
-  if (find || ip_port == kKillAllConnsTask) {
-    slash::MutexLock l(&killer_mutex_);
-    deleting_conn_ipport_.insert(ip_port);
-    return true;
-  }
-  return false;
+    if (find || ip_port == kKillAllConnsTask) {
+      deleting_conn_ipport_.insert(ip_port);
+    }
+  }, true);
+  return find || ip_port == kKillAllConnsTask;
 }
 
 void WorkerThread::CloseFd(std::shared_ptr<PinkConn> conn) {
+  conn->CancelTimers();
+#ifdef PINK_HAVE_IO_URING
+  if (uring_ != nullptr) {
+    UringRemoveConn(conn->fd());
+  }
+#endif
   if (close(conn->fd()) != 0) {
     log_warn("Closing fd failed");
   }
@@ -311,16 +849,335 @@ void WorkerThread::CloseFd(std::shared_ptr<PinkConn> conn) {
 }
 
 void WorkerThread::Cleanup() {
-  std::map<int, std::shared_ptr<PinkConn>> to_close;
-  {
-    slash::WriteLock l(&rwlock_);
-    to_close = std::move(conns_);
-    conns_.clear();
+  std::vector<ConnSlot> to_close;
+  to_close.swap(conn_slots_);
+  conn_num_.store(0, std::memory_order_relaxed);
+  for (const ConnSlot& slot : to_close) {
+    if (slot.conn != nullptr) {
+      CloseFd(slot.conn);
+    }
   }
-  for (const auto& iter : to_close) {
-    CloseFd(iter.second);
+  released_conns_.clear();
+}
+
+#ifdef PINK_HAVE_IO_URING
+static const unsigned kUringEntries = 256;
+// Provided receive buffers per worker
+static const unsigned kUringBufCount = 256;
+static const unsigned kUringBufSize = REDIS_IOBUF_LEN;
+
+static inline uint64_t UringUserData(int tag, uint64_t id) {
+  return (static_cast<uint64_t>(tag) << 56) | id;
+}
+
+bool WorkerThread::StartUring() {
+  uring_ = new PinkUring();
+  int ret = uring_->Init(kUringEntries, kUringBufCount, kUringBufSize);
+  if (ret != 0) {
+    log_warn("io_uring not available (%s), worker uses epoll",
+             strerror(-ret));
+    delete uring_;
+    uring_ = nullptr;
+    return false;
+  }
+  for (ServerSocket* server_socket : server_sockets_) {
+    pink_epoll_->PinkDelEvent(server_socket->sockfd(), 0);
+    uring_->PrepMultishotAccept(server_socket->sockfd(),
+                                UringUserData(kUringAccept,
+                                              server_socket->sockfd()));
+  }
+  // The notify queue and conns without completion I/O stay on epoll
+  uring_->PrepPollMultishot(pink_epoll_->epoll_fd(), POLLIN,
+                            UringUserData(kUringEpoll, 0));
+  return true;
+}
+
+void WorkerThread::StopUring() {
+  if (uring_ == nullptr) {
+    return;
+  }
+  /*
+   * Receives write into our buffers and sends read from UringConn::output,
+   * so wait until the kernel has given up all requests
+   */
+  uring_->PrepCancelAll(UringUserData(kUringCancel, 0));
+  struct timeval now;
+  gettimeofday(&now, NULL);
+  for (int i = 0; i < 100 && !uring_conns_.empty(); i++) {
+    UringPoll(10, now);
+  }
+  delete uring_;
+  uring_ = nullptr;
+  uring_conns_.clear();
+  uring_fds_.clear();
+}
+
+int WorkerThread::UringPoll(int timeout, const struct timeval& now) {
+  int ret = uring_->Submit(1, timeout);
+  if (ret < 0) {
+    log_warn("io_uring_enter error: %s", strerror(-ret));
+  }
+  pink_epoll_->UpdateLastPollTime();
+  busy_start_ns_ = MonotonicNs();
+  int completions = 0;
+  struct io_uring_cqe* cqe;
+  while ((cqe = uring_->PeekCqe()) != nullptr) {
+    completions++;
+    uint64_t user_data = cqe->user_data;
+    int res = cqe->res;
+    uint32_t flags = cqe->flags;
+    uring_->CqeSeen();
+    HandleUringCompletion(user_data, res, flags, now);
+  }
+  return completions;
+}
+
+void WorkerThread::HandleUringCompletion(uint64_t user_data, int res,
+                                         uint32_t flags,
+                                         const struct timeval& now) {
+  int tag = static_cast<int>(user_data >> 56);
+  uint64_t id = user_data & ((1ULL << 56) - 1);
+  bool more = flags & IORING_CQE_F_MORE;
+
+  if (tag == kUringEpoll) {
+    ProcessEvents(pink_epoll_->PinkPoll(0), now);
+    if (!more && !should_stop()) {
+      uring_->PrepPollMultishot(pink_epoll_->epoll_fd(), POLLIN, user_data);
+    }
+    return;
+  }
+  if (tag == kUringAccept) {
+    int listen_fd = static_cast<int>(id);
+    if (res >= 0) {
+      struct sockaddr_in cliaddr;
+      socklen_t clilen = sizeof(cliaddr);
+      std::string ip_port;
+      ServerSocket* listener = FindServerSocket(listen_fd);
+      if (listener != nullptr) {
+        listener->SetConnOptions(res);
+      }
+      if (getpeername(res, (struct sockaddr *) &cliaddr, &clilen) != 0) {
+        close(res);
+      } else if (server_thread_->SetupAcceptedConn(res, cliaddr,
+                                                   &ip_port) != -1) {
+        NewConn(res, ip_port);
+      }
+    } else if (res != -ECANCELED) {
+      log_warn("accept error on listen fd %d: %s", listen_fd,
+               strerror(-res));
+    }
+    if (!more && !should_stop() && res != -ECANCELED) {
+      uring_->PrepMultishotAccept(listen_fd, user_data);
+    }
+    return;
+  }
+  if (tag != kUringRecv && tag != kUringSend) {
+    return;
+  }
+
+  bool has_buffer = (tag == kUringRecv) && (flags & IORING_CQE_F_BUFFER);
+  uint16_t bid = static_cast<uint16_t>(flags >> IORING_CQE_BUFFER_SHIFT);
+  auto iter = uring_conns_.find(id);
+  if (iter == uring_conns_.end()) {
+    if (has_buffer) {
+      uring_->RecycleBuffer(bid);
+    }
+    return;
+  }
+  UringConn* uc = &iter->second;
+
+  if (tag == kUringRecv) {
+    if (!more) {
+      uc->recv_armed = false;
+    }
+    if (uc->closing) {
+      if (has_buffer) {
+        uring_->RecycleBuffer(bid);
+      }
+      UringMaybeErase(id);
+      return;
+    }
+    if (res > 0 && has_buffer) {
+      ReadStatus read_status = uc->conn->ProcessInput(uring_->buffer(bid),
+                                                      res);
+      uring_->RecycleBuffer(bid);
+      uc->conn->set_last_interaction(now);
+      if (read_status != kReadAll && read_status != kReadHalf) {
+        UringCloseConn(uc);
+        return;
+      }
+      ConnSlot* slot = FindSlot(uc->fd);
+      if (slot != nullptr) {
+        MaybeArmResizeTimer(uc->fd, slot->gen);
+      }
+      if (uc->conn->is_reply()) {
+        UringSend(uc);
+      }
+      if (!UringFlowControl(uc)) {
+        UringCloseConn(uc);
+        return;
+      }
+    } else if (res != -ENOBUFS && res != -ECANCELED) {
+      // Closed by the client or a receive error
+      if (has_buffer) {
+        uring_->RecycleBuffer(bid);
+      }
+      UringCloseConn(uc);
+      return;
+    }
+    if (!uc->recv_armed && !uc->read_paused) {
+      uring_->PrepRecv(uc->fd, UringUserData(kUringRecv, id));
+      uc->recv_armed = true;
+    }
+    return;
+  }
+
+  // kUringSend
+  uc->sending = false;
+  if (uc->closing) {
+    UringMaybeErase(id);
+    return;
+  }
+  if (res < 0) {
+    UringCloseConn(uc);
+    return;
+  }
+  uc->output.Consume(res);
+  if (!uc->output.empty()) {
+    UringSend(uc);
+    if (!UringFlowControl(uc)) {
+      UringCloseConn(uc);
+    }
+    return;
+  }
+  uc->conn->OutputSent();
+  if (uc->conn->IsClose()) {
+    UringCloseConn(uc);
+    return;
+  } else if (uc->conn->is_reply()) {
+    UringSend(uc);
   }
+  if (!UringFlowControl(uc)) {
+    UringCloseConn(uc);
+  }
+}
+
+void WorkerThread::UringAddConn(std::shared_ptr<PinkConn> conn) {
+  uint64_t id = uring_next_id_++;
+  UringConn& uc = uring_conns_[id];
+  uc.id = id;
+  uc.conn = conn;
+  uc.fd = conn->fd();
+  uc.sending = false;
+  uc.recv_armed = true;
+  uc.read_paused = false;
+  uc.closing = false;
+  uring_fds_[uc.fd] = id;
+  uring_->PrepRecv(uc.fd, UringUserData(kUringRecv, id));
+}
+
+void WorkerThread::UringRemoveConn(int fd) {
+  auto iter = uring_fds_.find(fd);
+  if (iter == uring_fds_.end()) {
+    return;
+  }
+  uint64_t id = iter->second;
+  uring_fds_.erase(iter);
+  UringConn& uc = uring_conns_[id];
+  uc.closing = true;
+  uc.conn = nullptr;
+  if (uc.recv_armed || uc.sending) {
+    // Must reach the kernel before the fd is closed
+    uring_->PrepCancelFd(fd, UringUserData(kUringCancel, id));
+    uring_->Submit(0, 0);
+  }
+  UringMaybeErase(id);
+}
+
+void WorkerThread::UringCloseConn(UringConn* uc) {
+  std::shared_ptr<PinkConn> conn = uc->conn;
+  ReleaseSlot(uc->fd);
+  // uc is gone after this
+  CloseFd(conn);
+}
 
+void WorkerThread::UringSend(UringConn* uc) {
+  if (uc->sending || uc->closing) {
+    return;
+  }
+  if (uc->output.empty() && !uc->conn->TakeOutput(&uc->output)) {
+    return;
+  }
+  // The segments are sent where they are, without gathering them first
+  int iovcnt = uc->output.FillIov(uc->iov, kUringSendIov);
+  if (iovcnt == 1) {
+    uring_->PrepSend(uc->fd, uc->iov[0].iov_base, uc->iov[0].iov_len,
+                     UringUserData(kUringSend, uc->id));
+  } else {
+    memset(&uc->msg, 0, sizeof(uc->msg));
+    uc->msg.msg_iov = uc->iov;
+    uc->msg.msg_iovlen = iovcnt;
+    uring_->PrepSendmsg(uc->fd, &uc->msg, UringUserData(kUringSend, uc->id));
+  }
+  uc->sending = true;
+}
+
+bool WorkerThread::UringFlowControl(UringConn* uc) {
+  size_t output_bytes = uc->conn->output_bytes() + uc->output.size();
+  if (OutputLimitReached(uc->conn.get(), output_bytes)) {
+    return false;
+  }
+  size_t high = server_thread_->output_high_watermark();
+  if (high == 0) {
+    return true;
+  }
+  if (!uc->read_paused && output_bytes >= high) {
+    uc->read_paused = true;
+    if (uc->recv_armed && uring_->multishot_recv()) {
+      // Its completion comes with -ECANCELED
+      uring_->PrepCancel(UringUserData(kUringRecv, uc->id),
+                         UringUserData(kUringCancel, uc->id));
+    }
+  } else if (uc->read_paused &&
+             output_bytes <= server_thread_->output_low_watermark()) {
+    uc->read_paused = false;
+    if (!uc->recv_armed) {
+      uring_->PrepRecv(uc->fd, UringUserData(kUringRecv, uc->id));
+      uc->recv_armed = true;
+    }
+  }
+  return true;
+}
+
+void WorkerThread::UringMaybeErase(uint64_t id) {
+  auto iter = uring_conns_.find(id);
+  if (iter != uring_conns_.end() && iter->second.closing &&
+      !iter->second.sending && !iter->second.recv_armed) {
+    uring_conns_.erase(iter);
+  }
+}
+
+bool WorkerThread::UringNotify(const PinkItem& ti) {
+  auto iter = uring_fds_.find(ti.fd());
+  if (iter == uring_fds_.end()) {
+    return false;
+  }
+  UringConn* uc = &uring_conns_[iter->second];
+  switch (ti.notify_type()) {
+    case kNotiEpollout:
+    case kNotiEpolloutAndEpollin:
+    case kNotiWrite:
+      UringSend(uc);
+      if (!UringFlowControl(uc)) {
+        UringCloseConn(uc);
+      }
+      break;
+    default:
+      // Receives stay armed, kNotiWait is not supported
+      break;
+  }
+  return true;
 }
+#endif  // PINK_HAVE_IO_URING
 
 };  // namespace pink
@@ -8,7 +8,7 @@
 
 #include <string>
 #include <functional>
-#include <map>
+#include <unordered_map>
 #include <atomic>
 #include <vector>
 #include <set>
@@ -17,7 +17,9 @@
 #include "slash/include/slash_mutex.h"
 
 #include "pink/include/server_thread.h"
+#include "pink/src/output_chain.h"
 #include "pink/src/pink_epoll.h"
+#include "pink/src/pink_uring.h"
 #include "pink/include/pink_thread.h"
 #include "pink/include/pink_define.h"
 
@@ -28,6 +30,7 @@ class PinkEpoll;
 struct PinkFiredEvent;
 class PinkConn;
 class ConnFactory;
+class ServerSocket;
 
 class WorkerThread : public Thread {
  public:
@@ -42,7 +45,12 @@ class WorkerThread : public Thread {
 
   int conn_num() const;
 
-  std::vector<ServerThread::ConnInfo> conns_info() const;
+  /*
+   * conns_info, MoveConnOut, MoveConnIn(conn) and TryKillConn may be
+   * called from any thread, the work is done by the worker thread itself,
+   * see RunInLoop
+   */
+  std::vector<ServerThread::ConnInfo> conns_info();
 
   std::shared_ptr<PinkConn> MoveConnOut(int fd);
 
@@ -53,10 +61,26 @@ class WorkerThread : public Thread {
   PinkEpoll* pink_epoll() {
     return pink_epoll_;
   }
+
+  /*
+   * Accept connections on this listening socket in the worker's own loop,
+   * see ServerThread::set_reuse_port. Takes ownership, call before
+   * StartThread
+   */
+  void AddServerSocket(ServerSocket* server_socket);
+
   bool TryKillConn(const std::string& ip_port);
 
-  mutable slash::RWMutex rwlock_; /* For external statistics */
-  std::map<int, std::shared_ptr<PinkConn>> conns_;
+  ServerThread::WorkerLoad load() const;
+  /*
+   * For DispatchThread's rebalancing, from any thread. MigrateConnOut
+   * moves out the conn that caused the most events in the last load
+   * period among those that CanMigrate, if its estimated share of the
+   * busy time is at most max_permille. nullptr if there is none.
+   * MigrateConnIn takes such a conn over.
+   */
+  std::shared_ptr<PinkConn> MigrateConnOut(int max_permille);
+  void MigrateConnIn(std::shared_ptr<PinkConn> conn);
 
   void* private_data_;
 
@@ -73,15 +97,185 @@ class WorkerThread : public Thread {
 
   std::atomic<int> keepalive_timeout_;  // keepalive second
 
+  /*
+   * The conns by fd, only used by the worker thread. gen is renewed every
+   * time a slot is filled and is the tag of the conn's epoll registration,
+   * so events still pending for an earlier conn on the same fd are dropped.
+   */
+  struct ConnSlot {
+    std::shared_ptr<PinkConn> conn;
+    uint32_t gen;
+    // Events fired for the conn in this and the last load period
+    uint32_t events;
+    uint32_t last_events;
+    // Events registered while a reply is written on EPOLLOUT, 0 if unknown
+    uint32_t write_events;
+  };
+  std::vector<ConnSlot> conn_slots_;
+  uint32_t next_gen_;
+  std::atomic<int> conn_num_;
+  /*
+   * Conns released from their slot during this loop iteration. Event
+   * handling works on plain pointers, so they are kept until it ends.
+   */
+  std::vector<std::shared_ptr<PinkConn>> released_conns_;
+  // nullptr if there is no conn on fd
+  ConnSlot* FindSlot(int fd);
+  ConnSlot* AddSlot(std::shared_ptr<PinkConn> conn);
+  void ReleaseSlot(int fd);
+  /*
+   * Timers of each conn instead of a scan over all conns every
+   * cron_interval. The keepalive timer fires when the conn would time out
+   * and is armed again for the rest if it has been used since. The resize
+   * timer only runs every cron_interval while the conn has a large
+   * buffer, see PinkConn::HasLargeBuffer. gen tells whether the slot
+   * still holds the same conn.
+   */
+  void ArmKeepaliveTimer(int fd, uint32_t gen, const PinkConn* conn);
+  void KeepaliveTimer(int fd, uint32_t gen);
+  // After reading into the conn
+  void MaybeArmResizeTimer(int fd, uint32_t gen);
+  void ResizeTimer(int fd, uint32_t gen);
+
+  /*
+   * Output flow control, see ServerThread::set_output_buffer_limit and
+   * set_output_watermarks. WriteHalf is called after a reply could not be
+   * written completely. It returns false if the conn broke its output
+   * buffer limit and has to be closed, else registers EPOLLOUT, along
+   * with EPOLLIN unless reading is paused. WriteAll is called once the
+   * output is written, epollout tells whether EPOLLOUT may be registered.
+   * Both do nothing if the slot no longer holds the conn of gen.
+   */
+  bool WriteHalf(int fd, uint32_t gen);
+  void WriteAll(int fd, uint32_t gen, bool epollout);
+  bool OutputLimitReached(PinkConn* conn, size_t output_bytes);
+
+  /*
+   * Own listening sockets in SO_REUSEPORT mode, empty otherwise
+   */
+  std::vector<ServerSocket*> server_sockets_;
+  ServerSocket* FindServerSocket(int fd) const;
+
+  std::vector<PinkItem> notify_items_;
+
+  /*
+   * Load accounting, see ServerThread::WorkerLoad. The loop adds the time
+   * from the end of every wait to the end of its handling, PublishLoad
+   * averages it every kLoadPeriodMs. pending_conns_ are handed over by
+   * the dispatch thread but not set up yet.
+   */
+  uint64_t busy_start_ns_;
+  uint64_t period_start_ns_;
+  uint64_t period_busy_ns_;
+  uint64_t period_spin_ns_;
+  uint64_t period_events_;
+  std::atomic<int> busy_permille_;
+  std::atomic<int> spin_permille_;
+  std::atomic<int> events_per_sec_;
+  std::atomic<int> pending_conns_;
+  /*
+   * spin_start_ns is when a non-blocking poll of the busy poll mode
+   * started, 0 for a blocking one. Polls that find nothing count as
+   * spinning as a whole, and every event extends spinning to
+   * spin_until_ns_.
+   */
+  void AccountLoad(int events, uint64_t spin_start_ns);
+  void PublishLoad();
+
+  // Busy poll mode, see ServerThread::set_busy_poll, 0 if off
+  uint64_t busy_poll_ns_;
+  uint64_t spin_until_ns_;
+
+  /*
+   * Functions other threads want to run on the worker thread. If wait is
+   * set RunInLoop returns once task has run; a worker waiting for another
+   * worker runs its own tasks meanwhile, so two of them cannot deadlock.
+   * While the worker thread is not running the task runs right away.
+   * Without force the task is not queued and false returned if the notify
+   * queue is full, like PinkEpoll::Register.
+   */
+  bool RunInLoop(const std::function<void()>& task, bool wait,
+                 bool force = true);
+  void RunTasks();
+  slash::Mutex tasks_mu_;
+  std::vector<std::function<void()>> tasks_;
+  bool loop_running_;
+
   virtual void *ThreadMain() override;
+  void ProcessEvents(int nfds, const struct timeval& now);
+  void HandleNotify(const PinkItem& ti);
   void DoCronTask();
 
-  slash::Mutex killer_mutex_;
+  // Conns to close in the next DoCronTask, by TryKillConn
   std::set<std::string> deleting_conn_ipport_;
 
+  // Set up a connection accepted by us or handed over by the dispatch thread
+  void NewConn(int fd, const std::string& ip_port);
+
   // clean conns
   void CloseFd(std::shared_ptr<PinkConn> conn);
   void Cleanup();
+
+#ifdef PINK_HAVE_IO_URING
+  /*
+   * io_uring backend, see ServerThread::set_io_backend. Requests carry
+   * the UringTag and the id of their UringConn (the fd for accepts) in
+   * their user_data. An id is never reused, so completions arriving after
+   * a conn is gone cannot be mistaken for those of a new conn on the
+   * same fd.
+   */
+  enum UringTag {
+    kUringEpoll = 1,
+    kUringAccept = 2,
+    kUringRecv = 3,
+    kUringSend = 4,
+    kUringCancel = 5,
+  };
+  // Output segments passed to one send
+  static const int kUringSendIov = 16;
+  struct UringConn {
+    uint64_t id;
+    std::shared_ptr<PinkConn> conn;
+    int fd;
+    // Taken from the conn by TakeOutput, untouched while a send is running
+    OutputChain output;
+    // What the running send writes from
+    struct iovec iov[kUringSendIov];
+    struct msghdr msg;
+    bool sending;
+    bool recv_armed;
+    // No receive is armed while set, see UringFlowControl
+    bool read_paused;
+    // Closed, kept until the kernel has finished with our requests
+    bool closing;
+  };
+  PinkUring* uring_;
+  uint64_t uring_next_id_;
+  std::unordered_map<uint64_t, UringConn> uring_conns_;
+  // Open io_uring conns by fd
+  std::unordered_map<int, uint64_t> uring_fds_;
+
+  bool StartUring();
+  void StopUring();
+  // Returns the number of completions handled
+  int UringPoll(int timeout, const struct timeval& now);
+  void HandleUringCompletion(uint64_t user_data, int res, uint32_t flags,
+                             const struct timeval& now);
+  void UringAddConn(std::shared_ptr<PinkConn> conn);
+  // Called from CloseFd before the fd is closed
+  void UringRemoveConn(int fd);
+  void UringCloseConn(UringConn* uc);
+  void UringSend(UringConn* uc);
+  /*
+   * Like WriteHalf for io_uring conns, called whenever their output grew
+   * or shrank. Pausing cancels a multishot receive. Returns false if the
+   * conn has to be closed
+   */
+  bool UringFlowControl(UringConn* uc);
+  void UringMaybeErase(uint64_t id);
+  // Handles a notify item for an io_uring conn, false if fd is not one
+  bool UringNotify(const PinkItem& ti);
+#endif
 };  // class WorkerThread
 
 }  // namespace pink